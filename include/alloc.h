@@ -0,0 +1,128 @@
+/**
+ * fsemu/include/alloc.h
+ *
+ * Bitmap allocators for data blocks and inodes.
+ *
+ * Both on-disk bitmaps are scanned 64 bits at a time. On top of each,
+ * an in-memory summary bitmap records which 64-bit words still have a
+ * free bit (a two-level bitmap), so a free bit can be found by skipping
+ * 4096 bits per summary word, and a rotating cursor remembers where the
+ * last allocation was made so that allocation never rescans the full
+ * part of the bitmap. An allocation may also be given a goal, in which
+ * case the first free bit at or after the goal is taken. A run of blocks
+ * is allocated by taking the bits after the first one for as long as
+ * they are free.
+ *
+ * Placement: the file system is divided into block groups, one per
+ * region of the block bitmap (the blocks mapped by one bitmap block),
+ * with the inode table split evenly between them. Free inodes, free
+ * blocks and directories are counted per group. Under the "group" and
+ * "orlov" placement policies (see the placement= mount option) inodes
+ * are placed in a group chosen like ext2/ext4 do, next to their parent
+ * when possible, and an inode's blocks are placed at the position of the
+ * data area that corresponds to the inode's position in the inode table,
+ * so that neighbouring inodes get neighbouring blocks.
+ *
+ * Concurrency: the allocators take no locks. A bit is claimed with an
+ * atomic fetch-or on its word of the bitmap, and whoever finds the bit
+ * already set looks again from there. Every thread is given one of
+ * HFS_ALLOC_NSHARDS shards, round robin, and every shard has its own
+ * rotating cursor in each bitmap, starting at its own slice of it, so
+ * threads allocating without a goal do not fight over the same words
+ * until their slices fill up and they move on into the next one. The
+ * first thread, the shell, gets shard 0, whose cursor starts at the
+ * beginning, so a single thread allocates exactly as before.
+ *
+ * The free counts of both bitmaps and the superblock's inode, file and
+ * directory counts are kept as per-shard deltas (see hfs_alloc_count()),
+ * which are folded into the shared count only when they grow past
+ * HFS_ALLOC_BATCH, or when hfs_alloc_sync() is called. The per-group
+ * counts used for placement are updated atomically and read without
+ * synchronization, as the hints they are.
+ */
+
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+#include "fs.h"
+
+#include <stdint.h>
+
+/* Number of data blocks mapped by one region of the bitmap. */
+#define HFS_BALLOC_REGION_BITS	(BSIZE * 8)
+
+/* No allocation goal, use the rotating cursor. */
+#define HFS_NOGOAL		((uint64_t)-1)
+
+/* Number of allocation shards, and how far a shard's counter deltas may
+ * drift before they are folded into the shared counts. */
+#define HFS_ALLOC_NSHARDS	16
+#define HFS_ALLOC_BATCH		32
+
+/* Counters kept per shard. */
+#define HFS_CNT_IFREE		0	// free inodes
+#define HFS_CNT_BFREE		1	// free blocks
+#define HFS_CNT_INODES		2	// sb->inode_used
+#define HFS_CNT_FILES		3	// sb->nfiles
+#define HFS_CNT_DIRS		4	// sb->ndirectories
+#define HFS_NCOUNTERS		5
+
+struct hfs_bmap_cursor {
+	uint64_t	pos;			// bit index
+} __attribute__((aligned(64)));
+
+/**
+ * A two-level view of an on-disk bitmap.
+ */
+struct hfs_bmap {
+	uint64_t	*map;			// the on-disk bitmap, as 64-bit words
+	uint64_t	nbits;			// number of allocatable bits
+	uint64_t	nwords;
+	uint64_t	*summary;		// bit w set if map[w] may have a free bit
+	uint64_t	nsummary;
+	int64_t		nfree;			// less what the shards have not folded
+	int			counter;		// HFS_CNT_IFREE or HFS_CNT_BFREE
+	struct hfs_bmap_cursor	cursors[HFS_ALLOC_NSHARDS];
+};
+
+struct hfs_alloc_shard {
+	int64_t		delta[HFS_NCOUNTERS];
+} __attribute__((aligned(64)));
+
+struct hfs_balloc {
+	struct hfs_bmap	bm;
+	uint32_t		*region_free;	// free blocks in each region
+	uint32_t		nregions;
+};
+
+struct hfs_group {
+	uint32_t	free_inodes;
+	uint32_t	free_blocks;
+	uint32_t	ndirs;
+};
+
+struct hfs_groups {
+	struct hfs_group	*groups;
+	uint32_t			ngroups;
+	uint32_t			inodes_per_group;
+	uint64_t			ndirs;
+	uint32_t			spread;		// next group to try when spreading
+};
+
+int hfs_alloc_init(void);
+void hfs_alloc_exit(void);
+void hfs_alloc_count(int counter, int64_t delta);
+void hfs_alloc_sync(void);
+
+uint32_t hfs_balloc_alloc(uint64_t goal);
+uint32_t hfs_balloc_alloc_run(uint64_t goal, uint32_t n, uint32_t *count);
+void hfs_balloc_free(uint32_t b);
+uint64_t hfs_balloc_nfree(void);
+uint64_t hfs_balloc_goal(struct hfs_inode *inode);
+
+uint32_t hfs_ialloc_alloc(uint64_t goal, bool isdir);
+void hfs_ialloc_free(uint32_t inum, bool isdir);
+uint64_t hfs_ialloc_nfree(void);
+uint64_t hfs_ialloc_goal(struct hfs_inode *parent, bool isdir);
+
+#endif  // __ALLOC_H__
@@ -0,0 +1,101 @@
+/**
+ * fsemu/include/bench.h
+ *
+ * Measuring benchmarks.
+ *
+ * A benchmark times every operation it makes on its own, with
+ * hfs_bench_ticks() before and after, and hands the difference to
+ * hfs_bench_sample(); it also wraps every timed pass in
+ * hfs_bench_pass_begin() and hfs_bench_pass_end(), which time the whole
+ * pass. hfs_bench_report() then gives:
+ *  - the latency of one operation: mean, p50, p90, p99, p99.9 and the
+ *    extremes, from the samples;
+ *  - throughput: with two or more timed passes, the mean of their
+ *    throughputs and a 95% confidence interval for it (Student's t, not
+ *    below 0); with one, its operations over its time;
+ *  - what reading the timer costs, which every sample includes once;
+ *  - with perf=on, hardware performance counters per operation, counted
+ *    over the timed passes (see include/perf.h).
+ *
+ * The timer is CLOCK_MONOTONIC_RAW, or on x86-64 the time stamp counter
+ * read with rdtscp, calibrated against CLOCK_MONOTONIC_RAW (timer=tsc).
+ * Untimed warmup passes come first (warmup=). Reports are printed for
+ * humans, or as CSV rows or JSON objects, one per line, to stdout or
+ * appended to a file, for dashboards. All of these are set with
+ * hfs_bench_set_opt(), from the shell's benchopt command.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "perf.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define HFS_BENCH_HUMAN		0
+#define HFS_BENCH_CSV		1
+#define HFS_BENCH_JSON		2
+
+#define HFS_BENCH_TIMER_RAW	0	// clock_gettime(CLOCK_MONOTONIC_RAW)
+#define HFS_BENCH_TIMER_TSC	1	// rdtscp
+
+struct hfs_bench_opts {
+	int		warmup;			// untimed passes first (default 1)
+	int		format;			// HFS_BENCH_*
+	int		timer;			// HFS_BENCH_TIMER_*
+	bool	perf;			// count with hardware counters too
+	char	output[256];	// file to append to, "" for stdout
+};
+
+extern struct hfs_bench_opts bench_opts;
+
+struct hfs_bench {
+	const char	*name;		// what was measured
+	const char	*label;		// what it was measured on, e.g. a workload
+	uint64_t	*samples;	// ticks per operation
+	size_t		nsamples;
+	size_t		cap;
+	double		*passes;	// operations per second, per timed pass
+	int			npasses;
+	int			cappasses;
+	uint64_t	ops;		// operations in the timed passes
+	double		time;		// seconds the timed passes took
+	uint64_t	pass_begin;	// ticks when the current pass began
+
+	/* bench_opts.perf: hardware counters, added up over the passes. */
+	struct hfs_perf	perf;
+	bool			perf_open;
+	uint64_t		counts[HFS_PERF_NEVENTS];
+	bool			counted[HFS_PERF_NEVENTS];
+};
+
+static inline uint64_t hfs_bench_ticks(void)
+{
+#if defined(__x86_64__)
+	if (bench_opts.timer == HFS_BENCH_TIMER_TSC) {
+		uint32_t lo, hi;
+		__asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi) : : "rcx");
+		return ((uint64_t)hi << 32) | lo;
+	}
+#endif
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double hfs_bench_ns(uint64_t ticks);
+double hfs_bench_seconds(uint64_t begin, uint64_t end);
+
+int hfs_bench_init(struct hfs_bench *b, const char *name, const char *label);
+void hfs_bench_free(struct hfs_bench *b);
+void hfs_bench_sample(struct hfs_bench *b, uint64_t ticks);
+void hfs_bench_pass_begin(struct hfs_bench *b);
+void hfs_bench_pass_end(struct hfs_bench *b, uint64_t ops);
+void hfs_bench_report(struct hfs_bench *b);
+int hfs_bench_set_opt(const char *opt);
+void hfs_bench_show_opts(void);
+
+#endif  // __BENCH_H__
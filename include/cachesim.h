@@ -0,0 +1,89 @@
+/**
+ * fsemu/include/cachesim.h
+ *
+ * A software cache and TLB simulator, for counting the cache misses of
+ * pathname lookups exactly, where hardware counters are too noisy or not
+ * there at all.
+ *
+ * The simulator is fed the reads pathname walks make, through the lookup
+ * tracer (see fs_trace_lookup()): dentries and names in directory blocks
+ * and inline directories, htree roots, directory inodes, and dirhash
+ * control bytes and slots. Each read is split into the cache lines and
+ * pages it covers. Every page is looked up in the data TLB, and every
+ * line in up to three levels of cache, in turn, until one has it; a line
+ * that misses is filled into every level it missed in. Each level, and
+ * the TLB, is set-associative with LRU replacement. Nothing else the
+ * program does (stack, code, the path cache) goes through the caches.
+ *
+ * Sets are picked from simulated physical addresses: pages are given
+ * frames in the order they are first read in, so counts do not depend on
+ * where the image or the dirhash tables happen to be mapped, and the
+ * same lookups on the same image always give the same counts.
+ *
+ * The geometry is set with hfs_cachesim_set_opt(), from the shell's
+ * cachesimopt command:
+ *	l1=SIZE:WAYS, l2=SIZE:WAYS, llc=SIZE:WAYS	(SIZE 0 leaves a level out)
+ *	line=BYTES, tlb=ENTRIES:WAYS, page=BYTES
+ *	flush=on|off	(empty the caches and TLB before every lookup)
+ * SIZE and BYTES take a k or m suffix. The simulator is not thread-safe;
+ * only one thread may look up while it is tracing.
+ */
+
+#ifndef __CACHESIM_H__
+#define __CACHESIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HFS_CACHESIM_NLEVELS	3
+
+struct hfs_cachesim_opts {
+	uint32_t	size[HFS_CACHESIM_NLEVELS];	// bytes, 0 if not there
+	uint32_t	ways[HFS_CACHESIM_NLEVELS];
+	uint32_t	line;						// bytes, a power of two
+	uint32_t	tlb_entries;				// 0 if not there
+	uint32_t	tlb_ways;
+	uint32_t	page;						// bytes, a power of two
+	bool		flush;						// cold caches for every lookup
+};
+
+extern struct hfs_cachesim_opts cachesim_opts;
+
+/**
+ * One set-associative cache, or the TLB. Each set holds the line (or
+ * frame) numbers it caches, most recently used first, 0 for an empty way
+ * (numbers are stored plus one).
+ */
+struct hfs_cache {
+	const char	*name;
+	uint32_t	nsets;
+	uint32_t	ways;
+	uint64_t	*tags;		// nsets * ways
+	uint64_t	accesses;
+	uint64_t	misses;
+};
+
+struct hfs_cachesim {
+	struct hfs_cache	levels[HFS_CACHESIM_NLEVELS];
+	struct hfs_cache	tlb;
+	int					line_shift;
+	int					page_shift;
+
+	/* Frames of the pages read so far (open addressing). */
+	uint64_t			*pages;		// page number + 1, 0 marks a free slot
+	uint64_t			*frames;
+	uint64_t			npages;
+	uint64_t			size;		// power of two
+};
+
+extern struct hfs_cachesim cachesim;
+
+int hfs_cachesim_init(void);
+void hfs_cachesim_free(void);
+void hfs_cachesim_flush(void);
+void hfs_cachesim_read(const void *addr, size_t len);
+int hfs_cachesim_set_opt(const char *opt);
+void hfs_cachesim_show_opts(void);
+
+#endif  // __CACHESIM_H__
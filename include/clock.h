@@ -0,0 +1,44 @@
+/**
+ * fsemu/include/clock.h
+ *
+ * The clock inode timestamps are taken from.
+ *
+ * Timestamps only count seconds, yet every create, write, rename and
+ * unlink used to ask the C library for the time, once per timestamp.
+ * Instead, a ticker thread reads the time every few milliseconds (the
+ * clock= mount option) and leaves it where hfs_now() finds it with one
+ * load, much like the kernel's jiffies-based current_time(). The time
+ * handed out is never more than one tick behind. With clock=precise
+ * there is no ticker, and hfs_now() reads the time on every call.
+ *
+ * Timestamps are only stored when they change (see inode_touch_*() in
+ * fs.c), so an inode written many times within the same second does not
+ * have its timestamps rewritten every time.
+ */
+
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <time.h>
+#include <stdbool.h>
+
+/* How often the ticker reads the time by default, in milliseconds. */
+#define HFS_CLOCK_TICK_DEFAULT	10
+
+extern time_t hfs_clock_now;
+extern bool hfs_clock_coarse;
+
+/**
+ * The current time, as seen by the ticker if there is one.
+ */
+static inline time_t hfs_now(void)
+{
+	if (__atomic_load_n(&hfs_clock_coarse, __ATOMIC_RELAXED))
+		return __atomic_load_n(&hfs_clock_now, __ATOMIC_RELAXED);
+	return time(NULL);
+}
+
+int hfs_clock_start(int tick_ms);
+void hfs_clock_stop(void);
+
+#endif  // __CLOCK_H__
@@ -1,8 +1,32 @@
 /**
  * fsemu/include/dirhash.h
- * 
- * An in-memory LRU directory entry cache for O(1) lookup. 
+ *
+ * An in-memory LRU directory entry cache for O(1) lookup.
  * A more aggressive implementation of UFS dirhash.
+ *
+ * Every cached directory gets its own open-addressed hash table, sized
+ * to the directory: a power-of-two number of slots, kept at most 7/8
+ * full, and doubled and rehashed when it fills up. Tables are laid out
+ * SwissTable-style: an array of one-byte control words (empty, deleted,
+ * or a 7-bit tag taken from the name's hash) in groups of 16, followed
+ * by the slots. A lookup compares the 16 control bytes of a group, which
+ * sit in one cache line, against the tag with a single SSE2 compare (32
+ * bytes with AVX2, or two 64-bit words without either), and only looks
+ * at slots whose tag matches.
+ *
+ * Table memory comes from a slab allocator with a free list per table
+ * size. Tables are found by inode number through a small in-memory hash,
+ * so nothing about dirhash is stored on disk.
+ *
+ * The number of tables is set at mount time (dirhash=N), and when they
+ * are all in use a replacement policy (dirhash_policy=) picks the one to
+ * recycle: strict LRU, CLOCK, which only sets a reference bit on a hit,
+ * or one of the scan-resistant 2Q and ARC, which keep a history of
+ * recently evicted directories. See src/dirhash_policy.c.
+ *
+ * Unlike the rest of the lookup path, dirhash is not lock-free: a lookup
+ * may load a table or move one on the policy's lists, so every entry
+ * point takes dirhash->lock.
  */
 
 #ifndef __DIRHASH_H__
@@ -11,45 +35,145 @@
 #include "fsemu.h"
 #include "fs.h"
 
-/* Total number of hash tables */
+#include <stddef.h>
+#include <pthread.h>
+
+/* Default number of hash tables */
 #define HFS_DIRHASH_SIZE    100
 
-/* Size of each hash table, a prime number. */
-#define HFS_DIRHASH_TABLESIZE   97
+/* Replacement policies */
+#define HFS_DIRHASH_LRU         0
+#define HFS_DIRHASH_CLOCK       1
+#define HFS_DIRHASH_2Q          2
+#define HFS_DIRHASH_ARC         3
+#define HFS_DIRHASH_NPOLICIES   4
+
+/* Number of buckets finding a table by inum, must be a power of two. */
+#define HFS_DIRHASH_NHASH   128
+
+/* Control bytes scanned per probe, one vector compare. */
+#ifdef __AVX2__
+#define HFS_DIRHASH_GROUP   32
+#else
+#define HFS_DIRHASH_GROUP   16
+#endif
+
+/* Smallest and largest table, in slots. The largest can hold a block. */
+#define HFS_DIRHASH_MINSLOTS    HFS_DIRHASH_GROUP
+#define HFS_DIRHASH_MAXSLOTS    1024
+#define HFS_DIRHASH_NCLASSES    7       // up to 16, 32, ..., 1024 slots
+
+/* Memory is taken from the system in slabs of (at least) this size. */
+#define HFS_DIRHASH_SLABSIZE    (64 * 1024)
+
+/* Control byte values, anything else is the tag of a full slot. */
+#define HFS_DIRHASH_EMPTY       0x80
+#define HFS_DIRHASH_DELETED     0xfe
 
+/**
+ * A slot. A name is first checked against the slot's copy of its 32-bit
+ * hash and name_key, which holds the name's length (including the NUL)
+ * in the low byte and its first three bytes above it, so mismatches are
+ * rejected without touching the dentry. The name in the dentry is then
+ * compared in full.
+ */
 struct hfs_dirhash_entry {
-    uint32_t            seqno;
     uint32_t            name_hash;
+    uint32_t            name_key;
     struct hfs_dentry   *dent;
-    struct hfs_dirhash_entry    *next_dirhash;
 };
 
 struct hfs_dirhash_table {
-    uint32_t                    seqno;
-    uint32_t                    inum;
-    uint32_t                    capacity;
-    struct hfs_dirhash_table   *prev;
-    struct hfs_dirhash_table   *next;
-    struct hfs_dirhash_entry    data[HFS_DIRHASH_TABLESIZE];
+    uint32_t                    inum;       // 0 if the table is unused
+    uint32_t                    nslots;
+    uint32_t                    nentries;
+    uint32_t                    ndeleted;
+    uint8_t                     *ctrl;      // nslots control bytes
+    struct hfs_dirhash_entry    *slots;
+    struct hfs_dirhash_table    *prev;      // replacement policy list
+    struct hfs_dirhash_table    *next;
+    struct hfs_dirhash_table    *hnext;     // inum hash chain
+    uint8_t                     list;       // list the table is on
+    uint8_t                     ref;        // CLOCK reference bit
+};
+
+struct hfs_dirhash_list {
+    struct hfs_dirhash_table    *head;      // most recently inserted
+    struct hfs_dirhash_table    *tail;
+    int                         len;
+};
+
+/* Inode numbers of recently evicted directories, oldest first. */
+struct hfs_dirhash_ghost {
+    uint32_t    *inums;
+    int         len;
+    int         cap;
 };
 
+/**
+ * A replacement policy.
+ *
+ * get:     Return a table to cache directory inum in, and put it on
+ *          the policy's lists. The table may still hold another
+ *          directory, which the caller evicts.
+ * hit:     The table has been used.
+ * put:     The table no longer holds a directory and can be reused first.
+ */
+struct hfs_dirhash_policy {
+    const char  *name;
+    void        (*init)(void);
+    struct hfs_dirhash_table *(*get)(uint32_t inum);
+    void        (*hit)(struct hfs_dirhash_table *dt);
+    void        (*put)(struct hfs_dirhash_table *dt);
+};
+
+extern const struct hfs_dirhash_policy hfs_dirhash_policies[];
+
+/* An unused piece of table memory, on its size class' free list. */
+struct hfs_dirhash_chunk {
+    struct hfs_dirhash_chunk    *next;
+};
+
+struct hfs_dirhash_slab {
+    struct hfs_dirhash_slab     *next;
+    size_t                      size;
+    char                        mem[] __attribute__((aligned(64)));
+};
+
+#define HFS_DIRHASH_NLISTS  3   // unused tables, and two per policy
+
 struct hfs_dirhash {
-    struct hfs_dirhash_table   *head;
-    struct hfs_dirhash_table   *tail;
-    struct hfs_dirhash_table    tables[HFS_DIRHASH_SIZE];
+    pthread_mutex_t             lock;
+    const struct hfs_dirhash_policy *policy;
+    struct hfs_dirhash_list     lists[HFS_DIRHASH_NLISTS];
+    struct hfs_dirhash_ghost    ghosts[2];
+    struct hfs_dirhash_table    *hand;      // CLOCK hand
+    int                         target;     // ARC: target size of list 1
+    struct hfs_dirhash_table   *hash[HFS_DIRHASH_NHASH];
+    struct hfs_dirhash_chunk   *free[HFS_DIRHASH_NCLASSES];
+    struct hfs_dirhash_slab    *slabs;
+    size_t                      slab_bytes;     // taken from the system
+    size_t                      used_bytes;     // handed out to tables
+    int                         ntables;
+    struct hfs_dirhash_table    tables[];
 };
 
 extern struct hfs_dirhash *dirhash;
 
-int hfs_dirhash_init(void);
+int hfs_dirhash_init(int ntables, int policy);
 void hfs_dirhash_free(void);
 int hfs_dirhash_put(struct hfs_inode *dir, struct hfs_dentry *dent);
 int hfs_dirhash_put_dir(struct hfs_inode *dir);
 
-struct hfs_dirhash_entry *hfs_dirhash_lookup(struct hfs_inode *dir, 
-                                             const char *name);
+struct hfs_dentry *hfs_dirhash_lookup(struct hfs_inode *dir,
+                                      const char *name);
 
 void hfs_dirhash_delete(struct hfs_inode *dir, const char *name);
+void hfs_dirhash_release(struct hfs_inode *dir);
+
+#ifdef HFS_DEBUG
+void hfs_dirhash_verify_names(bool verify);
+#endif
 
 static inline int inode_dirhash_enabled(struct hfs_inode *dir)
 {
@@ -57,15 +181,13 @@ static inline int inode_dirhash_enabled(struct hfs_inode *dir)
 }
 
 /**
- * Disable dirhash for the given directory inode.
- * Need to reset id and seqno to 0, otherwise the garbage data will
- * be mistaken as an in-use block address.
+ * Disable dirhash for the given directory inode, and give back its
+ * table if it has one.
  */
 static inline void inode_disable_dirhash(struct hfs_inode *dir)
 {
     dir->flags &= (~I_DIRHASH);
-    dir->data.dirhash_rec.id = 0;
-    dir->data.dirhash_rec.seqno = 0;
+    hfs_dirhash_release(dir);
 }
 
-#endif  // __DIRHASH_H__
\ No newline at end of file
+#endif  // __DIRHASH_H__
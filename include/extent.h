@@ -0,0 +1,63 @@
+/**
+ * fsemu/include/extent.h
+ *
+ * Extent-mapped regular files.
+ *
+ * A file's blocks are described by extents: runs of blocks that are
+ * contiguous both in the file and on disk, given as (first file block,
+ * length, first disk block). Up to HFS_EXT_INODE_MAX extents fit in the
+ * inode itself, which is enough for a file that was written from start
+ * to end on a disk that was not too fragmented. Beyond that, the extents
+ * move to a B-tree like ext4's: the root stays in the inode and holds
+ * index entries, each covering the file blocks from its own key up to
+ * the next one, and the nodes below it are whole blocks. Nodes are split
+ * in half when full, and the tree grows from the root.
+ *
+ * A sequential read or write looks up one mapping per extent rather than
+ * one per block, and copies the whole run at once. Appends are allocated
+ * from a contiguous run set aside for the file (see hfs_extent_alloc()),
+ * so a file written from start to end ends up in a few large extents
+ * even when other files are being written at the same time.
+ *
+ * Readers do not lock the tree (see include/sync.h), so everything they
+ * read out of it is checked against the bounds of the image before it
+ * is used; what they read may be nonsense, but the sequence count tells
+ * them to throw it away.
+ */
+
+#ifndef __EXTENT_H__
+#define __EXTENT_H__
+
+#include "fs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Entries in a node that is a whole block. */
+#define HFS_EXT_BLOCK_MAX	((BSIZE - sizeof(struct hfs_extent_header)) \
+								/ sizeof(struct hfs_extent))
+
+/* Deepest tree that is looked at, far more than a 4 GiB file needs. */
+#define HFS_EXT_MAXDEPTH	5
+
+/* Most blocks set aside for a file's appends at once (8 MiB). */
+#define HFS_EXT_PREALLOC_MAX	2048
+
+void hfs_extent_init(struct hfs_inode *file);
+bool hfs_extent_map(struct hfs_inode *file, uint32_t lblk,
+					uint32_t *pblk, uint32_t *len);
+uint32_t hfs_extent_alloc(struct hfs_inode *file, uint32_t lblk,
+						  uint32_t n, uint32_t *pblk);
+void hfs_extent_free_all(struct hfs_inode *file);
+uint32_t hfs_extent_nblocks(struct hfs_inode *file);
+
+void hfs_extent_release(struct hfs_inode *file);
+bool hfs_extent_reserved(struct hfs_inode *file);
+int hfs_extent_rsv_init(void);
+void hfs_extent_rsv_exit(void);
+
+#ifdef HFS_DEBUG
+uint64_t hfs_extent_nlookups(void);
+#endif
+
+#endif  // __EXTENT_H__
@@ -11,21 +11,17 @@
 
 #include <stdint.h>
 
-#define MAXOPENFILES    32
-
 typedef unsigned int	foff_t;     // R/W offset value
 
 /**
- * The file structure represents an open file. In real Linux, 
- * open files are private to each process. Since there are on
- * processes in this emulator (yet), we will consider open files
- * a property of the emulator itself.
+ * The file structure represents an open file. As in real Linux,
+ * open files are private to each process (see process.h).
  */
 struct file {
     foff_t          offset;
-	struct hfs_dentry	*f_dentry;
+	struct hfs_dentry	*f_dentry;	// NULL if the slot is free
+	struct hfs_inode	*f_inode;	// resolved at open; dentries move
+	int				next_free;		// next free slot, if this one is free
 };
 
-extern struct file openfiles[MAXOPENFILES];
-
 #endif  // __FILE_H__
\ No newline at end of file
@@ -40,6 +40,8 @@
 // Uncomment the following macros to enable the corresponding features.
 #define _HFS_INLINE_DIRECTORY
 // #define _HFS_DIRHASH
+#define _HFS_PCACHE
+#define _HFS_HTREE
 
 /*
  * Simple File System layout diagram:
@@ -56,6 +58,8 @@
 /* Inode flags */
 #define I_INLINE	0x00000001		/* Inline directory/symlink */
 #define I_DIRHASH	0x00000002		/* Dirhashed directory */
+#define I_HTREE		0x00000004		/* Hash-indexed directory */
+#define I_EXTENTS	0x00000008		/* File mapped by an extent tree */
 
 struct hfs_dentry {
 	uint32_t	inum;
@@ -67,6 +71,33 @@ struct hfs_dentry {
 
 #define INODE_BLOCKS_SIZE	(sizeof(uint32_t) * NBLOCKS)
 
+/*
+ * Extent trees (see include/extent.h). Every node, the root in the
+ * inode included, is a header followed by 12-byte entries: extents in
+ * the leaves, and index entries pointing to child nodes above them.
+ */
+#define HFS_EXT_MAGIC		0xf30a
+#define HFS_EXT_INODE_MAX	4		// entries in the root, in the inode
+
+struct hfs_extent_header {
+	uint16_t	magic;
+	uint16_t	entries;
+	uint16_t	max;
+	uint16_t	depth;		// 0 if the entries are extents
+};
+
+struct hfs_extent {
+	uint32_t	lblk;		// first file block
+	uint32_t	len;		// number of blocks
+	uint32_t	pblk;		// first disk block
+};
+
+struct hfs_extent_idx {
+	uint32_t	lblk;		// no file block below this is in the child
+	uint32_t	child;		// disk block of the child node
+	uint32_t	unused;
+};
+
 struct hfs_inode {
 	uint32_t		nlink;
 	uint32_t		size;
@@ -78,13 +109,11 @@ struct hfs_inode {
 		/**
 		 * Dirhashed directory: If dirhash is enabled for a directory,
 		 * there can only be one block full of directory entries.
-		 * After the single block address, the dirhash_rec field is used
-		 * to identify the dirhash table for this directory.
+		 * The dirhash table itself is found by inum and lives only
+		 * in memory.
 		 */
 		struct {
 			uint32_t	block;
-			uint32_t	seqno;
-			uint16_t	id;
 		} dirhash_rec;
 
 		/**
@@ -101,6 +130,15 @@ struct hfs_inode {
 		 * Inline symbolic link path.
 		 */
 		char		symlink_path[INODE_BLOCKS_SIZE]; 
+
+		/**
+		 * Regular file (I_EXTENTS): the root of the extent tree.
+		 * Files without the flag use blocks[] directly.
+		 */
+		struct {
+			struct hfs_extent_header	hdr;
+			struct hfs_extent			extents[HFS_EXT_INODE_MAX];
+		} ext_root;
 	} data;
 
 	/**
@@ -158,6 +196,32 @@ static inline uint16_t get_dentry_reclen_from_name(const char *name)
 	return (sizeof(struct hfs_dentry) + strlen(name) + 1);
 }
 
+/**
+ * Hash-indexed (htree) directories, for directories that outgrow one
+ * block. Block 0 holds the "." and ".." entries, with ".." stretched to
+ * the end of the block, and the index is kept in the space after the
+ * ".." name, so anything that walks dentry blocks sees an ordinary block
+ * with two entries. The index maps the lowest name hash stored in each
+ * leaf block to the leaf's position in data.blocks[], sorted by hash;
+ * the first entry always has hash 0. Leaf blocks are ordinary dentry
+ * blocks. A lookup is a binary search of the index and a scan of one
+ * leaf. A full leaf is split in two at its median hash, or once all
+ * blocks are in use, shares its entries out with a neighbouring leaf.
+ */
+struct hfs_dx_entry {
+	uint32_t	hash;
+	uint32_t	block;		// index into data.blocks[]
+};
+
+struct hfs_dx_root {
+	uint16_t			limit;		// capacity of entries[]
+	uint16_t			count;
+	struct hfs_dx_entry	entries[0];
+};
+
+/* Offset of the index in block 0, after "." and "..", 8-byte aligned. */
+#define HFS_DX_ROOT_OFF	((2 * sizeof(struct hfs_dentry) + 5 + 7) & ~7)
+
 #define ROOTINO		1
 
 #define DENTRYNAMELEN	255  // Just like in EXT2 and EXT4 
@@ -217,29 +281,43 @@ static inline struct hfs_inode *dentry_get_inode(struct hfs_dentry *dent)
 	return inode_from_inum(dent->inum);
 }
 
+struct hfs_stat;
+
 struct hfs_dentry *lookup(const char *pathname);
 struct hfs_dentry *dir_lookup(const char *pathname, struct hfs_inode **pi);
+struct hfs_inode *lookup_inode(const char *pathname, struct hfs_dentry **dent);
+struct hfs_inode *lookup_at(struct hfs_dentry *dir, struct hfs_inode *idir,
+							const char *pathname);
+void inode_stat(struct hfs_inode *inode, struct hfs_stat *statbuf);
+int dentry_readdir(struct hfs_dentry *dent);
 
 static inline int inum(struct hfs_inode *i)
 {
 	return (i - inodes);
 }
 
-#define MAXOPENFILES    32
-
-/* 
- * Plan to simulate processes with threads. By which time
- * things like the openfiles array should be a property of
- * each individual process. Right now we consider the entire
- * emulator as a single process -- which of course it is but
- * in a difference sense.
+/**
+ * Mount options, set by fs_mount().
  */
+struct hfs_mount_opts {
+	bool	ialloc_near_parent;		// ialloc=near
+	int		placement;				// placement=, one of HFS_PLACE_*
+	int		dirhash_size;			// dirhash=, number of tables (0: default)
+	int		dirhash_policy;			// dirhash_policy=, one of HFS_DIRHASH_*
+	int		clock_tick;				// clock=, ms between ticks (-1: precise)
+	int		atime;					// atime=, one of HFS_ATIME_*
+};
 
-extern struct file openfiles[MAXOPENFILES];
+/* Inode and block placement policies (see include/alloc.h). */
+#define HFS_PLACE_FLAT		0	// next free inode/block, no grouping
+#define HFS_PLACE_GROUP		1	// ext2-style block groups
+#define HFS_PLACE_ORLOV		2	// block groups, Orlov directory spreading
 
-/**
- * Current working directory.
- */
-extern struct hfs_dentry *cwd;
+/* When reads update a file's access time. */
+#define HFS_ATIME_RELATIME	0	// if it is older than mtime/ctime, or a day
+#define HFS_ATIME_STRICT	1	// on every read
+#define HFS_ATIME_NONE		2	// never
+
+extern struct hfs_mount_opts mount_opts;
 
 #endif  // __FS_H__
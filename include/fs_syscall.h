@@ -22,6 +22,7 @@
 #include "fsemu.h"
 
 #include <time.h>
+#include <sys/uio.h>
 
 struct hfs_stat {
 	uint32_t	st_ino;
@@ -34,7 +35,15 @@ struct hfs_stat {
 	time_t		st_changetime;
 };
 
-int fs_mount(unsigned long size);
+/* Most buffers fs_readv() and fs_writev() take, like IOV_MAX. */
+#define HFS_IOV_MAX	1024
+
+/* A file pinned by fs_read_map(). */
+struct hfs_pin {
+	uint32_t	inum;
+};
+
+int fs_mount(unsigned long size, const char *opts);
 int fs_unmount(void);
 int fs_open(const char *pathname);
 int fs_close(int fd);
@@ -47,6 +56,13 @@ int fs_rename(const char *oldpath, const char *newpath);
 unsigned int fs_lseek(int fd, unsigned int off);
 unsigned int fs_read(int fd, void *buf, unsigned int count);
 unsigned int fs_write(int fd, void *buf, unsigned int count);
+int fs_pread(int fd, void *buf, unsigned int count, unsigned int off);
+int fs_pwrite(int fd, const void *buf, unsigned int count, unsigned int off);
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+int fs_read_map(int fd, unsigned int off, unsigned int len,
+				struct iovec *iov, int iovcnt, struct hfs_pin *pin);
+void fs_read_unmap(struct hfs_pin *pin);
 int fs_reset(void);
 int fs_symlink(const char *target, const char *linkpath);
 int fs_readlink(const char *pathname, char *buf, size_t bufsize);
@@ -73,6 +89,13 @@ int fs_chdir(const char *pathname);
 #define SYS_readlink 15
 #define SYS_stat	16
 #define SYS_chdir	17
+#define SYS_pread	18
+#define SYS_pwrite	19
+#define SYS_readv	20
+#define SYS_writev	21
+#define SYS_read_map	22
+#define SYS_read_unmap	23
+#define NR_SYSCALLS	24
 
 // Debug functions
 // If around declarations because these functions should
@@ -2,8 +2,7 @@
  * fsemu/include/fsemu.h
  * 
  * Things relevant to the emulator itself. Strictly "user space".
- * For now the fsemu itself is also a "process" so open file 
- * descriptors can also be found here.
+ * The shell runs as the init process (see process.h).
  */
 
 #ifndef __FSEMU_H__
@@ -0,0 +1,145 @@
+/**
+ * fsemu/include/pcache.h
+ *
+ * Full-path lookup cache (pcache).
+ *
+ * A direct-mapped, in-memory cache keyed by (starting directory, pathname)
+ * that sits in front of the component-by-component walk in do_lookup().
+ * Both successful (positive) and failed (negative) lookups are cached,
+ * so a repeated lookup costs one hash of the pathname and one probe.
+ *
+ * Invalidation is done with generation numbers rather than by searching
+ * the cache: every entry remembers the directory that was scanned in the
+ * final step of its walk, along with that directory's generation number
+ * at the time the entry was filled. Creating or removing a name in a
+ * directory bumps the directory's generation, which silently retires
+ * every entry that depends on it. Renaming a directory changes every
+ * path that runs through it, so that bumps the global generation, as
+ * does moving dentries to other addresses (splitting or converting a
+ * directory), since entries refer to dentries by address. Entries also
+ * hold the inode the walk found, as it was when the walk checked that
+ * its dentry led there, so that callers that only need the inode (e.g.
+ * stat) do not have to read it back through the dentry.
+ *
+ * Prefix resumption: while walking a pathname that missed, every
+ * directory resolved along the way is also cached under its own prefix
+ * of the pathname (e.g. "/a/b/c" for "/a/b/c/d/x"). On the next miss,
+ * the prefixes of the new pathname are probed from the deepest up and
+ * the walk resumes from the deepest one found, so a lookup of a sibling
+ * under a long shared prefix only has to scan the final directory.
+ * Since FNV-1a is computed incrementally, the hash of every prefix falls
+ * out of hashing the full pathname once.
+ *
+ * Concurrency: lookups probe and fill the cache without locks. Every
+ * entry has a sequence count (see include/sync.h); a probe copies what it
+ * needs out of the entry and discards the copy if the entry was being
+ * filled at the same time, and a fill gives up if another one is already
+ * filling the entry. Generations are read before the walk that fills an
+ * entry reads the directory they describe, so an entry filled by a walk
+ * that raced with a change to the directory is already stale.
+ */
+
+#ifndef __PCACHE_H__
+#define __PCACHE_H__
+
+#include "fsemu.h"
+#include "fs.h"
+
+#include <stdbool.h>
+
+/* Number of cache entries, must be a power of two. */
+#define HFS_PCACHE_SIZE		4096
+
+/* Longest pathname (including the terminating NUL) that will be cached. */
+#define HFS_PCACHE_PATHLEN	160
+
+/* Number of directory generation counters, must be a power of two. */
+#define HFS_PCACHE_NGENS	4096
+
+/* Number of pathname prefixes considered for prefix resumption. */
+#define HFS_PCACHE_MAXDEPTH	32
+
+struct hfs_pcache_entry {
+	uint32_t			seq;
+	uint32_t			hash;
+	uint32_t			gen;		// global generation at fill time
+	uint32_t			dir;		// inum of the last directory scanned
+	uint32_t			dir_gen;	// its generation at fill time
+	struct hfs_inode	*start;		// directory the walk started in
+	struct hfs_dentry	*dent;		// result, NULL for negative entries
+	struct hfs_inode	*inode;		// inode of dent found by the walk
+	struct hfs_inode	*pi;		// parent inode reported by the walk
+	uint16_t			pathlen;
+	char				path[HFS_PCACHE_PATHLEN];
+};
+
+struct hfs_pcache {
+	bool						enabled;
+	bool						prefix;		// prefix resumption
+	uint32_t					gen;
+	uint32_t					dir_gens[HFS_PCACHE_NGENS];
+	struct hfs_pcache_entry		entries[HFS_PCACHE_SIZE];
+};
+
+/**
+ * A pathname prepared for probing the cache. The hash is computed once
+ * and shared between the lookup and the fill that follows a miss.
+ * prefix[i] describes the pathname up to the end of its i-th component.
+ *
+ * gen is the global generation when the key was prepared, and dir_gen
+ * the generation of the directory the walk is about to scan (see
+ * hfs_pcache_key_dir()). Fills record these rather than the current ones.
+ */
+struct hfs_pcache_key {
+	struct hfs_inode	*start;
+	const char			*path;
+	int					len;
+	uint32_t			hash;
+	uint32_t			gen;
+	uint32_t			dir_gen;
+	int					nprefix;
+	struct {
+		uint16_t		len;
+		uint32_t		hash;
+	} prefix[HFS_PCACHE_MAXDEPTH];
+};
+
+/**
+ * What a probe found, copied out of the entry.
+ */
+struct hfs_pcache_hit {
+	struct hfs_dentry	*dent;		// NULL for negative entries
+	struct hfs_inode	*inode;
+	struct hfs_inode	*pi;
+	uint32_t			dir;
+	uint32_t			dir_gen;
+	uint32_t			gen;
+};
+
+extern struct hfs_pcache *pcache;
+
+int hfs_pcache_init(void);
+void hfs_pcache_free(void);
+void hfs_pcache_clear(void);
+void hfs_pcache_enable(bool enable);
+bool hfs_pcache_enabled(void);
+void hfs_pcache_enable_prefix(bool enable);
+
+void hfs_pcache_key_init(struct hfs_pcache_key *key,
+						 struct hfs_inode *start, const char *path);
+void hfs_pcache_key_dir(struct hfs_pcache_key *key, struct hfs_inode *dir);
+bool hfs_pcache_lookup(struct hfs_pcache_key *key, struct hfs_pcache_hit *hit);
+bool hfs_pcache_hit_valid(struct hfs_pcache_hit *hit);
+void hfs_pcache_put(struct hfs_pcache_key *key, struct hfs_dentry *dent,
+					struct hfs_inode *inode, struct hfs_inode *pi,
+					struct hfs_inode *last);
+bool hfs_pcache_lookup_prefix(struct hfs_pcache_key *key, int *depth,
+							  struct hfs_pcache_hit *hit);
+void hfs_pcache_put_prefix(struct hfs_pcache_key *key, int depth,
+						   struct hfs_dentry *dent, struct hfs_inode *inode,
+						   struct hfs_inode *pi, struct hfs_inode *last);
+
+void hfs_pcache_invalidate_dir(struct hfs_inode *dir);
+void hfs_pcache_invalidate_all(void);
+
+#endif  // __PCACHE_H__
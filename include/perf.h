@@ -0,0 +1,51 @@
+/**
+ * fsemu/include/perf.h
+ *
+ * Hardware performance counters, through perf_event_open(2).
+ *
+ * A benchmark phase can be wrapped in hfs_perf_start() and hfs_perf_stop()
+ * to count what the CPU did during it: cycles, instructions, branch
+ * misses, L1d and last-level cache loads and misses, and dTLB load
+ * misses. Only user space is counted (perf_event_paranoid permitting),
+ * in the calling thread and in every thread it creates during the phase.
+ * Each event has its own counter rather than one group, so that events
+ * the CPU (or the hypervisor) does not have are left out on their own;
+ * if the kernel had to share the hardware between more counters than it
+ * has, counts are scaled up by the time each one ran.
+ *
+ * Counters that cannot be opened, e.g. in a container without access to
+ * them, are simply reported as unavailable.
+ */
+
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+	HFS_PERF_CYCLES,
+	HFS_PERF_INSTRUCTIONS,
+	HFS_PERF_BRANCH_MISSES,
+	HFS_PERF_L1D_LOADS,
+	HFS_PERF_L1D_MISSES,
+	HFS_PERF_LLC_LOADS,
+	HFS_PERF_LLC_MISSES,
+	HFS_PERF_DTLB_MISSES,
+	HFS_PERF_NEVENTS
+};
+
+struct hfs_perf {
+	int			fds[HFS_PERF_NEVENTS];		// -1 if unavailable
+	uint64_t	values[HFS_PERF_NEVENTS];	// counted by the last phase
+	bool		valid[HFS_PERF_NEVENTS];	// whether values[] is
+};
+
+extern const char *hfs_perf_names[HFS_PERF_NEVENTS];
+
+int hfs_perf_open(struct hfs_perf *perf);
+void hfs_perf_close(struct hfs_perf *perf);
+void hfs_perf_start(struct hfs_perf *perf);
+void hfs_perf_stop(struct hfs_perf *perf);
+
+#endif  // __PERF_H__
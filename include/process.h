@@ -0,0 +1,65 @@
+/**
+ * fsemu/include/process.h
+ *
+ * Emulated processes.
+ *
+ * A process owns a file descriptor table and a working directory. Every
+ * thread runs as some process: the one it attached itself to with
+ * process_attach(), or init (pid 1), which is also what the shell runs
+ * as. Threads attached to the same process share its descriptors, as
+ * after clone(CLONE_FILES), and take turns on its lock to use them.
+ *
+ * A descriptor table starts out with NR_OPEN_DEFAULT slots and doubles
+ * when it is full, up to NR_OPEN_MAX. Unused slots are kept on a free
+ * list, so opening a file takes constant time. Unlike POSIX, the
+ * descriptor handed out is the one closed most recently rather than the
+ * lowest one that is free.
+ */
+
+#ifndef __PROCESS_H__
+#define __PROCESS_H__
+
+#include "fs.h"
+#include "file.h"
+
+#include <pthread.h>
+
+#define NR_OPEN_DEFAULT		32
+#define NR_OPEN_MAX			(1 << 20)
+
+struct hfs_process {
+	pthread_mutex_t		lock;		// the descriptor table and cwd
+	int					pid;
+	struct hfs_dentry	*cwd;
+	struct file			*files;		// nfiles slots
+	int					nfiles;
+	int					free_fd;	// first free slot, -1 if none
+	int					nopen;
+	struct hfs_process	*prev;		// all processes
+	struct hfs_process	*next;
+};
+
+extern struct hfs_process init_process;
+extern __thread struct hfs_process *current;
+
+/**
+ * The process the calling thread runs as.
+ */
+static inline struct hfs_process *current_process(void)
+{
+	return current ? current : &init_process;
+}
+
+void init_processes(void);
+struct hfs_process *process_create(void);
+void process_attach(struct hfs_process *p);
+void process_exit(struct hfs_process *p);
+void process_for_each(void (*fn)(struct hfs_process *p, void *arg),
+					  void *arg);
+
+int fd_install(struct hfs_dentry *dent, struct hfs_inode *inode);
+struct hfs_inode *fd_get(int fd, foff_t *off);
+void fd_set_offset(int fd, struct hfs_inode *inode, foff_t off);
+int fd_close(int fd);
+
+#endif  // __PROCESS_H__
@@ -0,0 +1,87 @@
+/**
+ * fsemu/include/replay.h
+ *
+ * Replaying system call traces.
+ *
+ * tools/stracegen.py turns an strace -f capture (of a build, say) into an
+ * op log: the pathname system calls in it (openat, stat, lstat, access,
+ * readlink, mkdir, getdents64, execve and their newer variants), with
+ * every path made absolute, and the process that made each call. It can
+ * also write out, as a file system description for load, the files and
+ * directories the trace shows existed before it began.
+ *
+ * The log is binary, so that it can be replayed as fast as the calls can
+ * be made: a header, then npaths NUL-terminated paths (strsize bytes),
+ * then nops operations of 8 bytes each, in the order they were made. All
+ * numbers are little-endian.
+ *
+ * hfs_replay_run() makes each call in the file system, timing each one.
+ * Every traced process becomes a process of its own here (see
+ * include/process.h). With more than one thread, the processes are
+ * divided among the threads, and each thread makes the calls of its
+ * processes in the order of the log: calls of one process keep their
+ * order, calls of different processes may not.
+ *
+ * A replay creates what the trace did. hfs_replay_undo() removes it
+ * again, so that the next replay finds the file system as the first one
+ * did: hfs_replay_load() notes which of the paths that mkdir and O_CREAT
+ * calls make were there already.
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HFS_REPLAY_MAGIC	"HFSREPL"	// 8 bytes with the NUL
+#define HFS_REPLAY_VERSION	1
+
+/* Operations, and what they do here. */
+#define HFS_REPLAY_OPEN		0	// fs_open(), fs_creat() for O_CREAT; close
+#define HFS_REPLAY_STAT		1	// fs_stat()
+#define HFS_REPLAY_LSTAT	2	// fs_stat()
+#define HFS_REPLAY_ACCESS	3	// fs_stat()
+#define HFS_REPLAY_READLINK	4	// fs_readlink(), a file stands in for a link
+#define HFS_REPLAY_MKDIR	5	// fs_mkdir()
+#define HFS_REPLAY_GETDENTS	6	// lookup and read every entry
+#define HFS_REPLAY_EXECVE	7	// fs_open(), fs_close()
+#define HFS_REPLAY_NOPS		8
+
+/* Flags */
+#define HFS_REPLAY_FAILED	0x01	// the call failed in the trace
+#define HFS_REPLAY_CREAT	0x02	// openat() with O_CREAT
+
+struct hfs_replay_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	npids;		// processes
+	uint32_t	npaths;
+	uint32_t	nops;
+	uint32_t	strsize;	// bytes of paths
+} __attribute__((packed));
+
+struct hfs_replay_op {
+	uint8_t		op;			// HFS_REPLAY_*
+	uint8_t		flags;
+	uint16_t	pid;		// process, numbered from 0 as they appear
+	uint32_t	path;		// index of the path
+} __attribute__((packed));
+
+struct hfs_replay {
+	struct hfs_replay_hdr	hdr;
+	struct hfs_replay_op	*ops;
+	const char				**paths;
+	char					*data;		// the whole log
+	bool					*existed;	// by path, when the log was loaded
+};
+
+extern const char *hfs_replay_names[HFS_REPLAY_NOPS];
+
+int hfs_replay_load(struct hfs_replay *r, const char *file);
+void hfs_replay_free(struct hfs_replay *r);
+int hfs_replay_run(struct hfs_replay *r, int nthreads, uint64_t *ticks,
+				   int *results);
+void hfs_replay_undo(struct hfs_replay *r);
+
+#endif  // __REPLAY_H__
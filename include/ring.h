@@ -0,0 +1,84 @@
+/**
+ * fsemu/include/ring.h
+ *
+ * Batched system calls, after io_uring.
+ *
+ * A caller fills submission queue entries (hfs_ring_get_sqe()) with the
+ * operations it wants done, hands them all over at once with
+ * hfs_ring_submit(), and then collects one completion per operation
+ * (hfs_ring_peek_cqe() and hfs_ring_cqe_seen()), matched up through
+ * user_data. Everything is done by the submitting thread, on its own
+ * process's descriptors, before hfs_ring_submit() returns.
+ *
+ * Seeing the whole batch at once lets the ring do better than one call
+ * at a time:
+ *  - Operations that do not change anything (LOOKUP and STAT) can be
+ *    done in any order, so every run of them between two operations
+ *    that do change something is sorted by parent directory and name.
+ *  - The parent directory of each group of such operations is then
+ *    looked up once, and only the last component of each path is looked
+ *    up in it (see lookup_at()).
+ *  - A path that comes up more than once in a run is looked up once.
+ * Operations that change something are done one by one, in the order
+ * they were submitted, and completions come in the order the operations
+ * were done in, which is not necessarily the order they were submitted.
+ *
+ * A ring is used by one thread at a time.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "fs_syscall.h"
+
+#include <stdint.h>
+
+enum {
+	HFS_OP_NOP,
+	HFS_OP_LOOKUP,		// path; res is 0 or -ENOFOUND
+	HFS_OP_STAT,		// path, statbuf
+	HFS_OP_OPEN,		// path; res is the descriptor
+	HFS_OP_CLOSE,		// fd
+	HFS_OP_READ,		// fd, buf, len, off (as fs_pread())
+	HFS_OP_WRITE,		// fd, buf, len, off (as fs_pwrite())
+	HFS_OP_CREAT,		// path
+	HFS_OP_UNLINK,		// path
+	HFS_OP_MKDIR,		// path
+	HFS_OP_NR
+};
+
+struct hfs_sqe {
+	uint8_t			opcode;		// HFS_OP_*
+	int				fd;
+	const char		*path;
+	void			*buf;
+	uint32_t		len;
+	uint32_t		off;
+	struct hfs_stat	*statbuf;
+	uint64_t		user_data;	// handed back in the completion
+};
+
+struct hfs_cqe {
+	uint64_t	user_data;
+	int			res;		// what the system call returned
+};
+
+struct hfs_ring {
+	unsigned int	entries;	// power of two
+	unsigned int	sq_head;	// next to be done
+	unsigned int	sq_tail;	// next to be filled
+	unsigned int	cq_head;	// next to be collected
+	unsigned int	cq_tail;
+	struct hfs_sqe	*sqes;		// entries of them
+	struct hfs_cqe	*cqes;		// 2 * entries of them
+	struct ring_op	*ops;		// scratch space for sorting, entries
+};
+
+int hfs_ring_init(struct hfs_ring *ring, unsigned int entries);
+void hfs_ring_free(struct hfs_ring *ring);
+struct hfs_sqe *hfs_ring_get_sqe(struct hfs_ring *ring);
+int hfs_ring_submit(struct hfs_ring *ring);
+struct hfs_cqe *hfs_ring_peek_cqe(struct hfs_ring *ring);
+void hfs_ring_cqe_seen(struct hfs_ring *ring);
+
+#endif  // __RING_H__
@@ -0,0 +1,80 @@
+/**
+ * fsemu/include/sync.h
+ *
+ * Synchronization between concurrent system calls.
+ *
+ * Lookups, stat and read take no locks. What they read is covered by a
+ * sequence count: a writer makes the count odd before it changes what the
+ * count covers and even again when it is done, and a reader that finds
+ * the count odd, or different after its reads than before, throws away
+ * what it read and tries again. The image stays mapped for as long as the
+ * file system is mounted, so a reader racing with a writer may read
+ * nonsense, but never touches memory it should not.
+ *
+ * Writers serialize among themselves with locks (see fs.c), so a count
+ * is only ever changed by the one writer holding its lock.
+ */
+
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Begin a read section, waiting for a writer to finish if there is one.
+ */
+static inline uint32_t read_seqbegin(const uint32_t *seq)
+{
+	uint32_t s;
+
+	while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+		cpu_relax();
+	return s;
+}
+
+/**
+ * Returns true if the reads since read_seqbegin() returned start may have
+ * raced with a writer and have to be done again.
+ */
+static inline bool read_seqretry(const uint32_t *seq, uint32_t start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqbegin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqend(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Begin a write section on a count that has no lock of its own (e.g. an
+ * entry of a cache). Returns false if another writer is in the middle of
+ * one, in which case the caller should simply give up.
+ */
+static inline bool write_seqtrybegin(uint32_t *seq)
+{
+	uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+	if ((s & 1) || !__atomic_compare_exchange_n(seq, &s, s + 1, false,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return false;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return true;
+}
+
+#endif  // __SYNC_H__
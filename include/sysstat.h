@@ -0,0 +1,125 @@
+/**
+ * fsemu/include/sysstat.h
+ *
+ * System call statistics: how many times each call in fs_syscall.h was
+ * made and how long it took, and how long lookups and I/O spent in each
+ * phase of the work (walking pathnames, scanning directories, allocating,
+ * copying data).
+ *
+ * Every system call starts with sysstat_syscall(SYS_x), and the code of a
+ * phase is wrapped in a block that starts with sysstat_phase(HFS_PHASE_x).
+ * Both start a timer that is stopped, and its time recorded, when the
+ * enclosing block is left, however it is left (GCC's cleanup attribute).
+ * They must come first in their block, so that no goto can jump back over
+ * them. Phases nest: a pathname walk includes the directory scans it
+ * makes.
+ *
+ * Times go into a log-bucketed histogram (in the manner of HdrHistogram:
+ * HFS_SYSSTAT_SUBBUCKETS buckets per power of two nanoseconds, so that
+ * every bucket is within 25% of its values), along with the count, total,
+ * smallest and largest. Each thread records into its own histograms, so
+ * the calls never contend; hfs_sysstat_dump() adds them all up, along
+ * with those of threads that have exited.
+ *
+ * The timers are always compiled in, but only run once turned on with
+ * hfs_sysstat_enable() (the shell's sysstat on); until then they cost a
+ * branch. hfs_sysstat_reset() zeroes everything, e.g. between the phases
+ * of a benchmark, and must not race with system calls.
+ */
+
+#ifndef __SYSSTAT_H__
+#define __SYSSTAT_H__
+
+#include "fs_syscall.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Phases */
+#define HFS_PHASE_WALK		0	// walk_path()
+#define HFS_PHASE_DIRSCAN	1	// looking up a name in a directory
+#define HFS_PHASE_ALLOC		2	// allocating inodes and blocks
+#define HFS_PHASE_COPY		3	// copying file data
+#define HFS_PHASE_NR		4
+
+#define HFS_SYSSTAT_SUBBITS		2
+#define HFS_SYSSTAT_SUBBUCKETS	(1 << HFS_SYSSTAT_SUBBITS)
+#define HFS_SYSSTAT_NBUCKETS	((64 - HFS_SYSSTAT_SUBBITS + 1) \
+								 << HFS_SYSSTAT_SUBBITS)
+
+struct hfs_sysstat_hist {
+	uint64_t	count;
+	uint64_t	total;		// ns
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	buckets[HFS_SYSSTAT_NBUCKETS];
+};
+
+/* What one thread recorded. */
+struct hfs_sysstat {
+	struct hfs_sysstat_hist	sys[NR_SYSCALLS];
+	struct hfs_sysstat_hist	phase[HFS_PHASE_NR];
+	struct hfs_sysstat		*prev;		// list of live threads
+	struct hfs_sysstat		*next;
+};
+
+/* A running timer, see sysstat_syscall(). */
+struct hfs_sysstat_timer {
+	struct hfs_sysstat_hist	*hist;		// NULL if not timing
+	uint64_t				begin;
+};
+
+extern bool hfs_sysstat_on;
+extern __thread struct hfs_sysstat *hfs_sysstat_self;
+
+extern const char *hfs_syscall_names[NR_SYSCALLS];
+extern const char *hfs_phase_names[HFS_PHASE_NR];
+
+struct hfs_sysstat *hfs_sysstat_thread(void);
+void hfs_sysstat_record(struct hfs_sysstat_timer *t);
+
+static inline uint64_t hfs_sysstat_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline struct hfs_sysstat_timer hfs_sysstat_begin(bool phase, int id)
+{
+	struct hfs_sysstat_timer t = { NULL, 0 };
+	struct hfs_sysstat *self;
+
+	if (!hfs_sysstat_on)
+		return t;
+	if (!(self = hfs_sysstat_self) && !(self = hfs_sysstat_thread()))
+		return t;
+	t.hist = phase ? &self->phase[id] : &self->sys[id];
+	t.begin = hfs_sysstat_ns();
+	return t;
+}
+
+static inline void hfs_sysstat_end(struct hfs_sysstat_timer *t)
+{
+	if (t->hist)
+		hfs_sysstat_record(t);
+}
+
+/* At most one of each per block. */
+#define sysstat_syscall(id) \
+	struct hfs_sysstat_timer __sysstat_syscall \
+		__attribute__((cleanup(hfs_sysstat_end))) \
+		= hfs_sysstat_begin(false, id)
+
+#define sysstat_phase(id) \
+	struct hfs_sysstat_timer __sysstat_phase \
+		__attribute__((cleanup(hfs_sysstat_end))) \
+		= hfs_sysstat_begin(true, id)
+
+void hfs_sysstat_enable(bool on);
+void hfs_sysstat_reset(void);
+void hfs_sysstat_dump(void);
+int hfs_sysstat_dump_hist(const char *name);
+
+#endif  // __SYSSTAT_H__
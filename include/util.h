@@ -18,8 +18,18 @@ int readl(const char *pathname);
 int loadf(const char *ospath, const char *emupath);
 int filestat(const char *pathname);
 
-int benchmark_init_fs(const char *input_file);
+int benchmark_init_fs(const char *input_file, int nthreads);
 int benchmark_lookup(const char *input_file, int repcount);
+int benchmark_lookup_mt(const char *input_file, int repcount, int maxthreads);
+int benchmark_creat_mt(int count, int maxthreads);
+int benchmark_seqio(int mib, int bufsize);
+int benchmark_vecio(int mib, int iosize, int iovcnt, int nthreads);
+int benchmark_ring(const char *input_file, int maxbatch, int repcount);
+int benchmark_clock(const char *input_file, int repcount);
+int benchmark_replay(const char *log_file, int nthreads, int repcount);
+int benchmark_placement(const char *tree_file, const char *input_file);
+int benchmark_cachesim(const char *input_file, int passes);
+int benchmark_dirhash_sweep(const char *input_file, int repcount);
 void benchmark(const char *input_file);
 
 #ifdef HFS_DEBUG
@@ -35,6 +45,35 @@ struct hfs_dirhash_perf_stat {
 
 void hfs_dirhash_perf_stat(struct hfs_dirhash_perf_stat *statbuf);
 void hfs_dirhash_stat_clear(void);
+
+struct hfs_pcache_perf_stat {
+	int s_hit_count;		// positive hits
+	int s_neg_hit_count;	// negative hits
+	int s_miss_count;
+	int s_stale_count;		// misses due to invalidation
+	int s_inval_count;
+	int s_resume_count;		// walks resumed from a cached prefix
+	int s_resume_depth;		// total components skipped by resuming
+};
+
+void hfs_pcache_perf_stat(struct hfs_pcache_perf_stat *statbuf);
+void hfs_pcache_stat_clear(void);
+
+void fs_trace_lookup(void (*tracer)(const void *addr, size_t len));
+
+/**
+ * Called with every piece of memory that is read while walking a
+ * pathname, see fs_trace_lookup().
+ */
+extern void (*lookup_tracer)(const void *addr, size_t len);
+
+#define trace_read(addr, len) \
+	do { \
+		if (lookup_tracer) \
+			lookup_tracer(addr, len); \
+	} while (0)
+#else
+#define trace_read(addr, len)	do { } while (0)
 #endif  // HFS_DEBUG
 
 #endif  // __UTIL_H__
\ No newline at end of file
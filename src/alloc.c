@@ -0,0 +1,640 @@
+/**
+ * fsemu/src/alloc.c
+ *
+ * Bitmap allocators. See include/alloc.h.
+ */
+
+#include "fsemu.h"
+#include "alloc.h"
+#include "sysstat.h"
+
+#include <stdlib.h>
+
+static struct hfs_balloc balloc;
+static struct hfs_bmap ialloc;
+static struct hfs_groups groups;
+static struct hfs_alloc_shard shards[HFS_ALLOC_NSHARDS];
+
+/* Shard of the calling thread, handed out round robin. */
+static __thread int this_shard = -1;
+static int next_shard;
+
+static inline int shard_id(void)
+{
+	if (this_shard < 0)
+		this_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+						% HFS_ALLOC_NSHARDS;
+	return this_shard;
+}
+
+static inline bool test_bit64(uint64_t *map, uint64_t i)
+{
+	return __atomic_load_n(&map[i / 64], __ATOMIC_RELAXED)
+				& (1ULL << (i % 64));
+}
+
+/*
+ * Bits are set and cleared with sequentially consistent read-modify-write
+ * operations, which bmap_claim() relies on to keep the summary right.
+ */
+static inline uint64_t set_bit64(uint64_t *map, uint64_t i)
+{
+	return __atomic_fetch_or(&map[i / 64], 1ULL << (i % 64),
+							 __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t clear_bit64(uint64_t *map, uint64_t i)
+{
+	return __atomic_fetch_and(&map[i / 64], ~(1ULL << (i % 64)),
+							  __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t load_word(uint64_t *word)
+{
+	return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+/* Atomic updates of the per-group counts, which are only hints. */
+static inline void group_add(uint32_t *count, int delta)
+{
+	__atomic_add_fetch(count, delta, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t group_load(uint32_t *count)
+{
+	return __atomic_load_n(count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Where the counts of a counter are folded into.
+ */
+static void counter_fold(int counter, int64_t delta)
+{
+	switch (counter) {
+	case HFS_CNT_IFREE:
+		__atomic_add_fetch(&ialloc.nfree, delta, __ATOMIC_RELAXED);
+		break;
+	case HFS_CNT_BFREE:
+		__atomic_add_fetch(&balloc.bm.nfree, delta, __ATOMIC_RELAXED);
+		break;
+	case HFS_CNT_INODES:
+		__atomic_add_fetch(&sb->inode_used, delta, __ATOMIC_RELAXED);
+		break;
+	case HFS_CNT_FILES:
+		__atomic_add_fetch(&sb->nfiles, delta, __ATOMIC_RELAXED);
+		break;
+	case HFS_CNT_DIRS:
+		__atomic_add_fetch(&sb->ndirectories, delta, __ATOMIC_RELAXED);
+		break;
+	}
+}
+
+/**
+ * Add delta to one of the HFS_CNT_* counters. The change goes to the
+ * calling thread's shard, and only reaches the shared count once the
+ * shard has collected HFS_ALLOC_BATCH of them.
+ */
+void hfs_alloc_count(int counter, int64_t delta)
+{
+	int64_t *d = &shards[shard_id()].delta[counter];
+	int64_t v = __atomic_add_fetch(d, delta, __ATOMIC_RELAXED);
+
+	if (v >= HFS_ALLOC_BATCH || v <= -HFS_ALLOC_BATCH)
+		counter_fold(counter, __atomic_exchange_n(d, 0, __ATOMIC_RELAXED));
+}
+
+/**
+ * Fold every shard's deltas into the shared counts, so that the counts
+ * in the superblock are exact (as long as nothing is being allocated).
+ */
+void hfs_alloc_sync(void)
+{
+	for (int i = 0; i < HFS_ALLOC_NSHARDS; i++) {
+		for (int c = 0; c < HFS_NCOUNTERS; c++) {
+			int64_t v = __atomic_exchange_n(&shards[i].delta[c], 0,
+											__ATOMIC_RELAXED);
+			if (v)
+				counter_fold(c, v);
+		}
+	}
+}
+
+/**
+ * Free bits of a bitmap, counting what the shards have not folded yet.
+ */
+static uint64_t bmap_nfree(struct hfs_bmap *bm)
+{
+	int64_t n = __atomic_load_n(&bm->nfree, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < HFS_ALLOC_NSHARDS; i++)
+		n += __atomic_load_n(&shards[i].delta[bm->counter], __ATOMIC_RELAXED);
+	return n > 0 ? n : 0;
+}
+
+/**
+ * Find a word of the bitmap with a free bit, starting from word "from"
+ * and wrapping around. Returns -1 if the bitmap is full.
+ */
+static int64_t find_free_word(struct hfs_bmap *bm, uint64_t from)
+{
+	uint64_t s = from / 64;
+	uint64_t mask = ~0ULL << (from % 64);
+
+	for (uint64_t n = 0; n <= bm->nsummary; n++) {
+		uint64_t bits = load_word(&bm->summary[s]) & mask;
+		if (bits)
+			return s * 64 + __builtin_ctzll(bits);
+		mask = ~0ULL;
+		s = (s + 1 < bm->nsummary) ? s + 1 : 0;
+	}
+	return -1;
+}
+
+/**
+ * Find the first free bit at or after "from", wrapping around.
+ * Returns -1 if the bitmap is full.
+ *
+ * The summary may still show a word as having a free bit that another
+ * thread has just taken, in which case the search goes on after it.
+ */
+static int64_t find_free_bit(struct hfs_bmap *bm, uint64_t from)
+{
+	uint64_t w = from / 64;
+	uint64_t bits = ~load_word(&bm->map[w]) & (~0ULL << (from % 64));
+	int64_t fw;
+
+	if (bits)
+		return w * 64 + __builtin_ctzll(bits);
+
+	for (uint64_t n = 0; n < bm->nwords; n++) {
+		w = (w + 1 < bm->nwords) ? w + 1 : 0;
+		if ((fw = find_free_word(bm, w)) < 0)
+			return -1;
+		if ((bits = ~load_word(&bm->map[fw])))
+			return fw * 64 + __builtin_ctzll(bits);
+		w = fw;
+	}
+	return -1;
+}
+
+/**
+ * Try to take a bit. Returns false if another thread got there first.
+ *
+ * Whoever fills a word clears its summary bit, and whoever frees a bit
+ * in it sets the summary bit after clearing the bit. If a bit is freed
+ * between filling the word and clearing the summary bit, the summary bit
+ * would be lost, so the word is looked at again afterwards.
+ */
+static bool bmap_claim(struct hfs_bmap *bm, uint64_t bit)
+{
+	uint64_t mask = 1ULL << (bit % 64);
+	uint64_t old = set_bit64(bm->map, bit);
+
+	if (old & mask)
+		return false;
+	if ((old | mask) == ~0ULL) {
+		clear_bit64(bm->summary, bit / 64);
+		if (__atomic_load_n(&bm->map[bit / 64], __ATOMIC_SEQ_CST) != ~0ULL)
+			set_bit64(bm->summary, bit / 64);
+	}
+	return true;
+}
+
+/**
+ * Take a free bit: the first one at or after goal, or at or after the
+ * calling thread's rotating cursor if there is no goal. Returns -1 if the
+ * bitmap is full.
+ */
+static int64_t bmap_alloc(struct hfs_bmap *bm, uint64_t goal)
+{
+	struct hfs_bmap_cursor *cursor = &bm->cursors[shard_id()];
+	int64_t bit;
+
+	if (goal >= bm->nbits)
+		goal = __atomic_load_n(&cursor->pos, __ATOMIC_RELAXED);
+	do {
+		if ((bit = find_free_bit(bm, goal)) < 0)
+			return -1;
+		goal = bit;
+	} while (!bmap_claim(bm, bit));
+
+	hfs_alloc_count(bm->counter, -1);
+	__atomic_store_n(&cursor->pos, (bit + 1 < bm->nbits) ? bit + 1 : 0,
+					 __ATOMIC_RELAXED);
+	return bit;
+}
+
+/**
+ * Release a bit. Returns -1 if it was not in use.
+ */
+static int bmap_free(struct hfs_bmap *bm, uint64_t bit)
+{
+	if (bit >= bm->nbits)
+		return -1;
+	if (!(clear_bit64(bm->map, bit) & (1ULL << (bit % 64))))
+		return -1;
+
+	set_bit64(bm->summary, bit / 64);
+	hfs_alloc_count(bm->counter, 1);
+	return 0;
+}
+
+/**
+ * Build the summary of an on-disk bitmap of nbits bits. The unused tail
+ * bits of the last word are marked in use. Each shard's cursor starts at
+ * the beginning of the shard's slice of the bitmap.
+ */
+static int bmap_init(struct hfs_bmap *bm, void *map, uint64_t nbits,
+					 int counter)
+{
+	bm->map = (uint64_t *)map;
+	bm->nbits = nbits;
+	bm->nwords = (nbits + 63) / 64;
+	bm->nsummary = (bm->nwords + 63) / 64;
+	bm->summary = calloc(bm->nsummary, sizeof(uint64_t));
+	if (!bm->summary)
+		return -1;
+
+	if (nbits % 64)
+		bm->map[bm->nwords - 1] |= ~0ULL << (nbits % 64);
+
+	bm->nfree = 0;
+	for (uint64_t w = 0; w < bm->nwords; w++) {
+		int nfree = 64 - __builtin_popcountll(bm->map[w]);
+		if (nfree) {
+			bm->summary[w / 64] |= 1ULL << (w % 64);
+			bm->nfree += nfree;
+		}
+	}
+	bm->counter = counter;
+	for (int i = 0; i < HFS_ALLOC_NSHARDS; i++)
+		bm->cursors[i].pos = bm->nwords / HFS_ALLOC_NSHARDS * i * 64;
+	return 0;
+}
+
+static void bmap_exit(struct hfs_bmap *bm)
+{
+	free(bm->summary);
+	memset(bm, 0, sizeof(*bm));
+}
+
+static inline uint32_t inode_group(uint32_t inum)
+{
+	return inum / groups.inodes_per_group;
+}
+
+/* hfs_balloc_alloc(), without timing it as a phase of its own. */
+static uint32_t balloc_alloc(uint64_t goal)
+{
+	int64_t bit;
+
+	if (goal != HFS_NOGOAL)
+		goal = (goal >= sb->datastart) ? goal - sb->datastart : 0;
+	if ((bit = bmap_alloc(&balloc.bm, goal)) < 0)
+		return 0;
+	group_add(&balloc.region_free[bit / HFS_BALLOC_REGION_BITS], -1);
+	group_add(&groups.groups[bit / HFS_BALLOC_REGION_BITS].free_blocks, -1);
+	return sb->datastart + bit;
+}
+
+/**
+ * Allocate a data block, the first free one at or after the (absolute)
+ * block number goal. Pass HFS_NOGOAL to continue from the last
+ * allocation instead.
+ *
+ * Returns 0 for failure, otherwise the (absolute) block number.
+ */
+uint32_t hfs_balloc_alloc(uint64_t goal)
+{
+	sysstat_phase(HFS_PHASE_ALLOC);
+	return balloc_alloc(goal);
+}
+
+/**
+ * Allocate up to n contiguous data blocks: the first free one at or after
+ * goal (as hfs_balloc_alloc() does), and those right after it for as long
+ * as they are free.
+ *
+ * Returns 0 for failure, otherwise the first block, with *count set to
+ * the number of blocks allocated.
+ */
+uint32_t hfs_balloc_alloc_run(uint64_t goal, uint32_t n, uint32_t *count)
+{
+	sysstat_phase(HFS_PHASE_ALLOC);
+	uint32_t first;
+	uint64_t bit;
+
+	if (!(first = balloc_alloc(goal)))
+		return 0;
+	bit = first - sb->datastart;
+	for (*count = 1; *count < n; (*count)++) {
+		if (++bit >= balloc.bm.nbits || !bmap_claim(&balloc.bm, bit))
+			break;
+		group_add(&balloc.region_free[bit / HFS_BALLOC_REGION_BITS], -1);
+		group_add(&groups.groups[bit / HFS_BALLOC_REGION_BITS].free_blocks, -1);
+	}
+	if (*count > 1) {
+		hfs_alloc_count(balloc.bm.counter, -(int64_t)(*count - 1));
+		bit = first - sb->datastart + *count;
+		__atomic_store_n(&balloc.bm.cursors[shard_id()].pos,
+						 (bit < balloc.bm.nbits) ? bit : 0, __ATOMIC_RELAXED);
+	}
+	return first;
+}
+
+/**
+ * Free data block number b.
+ */
+void hfs_balloc_free(uint32_t b)
+{
+	uint64_t bit = b - sb->datastart;
+
+	if (b < sb->datastart)
+		return;
+	if (bmap_free(&balloc.bm, bit) == 0) {
+		group_add(&balloc.region_free[bit / HFS_BALLOC_REGION_BITS], 1);
+		group_add(&groups.groups[bit / HFS_BALLOC_REGION_BITS].free_blocks, 1);
+	}
+}
+
+uint64_t hfs_balloc_nfree(void)
+{
+	return bmap_nfree(&balloc.bm);
+}
+
+/**
+ * Where the blocks of inode should go: the point of the data area that
+ * corresponds to the inode's position in the inode table, which lies in
+ * the inode's group. Blocks of the same inode follow each other from
+ * there, and the blocks of neighbouring inodes end up close together.
+ */
+uint64_t hfs_balloc_goal(struct hfs_inode *inode)
+{
+	uint32_t i = inum(inode), g;
+
+	if (mount_opts.placement == HFS_PLACE_FLAT || !groups.ngroups)
+		return HFS_NOGOAL;
+	g = inode_group(i);
+	return sb->datastart + (uint64_t)g * HFS_BALLOC_REGION_BITS
+		+ (uint64_t)(i % groups.inodes_per_group) * HFS_BALLOC_REGION_BITS
+						/ groups.inodes_per_group;
+}
+
+/**
+ * Build the in-memory summary of the on-disk block bitmap.
+ *
+ * The bitmap maps blocks starting at sb->datastart, but sb->nblocks is
+ * overestimated (see init_superblock()), so only the blocks that are
+ * actually inside the image are made allocatable.
+ */
+static int balloc_init(void)
+{
+	uint64_t nbits;
+
+	nbits = sb->nblocks;
+	if (sb->datastart + nbits > sb->size)
+		nbits = sb->size - sb->datastart;
+	balloc.nregions = (nbits + HFS_BALLOC_REGION_BITS - 1)
+							/ HFS_BALLOC_REGION_BITS;
+	balloc.region_free = calloc(balloc.nregions, sizeof(uint32_t));
+	if (!balloc.region_free
+			|| bmap_init(&balloc.bm, bitmap, nbits, HFS_CNT_BFREE) < 0) {
+		pr_warn("Failed to initialize block allocator.\n");
+		return -1;
+	}
+
+	for (uint64_t w = 0; w < balloc.bm.nwords; w++) {
+		balloc.region_free[w * 64 / HFS_BALLOC_REGION_BITS] +=
+						64 - __builtin_popcountll(balloc.bm.map[w]);
+	}
+	return 0;
+}
+
+static void balloc_exit(void)
+{
+	bmap_exit(&balloc.bm);
+	free(balloc.region_free);
+	memset(&balloc, 0, sizeof(balloc));
+}
+
+/**
+ * Allocate an inode number, the first free one at or after goal.
+ * Pass HFS_NOGOAL to continue from the last allocation instead.
+ *
+ * Returns 0 for failure (inode 0 is never handed out).
+ */
+uint32_t hfs_ialloc_alloc(uint64_t goal, bool isdir)
+{
+	sysstat_phase(HFS_PHASE_ALLOC);
+	int64_t inum = bmap_alloc(&ialloc, goal);
+
+	if (inum < 0)
+		return 0;
+	group_add(&groups.groups[inode_group(inum)].free_inodes, -1);
+	if (isdir) {
+		group_add(&groups.groups[inode_group(inum)].ndirs, 1);
+		__atomic_add_fetch(&groups.ndirs, 1, __ATOMIC_RELAXED);
+	}
+	return inum;
+}
+
+/**
+ * Release inode number inum.
+ */
+void hfs_ialloc_free(uint32_t inum, bool isdir)
+{
+	if (bmap_free(&ialloc, inum) < 0)
+		return;
+	group_add(&groups.groups[inode_group(inum)].free_inodes, 1);
+	if (isdir) {
+		group_add(&groups.groups[inode_group(inum)].ndirs, -1);
+		__atomic_sub_fetch(&groups.ndirs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t hfs_ialloc_nfree(void)
+{
+	return bmap_nfree(&ialloc);
+}
+
+/**
+ * ext2's find_group_dir(): of the groups with an above-average number
+ * of free inodes, the one with the most free blocks. Orlov instead takes
+ * the one with the fewest directories, so that top-level directories
+ * (and the subtrees below them) are spread over the whole disk. The
+ * search starts from a rotating position so that ties do not all go to
+ * the first group.
+ */
+static uint32_t find_group_spread(void)
+{
+	uint64_t avg_inodes = bmap_nfree(&ialloc) / groups.ngroups;
+	uint64_t avg_blocks = bmap_nfree(&balloc.bm) / groups.ngroups;
+	uint32_t spread = __atomic_load_n(&groups.spread, __ATOMIC_RELAXED);
+	int64_t best = -1, fallback = 0;
+	uint32_t g;
+
+	for (uint32_t n = 0; n < groups.ngroups; n++) {
+		struct hfs_group *grp, *bgrp;
+		uint32_t free_inodes;
+
+		g = (spread + n) % groups.ngroups;
+		grp = &groups.groups[g];
+		free_inodes = group_load(&grp->free_inodes);
+		if (free_inodes > group_load(&groups.groups[fallback].free_inodes))
+			fallback = g;
+		if (!free_inodes || free_inodes < avg_inodes
+				|| group_load(&grp->free_blocks) < avg_blocks)
+			continue;
+		if (best < 0) {
+			best = g;
+			continue;
+		}
+		bgrp = &groups.groups[best];
+		if (mount_opts.placement == HFS_PLACE_ORLOV ?
+				group_load(&grp->ndirs) < group_load(&bgrp->ndirs) :
+				group_load(&grp->free_blocks)
+						> group_load(&bgrp->free_blocks))
+			best = g;
+	}
+
+	if (best < 0)
+		best = fallback;
+	__atomic_store_n(&groups.spread, (best + 1) % groups.ngroups,
+					 __ATOMIC_RELAXED);
+	return best;
+}
+
+/**
+ * ext2's find_group_other(): the parent's group if it has room, then a
+ * quadratic hash search from there, then anything with a free inode.
+ */
+static uint32_t find_group_other(uint32_t pg)
+{
+	struct hfs_group *grp = &groups.groups[pg];
+	uint32_t g;
+
+	if (group_load(&grp->free_inodes) && group_load(&grp->free_blocks))
+		return pg;
+
+	g = pg;
+	for (uint32_t i = 1; i < groups.ngroups; i <<= 1) {
+		g = (g + i) % groups.ngroups;
+		grp = &groups.groups[g];
+		if (group_load(&grp->free_inodes) && group_load(&grp->free_blocks))
+			return g;
+	}
+
+	for (uint32_t n = 1; n <= groups.ngroups; n++) {
+		g = (pg + n) % groups.ngroups;
+		if (group_load(&groups.groups[g].free_inodes))
+			return g;
+	}
+	return pg;
+}
+
+/**
+ * Orlov for a directory below the top level: stay in the parent's group
+ * unless it is running out of inodes or blocks, or already holds more
+ * than its share of directories.
+ */
+static uint32_t find_group_orlov(uint32_t pg)
+{
+	struct hfs_group *grp = &groups.groups[pg];
+	uint64_t max_dirs = __atomic_load_n(&groups.ndirs, __ATOMIC_RELAXED)
+						/ groups.ngroups + groups.inodes_per_group / 16;
+	uint64_t min_inodes = bmap_nfree(&ialloc) / groups.ngroups / 4;
+	uint64_t min_blocks = bmap_nfree(&balloc.bm) / groups.ngroups / 4;
+
+	if (group_load(&grp->ndirs) < max_dirs
+			&& group_load(&grp->free_inodes) >= min_inodes
+			&& group_load(&grp->free_blocks) >= min_blocks)
+		return pg;
+	return find_group_other(pg);
+}
+
+/**
+ * Pick the allocation goal for a new inode that will be linked into
+ * parent (NULL if unknown), according to the placement policy.
+ *
+ * Within the chosen group, the inode goes right after its parent if the
+ * parent lives there, otherwise at the start of the group.
+ */
+uint64_t hfs_ialloc_goal(struct hfs_inode *parent, bool isdir)
+{
+	uint32_t pinum, pg, g;
+
+	if (!parent)
+		return HFS_NOGOAL;
+	pinum = inum(parent);
+
+	if (mount_opts.placement == HFS_PLACE_FLAT || !groups.ngroups)
+		return mount_opts.ialloc_near_parent ? pinum : HFS_NOGOAL;
+
+	pg = inode_group(pinum);
+	if (!isdir)
+		g = find_group_other(pg);
+	else if (mount_opts.placement == HFS_PLACE_GROUP || pinum == ROOTINO)
+		g = find_group_spread();
+	else
+		g = find_group_orlov(pg);
+
+	return (g == pg) ? pinum : (uint64_t)g * groups.inodes_per_group;
+}
+
+/**
+ * Count free inodes, free blocks and directories in every block group.
+ */
+static int groups_init(void)
+{
+	uint64_t ninodes = sb->ninodes;
+
+	groups.ngroups = balloc.nregions ? balloc.nregions : 1;
+	groups.inodes_per_group = (ninodes + groups.ngroups - 1) / groups.ngroups;
+	groups.groups = calloc(groups.ngroups, sizeof(struct hfs_group));
+	if (!groups.groups) {
+		pr_warn("Failed to initialize block groups.\n");
+		return -1;
+	}
+
+	for (uint32_t r = 0; r < balloc.nregions; r++)
+		groups.groups[r].free_blocks = balloc.region_free[r];
+	for (uint64_t i = 0; i < ninodes; i++) {
+		struct hfs_group *grp = &groups.groups[inode_group(i)];
+		if (!test_bit64(ialloc.map, i))
+			grp->free_inodes++;
+		else if (inodes[i].type == T_DIR) {
+			grp->ndirs++;
+			groups.ndirs++;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Build the in-memory state of both allocators from the on-disk bitmaps.
+ */
+int hfs_alloc_init(void)
+{
+	hfs_alloc_exit();
+	if (bmap_init(&ialloc, inobitmap, sb->ninodes, HFS_CNT_IFREE) < 0) {
+		pr_warn("Failed to initialize inode allocator.\n");
+		goto fail;
+	}
+	if (balloc_init() < 0 || groups_init() < 0)
+		goto fail;
+	return 0;
+
+fail:
+	hfs_alloc_exit();
+	return -1;
+}
+
+void hfs_alloc_exit(void)
+{
+	if (sb)
+		hfs_alloc_sync();
+	bmap_exit(&ialloc);
+	balloc_exit();
+	free(groups.groups);
+	memset(&groups, 0, sizeof(groups));
+}
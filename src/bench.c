@@ -0,0 +1,440 @@
+/**
+ * fsemu/src/bench.c
+ *
+ * Measuring benchmarks. See include/bench.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+struct hfs_bench_opts bench_opts = {
+	.warmup = 1,
+	.format = HFS_BENCH_HUMAN,
+	.timer = HFS_BENCH_TIMER_RAW,
+};
+
+static const char *format_names[] = {
+	[HFS_BENCH_HUMAN]	= "human",
+	[HFS_BENCH_CSV]		= "csv",
+	[HFS_BENCH_JSON]	= "json",
+};
+
+static const char *timer_names[] = {
+	[HFS_BENCH_TIMER_RAW]	= "raw",
+	[HFS_BENCH_TIMER_TSC]	= "tsc",
+};
+
+/* Nanoseconds per tick of the time stamp counter, once calibrated. */
+static double tsc_ns;
+
+/* Whether the CSV header has been printed to stdout. */
+static int csv_header_done;
+
+/**
+ * Count time stamp counter ticks over 20 ms of CLOCK_MONOTONIC_RAW.
+ */
+static int calibrate_tsc(void)
+{
+#if defined(__x86_64__)
+	struct timespec begin, now;
+	uint64_t t0, t1;
+	double ns;
+
+	bench_opts.timer = HFS_BENCH_TIMER_TSC;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+	t0 = hfs_bench_ticks();
+	do {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		ns = (now.tv_sec - begin.tv_sec) * 1e9
+				+ (now.tv_nsec - begin.tv_nsec);
+	} while (ns < 20e6);
+	t1 = hfs_bench_ticks();
+	tsc_ns = ns / (t1 - t0);
+	return 0;
+#else
+	return -EINVAL;
+#endif
+}
+
+static inline double tick_ns(void)
+{
+	return bench_opts.timer == HFS_BENCH_TIMER_TSC ? tsc_ns : 1.0;
+}
+
+double hfs_bench_ns(uint64_t ticks)
+{
+	return ticks * tick_ns();
+}
+
+double hfs_bench_seconds(uint64_t begin, uint64_t end)
+{
+	return hfs_bench_ns(end - begin) / 1e9;
+}
+
+int hfs_bench_init(struct hfs_bench *b, const char *name, const char *label)
+{
+	memset(b, 0, sizeof(*b));
+	b->name = name;
+	b->label = label ? label : "";
+	if (bench_opts.perf)
+		b->perf_open = hfs_perf_open(&b->perf) > 0;
+	return 0;
+}
+
+void hfs_bench_free(struct hfs_bench *b)
+{
+	if (b->perf_open)
+		hfs_perf_close(&b->perf);
+	free(b->samples);
+	free(b->passes);
+	memset(b, 0, sizeof(*b));
+}
+
+/**
+ * Record how many ticks one operation took. Samples that do not fit in
+ * memory are dropped, which the report can live with.
+ */
+void hfs_bench_sample(struct hfs_bench *b, uint64_t ticks)
+{
+	if (b->nsamples == b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 4096;
+		uint64_t *samples = realloc(b->samples, cap * sizeof(uint64_t));
+		if (!samples)
+			return;
+		b->samples = samples;
+		b->cap = cap;
+	}
+	b->samples[b->nsamples++] = ticks;
+}
+
+/**
+ * A timed pass begins. The hardware counters, if any, count from here.
+ */
+void hfs_bench_pass_begin(struct hfs_bench *b)
+{
+	if (b->perf_open)
+		hfs_perf_start(&b->perf);
+	b->pass_begin = hfs_bench_ticks();
+}
+
+/**
+ * The timed pass that began last is over, after ops operations.
+ */
+void hfs_bench_pass_end(struct hfs_bench *b, uint64_t ops)
+{
+	double seconds = hfs_bench_seconds(b->pass_begin, hfs_bench_ticks());
+
+	if (b->perf_open) {
+		hfs_perf_stop(&b->perf);
+		for (int i = 0; i < HFS_PERF_NEVENTS; i++) {
+			if (!b->perf.valid[i])
+				continue;
+			b->counts[i] += b->perf.values[i];
+			b->counted[i] = true;
+		}
+	}
+
+	if (b->npasses == b->cappasses) {
+		int cap = b->cappasses ? b->cappasses * 2 : 16;
+		double *passes = realloc(b->passes, cap * sizeof(double));
+		if (!passes)
+			return;
+		b->passes = passes;
+		b->cappasses = cap;
+	}
+	b->passes[b->npasses++] = seconds > 0 ? ops / seconds : 0;
+	b->ops += ops;
+	b->time += seconds;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Two-sided 95% quantile of Student's t distribution with df degrees of
+ * freedom.
+ */
+static double t95(int df)
+{
+	static const double t[] = {
+		0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+		2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+		2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+		2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (df < (int)(sizeof(t) / sizeof(t[0])))
+		return t[df];
+	if (df < 60)
+		return 2.000;
+	if (df < 120)
+		return 1.980;
+	return 1.960;
+}
+
+/* Summary of a benchmark's samples and passes. */
+struct bench_summary {
+	double	mean, min, max;
+	double	p50, p90, p99, p999;
+	double	ops_per_sec;
+	double	ci_low, ci_high;	// 0 if there are not two passes
+	double	timer_ns;			// cost of one hfs_bench_ticks()
+};
+
+/* nearest-rank percentile of sorted samples */
+static double percentile(struct hfs_bench *b, double p)
+{
+	size_t i = (size_t)ceil(p * b->nsamples);
+	return hfs_bench_ns(b->samples[i ? i - 1 : 0]);
+}
+
+/**
+ * What reading the timer twice in a row costs, the least of many tries.
+ */
+static double timer_overhead(void)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int i = 0; i < 1000; i++) {
+		uint64_t t0 = hfs_bench_ticks();
+		uint64_t t1 = hfs_bench_ticks();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return hfs_bench_ns(best);
+}
+
+static void summarize(struct hfs_bench *b, struct bench_summary *s)
+{
+	double sum = 0;
+
+	memset(s, 0, sizeof(*s));
+	if (b->nsamples) {
+		qsort(b->samples, b->nsamples, sizeof(uint64_t), cmp_u64);
+		for (size_t i = 0; i < b->nsamples; i++)
+			sum += b->samples[i];
+		s->mean = sum * tick_ns() / b->nsamples;
+		s->min = hfs_bench_ns(b->samples[0]);
+		s->max = hfs_bench_ns(b->samples[b->nsamples - 1]);
+		s->p50 = percentile(b, 0.50);
+		s->p90 = percentile(b, 0.90);
+		s->p99 = percentile(b, 0.99);
+		s->p999 = percentile(b, 0.999);
+	}
+	if (b->time > 0)
+		s->ops_per_sec = b->ops / b->time;
+	// With several passes, throughput is the mean of theirs, so that it
+	// is what the interval is about.
+	if (b->npasses >= 2) {
+		double mean = 0, var = 0, half;
+		for (int i = 0; i < b->npasses; i++)
+			mean += b->passes[i];
+		mean /= b->npasses;
+		for (int i = 0; i < b->npasses; i++)
+			var += (b->passes[i] - mean) * (b->passes[i] - mean);
+		var /= b->npasses - 1;
+		half = t95(b->npasses - 1) * sqrt(var / b->npasses);
+		s->ops_per_sec = mean;
+		s->ci_low = mean > half ? mean - half : 0;
+		s->ci_high = mean + half;
+	}
+	s->timer_ns = timer_overhead();
+}
+
+static void report_human(struct hfs_bench *b, struct bench_summary *s)
+{
+	printf(KBLD "%s" KNRM "%s%s: %lu ops in %d passes (%d warmup), "
+			"timer %s (%.1fns per read)\n", b->name,
+			*b->label ? " " : "", b->label, b->ops, b->npasses,
+			bench_opts.warmup, timer_names[bench_opts.timer],
+			s->timer_ns);
+	printf("  latency (ns): mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+			"p99.9 %.1f  min %.1f  max %.1f\n", s->mean, s->p50, s->p90,
+			s->p99, s->p999, s->min, s->max);
+	if (b->npasses >= 2)
+		printf("  throughput: %.0f ops/s (95%% CI %.0f .. %.0f)\n",
+				s->ops_per_sec, s->ci_low, s->ci_high);
+	else
+		printf("  throughput: %.0f ops/s\n", s->ops_per_sec);
+
+	if (!bench_opts.perf)
+		return;
+	if (!b->perf_open || !b->ops) {
+		printf("  counters: unavailable\n");
+		return;
+	}
+	printf("  per op:");
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++) {
+		if (b->counted[i])
+			printf(" %s %.1f", hfs_perf_names[i],
+					(double)b->counts[i] / b->ops);
+		else
+			printf(" %s n/a", hfs_perf_names[i]);
+	}
+	printf("\n");
+	if (b->counted[HFS_PERF_CYCLES] && b->counted[HFS_PERF_INSTRUCTIONS]
+			&& b->counts[HFS_PERF_CYCLES])
+		printf("  IPC %.2f\n", (double)b->counts[HFS_PERF_INSTRUCTIONS]
+							   / b->counts[HFS_PERF_CYCLES]);
+}
+
+/**
+ * Counter i per operation, for CSV ("" if not counted) or JSON (null).
+ */
+static const char *per_op(struct hfs_bench *b, int i, char *buf, size_t size,
+						  bool json)
+{
+	if (!b->perf_open || !b->counted[i] || !b->ops)
+		return json ? "null" : "";
+	snprintf(buf, size, "%.1f", (double)b->counts[i] / b->ops);
+	return buf;
+}
+
+static void report_csv(FILE *out, struct hfs_bench *b,
+					   struct bench_summary *s)
+{
+	char buf[32];
+
+	fprintf(out, "%s,%s,%lu,%d,%d,%s,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,"
+			"%.1f,%.1f,%.1f,%.1f", b->name, b->label, b->ops, b->npasses,
+			bench_opts.warmup, timer_names[bench_opts.timer], s->timer_ns,
+			s->mean, s->p50, s->p90, s->p99, s->p999, s->min, s->max,
+			s->ops_per_sec, s->ci_low, s->ci_high);
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++)
+		fprintf(out, ",%s", per_op(b, i, buf, sizeof(buf), false));
+	fputc('\n', out);
+}
+
+static void report_json(FILE *out, struct hfs_bench *b,
+						struct bench_summary *s)
+{
+	char buf[32];
+
+	fprintf(out, "{\"name\": \"%s\", \"label\": \"%s\", \"ops\": %lu, "
+			"\"passes\": %d, \"warmup\": %d, \"timer\": \"%s\", "
+			"\"timer_ns\": %.1f, \"mean_ns\": %.1f, \"p50_ns\": %.1f, "
+			"\"p90_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f, "
+			"\"min_ns\": %.1f, \"max_ns\": %.1f, \"ops_per_sec\": %.1f, "
+			"\"ci95_low\": %.1f, \"ci95_high\": %.1f", b->name, b->label,
+			b->ops, b->npasses, bench_opts.warmup,
+			timer_names[bench_opts.timer], s->timer_ns, s->mean, s->p50,
+			s->p90, s->p99, s->p999, s->min, s->max, s->ops_per_sec,
+			s->ci_low, s->ci_high);
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++)
+		fprintf(out, ", \"%s_per_op\": %s", hfs_perf_names[i],
+				per_op(b, i, buf, sizeof(buf), true));
+	fputs("}\n", out);
+}
+
+static const char csv_header[] = "name,label,ops,passes,warmup,timer,"
+	"timer_ns,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,min_ns,max_ns,"
+	"ops_per_sec,ci95_low,ci95_high";
+
+static void print_csv_header(FILE *out)
+{
+	fputs(csv_header, out);
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++)
+		fprintf(out, ",%s_per_op", hfs_perf_names[i]);
+	fputc('\n', out);
+}
+
+/**
+ * Report what was measured, in the format bench_opts asks for. CSV
+ * output starts with a header, when the file it goes to is new.
+ */
+void hfs_bench_report(struct hfs_bench *b)
+{
+	struct bench_summary s;
+	FILE *out = stdout;
+
+	summarize(b, &s);
+	if (bench_opts.format == HFS_BENCH_HUMAN) {
+		report_human(b, &s);
+		return;
+	}
+
+	if (*bench_opts.output && !(out = fopen(bench_opts.output, "a"))) {
+		perror("open");
+		return;
+	}
+	if (bench_opts.format == HFS_BENCH_CSV) {
+		if (out == stdout ? !csv_header_done++ : ftell(out) == 0)
+			print_csv_header(out);
+		report_csv(out, b, &s);
+	} else {
+		report_json(out, b, &s);
+	}
+	if (out != stdout)
+		fclose(out);
+	else
+		fflush(out);
+}
+
+/**
+ * Set one option, given as "name=value":
+ *   warmup=N					Untimed passes before the timed ones.
+ *   format=human|csv|json		How reports are printed.
+ *   timer=raw|tsc				CLOCK_MONOTONIC_RAW, or rdtscp (x86-64).
+ *   perf=on|off				Count with hardware counters too.
+ *   output=FILE				Append CSV and JSON reports to FILE
+ *   							("-": stdout).
+ */
+int hfs_bench_set_opt(const char *opt)
+{
+	const char *val = strchr(opt, '=');
+	size_t len;
+
+	if (!val)
+		return -EINVAL;
+	len = val++ - opt;
+
+	if (len == 6 && strncmp(opt, "warmup", len) == 0) {
+		if (atoi(val) < 0)
+			return -EINVAL;
+		bench_opts.warmup = atoi(val);
+	} else if (len == 6 && strncmp(opt, "format", len) == 0) {
+		int i;
+		for (i = 0; i < 3; i++)
+			if (strcmp(val, format_names[i]) == 0)
+				break;
+		if (i == 3)
+			return -EINVAL;
+		bench_opts.format = i;
+	} else if (len == 5 && strncmp(opt, "timer", len) == 0) {
+		if (strcmp(val, "raw") == 0)
+			bench_opts.timer = HFS_BENCH_TIMER_RAW;
+		else if (strcmp(val, "tsc") != 0 || calibrate_tsc() < 0)
+			return -EINVAL;
+	} else if (len == 4 && strncmp(opt, "perf", len) == 0) {
+		if (strcmp(val, "on") == 0)
+			bench_opts.perf = true;
+		else if (strcmp(val, "off") == 0)
+			bench_opts.perf = false;
+		else
+			return -EINVAL;
+	} else if (len == 6 && strncmp(opt, "output", len) == 0) {
+		if (strlen(val) >= sizeof(bench_opts.output))
+			return -EINVAL;
+		strcpy(bench_opts.output, strcmp(val, "-") ? val : "");
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+void hfs_bench_show_opts(void)
+{
+	printf("warmup=%d format=%s timer=%s perf=%s output=%s\n",
+			bench_opts.warmup, format_names[bench_opts.format],
+			timer_names[bench_opts.timer], bench_opts.perf ? "on" : "off",
+			*bench_opts.output ? bench_opts.output : "-");
+}
@@ -8,28 +8,46 @@
 #include "fserror.h"
 #include "util.h"
 #include "fs.h"
+#include "process.h"
+#include "extent.h"
+#include "ring.h"
+#include "clock.h"
+#include "bench.h"
+#include "cachesim.h"
+#include "replay.h"
+
+#ifdef _HFS_DIRHASH
+#include "dirhash.h"
+#endif
+#ifdef _HFS_PCACHE
+#include "pcache.h"
+#endif
 
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 /**
- * Fill a char array with len random characters.
+ * Fill a char array with len random characters, drawn from rand(), or
+ * from rand_r(seed) if seed is given.
  */
-static void gen_rand_str(char *s, const int len) 
+static void gen_rand_str(char *s, const int len, unsigned int *seed) 
 {
     static const char alphanum[] =     
 		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
     for (int i = 0; i < len - 1; ++i)
-        s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+        s[i] = alphanum[(seed ? rand_r(seed) : rand()) % (sizeof(alphanum) - 1)];
     s[len - 1] = '\0';
 }
 
 /**
  * Fill a given directory with n random entries.
  */
-static void fill_dir(const char *dirpath, int n)
+static void fill_dir(const char *dirpath, int n, unsigned int *seed)
 {
 	int ret, dirpathlen;
 	char name[16];
@@ -41,7 +59,7 @@ static void fill_dir(const char *dirpath, int n)
 	strcpy(pathname, dirpath);
 	dirpathlen = strlen(pathname);
 	for (int i = 0; i < n; i++) {
-		gen_rand_str(name, 16);
+		gen_rand_str(name, 16, seed);
 		strcat(pathname, name);
 		pr_info("creat %s\n", pathname);
 		if ((ret = fs_creat(pathname)) < 0) {
@@ -53,6 +71,261 @@ static void fill_dir(const char *dirpath, int n)
 	}
 }
 
+/**
+ * The lines of a benchmark input file, read into memory so that threads
+ * can share them.
+ */
+struct path_list {
+	char	**paths;
+	int		n;
+};
+
+static int path_list_read(FILE *fp, struct path_list *list)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int cap = 0;
+
+	list->paths = NULL;
+	list->n = 0;
+	while (getline(&line, &len, fp) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		if (list->n == cap) {
+			char **paths;
+			cap = cap ? cap * 2 : 256;
+			if (!(paths = realloc(list->paths, cap * sizeof(char *))))
+				goto oom;
+			list->paths = paths;
+		}
+		if (!(list->paths[list->n] = strdup(line)))
+			goto oom;
+		list->n++;
+	}
+	free(line);
+	rewind(fp);
+	return 0;
+
+oom:
+	free(line);
+	rewind(fp);
+	printf("Error: out of memory.\n");
+	return -1;
+}
+
+static void path_list_free(struct path_list *list)
+{
+	for (int i = 0; i < list->n; i++)
+		free(list->paths[i]);
+	free(list->paths);
+	list->paths = NULL;
+	list->n = 0;
+}
+
+/**
+ * Create what one line of a file system description says (see
+ * benchmark_init_fs()).
+ */
+static int load_line(const char *line, unsigned int *seed)
+{
+	const char *pathname = line + 2;
+	int ret;
+
+	if (line[0] == 'D') {
+		ret = fs_mkdir(pathname);
+		fill_dir(pathname, 10, seed);	// Testing
+	} else if (line[0] == 'F') {
+		ret = fs_creat(pathname);
+	} else {
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * Number of components of the pathname in a line.
+ */
+static int line_depth(const char *line)
+{
+	int depth = 0;
+
+	for (const char *c = line + 2; *c; c++) {
+		if (*c != '/' && (c == line + 2 || c[-1] == '/'))
+			depth++;
+	}
+	return depth;
+}
+
+/**
+ * Length of the first depth components of the pathname in a line.
+ */
+static int line_prefix_len(const char *line, int depth)
+{
+	const char *c = line + 2;
+
+	while (*c && depth > 0) {
+		while (*c == '/')
+			c++;
+		while (*c && *c != '/')
+			c++;
+		depth--;
+	}
+	return c - (line + 2);
+}
+
+struct load_thread {
+	pthread_t			thread;
+	struct path_list	lines;
+	unsigned int		seed;
+	int					ret;
+};
+
+static void *load_thread_main(void *arg)
+{
+	struct load_thread *t = arg;
+
+	for (int i = 0; i < t->lines.n && t->ret >= 0; i++)
+		t->ret = load_line(t->lines.paths[i], &t->seed);
+	return NULL;
+}
+
+/**
+ * Parallel load: find the shallowest depth with at least nthreads
+ * directories, create everything down to that depth, then hand each
+ * subtree below it to one of nthreads threads, balancing the number of
+ * lines per thread. Subtrees are independent, so the threads only meet
+ * in the allocator.
+ */
+static int load_parallel(struct path_list *list, int nthreads)
+{
+	struct load_thread *threads;
+	int *depths, *owner, *load, *thread_of = NULL;
+	bool *done = NULL;
+	int split = 0, maxdepth = 0, ngroups = 0, i, ret = 0;
+	struct {
+		const char	*prefix;
+		int			len;
+		int			nlines;
+	} *groups;
+
+	depths = calloc(list->n, sizeof(int));
+	owner = calloc(list->n, sizeof(int));
+	groups = calloc(list->n, sizeof(*groups));
+	thread_of = calloc(list->n, sizeof(int));
+	done = calloc(list->n, sizeof(bool));
+	load = calloc(nthreads, sizeof(int));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!depths || !owner || !groups || !thread_of || !done || !load
+			|| !threads) {
+		printf("Error: out of memory.\n");
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < list->n; i++) {
+		depths[i] = line_depth(list->paths[i]);
+		if (depths[i] > maxdepth)
+			maxdepth = depths[i];
+	}
+	for (int d = 1, best = 0; d < maxdepth; d++) {
+		int ndirs = 0;
+		for (i = 0; i < list->n; i++)
+			ndirs += (depths[i] == d && list->paths[i][0] == 'D');
+		if (ndirs > best) {
+			best = ndirs;
+			split = d;
+		}
+		if (ndirs >= nthreads)
+			break;
+	}
+
+	// Everything down to the split, in order, and the subtrees below it.
+	for (i = 0; i < list->n; i++) {
+		const char *line = list->paths[i];
+		int g, len;
+
+		if (depths[i] <= split) {
+			if ((ret = load_line(line, NULL)) < 0)
+				goto out;
+			owner[i] = -1;
+			continue;
+		}
+		len = line_prefix_len(line, split);
+		for (g = ngroups - 1; g >= 0; g--) {
+			if (groups[g].len == len
+					&& strncmp(groups[g].prefix, line + 2, len) == 0)
+				break;
+		}
+		if (g < 0) {
+			g = ngroups++;
+			groups[g].prefix = line + 2;
+			groups[g].len = len;
+		}
+		groups[g].nlines++;
+		owner[i] = g;
+	}
+
+	// Largest subtree first, to the thread with the fewest lines.
+	for (int k = 0; k < ngroups; k++) {
+		int g = -1, t = 0;
+		for (int j = 0; j < ngroups; j++) {
+			if (!done[j] && (g < 0 || groups[j].nlines > groups[g].nlines))
+				g = j;
+		}
+		for (int j = 1; j < nthreads; j++) {
+			if (load[j] < load[t])
+				t = j;
+		}
+		done[g] = true;
+		thread_of[g] = t;
+		load[t] += groups[g].nlines;
+	}
+	for (int t = 0; t < nthreads; t++) {
+		threads[t].seed = t + 1;
+		threads[t].lines.paths = malloc((load[t] ? load[t] : 1)
+										* sizeof(char *));
+		if (!threads[t].lines.paths)
+			ret = -1;
+	}
+	for (i = 0; i < list->n && ret == 0; i++) {
+		if (owner[i] >= 0) {
+			struct path_list *l = &threads[thread_of[owner[i]]].lines;
+			l->paths[l->n++] = list->paths[i];
+		}
+	}
+	if (ret < 0)
+		goto out_free;
+
+	printf(KBLD "%d subtrees at depth %d on %d threads\n" KNRM,
+				ngroups, split, nthreads);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, load_thread_main,
+						   &threads[i]) != 0)
+			break;
+	}
+	// Whatever could not get a thread of its own is loaded here.
+	for (int t = i; t < nthreads; t++)
+		load_thread_main(&threads[t]);
+	for (int t = 0; t < nthreads; t++) {
+		if (t < i)
+			pthread_join(threads[t].thread, NULL);
+		if (threads[t].ret < 0)
+			ret = threads[t].ret;
+	}
+
+out_free:
+	for (int t = 0; t < nthreads; t++)
+		free(threads[t].lines.paths);	// the lines belong to list
+out:
+	free(depths);
+	free(owner);
+	free(groups);
+	free(thread_of);
+	free(done);
+	free(load);
+	free(threads);
+	return ret;
+}
+
 /**
  * Populate the file system based on the input file.
  * The input file will contain a list of pathnames, and 
@@ -73,93 +346,1711 @@ static void fill_dir(const char *dirpath, int n)
  * a file or a directory. The pathnames must be sorted in order of
  * dependency. (e.g. "/dir1/file" should not come before "/dir1".)
  * Component names can be anything (see fs.h for max name length.)
+ *
+ * With nthreads > 1, independent subtrees are created on nthreads
+ * threads at once (see load_parallel()), and the wall-clock time is
+ * reported.
  */
-int benchmark_init_fs(const char *input_file)
+int benchmark_init_fs(const char *input_file, int nthreads)
 {
 	FILE *fp;
-	char *line = NULL, *pathname;
+	char *line = NULL;
 	size_t len = 0;
-	int ret;
+	int ret = 0;
 
 	printf("Initializing file system based on %s...\n", input_file);
 	if (!(fp = fopen(input_file, "r"))) {
 		perror("open");
 		return -1;
 	}
-	
-	clock_t begin = clock();
-	while (getline(&line, &len, fp) != -1) {
-		line[strlen(line) - 1] = '\0';  // clear trailing \n
-		pathname = line + 2;
-		if (line[0] == 'D') {
-			ret = fs_mkdir(pathname);
-			fill_dir(pathname, 10);	// Testing
-		} else if (line[0] == 'F') {
-			ret = fs_creat(pathname);
-		} else {
+
+	if (nthreads > 1) {
+		struct path_list list;
+		struct timespec begin, end;
+
+		if (path_list_read(fp, &list) < 0) {
+			fclose(fp);
 			return -1;
 		}
-
-		if (ret < 0) {
+		fclose(fp);
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		ret = load_parallel(&list, nthreads);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (ret == 0)
+			printf("Done in %.3fms (%d lines, %d threads).\n",
+					(end.tv_sec - begin.tv_sec) * 1e3
+						+ (end.tv_nsec - begin.tv_nsec) / 1e6,
+					list.n, nthreads);
+		path_list_free(&list);
+		return ret;
+	}
+	
+	uint64_t begin = hfs_bench_ticks();
+	while (getline(&line, &len, fp) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((ret = load_line(line, NULL)) < 0)
 			return ret;
-		}
 	}
 
-	clock_t end = clock();
-	double runtime_main = (double)(end - begin) / (CLOCKS_PER_SEC / 1000);
+	double runtime_main = hfs_bench_seconds(begin, hfs_bench_ticks()) * 1e3;
 	printf("Done in %.3fms.\n", runtime_main);
 
 	fclose(fp);
 	return 0;
 }
 
+/**
+ * Perform repcount passes of the lookups in the list, each beginning
+ * with empty dirhash tables and path cache. If b is given, every lookup
+ * and every pass is timed into it, and if dstat is given, the dirhash
+ * hits and misses of all the passes are added up in it.
+ * Returns the total number of lookups performed.
+ */
+static long lookup_passes(struct path_list *list, int repcount,
+						  struct hfs_bench *b,
+						  struct hfs_dirhash_perf_stat *dstat)
+{
+	struct hfs_dirhash_perf_stat pass_stat;
+	struct hfs_dentry *dent;
+	uint64_t t = 0;
+	long total = 0;
+
+	for (int i = 0; i < repcount; i++) {
+		hfs_dirhash_clear();
+		hfs_dirhash_stat_clear();
+#ifdef _HFS_PCACHE
+		hfs_pcache_clear();
+#endif
+		if (b)
+			hfs_bench_pass_begin(b);
+		for (int j = 0; j < list->n; j++) {
+			if (b)
+				t = hfs_bench_ticks();
+			dent = lookup(list->paths[j]);
+			if (b)
+				hfs_bench_sample(b, hfs_bench_ticks() - t);
+			if (!dent)
+				printf(KRED "Lookup failed: %s\n" KNRM, list->paths[j]);
+		}
+		if (b)
+			hfs_bench_pass_end(b, list->n);
+		total += list->n;
+		if (dstat) {
+			hfs_dirhash_perf_stat(&pass_stat);
+			dstat->s_lookup_hcount += pass_stat.s_lookup_hcount;
+			dstat->s_lookup_mcount += pass_stat.s_lookup_mcount;
+		}
+	}
+	return total;
+}
+
+#if defined(_HFS_DIRHASH) && defined(HFS_DEBUG)
+/**
+ * Perform repcount passes of all the lookups listed in fp, without
+ * clearing any cache in between. Returns the number of lookups.
+ */
+static int warm_passes(FILE *fp, int repcount)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int total = 0;
+
+	for (int i = 0; i < repcount; i++) {
+		while (getline(&line, &len, fp) != -1) {
+			line[strcspn(line, "\n")] = '\0';
+			lookup(line);
+			total++;
+		}
+		rewind(fp);
+	}
+
+	free(line);
+	return total;
+}
+#endif
+
+#ifdef _HFS_PCACHE
+/**
+ * Report path cache hit rate, then repeat the same passes with prefix
+ * resumption turned off, and with the cache bypassed altogether, to find
+ * out what each saves per lookup. cached holds the passes made with both.
+ */
+static void benchmark_pcache(struct path_list *list, int repcount,
+							 const char *label, struct hfs_bench *cached)
+{
+	struct hfs_pcache_perf_stat pcstat;
+	struct hfs_bench noprefix, nocache;
+	double ns, ns_noprefix, ns_nocache;
+	int hits, lookups;
+
+	hfs_pcache_perf_stat(&pcstat);
+	hits = pcstat.s_hit_count + pcstat.s_neg_hit_count;
+	lookups = hits + pcstat.s_miss_count;
+	printf("Path cache hits: %d (%d negative)  Misses: %d (%d stale)\n",
+				hits, pcstat.s_neg_hit_count, pcstat.s_miss_count,
+				pcstat.s_stale_count);
+	printf("Path cache hit rate: %d/%d=%.2f%%\n", hits, lookups,
+				lookups ? (hits / (double)lookups) * 100 : 0.0);
+	printf("Prefix resumes: %d/%d misses (%.2f components skipped)\n",
+				pcstat.s_resume_count, pcstat.s_miss_count,
+				pcstat.s_resume_count ? pcstat.s_resume_depth /
+					(double)pcstat.s_resume_count : 0.0);
+
+	hfs_bench_init(&noprefix, "lookup_noprefix", label);
+	hfs_pcache_enable_prefix(false);
+	lookup_passes(list, repcount, &noprefix, NULL);
+	hfs_pcache_enable_prefix(true);
+
+	hfs_bench_init(&nocache, "lookup_nocache", label);
+	hfs_pcache_enable(false);
+	lookup_passes(list, repcount, &nocache, NULL);
+	hfs_pcache_enable(true);
+
+	hfs_bench_report(&noprefix);
+	hfs_bench_report(&nocache);
+
+	ns = cached->time * 1e9 / cached->ops;
+	ns_noprefix = noprefix.time * 1e9 / noprefix.ops;
+	ns_nocache = nocache.time * 1e9 / nocache.ops;
+	printf("Per lookup: %.1fns cached, %.1fns uncached (delta %+.1fns)\n",
+				ns, ns_nocache, ns - ns_nocache);
+	printf("Per lookup without prefix resumption: %.1fns (delta %+.1fns)\n",
+				ns_noprefix, ns - ns_noprefix);
+	hfs_bench_free(&noprefix);
+	hfs_bench_free(&nocache);
+}
+#endif  // _HFS_PCACHE
+
+#if defined(_HFS_DIRHASH) && defined(HFS_DEBUG)
+/**
+ * Time the lookups in fp with dirhash comparing full names, and with
+ * dirhash trusting its 32-bit name hash alone, alternating between the
+ * two for a few rounds and keeping the best time of each. The tables are
+ * loaded by a first pass, and the path cache is bypassed so that every
+ * component goes through a dirhash lookup.
+ */
+static void benchmark_dirhash_verify(FILE *fp, int repcount)
+{
+	double best[2] = { 0.0, 0.0 };
+	int total = 0;
+#ifdef _HFS_PCACHE
+	bool pcache_on = hfs_pcache_enabled();
+
+	hfs_pcache_enable(false);
+#endif
+
+	hfs_dirhash_clear();
+	warm_passes(fp, 1);
+	for (int round = 0; round < 5; round++) {
+		for (int verify = 0; verify < 2; verify++) {
+			double time;
+			uint64_t begin;
+
+			hfs_dirhash_verify_names(verify);
+			begin = hfs_bench_ticks();
+			total = warm_passes(fp, repcount);
+			time = hfs_bench_seconds(begin, hfs_bench_ticks()) * 1e3;
+			if (round == 0 || time < best[verify])
+				best[verify] = time;
+		}
+	}
+	hfs_dirhash_verify_names(true);
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(pcache_on);
+#endif
+
+	if (total == 0)
+		return;
+	printf("Dirhash per lookup: %.1fns verifying names, %.1fns hash only "
+			"(delta %+.1fns)\n", best[1] * 1e6 / total,
+			best[0] * 1e6 / total, (best[1] - best[0]) * 1e6 / total);
+}
+#endif
+
+#define CACHELINE_SHIFT		6
+#define PAGE_SHIFT			12
+
+/**
+ * A set of cache line or page numbers (open addressing, linear probing).
+ */
+struct addr_set {
+	uint64_t	*slots;		// number + 1, 0 marks a free slot
+	uint64_t	size;		// power of two
+	uint64_t	count;
+};
+
+static int addr_set_init(struct addr_set *set, uint64_t size)
+{
+	set->slots = calloc(size, sizeof(uint64_t));
+	set->size = size;
+	set->count = 0;
+	return set->slots ? 0 : -1;
+}
+
+static void addr_set_free(struct addr_set *set)
+{
+	free(set->slots);
+	set->slots = NULL;
+}
+
+static void addr_set_clear(struct addr_set *set)
+{
+	if (set->count)
+		memset(set->slots, 0, set->size * sizeof(uint64_t));
+	set->count = 0;
+}
+
+static void addr_set_add(struct addr_set *set, uint64_t n);
+
+static void addr_set_grow(struct addr_set *set)
+{
+	struct addr_set old = *set;
+
+	if (addr_set_init(set, old.size * 2) < 0) {
+		*set = old;
+		return;
+	}
+	for (uint64_t i = 0; i < old.size; i++) {
+		if (old.slots[i])
+			addr_set_add(set, old.slots[i] - 1);
+	}
+	free(old.slots);
+}
+
+static void addr_set_add(struct addr_set *set, uint64_t n)
+{
+	uint64_t i = (n * 0x9e3779b97f4a7c15ULL) & (set->size - 1);
+
+	while (set->slots[i]) {
+		if (set->slots[i] == n + 1)
+			return;
+		i = (i + 1) & (set->size - 1);
+	}
+	set->slots[i] = n + 1;
+	if (++set->count * 2 > set->size)
+		addr_set_grow(set);
+}
+
+/* Cache lines and pages touched by all lookups, and by the current one. */
+static struct addr_set fp_lines, fp_pages, fp_lookup_lines, fp_lookup_pages;
+
+static void footprint_tracer(const void *addr, size_t len)
+{
+	uintptr_t a = (uintptr_t)addr;
+
+	if (!len)
+		return;
+	for (uintptr_t l = a >> CACHELINE_SHIFT;
+			l <= (a + len - 1) >> CACHELINE_SHIFT; l++) {
+		addr_set_add(&fp_lines, l);
+		addr_set_add(&fp_lookup_lines, l);
+	}
+	for (uintptr_t p = a >> PAGE_SHIFT;
+			p <= (a + len - 1) >> PAGE_SHIFT; p++) {
+		addr_set_add(&fp_pages, p);
+		addr_set_add(&fp_lookup_pages, p);
+	}
+}
+
+static const char *placement_name(int placement)
+{
+	switch (placement) {
+	case HFS_PLACE_GROUP:
+		return "group";
+	case HFS_PLACE_ORLOV:
+		return "orlov";
+	default:
+		return "flat";
+	}
+}
+
+/**
+ * Walk every pathname in fp once, uncached, and report how many distinct
+ * cache lines and pages of the image the walks read in total, and on
+ * average per lookup. This is what the placement policy is meant to
+ * reduce.
+ */
+static int benchmark_footprint(FILE *fp)
+{
+	char *line = NULL;
+	size_t len = 0;
+	uint64_t nlookups = 0, sum_lines = 0, sum_pages = 0;
+#ifdef _HFS_PCACHE
+	bool pcache_on = hfs_pcache_enabled();
+#endif
+
+	if (addr_set_init(&fp_lines, 1 << 16) < 0
+			|| addr_set_init(&fp_pages, 1 << 12) < 0
+			|| addr_set_init(&fp_lookup_lines, 1 << 8) < 0
+			|| addr_set_init(&fp_lookup_pages, 1 << 6) < 0) {
+		printf("Error: out of memory.\n");
+		goto out;
+	}
+
+	hfs_dirhash_clear();
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(false);
+#endif
+	fs_trace_lookup(footprint_tracer);
+	while (getline(&line, &len, fp) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		addr_set_clear(&fp_lookup_lines);
+		addr_set_clear(&fp_lookup_pages);
+		lookup(line);
+		sum_lines += fp_lookup_lines.count;
+		sum_pages += fp_lookup_pages.count;
+		nlookups++;
+	}
+	fs_trace_lookup(NULL);
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(pcache_on);
+#endif
+	rewind(fp);
+
+	printf("Footprint: %lu lookups read %lu cache lines in %lu pages\n",
+				nlookups, fp_lines.count, fp_pages.count);
+	printf("Per lookup: %.2f cache lines, %.2f pages\n",
+				nlookups ? sum_lines / (double)nlookups : 0.0,
+				nlookups ? sum_pages / (double)nlookups : 0.0);
+
+out:
+	addr_set_free(&fp_lines);
+	addr_set_free(&fp_pages);
+	addr_set_free(&fp_lookup_lines);
+	addr_set_free(&fp_lookup_pages);
+	free(line);
+	return nlookups;
+}
+
+/**
+ * Lookup benchmark. After bench_opts.warmup untimed passes, every
+ * pathname in input_file is looked up repcount times, each pass starting
+ * with empty caches, and each lookup is timed (see include/bench.h).
+ */
 int benchmark_lookup(const char *input_file, int repcount)
 {
 	FILE *fp;
-	char *line = NULL, *pathname;
-	size_t len = 0;
-	clock_t begin, end;
-	double time;
-	int counter = 0;
-	struct hfs_dirhash_perf_stat statbuf;
+	struct path_list list;
+	struct hfs_bench b;
+	struct hfs_dirhash_perf_stat statbuf = { 0 };
+	long total;
+	int counter;
 
+	if (repcount <= 0)
+		repcount = 1;
 	if (!(fp = fopen(input_file, "r"))) {
 		perror("open");
 		return -1;
 	}
-
-	begin = clock();
-	for (int i = 0; i < repcount; i++) {
-		hfs_dirhash_clear();
-		hfs_dirhash_stat_clear();
-		counter = 0;
-		while (getline(&line, &len, fp) != -1 && ++counter < 300) {
-			line[strlen(line) - 1] = '\0';  // clear trailing \n
-			pathname = line;
-			if (!lookup(pathname)) {
-				printf(KRED "Lookup failed: %s\n" KNRM, pathname);
-			}
-		}
-		rewind(fp);
+	if (path_list_read(fp, &list) < 0) {
+		fclose(fp);
+		return -1;
 	}
-	end = clock();
-	time = (double)(end - begin) / (CLOCKS_PER_SEC / 1000);
 
-	pr_info(KBLD KBLU "%d lookups performed.\n", counter);
+	lookup_passes(&list, bench_opts.warmup, NULL, NULL);
+#ifdef _HFS_PCACHE
+	hfs_pcache_stat_clear();
+#endif
+
+	hfs_bench_init(&b, "lookup", input_file);
+	total = lookup_passes(&list, repcount, &b, &statbuf);
+
+	pr_info(KBLD KBLU "%ld lookups performed.\n", total);
 
-	hfs_dirhash_perf_stat(&statbuf);
 	counter = statbuf.s_lookup_hcount + statbuf.s_lookup_mcount;
-	double hitrate = (statbuf.s_lookup_hcount / (double)(counter)) * 100;
 	pr_info("Hits: %d  Misses: %d\n", 
 				statbuf.s_lookup_hcount, statbuf.s_lookup_mcount);
-	pr_info("Hit rate: %d/%d=%.2f%%\n", 
-				statbuf.s_lookup_hcount, counter, hitrate);
+	pr_info("Hit rate: %d/%d=%.2f%%\n", statbuf.s_lookup_hcount, counter,
+				counter ? statbuf.s_lookup_hcount * 100.0 / counter : 0.0);
+	hfs_bench_report(&b);
+
+#ifdef _HFS_PCACHE
+	if (total > 0)
+		benchmark_pcache(&list, repcount, input_file, &b);
+#endif
+#if defined(_HFS_DIRHASH) && defined(HFS_DEBUG)
+	benchmark_dirhash_verify(fp, repcount);
+#endif
+	benchmark_footprint(fp);
 
 	printf("\033[32;1m");
-	printf("Average running time per cycle: %.3fms.\n", time/repcount);
+	printf("Average running time per cycle: %.3fms.\n", b.time * 1e3 / repcount);
 	printf("\033[0m\n");
 
+	hfs_bench_free(&b);
+	path_list_free(&list);
+	fclose(fp);
+	return 0;
+}
+
+/* What the threads of a multi-threaded benchmark do with each pathname. */
+#define MT_LOOKUP			0	// look it up
+#define MT_OPEN_SHARED		1	// open and close it, all in one process
+#define MT_OPEN_PRIVATE		2	// the same, each thread its own process
+
+struct lookup_thread {
+	pthread_t			thread;
+	struct path_list	*list;
+	int					*go;		// set once all threads exist
+	int					first;		// where in the list to begin
+	int					repcount;
+	int					op;			// MT_*
+	struct hfs_process	*proc;		// process to run as
+	long				failed;
+};
+
+/**
+ * Look up (or open and close) every pathname in the list repcount times,
+ * beginning at a different place in the list in each thread so that the
+ * threads do not walk the same directories in lockstep. Directories
+ * cannot be opened, so they only count as failures if they are missing.
+ */
+static void *lookup_thread_main(void *arg)
+{
+	struct lookup_thread *t = arg;
+	int n = t->list->n;
+	int fd;
+
+	process_attach(t->proc);
+	while (!__atomic_load_n(t->go, __ATOMIC_ACQUIRE))
+		;
+	for (int r = 0; r < t->repcount; r++) {
+		for (int i = 0; i < n; i++) {
+			const char *path = t->list->paths[(t->first + i) % n];
+
+			if (t->op == MT_LOOKUP) {
+				if (!lookup(path))
+					t->failed++;
+			} else if ((fd = fs_open(path)) >= 0) {
+				fs_close(fd);
+			} else if (fd != -EINVTYPE) {
+				t->failed++;
+			}
+		}
+	}
+	process_attach(NULL);
+	return NULL;
+}
+
+/**
+ * Time repcount passes over the list in each of nthreads threads.
+ * Returns the elapsed time in seconds, or a negative value on failure.
+ */
+static double run_lookup_threads(struct path_list *list, int nthreads,
+								 int repcount, int op, long *failed)
+{
+	struct lookup_thread *threads;
+	struct hfs_process *shared = NULL;
+	struct timespec begin, end;
+	int i, created, go = 0;
+
+	if (!(threads = calloc(nthreads, sizeof(*threads))))
+		return -1;
+	if (op == MT_OPEN_SHARED && !(shared = process_create())) {
+		free(threads);
+		return -1;
+	}
+	for (created = 0; created < nthreads; created++) {
+		struct lookup_thread *t = &threads[created];
+		t->list = list;
+		t->go = &go;
+		t->first = (long)list->n * created / nthreads;
+		t->repcount = repcount;
+		t->op = op;
+		t->proc = shared;
+		if (op == MT_OPEN_PRIVATE && !(t->proc = process_create())) {
+			printf("Error: failed to create process %d.\n", created);
+			break;
+		}
+		if (pthread_create(&t->thread, NULL, lookup_thread_main, t) != 0) {
+			printf("Error: failed to create thread %d.\n", created);
+			process_exit(t->proc == shared ? NULL : t->proc);
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	*failed = 0;
+	for (i = 0; i < created; i++) {
+		pthread_join(threads[i].thread, NULL);
+		*failed += threads[i].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < created; i++) {
+		if (threads[i].proc != shared)
+			process_exit(threads[i].proc);
+	}
+	process_exit(shared);
+	free(threads);
+	if (created < nthreads)
+		return -1;
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+/**
+ * Report lookups (or opens) per second with 1, 2, 4, ... and finally
+ * maxthreads threads going through the same list at once, and the
+ * speedup over one thread.
+ */
+static void lookup_scaling(struct path_list *list, int repcount,
+						   int maxthreads, int op)
+{
+	double rate1 = 0.0;
+
+	printf(KBLD "%8s %14s %9s %11s %8s\n" KNRM, "threads",
+				op == MT_LOOKUP ? "lookups/s" : "opens/s",
+				"speedup", "efficiency", "failed");
+	for (int n = 1; n <= maxthreads; n = (n < maxthreads && n * 2 > maxthreads)
+												? maxthreads : n * 2) {
+		long failed;
+		double time = run_lookup_threads(list, n, repcount, op, &failed);
+		double rate;
+
+		if (time <= 0)
+			break;
+		rate = (double)list->n * repcount * n / time;
+		if (n == 1)
+			rate1 = rate;
+		printf("%8d %14.0f %8.2fx %10.1f%% %8ld\n", n, rate,
+					rate / rate1, rate / rate1 / n * 100, failed);
+	}
+}
+
+/**
+ * Multi-threaded lookup benchmark: look up every pathname in input_file
+ * repcount times in each thread, with the number of threads going from
+ * one up to maxthreads (0 for the number of online CPUs), and report how
+ * lookups per second scale. Lookups take no locks (see include/sync.h),
+ * so they should scale with the number of cores. With _HFS_PCACHE, this
+ * is done with the path cache, and then again with every lookup walking
+ * the directories.
+ *
+ * Then every pathname is opened and closed instead, first with all
+ * threads in one process and then with a process per thread. Both look
+ * up the same pathnames, so the difference between the two is what the
+ * threads lose to each other on the shared descriptor table.
+ */
+int benchmark_lookup_mt(const char *input_file, int repcount, int maxthreads)
+{
+	struct path_list list;
+	FILE *fp;
+
+	if (maxthreads <= 0)
+		maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (maxthreads <= 0)
+		maxthreads = 1;
+	if (repcount <= 0)
+		repcount = 1;
+
+	if (!(fp = fopen(input_file, "r"))) {
+		perror("open");
+		return -1;
+	}
+	if (path_list_read(fp, &list) < 0) {
+		fclose(fp);
+		return -1;
+	}
 	fclose(fp);
+	if (list.n == 0) {
+		path_list_free(&list);
+		return 0;
+	}
+
+	hfs_dirhash_clear();
+#ifdef _HFS_PCACHE
+	bool pcache_on = hfs_pcache_enabled();
+
+	hfs_pcache_clear();
+	printf(KBLD KBLU "\nPath cache on\n" KNRM);
+	lookup_scaling(&list, repcount, maxthreads, MT_LOOKUP);
+	hfs_pcache_enable(false);
+	printf(KBLD KBLU "\nPath cache off\n" KNRM);
+#endif
+	lookup_scaling(&list, repcount, maxthreads, MT_LOOKUP);
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(pcache_on);
+#endif
+
+	printf(KBLD KBLU "\nOpen/close, one process\n" KNRM);
+	lookup_scaling(&list, repcount, maxthreads, MT_OPEN_SHARED);
+	printf(KBLD KBLU "\nOpen/close, a process per thread\n" KNRM);
+	lookup_scaling(&list, repcount, maxthreads, MT_OPEN_PRIVATE);
+
+	path_list_free(&list);
+	return 0;
+}
+
+struct creat_thread {
+	pthread_t	thread;
+	int			*go;		// set once all threads exist
+	int			id;			// creates in /.creates.<id>
+	int			count;
+	long		failed;
+};
+
+static void *creat_thread_main(void *arg)
+{
+	struct creat_thread *t = arg;
+	char path[64];
+
+	while (!__atomic_load_n(t->go, __ATOMIC_ACQUIRE))
+		;
+	for (int i = 0; i < t->count; i++) {
+		snprintf(path, sizeof(path), "/.creates.%d/f%d", t->id, i);
+		if (fs_creat(path) < 0)
+			t->failed++;
+	}
+	return NULL;
+}
+
+/**
+ * Time nthreads threads each creating count files in a directory of its
+ * own. The directories are made beforehand, and everything is removed
+ * again afterwards, neither of which is timed. Returns the elapsed time
+ * in seconds, or a negative value on failure.
+ */
+static double run_creat_threads(int nthreads, int count, long *failed)
+{
+	struct creat_thread *threads;
+	struct timespec begin, end;
+	int i, created, go = 0;
+	char path[64];
+
+	if (!(threads = calloc(nthreads, sizeof(*threads))))
+		return -1;
+	for (i = 0; i < nthreads; i++) {
+		snprintf(path, sizeof(path), "/.creates.%d", i);
+		fs_mkdir(path);
+	}
+	for (created = 0; created < nthreads; created++) {
+		struct creat_thread *t = &threads[created];
+		t->go = &go;
+		t->id = created;
+		t->count = count;
+		if (pthread_create(&t->thread, NULL, creat_thread_main, t) != 0) {
+			printf("Error: failed to create thread %d.\n", created);
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	*failed = 0;
+	for (i = 0; i < created; i++) {
+		pthread_join(threads[i].thread, NULL);
+		*failed += threads[i].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < nthreads; i++) {
+		for (int j = 0; j < count; j++) {
+			snprintf(path, sizeof(path), "/.creates.%d/f%d", i, j);
+			fs_unlink(path);
+		}
+		snprintf(path, sizeof(path), "/.creates.%d", i);
+		fs_rmdir(path);
+	}
+
+	free(threads);
+	if (created < nthreads)
+		return -1;
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+/**
+ * Multi-threaded create benchmark: 1, 2, 4, ... and finally maxthreads
+ * (0 for the number of online CPUs) threads each create count files in
+ * a directory of their own, and creates per second are reported with the
+ * speedup over one thread. The threads take locks on different
+ * directories and allocate from different shards (see include/alloc.h),
+ * so they only meet on the path cache.
+ */
+int benchmark_creat_mt(int count, int maxthreads)
+{
+	double rate1 = 0.0;
+
+	if (maxthreads <= 0)
+		maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (maxthreads <= 0)
+		maxthreads = 1;
+	if (count <= 0)
+		count = 1000;
+
+	printf(KBLD "%8s %14s %9s %11s %8s\n" KNRM,
+				"threads", "creates/s", "speedup", "efficiency", "failed");
+	for (int n = 1; n <= maxthreads; n = (n < maxthreads && n * 2 > maxthreads)
+												? maxthreads : n * 2) {
+		long failed;
+		double time = run_creat_threads(n, count, &failed);
+		double rate;
+
+		if (time <= 0)
+			return -1;
+		rate = (double)count * n / time;
+		if (n == 1)
+			rate1 = rate;
+		printf("%8d %14.0f %8.2fx %10.1f%% %8ld\n", n, rate,
+					rate / rate1, rate / rate1 / n * 100, failed);
+	}
+	return 0;
+}
+
+#define SEQIO_PATH	"/.seqio"
+
+/**
+ * Write size bytes of SEQIO_PATH from the start, bufsize bytes of buf per
+ * call, the way loadf does; or, if expect is given, read them back the
+ * way cat does and check every buffer against expect. Returns the
+ * elapsed time in seconds, or a negative value on failure.
+ */
+static double seqio_pass(uint64_t size, char *buf, int bufsize,
+						 const char *expect)
+{
+	struct timespec begin, end;
+	uint64_t off = 0;
+	int fd, n, ret = 0;
+
+	if ((fd = fs_open(SEQIO_PATH)) < 0)
+		return fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	while (off < size) {
+		n = (size - off < bufsize) ? size - off : bufsize;
+		ret = expect ? fs_read(fd, buf, n) : fs_write(fd, buf, n);
+		if (ret != n || (expect && memcmp(buf, expect, n) != 0))
+			break;
+		off += n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fs_close(fd);
+
+	if (off < size) {
+		printf("Error: %s failed at offset %lu.\n",
+				expect ? "read" : "write", off);
+		return ret < 0 ? ret : -1;
+	}
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+/**
+ * Sequential I/O benchmark: a file of mib MiB is written from start to
+ * end, written over again, and read back, bufsize bytes per call, and
+ * the throughput of each pass is reported with the number of mapping
+ * lookups it took.
+ */
+int benchmark_seqio(int mib, int bufsize)
+{
+	static const char *passes[] = { "write", "rewrite", "read" };
+	struct hfs_stat st;
+	char *buf, *expect;
+	uint64_t size;
+	int ret;
+
+	if (mib <= 0)
+		mib = 16;
+	if (bufsize <= 0)
+		bufsize = BUFSIZ;
+	size = (uint64_t)mib << 20;
+	buf = malloc(bufsize);
+	expect = malloc(bufsize);
+	if (!buf || !expect) {
+		ret = -1;
+		goto out;
+	}
+	for (int i = 0; i < bufsize; i++)
+		expect[i] = rand();
+
+	fs_unlink(SEQIO_PATH);
+	if ((ret = fs_creat(SEQIO_PATH)) < 0)
+		goto out;
+
+	printf(KBLD "%8s %10s %12s %14s\n" KNRM,
+				"pass", "MiB/s", "lookups", "bytes/lookup");
+	for (int p = 0; p < 3; p++) {
+		uint64_t lookups = 0;
+		double time;
+#ifdef HFS_DEBUG
+		lookups = hfs_extent_nlookups();
+#endif
+		memcpy(buf, expect, bufsize);
+		time = seqio_pass(size, buf, bufsize, p == 2 ? expect : NULL);
+		if (time < 0) {
+			ret = -1;
+			goto out;
+		}
+#ifdef HFS_DEBUG
+		lookups = hfs_extent_nlookups() - lookups;
+#endif
+		printf("%8s %10.1f %12lu %14.0f\n", passes[p], mib / time,
+					lookups, lookups ? (double)size / lookups : 0.0);
+	}
+
+	if ((ret = fs_stat(SEQIO_PATH, &st)) < 0)
+		goto out;
+	printf("\n%u blocks for %lu bytes.\n", st.st_blocks, size);
+
+out:
+	fs_unlink(SEQIO_PATH);
+	free(buf);
+	free(expect);
+	return ret;
+}
+
+#define VECIO_PATH	"/.vecio"
+
+enum {
+	VIO_READ,		// fs_read(), iosize bytes at a time
+	VIO_PREAD,		// fs_pread()
+	VIO_READV,		// fs_readv(), iovcnt buffers of iosize bytes
+	VIO_WRITE,		// fs_write()
+	VIO_PWRITE,		// fs_pwrite()
+	VIO_WRITEV,		// fs_writev()
+	VIO_NPASSES
+};
+
+static const char *vecio_names[] = {
+	[VIO_READ]		= "read",
+	[VIO_PREAD]		= "pread",
+	[VIO_READV]		= "readv",
+	[VIO_WRITE]		= "write",
+	[VIO_PWRITE]	= "pwrite",
+	[VIO_WRITEV]	= "writev",
+};
+
+static inline double elapsed(struct timespec *begin, struct timespec *end)
+{
+	return (end->tv_sec - begin->tv_sec)
+				+ (end->tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/**
+ * Go over size bytes of fd from the start, one way. iov holds iovcnt
+ * buffers of iosize bytes; the single-buffer calls only use the first.
+ * Returns the number of calls made, or -1 if one came up short.
+ */
+static long vecio_pass(int fd, int pass, uint64_t size, struct iovec *iov,
+					   int iovcnt, int iosize)
+{
+	uint64_t off = 0;
+	long calls = 0;
+	int n, ret = 0;
+
+	fs_lseek(fd, 0);
+	while (off < size) {
+		n = (pass == VIO_READV || pass == VIO_WRITEV) ? iosize * iovcnt
+													  : iosize;
+		if (n > size - off)
+			break;	// size is a multiple of iosize * iovcnt
+		switch (pass) {
+		case VIO_READ:	 ret = fs_read(fd, iov[0].iov_base, n); break;
+		case VIO_PREAD:	 ret = fs_pread(fd, iov[0].iov_base, n, off); break;
+		case VIO_READV:	 ret = fs_readv(fd, iov, iovcnt); break;
+		case VIO_WRITE:	 ret = fs_write(fd, iov[0].iov_base, n); break;
+		case VIO_PWRITE: ret = fs_pwrite(fd, iov[0].iov_base, n, off); break;
+		case VIO_WRITEV: ret = fs_writev(fd, iov, iovcnt); break;
+		}
+		if (ret != n)
+			return -1;
+		off += n;
+		calls++;
+	}
+	return calls;
+}
+
+struct vecio_thread {
+	pthread_t		thread;
+	int				*go;
+	int				fd;			// shared by all threads
+	pthread_mutex_t	*lock;		// NULL: use fs_pread()
+	uint64_t		off;		// slice of the file to read
+	uint64_t		len;
+	int				iosize;
+	long			failed;
+};
+
+static void *vecio_thread_main(void *arg)
+{
+	struct vecio_thread *t = arg;
+	char *buf = malloc(t->iosize);
+	int ret;
+
+	while (!__atomic_load_n(t->go, __ATOMIC_ACQUIRE))
+		;
+	for (uint64_t off = t->off; buf && off < t->off + t->len;
+			off += t->iosize) {
+		if (t->lock) {
+			// A shared offset: seek and read have to go together.
+			pthread_mutex_lock(t->lock);
+			fs_lseek(t->fd, off);
+			ret = fs_read(t->fd, buf, t->iosize);
+			pthread_mutex_unlock(t->lock);
+		} else {
+			ret = fs_pread(t->fd, buf, t->iosize, off);
+		}
+		if (ret != t->iosize)
+			t->failed++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Time nthreads threads reading a slice each of the file open at fd,
+ * through that one descriptor. Returns the elapsed time in seconds, or a
+ * negative value on failure.
+ */
+static double vecio_shared(int fd, int nthreads, uint64_t size, int iosize,
+						   bool positional)
+{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct vecio_thread *threads;
+	struct timespec begin, end;
+	int created, go = 0;
+	long failed = 0;
+	uint64_t slice = size / nthreads / iosize * iosize;
+
+	if (!(threads = calloc(nthreads, sizeof(*threads))))
+		return -1;
+	for (created = 0; created < nthreads; created++) {
+		struct vecio_thread *t = &threads[created];
+		t->go = &go;
+		t->fd = fd;
+		t->lock = positional ? NULL : &lock;
+		t->off = slice * created;
+		t->len = slice;
+		t->iosize = iosize;
+		if (pthread_create(&t->thread, NULL, vecio_thread_main, t) != 0) {
+			printf("Error: failed to create thread %d.\n", created);
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < created; i++) {
+		pthread_join(threads[i].thread, NULL);
+		failed += threads[i].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free(threads);
+	if (created < nthreads || failed)
+		return -1;
+	return elapsed(&begin, &end);
+}
+
+/**
+ * Vectored and positional I/O benchmark. A file of mib MiB is read and
+ * written over from start to end with fs_read()/fs_write() iosize bytes
+ * at a time, the same with fs_pread()/fs_pwrite(), and with
+ * fs_readv()/fs_writev() taking iovcnt buffers of iosize bytes per call.
+ * Then nthreads threads read a slice each through one shared descriptor,
+ * with fs_pread() and with lseek + fs_read() under a lock.
+ */
+int benchmark_vecio(int mib, int iosize, int iovcnt, int nthreads)
+{
+	struct iovec *iov = NULL;
+	struct timespec begin, end;
+	uint64_t size;
+	int fd = -1, ret = 0;
+
+	if (mib <= 0)
+		mib = 16;
+	if (iosize <= 0)
+		iosize = BSIZE;
+	if (iovcnt <= 0 || iovcnt > HFS_IOV_MAX)
+		iovcnt = 16;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	size = ((uint64_t)mib << 20) / ((uint64_t)iosize * iovcnt)
+				* iosize * iovcnt;
+	if (!size) {
+		printf("Error: %d buffers of %d bytes do not fit in %d MiB.\n",
+				iovcnt, iosize, mib);
+		return -1;
+	}
+
+	if (!(iov = calloc(iovcnt, sizeof(*iov))))
+		return -1;
+	for (int i = 0; i < iovcnt; i++) {
+		if (!(iov[i].iov_base = malloc(iosize))) {
+			ret = -1;
+			goto out;
+		}
+		memset(iov[i].iov_base, 'a' + i % 26, iosize);
+		iov[i].iov_len = iosize;
+	}
+
+	fs_unlink(VECIO_PATH);
+	if ((ret = fs_creat(VECIO_PATH)) < 0)
+		goto out;
+	if ((fd = fs_open(VECIO_PATH)) < 0) {
+		ret = fd;
+		goto out;
+	}
+	if (vecio_pass(fd, VIO_WRITEV, size, iov, iovcnt, iosize) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	printf(KBLD "%8s %10s %10s %12s %12s\n" KNRM,
+				"call", "MiB/s", "calls", "ns/call", "lookups");
+	for (int p = 0; p < VIO_NPASSES; p++) {
+		uint64_t lookups = 0;
+		double time;
+		long calls;
+#ifdef HFS_DEBUG
+		lookups = hfs_extent_nlookups();
+#endif
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		calls = vecio_pass(fd, p, size, iov, iovcnt, iosize);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (calls < 0) {
+			printf("Error: %s came up short.\n", vecio_names[p]);
+			ret = -1;
+			goto out;
+		}
+#ifdef HFS_DEBUG
+		lookups = hfs_extent_nlookups() - lookups;
+#endif
+		time = elapsed(&begin, &end);
+		printf("%8s %10.1f %10ld %12.0f %12lu\n", vecio_names[p],
+					size / 1048576.0 / time, calls, time * 1e9 / calls,
+					lookups);
+	}
+
+	printf(KBLD "\n%d threads, one descriptor\n" KNRM, nthreads);
+	for (int positional = 0; positional < 2; positional++) {
+		double time = vecio_shared(fd, nthreads, size, iosize, positional);
+		if (time < 0) {
+			ret = -1;
+			goto out;
+		}
+		printf("%14s %10.1f MiB/s\n",
+					positional ? "pread" : "lseek + read",
+					size / nthreads * nthreads / 1048576.0 / time);
+	}
+
+out:
+	if (fd >= 0)
+		fs_close(fd);
+	fs_unlink(VECIO_PATH);
+	for (int i = 0; i < iovcnt; i++)
+		free(iov[i].iov_base);
+	free(iov);
+	return ret;
+}
+
+/* Largest batch benchmark_ring() tries by default. */
+#define RING_BATCH_MAX	512
+
+/**
+ * stat() every pathname in the list through a ring of batch entries,
+ * submitting whenever it is full. Returns the number of calls that
+ * failed, or -1 if the ring could not be set up.
+ */
+static long ring_pass(struct path_list *list, int batch)
+{
+	struct hfs_ring ring;
+	struct hfs_stat statbuf;
+	struct hfs_cqe *cqe;
+	long failed = 0;
+
+	if (hfs_ring_init(&ring, batch) < 0)
+		return -1;
+	for (int i = 0; i < list->n; i++) {
+		struct hfs_sqe *sqe = hfs_ring_get_sqe(&ring);
+
+		sqe->opcode = HFS_OP_STAT;
+		sqe->path = list->paths[i];
+		sqe->statbuf = &statbuf;
+		sqe->user_data = i;
+		if (i + 1 < list->n && (i + 1) % batch)
+			continue;
+		hfs_ring_submit(&ring);
+		while ((cqe = hfs_ring_peek_cqe(&ring))) {
+			if (cqe->res < 0)
+				failed++;
+			hfs_ring_cqe_seen(&ring);
+		}
+	}
+	hfs_ring_free(&ring);
+	return failed;
+}
+
+/**
+ * Ring benchmark. Every pathname in input_file is stat()ed repcount
+ * times, one fs_stat() at a time, and then through a ring (see
+ * include/ring.h) with batches of 1, 8, 64, ... up to maxbatch.
+ */
+int benchmark_ring(const char *input_file, int maxbatch, int repcount)
+{
+	struct path_list list;
+	struct timespec begin, end;
+	struct hfs_stat statbuf;
+	FILE *fp;
+	int ret = 0;
+
+	if (maxbatch <= 0)
+		maxbatch = RING_BATCH_MAX;
+	if (repcount <= 0)
+		repcount = 1;
+	if (!(fp = fopen(input_file, "r"))) {
+		perror("open");
+		return -1;
+	}
+	ret = path_list_read(fp, &list);
+	fclose(fp);
+	if (ret < 0)
+		return -1;
+	if (!list.n) {
+		printf("Error: %s is empty.\n", input_file);
+		path_list_free(&list);
+		return -1;
+	}
+
+	printf(KBLD "%10s %12s %12s %10s\n" KNRM,
+				"batch", "ops/s", "ns/op", "failed");
+	// batch == 0 is fs_stat(), one call at a time.
+	for (int batch = 0; batch <= maxbatch; batch = batch ? batch * 8 : 1) {
+		long failed = 0;
+		double time;
+
+#ifdef _HFS_PCACHE
+		hfs_pcache_clear();
+#endif
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (int r = 0; r < repcount; r++) {
+			if (!batch) {
+				for (int i = 0; i < list.n; i++)
+					if (fs_stat(list.paths[i], &statbuf) < 0)
+						failed++;
+			} else {
+				long f = ring_pass(&list, batch);
+				if (f < 0) {
+					printf("Error: failed to set up a ring of %d.\n", batch);
+					ret = -1;
+					goto out;
+				}
+				failed += f;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		time = elapsed(&begin, &end);
+		if (batch)
+			printf("%10d", batch);
+		else
+			printf("%10s", "fs_stat");
+		printf(" %12.0f %12.0f %10ld\n",
+					(double)list.n * repcount / time,
+					time * 1e9 / ((double)list.n * repcount), failed);
+	}
+
+out:
+	path_list_free(&list);
+	return ret;
+}
+
+/* Writes made to every file benchmark_clock() creates, and their size. */
+#define CLOCK_NWRITES	4
+#define CLOCK_IOSIZE	64
+
+/* Where the clock reads timed by benchmark_clock() go. */
+static volatile time_t clock_sink;
+
+/**
+ * Empty the file system and create what the lines of a file system
+ * description say (see benchmark_init_fs(), but without filling every
+ * directory with random files), writing CLOCK_NWRITES small pieces to
+ * every file. Returns the time taken in seconds, or -1.
+ */
+static double clock_load_pass(struct path_list *list)
+{
+	struct timespec begin, end;
+	char buf[CLOCK_IOSIZE] = { 0 };
+	int fd;
+
+	if (fs_reset() < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < list->n; i++) {
+		const char *line = list->paths[i];
+
+		if (line[0] == 'D') {
+			if (fs_mkdir(line + 2) < 0)
+				return -1;
+			continue;
+		}
+		if (line[0] != 'F' || fs_creat(line + 2) < 0
+				|| (fd = fs_open(line + 2)) < 0)
+			return -1;
+		for (int w = 0; w < CLOCK_NWRITES; w++)
+			fs_pwrite(fd, buf, CLOCK_IOSIZE, w * CLOCK_IOSIZE);
+		fs_close(fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return elapsed(&begin, &end);
+}
+
+/**
+ * Read the first CLOCK_IOSIZE bytes of every file in the list n times.
+ * Returns the time taken in seconds, or -1.
+ */
+static double clock_read_pass(struct path_list *list, int n)
+{
+	struct timespec begin, end;
+	char buf[CLOCK_IOSIZE];
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < list->n; i++) {
+		if (list->paths[i][0] != 'F')
+			continue;
+		if ((fd = fs_open(list->paths[i] + 2)) < 0)
+			return -1;
+		for (int r = 0; r < n; r++)
+			fs_pread(fd, buf, CLOCK_IOSIZE, 0);
+		fs_close(fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return elapsed(&begin, &end);
+}
+
+/**
+ * Timestamp benchmark. The file system description in input_file is
+ * loaded repcount times, writing a little to every file, with inode
+ * timestamps taken from the time read on every call (clock=precise) and
+ * from the ticker (see include/clock.h). Then every file is read under
+ * each atime= mode. Leaves the file system loaded, and the clock as the
+ * mount options say.
+ */
+int benchmark_clock(const char *input_file, int repcount)
+{
+	static const struct { const char *name; int tick; } clocks[] = {
+		{ "precise", 0 },
+		{ "coarse", HFS_CLOCK_TICK_DEFAULT },
+	};
+	static const char *atimes[] = {
+		[HFS_ATIME_RELATIME]	= "relatime",
+		[HFS_ATIME_STRICT]		= "strict",
+		[HFS_ATIME_NONE]		= "noatime",
+	};
+	struct path_list list;
+	struct timespec begin, end;
+	int saved_atime = mount_opts.atime;
+	int nfiles = 0, ret = 0;
+	FILE *fp;
+
+	if (repcount <= 0)
+		repcount = 5;
+	if (!(fp = fopen(input_file, "r"))) {
+		perror("open");
+		return -1;
+	}
+	ret = path_list_read(fp, &list);
+	fclose(fp);
+	if (ret < 0)
+		return -1;
+	for (int i = 0; i < list.n; i++)
+		nfiles += list.paths[i][0] == 'F';
+
+	printf(KBLD "%10s %12s %12s %12s\n" KNRM,
+				"clock", "ns/hfs_now", "load (ms)", "ns/line");
+	for (int c = 0; c < 2; c++) {
+		double now_time, load_time = 0;
+
+		hfs_clock_start(clocks[c].tick);
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (int i = 0; i < 1000000; i++)
+			clock_sink = hfs_now();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		now_time = elapsed(&begin, &end);
+
+		for (int r = 0; r < repcount; r++) {
+			double t = clock_load_pass(&list);
+			if (t < 0) {
+				printf("Error: failed to load %s.\n", input_file);
+				ret = -1;
+				goto out;
+			}
+			load_time += t;
+		}
+		printf("%10s %12.1f %12.3f %12.0f\n", clocks[c].name,
+					now_time * 1e3, load_time * 1e3 / repcount,
+					load_time * 1e9 / repcount / list.n);
+	}
+
+	printf(KBLD "\n%10s %12s\n" KNRM, "atime", "ns/read");
+	if (clock_read_pass(&list, 1) < 0) {	// warm up the path cache
+		ret = -1;
+		goto out;
+	}
+	for (int a = 0; a < 3; a++) {
+		double t;
+
+		mount_opts.atime = a;
+		if ((t = clock_read_pass(&list, repcount)) < 0) {
+			ret = -1;
+			goto out;
+		}
+		printf("%10s %12.0f\n", atimes[a],
+					nfiles ? t * 1e9 / nfiles / repcount : 0);
+	}
+
+out:
+	mount_opts.atime = saved_atime;
+	hfs_clock_start(mount_opts.clock_tick ? mount_opts.clock_tick
+										  : HFS_CLOCK_TICK_DEFAULT);
+	path_list_free(&list);
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Trace replay benchmark. The op log in log_file (see include/replay.h)
+ * is replayed with nthreads threads, bench_opts.warmup times untimed and
+ * then repcount times timed, every operation timed on its own. What each
+ * replay creates is removed after it, untimed, so every replay starts
+ * from the same tree. For every kind of operation, reports how many there
+ * were, how many failed in the trace, and how many of them did not
+ * succeed or fail as they had in the trace the first time the log was
+ * replayed (none, if the file system was loaded with the tree the trace
+ * came with), and the latency of those of the last replay. Then the
+ * latency and throughput of all of them.
+ */
+int benchmark_replay(const char *log_file, int nthreads, int repcount)
+{
+	uint32_t count[HFS_REPLAY_NOPS] = { 0 }, failed[HFS_REPLAY_NOPS] = { 0 };
+	uint32_t mismatched[HFS_REPLAY_NOPS] = { 0 };
+	uint64_t *ticks, *sorted;
+	struct hfs_replay r;
+	struct hfs_bench b;
+	int *results;
+	int ret = 0;
+
+	if (repcount <= 0)
+		repcount = 1;
+	if (hfs_replay_load(&r, log_file) < 0)
+		return -1;
+	ticks = malloc(r.hdr.nops * sizeof(uint64_t) + 1);
+	sorted = malloc(r.hdr.nops * sizeof(uint64_t) + 1);
+	results = malloc(r.hdr.nops * sizeof(int) + 1);
+	if (!ticks || !sorted || !results || hfs_bench_init(&b, "replay",
+														log_file) < 0) {
+		printf("Error: out of memory.\n");
+		free(ticks);
+		free(sorted);
+		free(results);
+		hfs_replay_free(&r);
+		return -1;
+	}
+
+	for (int pass = 0; pass < bench_opts.warmup + repcount; pass++) {
+		bool timed = (pass >= bench_opts.warmup);
+
+		if (timed)
+			hfs_bench_pass_begin(&b);
+		if (hfs_replay_run(&r, nthreads, ticks, results) < 0) {
+			ret = -1;
+			goto out;
+		}
+		if (timed) {
+			hfs_bench_pass_end(&b, r.hdr.nops);
+			for (uint32_t i = 0; i < r.hdr.nops; i++)
+				hfs_bench_sample(&b, ticks[i]);
+		}
+		hfs_replay_undo(&r);
+		if (pass > 0)
+			continue;
+		for (uint32_t i = 0; i < r.hdr.nops; i++) {
+			struct hfs_replay_op *op = &r.ops[i];
+			bool traced_failed = op->flags & HFS_REPLAY_FAILED;
+
+			count[op->op]++;
+			failed[op->op] += traced_failed;
+			mismatched[op->op] += (results[i] < 0) != traced_failed;
+		}
+	}
+
+	printf("Replayed %u operations of %u processes with %d threads\n",
+				r.hdr.nops, r.hdr.npids, nthreads > 1 ? nthreads : 1);
+	printf(KBLD "%10s %10s %10s %10s %10s %10s %10s %10s\n" KNRM,
+				"op", "count", "failed", "mismatch", "mean (ns)", "p50",
+				"p99", "max");
+	for (int k = 0; k < HFS_REPLAY_NOPS; k++) {
+		uint64_t n = 0, total = 0;
+
+		if (!count[k])
+			continue;
+		for (uint32_t i = 0; i < r.hdr.nops; i++) {
+			if (r.ops[i].op == k) {
+				sorted[n++] = ticks[i];
+				total += ticks[i];
+			}
+		}
+		qsort(sorted, n, sizeof(uint64_t), cmp_u64);
+		printf("%10s %10u %10u %10u %10.0f %10.0f %10.0f %10.0f\n",
+					hfs_replay_names[k], count[k], failed[k], mismatched[k],
+					hfs_bench_ns(total) / n, hfs_bench_ns(sorted[(n - 1) / 2]),
+					hfs_bench_ns(sorted[(n * 99 + 99) / 100 - 1]),
+					hfs_bench_ns(sorted[n - 1]));
+	}
+	hfs_bench_report(&b);
+
+out:
+	hfs_bench_free(&b);
+	free(ticks);
+	free(sorted);
+	free(results);
+	hfs_replay_free(&r);
+	return ret;
+}
+
+#ifdef _HFS_DIRHASH
+/**
+ * Run the lookups in fp repcount times against a dirhash pool of every
+ * size in sizes[] under every replacement policy, and report the share
+ * of lookups that found their directory's table cached and the time per
+ * pathname lookup. The pool is emptied before each run but not between
+ * passes, and the path cache is bypassed so that every component goes
+ * through dirhash. The mounted pool is restored afterwards.
+ */
+static int benchmark_dirhash(FILE *fp, int repcount)
+{
+	static const int sizes[] = { 4, 16, 64, 256, 1024 };
+	struct hfs_dirhash_perf_stat statbuf;
+	uint64_t begin, end;
+	int ret = 0;
+#ifdef _HFS_PCACHE
+	bool pcache_on = hfs_pcache_enabled();
+
+	hfs_pcache_enable(false);
+#endif
+
+	printf(KBLD "\n%-8s %8s %10s %12s\n" KNRM,
+				"policy", "tables", "hit rate", "ns/lookup");
+	for (int p = 0; p < HFS_DIRHASH_NPOLICIES; p++) {
+		for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			int total, counter;
+
+			hfs_dirhash_free();
+			if ((ret = hfs_dirhash_init(sizes[i], p)) < 0)
+				goto out;
+			hfs_dirhash_stat_clear();
+
+			begin = hfs_bench_ticks();
+			total = warm_passes(fp, repcount);
+			end = hfs_bench_ticks();
+
+			hfs_dirhash_perf_stat(&statbuf);
+			counter = statbuf.s_lookup_hcount + statbuf.s_lookup_mcount;
+			printf("%-8s %8d %9.2f%% %12.1f\n",
+						hfs_dirhash_policies[p].name, sizes[i],
+						counter ? statbuf.s_lookup_hcount * 100.0 / counter
+								: 0.0,
+						total ? hfs_bench_ns(end - begin) / total : 0.0);
+		}
+	}
+
+out:
+	hfs_dirhash_free();
+	if (hfs_dirhash_init(mount_opts.dirhash_size,
+						 mount_opts.dirhash_policy) < 0)
+		ret = -1;
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(pcache_on);
+#endif
+	return ret;
+}
+#endif  // _HFS_DIRHASH
+
+/**
+ * Sweep the dirhash pool size and replacement policy over the lookups
+ * in input_file, see benchmark_dirhash().
+ */
+int benchmark_dirhash_sweep(const char *input_file, int repcount)
+{
+#ifdef _HFS_DIRHASH
+	FILE *fp;
+	int ret;
+
+	if (!(fp = fopen(input_file, "r"))) {
+		perror("open");
+		return -1;
+	}
+	ret = benchmark_dirhash(fp, repcount);
+	fclose(fp);
+	return ret;
+#else
+	printf("Dirhash is not enabled.\n");
+	return 0;
+#endif
+}
+
+/**
+ * Compare the placement policies: for each one, reset the file system,
+ * populate it from tree_file and report the footprint of the lookups in
+ * input_file. The file system is left populated under the last policy,
+ * and the mounted policy is restored for anything created afterwards.
+ *
+ * WARNING: this wipes the file system.
+ */
+int benchmark_placement(const char *tree_file, const char *input_file)
+{
+	static const int policies[] = {
+		HFS_PLACE_FLAT, HFS_PLACE_GROUP, HFS_PLACE_ORLOV
+	};
+	int saved = mount_opts.placement;
+	int ret = 0;
+	FILE *fp;
+
+	if (!(fp = fopen(input_file, "r"))) {
+		perror("open");
+		return -1;
+	}
+
+	for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		mount_opts.placement = policies[i];
+		printf(KBLD "\nplacement=%s\n" KNRM, placement_name(policies[i]));
+		if (fs_reset() < 0) {
+			ret = -1;
+			break;
+		}
+		srand(0);	// same random names under every policy
+		if ((ret = benchmark_init_fs(tree_file, 1)) < 0)
+			break;
+		benchmark_footprint(fp);
+	}
+
+	mount_opts.placement = saved;
+	fclose(fp);
+	return ret;
+}
+
+static void cache_geometry(char *buf, size_t len, int level)
+{
+	uint32_t size = cachesim_opts.size[level];
+
+	if (size % (1024 * 1024) == 0)
+		snprintf(buf, len, "%uM %u-way", size / (1024 * 1024),
+					cachesim_opts.ways[level]);
+	else
+		snprintf(buf, len, "%uK %u-way", size / 1024,
+					cachesim_opts.ways[level]);
+}
+
+/**
+ * Cache simulator benchmark. Every pathname in input_file is walked,
+ * bypassing the path cache, passes times, with every read the walks make
+ * fed to the cache simulator (see include/cachesim.h). The misses of each
+ * level of cache and of the TLB are then reported per lookup, over the
+ * last pass: earlier passes only warm the caches, unless the simulator
+ * empties them before every lookup (flush=on). The dirhash pool is
+ * emptied first, so runs on the same image give the same counts.
+ */
+int benchmark_cachesim(const char *input_file, int passes)
+{
+	struct hfs_cache *caches[HFS_CACHESIM_NLEVELS + 1];
+	uint64_t accesses[HFS_CACHESIM_NLEVELS + 1] = { 0 };
+	uint64_t misses[HFS_CACHESIM_NLEVELS + 1] = { 0 };
+	uint64_t max[HFS_CACHESIM_NLEVELS + 1] = { 0 };
+	int ncaches = 0, ret;
+	struct path_list list;
+	FILE *fp;
+#ifdef _HFS_PCACHE
+	bool pcache_on = hfs_pcache_enabled();
+#endif
+
+	if (passes <= 0)
+		passes = 1;
+	if (!(fp = fopen(input_file, "r"))) {
+		perror("open");
+		return -1;
+	}
+	ret = path_list_read(fp, &list);
+	fclose(fp);
+	if (ret < 0)
+		return -1;
+	if (hfs_cachesim_init() < 0) {
+		printf("Error: bad cache geometry.\n");
+		path_list_free(&list);
+		return -1;
+	}
+	for (int i = 0; i < HFS_CACHESIM_NLEVELS; i++) {
+		if (cachesim.levels[i].tags)
+			caches[ncaches++] = &cachesim.levels[i];
+	}
+	if (cachesim.tlb.tags)
+		caches[ncaches++] = &cachesim.tlb;
+
+	hfs_dirhash_clear();
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(false);
+#endif
+	fs_trace_lookup(hfs_cachesim_read);
+	for (int p = 0; p < passes; p++) {
+		bool counted = (p == passes - 1);
+
+		for (int i = 0; i < list.n; i++) {
+			uint64_t before[HFS_CACHESIM_NLEVELS + 1];
+
+			if (cachesim_opts.flush)
+				hfs_cachesim_flush();
+			for (int c = 0; c < ncaches; c++) {
+				before[c] = caches[c]->misses;
+				if (counted)
+					accesses[c] -= caches[c]->accesses;
+			}
+			lookup(list.paths[i]);
+			if (!counted)
+				continue;
+			for (int c = 0; c < ncaches; c++) {
+				uint64_t m = caches[c]->misses - before[c];
+				accesses[c] += caches[c]->accesses;
+				misses[c] += m;
+				if (m > max[c])
+					max[c] = m;
+			}
+		}
+	}
+	fs_trace_lookup(NULL);
+#ifdef _HFS_PCACHE
+	hfs_pcache_enable(pcache_on);
+#endif
+
+	printf("Cache simulator: %d lookups (pass %d of %d), %lu pages read, "
+			"caches %s\n", list.n, passes, passes, cachesim.npages,
+			cachesim_opts.flush ? "cold" : "warm");
+	printf(KBLD "%5s %16s %12s %10s %12s %6s %8s\n" KNRM,
+				"cache", "geometry", "accesses", "misses", "misses/lookup",
+				"max", "miss %");
+	for (int c = 0; c < ncaches; c++) {
+		char geometry[32];
+
+		if (caches[c] == &cachesim.tlb)
+			snprintf(geometry, sizeof(geometry), "%u %u-way",
+						cachesim_opts.tlb_entries, cachesim_opts.tlb_ways);
+		else
+			cache_geometry(geometry, sizeof(geometry),
+							caches[c] - cachesim.levels);
+		printf("%5s %16s %12lu %10lu %12.2f %6lu %7.2f%%\n",
+					caches[c]->name, geometry, accesses[c], misses[c],
+					list.n ? misses[c] / (double)list.n : 0.0, max[c],
+					accesses[c] ? misses[c] * 100.0 / accesses[c] : 0.0);
+	}
+
+	hfs_cachesim_free();
+	path_list_free(&list);
 	return 0;
 }
 
@@ -170,7 +2061,7 @@ void benchmark(const char *input_file)
 {
 	printf("\n:: Starting benchmark...\n");
 
-	if (benchmark_init_fs(input_file) < 0) {
+	if (benchmark_init_fs(input_file, 1) < 0) {
 		printf("Error: benchmark failed.\n");
 		return;
 	}
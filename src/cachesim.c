@@ -0,0 +1,350 @@
+/**
+ * fsemu/src/cachesim.c
+ *
+ * Software cache and TLB simulator. See include/cachesim.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "cachesim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Roughly a current x86-64 core. */
+struct hfs_cachesim_opts cachesim_opts = {
+	.size			= { 32 * 1024, 1024 * 1024, 8 * 1024 * 1024 },
+	.ways			= { 8, 16, 16 },
+	.line			= 64,
+	.tlb_entries	= 64,
+	.tlb_ways		= 4,
+	.page			= 4096,
+	.flush			= false,
+};
+
+struct hfs_cachesim cachesim;
+
+static const char *level_names[HFS_CACHESIM_NLEVELS] = { "L1d", "L2", "LLC" };
+static const char *level_opts[HFS_CACHESIM_NLEVELS] = { "l1", "l2", "llc" };
+
+static int log2_exact(uint32_t n)
+{
+	if (!n || (n & (n - 1)))
+		return -1;
+	return __builtin_ctz(n);
+}
+
+static int cache_init(struct hfs_cache *c, const char *name,
+					  uint32_t nentries, uint32_t ways)
+{
+	c->name = name;
+	c->tags = NULL;
+	c->accesses = c->misses = 0;
+	if (!nentries)
+		return 0;
+	if (!ways || nentries % ways)
+		return -EINVAL;
+	c->ways = ways;
+	c->nsets = nentries / ways;
+	c->tags = calloc((size_t)c->nsets * ways, sizeof(uint64_t));
+	return c->tags ? 0 : -EALLOC;
+}
+
+/**
+ * Look up line (or frame) n in c, and make it the set's most recently
+ * used. Returns true on a hit; on a miss, n is filled in, evicting the
+ * least recently used.
+ */
+static bool cache_access(struct hfs_cache *c, uint64_t n)
+{
+	uint64_t *set = c->tags + (n % c->nsets) * c->ways;
+	bool hit = false;
+	uint32_t i;
+
+	c->accesses++;
+	for (i = 0; i < c->ways - 1; i++) {
+		if (set[i] == n + 1)
+			break;
+	}
+	if (set[i] == n + 1)
+		hit = true;
+	else
+		c->misses++;
+	memmove(set + 1, set, i * sizeof(uint64_t));
+	set[0] = n + 1;
+	return hit;
+}
+
+static void cache_flush(struct hfs_cache *c)
+{
+	if (c->tags)
+		memset(c->tags, 0, (size_t)c->nsets * c->ways * sizeof(uint64_t));
+}
+
+static void cache_free(struct hfs_cache *c)
+{
+	free(c->tags);
+	c->tags = NULL;
+}
+
+static int pages_init(uint64_t size)
+{
+	cachesim.pages = calloc(size, sizeof(uint64_t));
+	cachesim.frames = calloc(size, sizeof(uint64_t));
+	if (!cachesim.pages || !cachesim.frames) {
+		free(cachesim.pages);
+		free(cachesim.frames);
+		cachesim.pages = cachesim.frames = NULL;
+		return -EALLOC;
+	}
+	cachesim.size = size;
+	return 0;
+}
+
+static uint64_t *page_slot(uint64_t page)
+{
+	uint64_t i = (page * 0x9e3779b97f4a7c15ULL) & (cachesim.size - 1);
+
+	while (cachesim.pages[i] && cachesim.pages[i] != page + 1)
+		i = (i + 1) & (cachesim.size - 1);
+	return &cachesim.pages[i];
+}
+
+static void pages_grow(void)
+{
+	uint64_t *pages = cachesim.pages, *frames = cachesim.frames;
+	uint64_t size = cachesim.size;
+
+	if (pages_init(size * 2) < 0) {
+		cachesim.pages = pages;
+		cachesim.frames = frames;
+		return;
+	}
+	for (uint64_t i = 0; i < size; i++) {
+		if (pages[i]) {
+			uint64_t *slot = page_slot(pages[i] - 1);
+			*slot = pages[i];
+			cachesim.frames[slot - cachesim.pages] = frames[i];
+		}
+	}
+	free(pages);
+	free(frames);
+}
+
+/**
+ * The frame of a (virtual) page: the number of pages read before it was
+ * first read.
+ */
+static uint64_t page_frame(uint64_t page)
+{
+	uint64_t *slot = page_slot(page);
+
+	if (!*slot) {
+		*slot = page + 1;
+		cachesim.frames[slot - cachesim.pages] = cachesim.npages++;
+		if (cachesim.npages * 2 > cachesim.size) {
+			uint64_t frame = cachesim.npages - 1;
+			pages_grow();
+			return frame;
+		}
+	}
+	return cachesim.frames[slot - cachesim.pages];
+}
+
+/**
+ * Set up empty caches, TLB and page frames as cachesim_opts describe,
+ * with every count at zero.
+ */
+int hfs_cachesim_init(void)
+{
+	int ret;
+
+	hfs_cachesim_free();
+	cachesim.line_shift = log2_exact(cachesim_opts.line);
+	cachesim.page_shift = log2_exact(cachesim_opts.page);
+	if (cachesim.line_shift < 0 || cachesim.page_shift < cachesim.line_shift)
+		return -EINVAL;
+	for (int i = 0; i < HFS_CACHESIM_NLEVELS; i++) {
+		ret = cache_init(&cachesim.levels[i], level_names[i],
+						 cachesim_opts.size[i] / cachesim_opts.line,
+						 cachesim_opts.ways[i]);
+		if (ret < 0)
+			goto fail;
+	}
+	ret = cache_init(&cachesim.tlb, "dTLB", cachesim_opts.tlb_entries,
+					 cachesim_opts.tlb_ways);
+	if (ret < 0 || (ret = pages_init(1 << 10)) < 0)
+		goto fail;
+	cachesim.npages = 0;
+	return 0;
+
+fail:
+	hfs_cachesim_free();
+	return ret;
+}
+
+void hfs_cachesim_free(void)
+{
+	for (int i = 0; i < HFS_CACHESIM_NLEVELS; i++)
+		cache_free(&cachesim.levels[i]);
+	cache_free(&cachesim.tlb);
+	free(cachesim.pages);
+	free(cachesim.frames);
+	cachesim.pages = cachesim.frames = NULL;
+}
+
+/**
+ * Empty the caches and the TLB. Counts and page frames are kept.
+ */
+void hfs_cachesim_flush(void)
+{
+	for (int i = 0; i < HFS_CACHESIM_NLEVELS; i++)
+		cache_flush(&cachesim.levels[i]);
+	cache_flush(&cachesim.tlb);
+}
+
+/**
+ * Simulate reading len bytes at addr. This is the lookup tracer.
+ */
+void hfs_cachesim_read(const void *addr, size_t len)
+{
+	uint64_t a = (uintptr_t)addr, end = a + len - 1;
+	int ps = cachesim.page_shift, ls = cachesim.line_shift;
+	uint64_t line_mask = (1ULL << (ps - ls)) - 1;
+
+	if (!len || !cachesim.pages)
+		return;
+	for (uint64_t p = a >> ps; p <= end >> ps; p++) {
+		uint64_t frame = page_frame(p);
+		uint64_t first = (p == a >> ps) ? a >> ls : p << (ps - ls);
+		uint64_t last = (p == end >> ps) ? end >> ls
+										 : ((p + 1) << (ps - ls)) - 1;
+
+		if (cachesim.tlb.tags)
+			cache_access(&cachesim.tlb, frame);
+		for (uint64_t l = first; l <= last; l++) {
+			uint64_t pline = (frame << (ps - ls)) | (l & line_mask);
+			for (int i = 0; i < HFS_CACHESIM_NLEVELS; i++) {
+				if (cachesim.levels[i].tags
+						&& cache_access(&cachesim.levels[i], pline))
+					break;
+			}
+		}
+	}
+}
+
+/**
+ * Parse a size with an optional k or m suffix, up to end or ':'.
+ */
+static int parse_size(const char *s, const char **end, uint32_t *size)
+{
+	char *e;
+	unsigned long n = strtoul(s, &e, 10);
+
+	if (e == s)
+		return -EINVAL;
+	if (*e == 'k' || *e == 'K')
+		n *= 1024, e++;
+	else if (*e == 'm' || *e == 'M')
+		n *= 1024 * 1024, e++;
+	if (n > UINT32_MAX)
+		return -EINVAL;
+	*size = n;
+	*end = e;
+	return 0;
+}
+
+/**
+ * Parse SIZE:WAYS (or just 0, for none).
+ */
+static int parse_geometry(const char *val, uint32_t *size, uint32_t *ways)
+{
+	const char *e;
+	uint32_t s, w = 0;
+
+	if (parse_size(val, &e, &s) < 0)
+		return -EINVAL;
+	if (*e == ':') {
+		if (parse_size(e + 1, &e, &w) < 0 || !w)
+			return -EINVAL;
+	} else if (s) {
+		return -EINVAL;
+	}
+	if (*e)
+		return -EINVAL;
+	*size = s;
+	*ways = w ? w : 1;
+	return 0;
+}
+
+/**
+ * Set one option, given as name=value:
+ *   l1=SIZE:WAYS, l2=SIZE:WAYS, llc=SIZE:WAYS	A level of cache, 0 for none.
+ *   line=BYTES				Cache line size.
+ *   tlb=ENTRIES:WAYS		Data TLB, 0 for none.
+ *   page=BYTES				Page size.
+ *   flush=on|off			Empty caches and TLB before every lookup.
+ * The geometry is checked by hfs_cachesim_init().
+ */
+int hfs_cachesim_set_opt(const char *opt)
+{
+	const char *val = strchr(opt, '=');
+	const char *e;
+	size_t len;
+	int i;
+
+	if (!val)
+		return -EINVAL;
+	len = val++ - opt;
+
+	for (i = 0; i < HFS_CACHESIM_NLEVELS; i++) {
+		if (len == strlen(level_opts[i])
+				&& strncmp(opt, level_opts[i], len) == 0)
+			return parse_geometry(val, &cachesim_opts.size[i],
+								  &cachesim_opts.ways[i]);
+	}
+	if (len == 3 && strncmp(opt, "tlb", len) == 0) {
+		return parse_geometry(val, &cachesim_opts.tlb_entries,
+							  &cachesim_opts.tlb_ways);
+	} else if (len == 4 && strncmp(opt, "line", len) == 0) {
+		if (parse_size(val, &e, &cachesim_opts.line) < 0 || *e)
+			return -EINVAL;
+	} else if (len == 4 && strncmp(opt, "page", len) == 0) {
+		if (parse_size(val, &e, &cachesim_opts.page) < 0 || *e)
+			return -EINVAL;
+	} else if (len == 5 && strncmp(opt, "flush", len) == 0) {
+		if (strcmp(val, "on") == 0)
+			cachesim_opts.flush = true;
+		else if (strcmp(val, "off") == 0)
+			cachesim_opts.flush = false;
+		else
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void show_geometry(const char *name, uint32_t size, uint32_t ways)
+{
+	if (!size)
+		printf("%s=0 ", name);
+	else if (size % (1024 * 1024) == 0)
+		printf("%s=%um:%u ", name, size / (1024 * 1024), ways);
+	else if (size % 1024 == 0)
+		printf("%s=%uk:%u ", name, size / 1024, ways);
+	else
+		printf("%s=%u:%u ", name, size, ways);
+}
+
+void hfs_cachesim_show_opts(void)
+{
+	for (int i = 0; i < HFS_CACHESIM_NLEVELS; i++)
+		show_geometry(level_opts[i], cachesim_opts.size[i],
+					  cachesim_opts.ways[i]);
+	printf("line=%u ", cachesim_opts.line);
+	show_geometry("tlb", cachesim_opts.tlb_entries, cachesim_opts.tlb_ways);
+	printf("page=%u flush=%s\n", cachesim_opts.page,
+			cachesim_opts.flush ? "on" : "off");
+}
@@ -0,0 +1,86 @@
+/**
+ * fsemu/src/clock.c
+ *
+ * The ticker behind hfs_now(). See include/clock.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "clock.h"
+
+#include <pthread.h>
+
+time_t hfs_clock_now;
+bool hfs_clock_coarse;
+
+static pthread_t ticker;
+static pthread_mutex_t ticker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ticker_cond;
+static bool ticker_running;
+static bool ticker_stop;
+static int ticker_ms;
+
+static void *ticker_main(void *arg)
+{
+	struct timespec next;
+
+	pthread_mutex_lock(&ticker_lock);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!ticker_stop) {
+		next.tv_nsec += (long)ticker_ms * 1000000;
+		next.tv_sec += next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&ticker_cond, &ticker_lock, &next);
+		__atomic_store_n(&hfs_clock_now, time(NULL), __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ticker_lock);
+	return NULL;
+}
+
+/**
+ * Have hfs_now() hand out the time as read by a ticker every tick_ms
+ * milliseconds, or read the time on every call if tick_ms is 0. Stops
+ * the ticker that was already running, if any.
+ */
+int hfs_clock_start(int tick_ms)
+{
+	pthread_condattr_t attr;
+
+	hfs_clock_stop();
+	if (tick_ms <= 0)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ticker_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ticker_ms = tick_ms;
+	ticker_stop = false;
+	hfs_clock_now = time(NULL);
+	if (pthread_create(&ticker, NULL, ticker_main, NULL) != 0) {
+		pthread_cond_destroy(&ticker_cond);
+		pr_warn("Failed to start the clock ticker.\n");
+		return -EALLOC;
+	}
+	ticker_running = true;
+	__atomic_store_n(&hfs_clock_coarse, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Stop the ticker; hfs_now() reads the time on every call from now on.
+ */
+void hfs_clock_stop(void)
+{
+	if (!ticker_running)
+		return;
+	__atomic_store_n(&hfs_clock_coarse, false, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&ticker_lock);
+	ticker_stop = true;
+	pthread_cond_signal(&ticker_cond);
+	pthread_mutex_unlock(&ticker_lock);
+	pthread_join(ticker, NULL);
+	pthread_cond_destroy(&ticker_cond);
+	ticker_running = false;
+}
@@ -1,355 +1,638 @@
 /**
  * fsemu/src/dirhash.c
- * 
+ *
  * An in-memory LRU directory entry cache for O(1) lookup.
+ * See include/dirhash.h for the table layout.
  */
 
 #include "fsemu.h"
 #include "dirhash.h"
 #include "fserror.h"
 #include "util.h"
+#include "sysstat.h"
 
 #include <stdlib.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 struct hfs_dirhash *dirhash;
 
 #ifdef HFS_DEBUG
 static int put_conflict_cnt = 0, put_no_conf_cnt = 0;
 static int lookup_miss_cnt = 0, lookup_hit_cnt = 0;
+static int grow_cnt = 0;
 #endif
 
-static inline struct hfs_dirhash_table *hfs_dirhash_get_table(int id)
-{
-    return &dirhash->tables[id];
-}
+/* Longest probe sequence tracked by the histogram in hfs_dirhash_dump(). */
+#define PROBE_HIST_MAX  8
 
 static inline int hfs_dirhash_get_id(struct hfs_dirhash_table *dt)
 {
     return (dt - dirhash->tables);
 }
 
+static inline struct hfs_dirhash_table **inum_bucket(uint32_t inum)
+{
+    return &dirhash->hash[inum & (HFS_DIRHASH_NHASH - 1)];
+}
+
 /**
- * Move an LRU entry to the tail end.
+ * Size class of a table of nslots slots.
  */
-static inline void lru_demote(struct hfs_dirhash_table *dt)
+static inline int size_class(uint32_t nslots)
 {
-    struct hfs_dirhash_table *prev = dt->prev;
-    struct hfs_dirhash_table *next = dt->next;
-
-    if (!next)
-        return;
-
-    next->prev = prev;
-    if (!prev) {
-        dirhash->head = next;
-    } else {
-        prev->next = next;
-    }
+    return __builtin_ctz(nslots) - __builtin_ctz(HFS_DIRHASH_MINSLOTS);
+}
 
-    dt->next = NULL;
-    dt->prev = dirhash->tail;
-    dirhash->tail->next = dt;
-    dirhash->tail = dt;
+static inline size_t chunk_size(uint32_t nslots)
+{
+    return nslots * (1 + sizeof(struct hfs_dirhash_entry));
 }
 
 /**
- * "Touch" an LRU entry and promoting it to be the head.
+ * Take the memory for a table of nslots slots from the slab allocator:
+ * the control bytes come first, then the slots. If the free list of the
+ * size class is empty, a new slab is carved up for it.
  */
-static inline void lru_touch(struct hfs_dirhash_table *dt)
+static void *chunk_alloc(uint32_t nslots)
 {
-    struct hfs_dirhash_table *prev = dt->prev;
-    struct hfs_dirhash_table *next = dt->next;
+    struct hfs_dirhash_chunk **free_list = &dirhash->free[size_class(nslots)];
+    struct hfs_dirhash_chunk *chunk;
+    size_t size = chunk_size(nslots);
+
+    if (!*free_list) {
+        struct hfs_dirhash_slab *slab;
+        size_t slab_size = HFS_DIRHASH_SLABSIZE;
+        if (slab_size < size)
+            slab_size = size;
+        slab = malloc(sizeof(*slab) + slab_size);
+        if (!slab)
+            return NULL;
+        slab->size = slab_size;
+        slab->next = dirhash->slabs;
+        dirhash->slabs = slab;
+        dirhash->slab_bytes += sizeof(*slab) + slab_size;
+
+        for (size_t off = 0; off + size <= slab_size; off += size) {
+            chunk = (struct hfs_dirhash_chunk *)(slab->mem + off);
+            chunk->next = *free_list;
+            *free_list = chunk;
+        }
+    }
 
-    // hdr is already most recently used.
-    if (!prev)
-        return;
+    chunk = *free_list;
+    *free_list = chunk->next;
+    dirhash->used_bytes += size;
+    return chunk;
+}
 
-    prev->next = next;
-    if (!next) {
-        dirhash->tail = prev;
-    } else {
-        next->prev = prev;
-    }
+static void chunk_free(void *mem, uint32_t nslots)
+{
+    struct hfs_dirhash_chunk **free_list = &dirhash->free[size_class(nslots)];
+    struct hfs_dirhash_chunk *chunk = mem;
 
-    // Move to top of list
-    dt->prev = NULL;
-    dt->next = dirhash->head;
-    dt->next->prev = dt;
-    dirhash->head = dt;
-} 
+    chunk->next = *free_list;
+    *free_list = chunk;
+    dirhash->used_bytes -= chunk_size(nslots);
+}
 
 /**
- * Return the least recently used table, but since it is 
- * used right now, we promote it to the head and consequently
- * return the new head of the LRU.
+ * Give the table fresh, empty storage for nslots slots.
  */
-static inline struct hfs_dirhash_table *lru_get_last(void)
+static int table_init_slots(struct hfs_dirhash_table *dt, uint32_t nslots)
 {
-    lru_touch(dirhash->tail);
-    return dirhash->head;
+    void *mem = chunk_alloc(nslots);
+    if (!mem)
+        return -1;
+    dt->ctrl = mem;
+    dt->slots = (struct hfs_dirhash_entry *)(dt->ctrl + nslots);
+    dt->nslots = nslots;
+    dt->nentries = 0;
+    dt->ndeleted = 0;
+    memset(dt->ctrl, HFS_DIRHASH_EMPTY, nslots);
+    return 0;
 }
 
 /**
- * Return a verified dirhash table attached to the specified directory inode,
+ * Drop whatever the table holds and detach it from its directory.
+ */
+static void dt_refresh(struct hfs_dirhash_table *dt)
+{
+    struct hfs_dirhash_table **p;
+
+    if (!dt->inum)
+        return;
+    for (p = inum_bucket(dt->inum); *p; p = &(*p)->hnext) {
+        if (*p == dt) {
+            *p = dt->hnext;
+            break;
+        }
+    }
+    chunk_free(dt->ctrl, dt->nslots);
+    dt->ctrl = NULL;
+    dt->slots = NULL;
+    dt->nslots = dt->nentries = dt->ndeleted = 0;
+    dt->inum = 0;
+    dt->hnext = NULL;
+}
+
+/**
+ * Return the dirhash table attached to the specified directory inode,
  * NULL if there isn't one.
- * Criteria: 
- *    0) There is a dirhash table ID number. 
- *    1) The sequence numbers match
- *    2) The table and inode are marked for each other.
  */
 static struct hfs_dirhash_table *inode_get_valid_dirhash(struct hfs_inode *dir)
 {
-    int id;
-    if ((id = dir->data.dirhash_rec.id)) {
-        struct hfs_dirhash_table *dt = hfs_dirhash_get_table(id);
-        if ((dt->seqno == dir->data.dirhash_rec.seqno)
-                    && (dt->inum == inum(dir))) {
+    uint32_t dir_inum = inum(dir);
+    struct hfs_dirhash_table *dt;
+
+    trace_read(inum_bucket(dir_inum), sizeof(dt));
+    for (dt = *inum_bucket(dir_inum); dt; dt = dt->hnext) {
+        trace_read(dt, sizeof(*dt));
+        if (dt->inum == dir_inum)
             return dt;
-        }
     }
-    return NULL; 
+    return NULL;
 }
 
 /**
  * This function is used to hash a file name to determine its location
- * in a dirhash table.
- * 
+ * in a dirhash table. The low 7 bits are the tag stored in the control
+ * byte, the rest pick the group where probing starts.
+ *
  * Courtesy of the Gods on StackOverflow:
  * https://stackoverflow.com/questions/11413860/best-string-hashing-function
  * -for-short-filenames
  */
-static inline int fnv_hash(const char *name, int namelen)
+static inline uint32_t fnv_hash(const char *name, int namelen)
 {
     const unsigned char *p = (const unsigned char *)name;
-    unsigned int h = 2166136261;
+    uint32_t h = 2166136261u;
 
     for (int i = 0; i < namelen; i++)
-        h = abs((h*16777619) ^ p[i]);
+        h = (h ^ p[i]) * 16777619u;
 
-    return (h % HFS_DIRHASH_TABLESIZE);
+    return h;
+}
+
+static inline uint8_t hash_tag(uint32_t h)
+{
+    return h & 0x7f;
 }
 
 /**
- * A separate hash function to verify a file name. The hope is that with the
- * combination of these two functions it would be virtually impossible to 
- * misidentify a file even if we don't store/check the full name.
+ * First slot of the group where probing for hash h starts.
  */
-static uint32_t name_hash(const char *name, int namelen)
+static inline uint32_t probe_start(struct hfs_dirhash_table *dt, uint32_t h)
 {
-    uint32_t hash = 5381;
-    const unsigned char *str = (const unsigned char *)name;
+    return (h >> 7) & (dt->nslots - 1) & ~(HFS_DIRHASH_GROUP - 1);
+}
 
-    for (int i = 0; i < namelen; i++)
-        hash = ((hash << 5) + hash) + str[i]; /* hash * 33 + c */
+/**
+ * First slot of the next group to probe: groups are visited in
+ * triangular order (+1, +2, +3... groups), which reaches every group of
+ * a power-of-two table.
+ */
+static inline uint32_t probe_next(struct hfs_dirhash_table *dt,
+                                  uint32_t g, int n)
+{
+    return (g + n * HFS_DIRHASH_GROUP) & (dt->nslots - 1);
+}
+
+/**
+ * Group matching: each function below looks at the control bytes of the
+ * group starting at ctrl and returns a bitmask with bit i set if byte i
+ * qualifies. With AVX2 a group is 32 bytes and takes one compare, with
+ * SSE2 a group is 16 bytes and takes one compare, and otherwise the 16
+ * bytes are checked as two 64-bit words.
+ *
+ * group_match:  bytes equal to tag.
+ * group_empty:  empty bytes, which end a probe sequence.
+ * group_free:   empty or deleted bytes (the ones with the top bit set).
+ */
+#if defined(__AVX2__)
+
+#define GROUP_PROBE_NAME    "AVX2"
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)ctrl);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(tag)));
+}
+
+static inline uint32_t group_empty(const uint8_t *ctrl)
+{
+    return group_match(ctrl, HFS_DIRHASH_EMPTY);
+}
 
-    return hash;
+static inline uint32_t group_free(const uint8_t *ctrl)
+{
+    return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)ctrl));
+}
+
+#elif defined(__SSE2__)
+
+#define GROUP_PROBE_NAME    "SSE2"
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(tag)));
 }
 
+static inline uint32_t group_empty(const uint8_t *ctrl)
+{
+    return group_match(ctrl, HFS_DIRHASH_EMPTY);
+}
+
+static inline uint32_t group_free(const uint8_t *ctrl)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+
+#else
+
+#define GROUP_PROBE_NAME    "scalar"
+
+#define LSB_BYTES   0x0101010101010101ull
+#define MSB_BYTES   0x8080808080808080ull
+
 /**
- * Add an entry to the given dirhash table.
- * 
- * If there is a collision, use linear probing.
- * 
- * This function assumes that the table is at a reasonable capacity.
- * When the directory grows beyond a certain size, we should swtich to a
- * different indexing mechanism.
- * 
- * TODO: Need to think about the case where two different file names
- * are hashed to the same index and also have the same name_hash value.
- * Unlikely, very unlikely, but should be considered.
+ * Gather the top bit of each byte of w into the low 8 bits.
  */
-static int put_dentry(struct hfs_dirhash_table *dt, struct hfs_dentry *dent)
+static inline uint32_t msb_gather(uint64_t w)
+{
+    return (((w & MSB_BYTES) >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+/**
+ * Top bit set in each byte of w that is zero (exact, no false positives).
+ */
+static inline uint64_t zero_bytes(uint64_t w)
+{
+    return ~(((w & ~MSB_BYTES) + ~MSB_BYTES) | w | ~MSB_BYTES);
+}
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
 {
+    uint64_t lo, hi, pattern = LSB_BYTES * tag;
+    memcpy(&lo, ctrl, 8);
+    memcpy(&hi, ctrl + 8, 8);
+    return msb_gather(zero_bytes(lo ^ pattern))
+           | (msb_gather(zero_bytes(hi ^ pattern)) << 8);
+}
+
+static inline uint32_t group_empty(const uint8_t *ctrl)
+{
+    return group_match(ctrl, HFS_DIRHASH_EMPTY);
+}
+
+static inline uint32_t group_free(const uint8_t *ctrl)
+{
+    uint64_t lo, hi;
+    memcpy(&lo, ctrl, 8);
+    memcpy(&hi, ctrl + 8, 8);
+    return msb_gather(lo) | (msb_gather(hi) << 8);
+}
+
+#endif
+
+/**
+ * The name_key of a slot: the length and the first three bytes of name.
+ */
+static inline uint32_t name_key(const char *name, int namelen)
+{
+    uint32_t key = namelen & 0xff;
+
+    for (int i = 0; i < 3 && i < namelen; i++)
+        key |= (uint32_t)(unsigned char)name[i] << (8 * (i + 1));
+    return key;
+}
+
 #ifdef HFS_DEBUG
-    int conflict = 0;
+/* Compare full names; only turned off to measure what it costs. */
+static bool verify_names = true;
+
+void hfs_dirhash_verify_names(bool verify)
+{
+    verify_names = verify;
+}
+#else
+#define verify_names    true
 #endif
 
-    int h = fnv_hash(dent->name, dent->namelen);
-    uint32_t h2 = name_hash(dent->name, dent->namelen);
-    struct hfs_dirhash_entry *ent = &dt->data[h];
+/**
+ * Does slot hold the name with the given hashes and key?
+ */
+static inline bool slot_matches(struct hfs_dirhash_entry *slot, uint32_t h,
+                                uint32_t key, const char *name, int namelen)
+{
+    trace_read(slot, sizeof(*slot));
+    if (!verify_names)
+        return slot->name_hash == h;
+    if (slot->name_hash != h || slot->name_key != key)
+        return false;
+    trace_read(slot->dent->name, namelen);
+    return memcmp(slot->dent->name, name, namelen) == 0;
+}
 
-    if (dt->capacity >= HFS_DIRHASH_TABLESIZE * 0.85) {
-        lru_demote(dt);
-        return -1;
+/**
+ * Find the slot holding name (of namelen bytes, including the NUL),
+ * whose hash is h, or -1.
+ */
+static int find_slot(struct hfs_dirhash_table *dt, uint32_t h,
+                     const char *name, int namelen)
+{
+    uint8_t tag = hash_tag(h);
+    uint32_t key = name_key(name, namelen);
+    uint32_t g = probe_start(dt, h);
+    uint32_t ngroups = dt->nslots / HFS_DIRHASH_GROUP;
+
+    for (uint32_t n = 1; n <= ngroups; n++) {
+        const uint8_t *ctrl = dt->ctrl + g;
+        uint32_t match = group_match(ctrl, tag);
+        trace_read(ctrl, HFS_DIRHASH_GROUP);
+        while (match) {
+            int i = __builtin_ctz(match);
+            if (slot_matches(&dt->slots[g + i], h, key, name, namelen))
+                return g + i;
+            match &= match - 1;
+        }
+        if (group_empty(ctrl))
+            break;
+        g = probe_next(dt, g, n);
     }
+    return -1;
+}
 
-    // If at index h there is already an entry belonging to this directory,
-    // we use linear probing to find an available spot
-    while (ent->seqno == dt->seqno) {
-        if (ent->name_hash == h2)
-            break;
-        // wrap around if h reaches the end of the table 
-        h = (h < HFS_DIRHASH_TABLESIZE - 1) ? (h + 1) : 0;
-        ent = &dt->data[h];
+/**
+ * Fill a free slot for dent, whose name hashes to h and must not be in
+ * the table.
+ * Returns the number of groups probed.
+ */
+static int insert_slot(struct hfs_dirhash_table *dt, uint32_t h,
+                       struct hfs_dentry *dent)
+{
+    uint32_t g = probe_start(dt, h);
+    uint32_t ngroups = dt->nslots / HFS_DIRHASH_GROUP;
+
+    for (uint32_t n = 1; n <= ngroups; n++) {
+        uint32_t avail = group_free(dt->ctrl + g);
+        if (avail) {
+            int i = g + __builtin_ctz(avail);
+            if (dt->ctrl[i] == HFS_DIRHASH_DELETED)
+                dt->ndeleted--;
+            dt->ctrl[i] = hash_tag(h);
+            dt->slots[i].name_hash = h;
+            dt->slots[i].name_key = name_key(dent->name, dent->namelen);
+            dt->slots[i].dent = dent;
+            dt->nentries++;
+            return n;
+        }
+        g = probe_next(dt, g, n);
+    }
+    return -1;  // cannot happen, tables are never full
+}
+
+/**
+ * Smallest table that holds n entries at most 7/8 full.
+ */
+static uint32_t slots_for(uint32_t n)
+{
+    uint32_t nslots = HFS_DIRHASH_MINSLOTS;
+    while (nslots * 7 < n * 8 && nslots < HFS_DIRHASH_MAXSLOTS)
+        nslots <<= 1;
+    return nslots;
+}
+
+/**
+ * Move the live entries of a table into new storage of nslots slots.
+ * Deleted entries are dropped along the way.
+ */
+static int rehash(struct hfs_dirhash_table *dt, uint32_t nslots)
+{
+    struct hfs_dirhash_table old = *dt;
+
+    if (table_init_slots(dt, nslots) < 0) {
+        *dt = old;
+        return -1;
+    }
+    for (uint32_t i = 0; i < old.nslots; i++) {
+        uint8_t c = old.ctrl[i];
+        if (c == HFS_DIRHASH_EMPTY || c == HFS_DIRHASH_DELETED)
+            continue;
+        struct hfs_dentry *dent = old.slots[i].dent;
+        insert_slot(dt, old.slots[i].name_hash, dent);
+    }
+    chunk_free(old.ctrl, old.nslots);
 #ifdef HFS_DEBUG
-        conflict++;
+    grow_cnt++;
 #endif
+    return 0;
+}
+
+/**
+ * Add an entry to the given dirhash table, replacing an entry with the
+ * same name. If the table would become more than 7/8 full (counting
+ * deleted slots), it is rehashed first, into a bigger table if needed.
+ */
+static int put_dentry(struct hfs_dirhash_table *dt, struct hfs_dentry *dent)
+{
+    uint32_t h = fnv_hash(dent->name, dent->namelen);
+    int slot, probes;
+
+    if ((slot = find_slot(dt, h, dent->name, dent->namelen)) >= 0) {
+        dt->slots[slot].dent = dent;
+        return 0;
+    }
+
+    if ((dt->nentries + dt->ndeleted + 1) * 8 > dt->nslots * 7) {
+        uint32_t nslots = slots_for(dt->nentries + 1);
+        if ((dt->nentries + 1) * 8 > nslots * 7 || rehash(dt, nslots) < 0)
+            return -1;
     }
 
+    probes = insert_slot(dt, h, dent);
 #ifdef HFS_DEBUG
-    if (conflict) {
-        // pr_warn("Conflict %d times!\n", conflict);
+    if (probes > 1)
         put_conflict_cnt++;
-    } else {
-        // pr_debug("Conflict free!\n");
+    else
         put_no_conf_cnt++;
-    }
 #endif
-
-    // Fill in the entry
-    ent->seqno = dt->seqno;
-    ent->name_hash = h2;
-    ent->dent = dent;
-    ent->next_dirhash = NULL;
-
-    dt->capacity++;
-    lru_touch(dt);
-
     return 0;
 }
 
 /**
- * Place all the entries in a directory into the specified dirhash table.
+ * Place all the entries in a directory into the specified dirhash table,
+ * which is sized for them up front.
  */
-static void put_directory(struct hfs_dirhash_table *dt, struct hfs_inode *dir)
+static int put_directory(struct hfs_dirhash_table *dt, struct hfs_inode *dir)
 {
     char *block = BLKADDR(dir->data.dirhash_rec.block);
     struct hfs_dentry *dent;
+    uint32_t n = 0;
+
+    for_each_block_dent(dent, block) {
+        if (dent->reclen == 0)
+            break;
+        if (dent->inum)
+            n++;
+    }
+    if (table_init_slots(dt, slots_for(n)) < 0)
+        return -1;
+
     for_each_block_dent(dent, block) {
         if (dent->reclen == 0)
             break;
         if (dent->inum == 0)
             continue;
-        if (put_dentry(dt, dent) != 0) {
-            inode_disable_dirhash(dir);
-        }
+        if (put_dentry(dt, dent) != 0)
+            return -1;
     }
-}
-
-/**
- * Refresh a dirhash table for a new allocation.
- */
-static void dt_refresh(struct hfs_dirhash_table *dt)
-{
-    dt->capacity = 0;
-    dt->seqno++;
-    dt->inum = 0;
+    return 0;
 }
 
 /**
  * Allocate a dirhash table for the specified directory,
  * and load all directory entries.
+ * Returns NULL (and disables dirhash for the directory) on failure.
  */
 static struct hfs_dirhash_table *dir_alloc_table(struct hfs_inode *dir)
 {
     struct hfs_dirhash_table *dt;
-    dt = lru_get_last();
+    dt = dirhash->policy->get(inum(dir));
     dt_refresh(dt);
-    dt->inum = inum(dir);
-    dir->data.dirhash_rec.seqno = dt->seqno;
-    dir->data.dirhash_rec.id = hfs_dirhash_get_id(dt);
 
-    put_directory(dt, dir);
+    if (put_directory(dt, dir) < 0) {
+        if (dt->ctrl)
+            chunk_free(dt->ctrl, dt->nslots);
+        dt->ctrl = NULL;
+        dt->nslots = dt->nentries = dt->ndeleted = 0;
+        dirhash->policy->put(dt);
+        dir->flags &= ~I_DIRHASH;
+        return NULL;
+    }
+
+    dt->inum = inum(dir);
+    dt->hnext = *inum_bucket(dt->inum);
+    *inum_bucket(dt->inum) = dt;
     return dt;
 }
 
 /**
  * Cache a directory in dirhash.
- * 
+ *
  * Assume that currently the directory is NOT cached.
  */
 int hfs_dirhash_put_dir(struct hfs_inode *dir)
 {
-    struct hfs_dirhash_table *dt = dir_alloc_table(dir);
-    return 0;
+    int ret;
+
+    pthread_mutex_lock(&dirhash->lock);
+    ret = dir_alloc_table(dir) ? 0 : -1;
+    pthread_mutex_unlock(&dirhash->lock);
+    return ret;
 }
 
 /**
- * Add a directory entry to the dirhash table belonging to 
+ * Give back the table of dir, if it has one.
+ */
+static void dir_release_table(struct hfs_inode *dir)
+{
+    struct hfs_dirhash_table *dt;
+
+    if ((dt = inode_get_valid_dirhash(dir))) {
+        dt_refresh(dt);
+        dirhash->policy->put(dt);
+    }
+}
+
+/**
+ * Add a directory entry to the dirhash table belonging to
  * the specified directory.
  */
 int hfs_dirhash_put(struct hfs_inode *dir, struct hfs_dentry *dent)
 {
-    int id;
-    int dir_inum = inum(dir);
-
     struct hfs_dirhash_table *dt;
+    int ret = 0;
+
+    pthread_mutex_lock(&dirhash->lock);
     if (!(dt = inode_get_valid_dirhash(dir))) {
         // NOTE: dir_alloc_table will have put dent into cache
         dt = dir_alloc_table(dir);
 #ifdef HFS_DEBUG
         lookup_miss_cnt++;
 #endif
+        ret = dt ? 0 : -1;
+    } else if (put_dentry(dt, dent) != 0) {
+        dir->flags &= ~I_DIRHASH;
+        dir_release_table(dir);
+        ret = -1;
     } else {
-        if (put_dentry(dt, dent) != 0) {
-            inode_disable_dirhash(dir);
-            return -1;
-        }
+        dirhash->policy->hit(dt);
 #ifdef HFS_DEBUG
         lookup_hit_cnt++;
 #endif
     }
-    return 0;
+    pthread_mutex_unlock(&dirhash->lock);
+    return ret;
 }
 
 /**
  * Lookup a name in a specified hash table.
- * Probe linearly if a collision marked.
- * 
- * Checking if an entry is valid:
- *   - If the sequence number is current;
- *   - If the name_hash matches;
- *   - If there is a non-NULL dentry pointer
- *      (a NULL dentry pointer is a deleted entry, so we should not
- *      immediately assume there is no match but proceed with a linear
- *      probe.)
+ *
+ * A slot matches if its control byte holds the tag of the name's hash,
+ * the slot holds the name's full hash and key, and the dentry holds the
+ * name. Probing stops at the first group with an empty slot;
+ * deleted slots do not stop it.
  */
 static struct hfs_dirhash_entry *do_lookup(struct hfs_dirhash_table *dt,
                                            const char *name)
 {
     int namelen = strlen(name) + 1;
-    int h = fnv_hash(name, namelen);  // index hash
-    int h2 = name_hash(name, namelen);   // name check hash
-
-    lru_touch(dt);
-
-    // Shouldn't have to worry about infinite loop anymore because
-    // we keep track of capacity in table header.
-    struct hfs_dirhash_entry *ent = &dt->data[h];
-    while (ent->seqno == dt->seqno && ent->name_hash != h2 && ent->dent) {
-        // advance index or wrap around to zero 
-        h = (h < HFS_DIRHASH_TABLESIZE - 1) ? (h + 1) : 0;
-        ent = &dt->data[h];
-    }
-    return (ent->name_hash == h2) ? ent : NULL;
+    uint32_t h = fnv_hash(name, namelen);
+    int slot;
+
+    slot = find_slot(dt, h, name, namelen);
+    return (slot >= 0) ? &dt->slots[slot] : NULL;
 }
 
 /**
- * Dirhash lookup.
+ * Dirhash lookup. Returns the dentry holding name, NULL if there is none
+ * or if the directory could not be cached (in which case dirhash is
+ * disabled for it).
  */
-struct hfs_dirhash_entry *hfs_dirhash_lookup(struct hfs_inode *dir,
-                                             const char *name)
+struct hfs_dentry *hfs_dirhash_lookup(struct hfs_inode *dir, const char *name)
 {
+    sysstat_phase(HFS_PHASE_DIRSCAN);
     struct hfs_dirhash_table *dt;
+    struct hfs_dirhash_entry *ent = NULL;
+
+    pthread_mutex_lock(&dirhash->lock);
     if (!(dt = inode_get_valid_dirhash(dir))) {
         dt = dir_alloc_table(dir);
 #ifdef HFS_DEBUG
         lookup_miss_cnt++;
 #endif
     } else {
+        dirhash->policy->hit(dt);
 #ifdef HFS_DEBUG
         lookup_hit_cnt++;
 #endif
     }
+    if (dt)
+        ent = do_lookup(dt, name);
+    pthread_mutex_unlock(&dirhash->lock);
 
-    return do_lookup(dt, name);
+    return ent ? ent->dent : NULL;
 }
 
 /**
  * Dirhash delete.
- * 
- * Mark an entry as deleted by setting its dentry pointer to NULL.
- * 
+ *
+ * Mark the entry's slot as deleted, so that probing for other names
+ * carries on past it.
+ *
  * NOTE: This function, as well as all other dirhash functions,
  * should be called after the main on-disk operations are completed.
  */
@@ -357,48 +640,70 @@ void hfs_dirhash_delete(struct hfs_inode *dir, const char *name)
 {
     struct hfs_dirhash_table *dt;
     struct hfs_dirhash_entry *ent;
-    if (!(dt = inode_get_valid_dirhash(dir))) {
-        dt = dir_alloc_table(dir);
-    } else {
-        if ((ent = do_lookup(dt, name)))
-            ent->dent = NULL;
+
+    pthread_mutex_lock(&dirhash->lock);
+    // An uncached directory is loaded from disk when next used.
+    if ((dt = inode_get_valid_dirhash(dir)) && (ent = do_lookup(dt, name))) {
+        dirhash->policy->hit(dt);
+        dt->ctrl[ent - dt->slots] = HFS_DIRHASH_DELETED;
+        ent->dent = NULL;
+        dt->nentries--;
+        dt->ndeleted++;
     }
+    pthread_mutex_unlock(&dirhash->lock);
 }
 
 /**
- * Form a doubly-linked list from all the dirhash tables.
+ * Forget the table of a directory (e.g. it is going away, or it has
+ * stopped using dirhash). The table is the first to be reused.
  */
-static void init_dirhash_tables(void)
+void hfs_dirhash_release(struct hfs_inode *dir)
 {
-    dirhash->head = hfs_dirhash_get_table(0);
-    dirhash->tail = hfs_dirhash_get_table(HFS_DIRHASH_SIZE - 1);
-
-    dirhash->head->prev = NULL;
-    dirhash->tail->next = NULL;
-
-    struct hfs_dirhash_table *curr, *next;
-    for (int i = 0; i < HFS_DIRHASH_SIZE - 1; i++) {
-        curr = hfs_dirhash_get_table(i);
-        next = hfs_dirhash_get_table(i + 1); curr->next = next;
-        next->prev = curr;
-    }
+    if (!dirhash)
+        return;
+    pthread_mutex_lock(&dirhash->lock);
+    dir_release_table(dir);
+    pthread_mutex_unlock(&dirhash->lock);
 }
 
 /**
- * Allocate and initialize dirhash.
+ * Allocate and initialize dirhash with ntables tables (0 for the
+ * default number), replaced according to policy (one of HFS_DIRHASH_*).
  */
-int hfs_dirhash_init(void)
+int hfs_dirhash_init(int ntables, int policy)
 {
-    dirhash = malloc(sizeof(struct hfs_dirhash));
+    size_t size;
+
+    if (ntables == 0)
+        ntables = HFS_DIRHASH_SIZE;
+    if (ntables < 0 || policy < 0 || policy >= HFS_DIRHASH_NPOLICIES)
+        return -1;
+    size = sizeof(struct hfs_dirhash)
+                    + ntables * sizeof(struct hfs_dirhash_table);
+
+    dirhash = malloc(size);
     if (!dirhash) {
         pr_warn("Failed to initialize dirhash.\n");
         return -1;
     }
-    memset(dirhash, 0, sizeof(struct hfs_dirhash));
-    init_dirhash_tables();    
+    memset(dirhash, 0, size);
+    pthread_mutex_init(&dirhash->lock, NULL);
+    dirhash->ntables = ntables;
+    dirhash->policy = &hfs_dirhash_policies[policy];
+    for (int i = 0; i < 2; i++) {
+        dirhash->ghosts[i].inums = malloc(ntables * sizeof(uint32_t));
+        if (!dirhash->ghosts[i].inums) {
+            pr_warn("Failed to initialize dirhash.\n");
+            hfs_dirhash_free();
+            return -1;
+        }
+        dirhash->ghosts[i].cap = ntables;
+    }
+    dirhash->policy->init();
 
-    pr_info("Dirhash initialized successfully (%ld bytes)\n", 
-                                    sizeof(struct hfs_dirhash));
+    pr_info("Dirhash initialized successfully (%ld bytes, %d tables, %s, "
+            "%s probing)\n", size, ntables, dirhash->policy->name,
+            GROUP_PROBE_NAME);
     return 0;
 }
 
@@ -407,26 +712,74 @@ int hfs_dirhash_init(void)
  */
 void hfs_dirhash_free(void)
 {
+    struct hfs_dirhash_slab *slab, *next;
+
+    if (!dirhash)
+        return;
+    for (slab = dirhash->slabs; slab; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    free(dirhash->ghosts[0].inums);
+    free(dirhash->ghosts[1].inums);
+    pthread_mutex_destroy(&dirhash->lock);
     free(dirhash);
     dirhash = NULL;
 }
 
 /**
- * Print out a single dirhash table.
+ * Number of groups probed to reach the entry in slot.
+ */
+static int probe_length(struct hfs_dirhash_table *dt, uint32_t slot)
+{
+    uint32_t g = probe_start(dt, dt->slots[slot].name_hash);
+    uint32_t target = slot & ~(HFS_DIRHASH_GROUP - 1);
+    int n = 1;
+
+    while (g != target)
+        g = probe_next(dt, g, n++);
+    return n;
+}
+
+/**
+ * Print out a single dirhash table: its size and memory, the histogram
+ * of probe lengths (in groups) of its entries, and the entries. The
+ * histogram is also added to hist.
  */
-static void dirhash_table_dump(struct hfs_dirhash_table *dt)
+static void dirhash_table_dump(struct hfs_dirhash_table *dt, int *hist)
 {
-    printf("(seq=%d): ", dt->seqno);
-    if (dt->seqno == 0) {
+    int local[PROBE_HIST_MAX] = { 0 };
+
+    if (!dt->inum) {
         printf("EMPTY");
         return;
     }
 
-    for (int i = 0; i < HFS_DIRHASH_TABLESIZE; i++) {
-        if (dt->data[i].seqno != dt->seqno)
+    for (uint32_t i = 0; i < dt->nslots; i++) {
+        uint8_t c = dt->ctrl[i];
+        if (c == HFS_DIRHASH_EMPTY || c == HFS_DIRHASH_DELETED)
             continue;
-        if (dt->data[i].dent)
-            printf("[%d|%.16s] ", i, dt->data[i].dent->name);
+        int n = probe_length(dt, i);
+        local[(n < PROBE_HIST_MAX ? n : PROBE_HIST_MAX) - 1]++;
+    }
+
+    printf("%u entries, %u slots (%u deleted), %zu bytes\n", dt->nentries,
+            dt->nslots, dt->ndeleted,
+            sizeof(*dt) + chunk_size(dt->nslots));
+    printf("  probes:");
+    for (int i = 0; i < PROBE_HIST_MAX; i++) {
+        if (local[i])
+            printf(" %d%s:%d", i + 1, i == PROBE_HIST_MAX - 1 ? "+" : "",
+                    local[i]);
+        hist[i] += local[i];
+    }
+    printf("\n  ");
+
+    for (uint32_t i = 0; i < dt->nslots; i++) {
+        uint8_t c = dt->ctrl[i];
+        if (c == HFS_DIRHASH_EMPTY || c == HFS_DIRHASH_DELETED)
+            continue;
+        printf("[%u|%.16s] ", i, dt->slots[i].dent->name);
     }
 }
 
@@ -435,11 +788,13 @@ static void dirhash_table_dump(struct hfs_dirhash_table *dt)
  */
 void hfs_dirhash_clear(void)
 {
-    struct hfs_dirhash_table *dt;
-    for (int i = 0; i < HFS_DIRHASH_SIZE; i++) {
-        dt = hfs_dirhash_get_table(i);
-        dt_refresh(dt);
-    }
+    if (!dirhash)
+        return;
+    pthread_mutex_lock(&dirhash->lock);
+    for (int i = 0; i < dirhash->ntables; i++)
+        dt_refresh(&dirhash->tables[i]);
+    dirhash->policy->init();
+    pthread_mutex_unlock(&dirhash->lock);
 }
 
 #ifdef HFS_DEBUG
@@ -457,28 +812,56 @@ void hfs_dirhash_stat_clear(void)
     lookup_miss_cnt = 0;
     put_conflict_cnt = 0;
     put_no_conf_cnt = 0;
+    grow_cnt = 0;
 }
 #endif  // HFS_DEBUG
 
 /**
- * Debug function: Print out all the contents of dirhash.
+ * Debug function: Print out all the contents of dirhash, followed by
+ * the memory used per cached directory and the probe length histogram
+ * over all tables.
  */
 void hfs_dirhash_dump(void)
 {
+    int hist[PROBE_HIST_MAX] = { 0 };
+    int ndirs = 0, nentries = 0;
+
     if (!dirhash)
         return;
 
+    // Tables in use, on the policy's lists in replacement order.
     struct hfs_dirhash_table *dt;
-    for (dt = dirhash->head; dt; dt = dt->next) {
-        printf(KBLD KBLU "\nDIRHASH #%d [%d]" KNRM, 
-                hfs_dirhash_get_id(dt), dt->inum);
-        dirhash_table_dump((struct hfs_dirhash_table *)dt);
-        puts("");
+    for (int l = 1; l < HFS_DIRHASH_NLISTS; l++) {
+        for (dt = dirhash->lists[l].head; dt; dt = dt->next) {
+            printf(KBLD KBLU "\nDIRHASH #%d [%d] (list %d) " KNRM,
+                    hfs_dirhash_get_id(dt), dt->inum, l);
+            dirhash_table_dump(dt, hist);
+            puts("");
+            if (dt->inum) {
+                ndirs++;
+                nentries += dt->nentries;
+            }
+        }
     }
 
+    printf("\nPolicy:                   %s, %d tables (%d unused)\n",
+            dirhash->policy->name, dirhash->ntables, dirhash->lists[0].len);
+    printf("Cached directories:       %d (%d entries)\n", ndirs, nentries);
+    printf("Table memory in use:      %zu bytes (%.1f per directory)\n",
+            dirhash->used_bytes + ndirs * sizeof(*dt),
+            ndirs ? (dirhash->used_bytes + ndirs * sizeof(*dt))
+                        / (double)ndirs : 0.0);
+    printf("Slab memory:              %zu bytes\n", dirhash->slab_bytes);
+    printf("Probe lengths (groups):  ");
+    for (int i = 0; i < PROBE_HIST_MAX; i++)
+        printf(" %d%s:%d", i + 1, i == PROBE_HIST_MAX - 1 ? "+" : "",
+                hist[i]);
+    puts("");
+
 #ifdef HFS_DEBUG
     printf("Total conflicted puts:    %d\n", put_conflict_cnt);
     printf("Total conflict free puts: %d\n", put_no_conf_cnt);
+    printf("Total table rehashes:     %d\n", grow_cnt);
     printf("Total lookup miss count:  %d\n", lookup_miss_cnt);
     printf("Total lookup hit count:   %d\n", lookup_hit_cnt);
     hfs_dirhash_stat_clear();
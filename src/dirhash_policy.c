@@ -0,0 +1,308 @@
+/**
+ * fsemu/src/dirhash_policy.c
+ *
+ * Replacement policies for the dirhash table pool.
+ *
+ * Every table is on exactly one list: the list of unused tables, or one
+ * of the two lists a policy keeps its tables on. Unused tables are always
+ * handed out first, so a policy only has to pick a victim once all
+ * tables are in use.
+ */
+
+#include "fsemu.h"
+#include "dirhash.h"
+
+#include <string.h>
+
+#define LIST_UNUSED     0
+#define LIST_1          1
+#define LIST_2          2
+
+#define unused_list     (&dirhash->lists[LIST_UNUSED])
+#define list_1          (&dirhash->lists[LIST_1])
+#define list_2          (&dirhash->lists[LIST_2])
+
+static void list_remove(struct hfs_dirhash_table *dt)
+{
+    struct hfs_dirhash_list *l = &dirhash->lists[dt->list];
+
+    if (dt->prev)
+        dt->prev->next = dt->next;
+    else
+        l->head = dt->next;
+    if (dt->next)
+        dt->next->prev = dt->prev;
+    else
+        l->tail = dt->prev;
+    dt->prev = dt->next = NULL;
+    l->len--;
+}
+
+static void list_push(int list, struct hfs_dirhash_table *dt)
+{
+    struct hfs_dirhash_list *l = &dirhash->lists[list];
+
+    dt->list = list;
+    dt->prev = NULL;
+    dt->next = l->head;
+    if (l->head)
+        l->head->prev = dt;
+    else
+        l->tail = dt;
+    l->head = dt;
+    l->len++;
+}
+
+/**
+ * Move a table to the head of a list.
+ */
+static inline void list_move(int list, struct hfs_dirhash_table *dt)
+{
+    if (dt->list == list && !dt->prev)
+        return;
+    list_remove(dt);
+    list_push(list, dt);
+}
+
+static bool ghost_remove(struct hfs_dirhash_ghost *g, uint32_t inum)
+{
+    for (int i = g->len - 1; i >= 0; i--) {
+        if (g->inums[i] == inum) {
+            memmove(&g->inums[i], &g->inums[i + 1],
+                    (g->len - i - 1) * sizeof(uint32_t));
+            g->len--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ghost_drop_oldest(struct hfs_dirhash_ghost *g)
+{
+    if (g->len == 0)
+        return;
+    memmove(&g->inums[0], &g->inums[1], (g->len - 1) * sizeof(uint32_t));
+    g->len--;
+}
+
+static void ghost_push(struct hfs_dirhash_ghost *g, uint32_t inum)
+{
+    if (!inum || !g->cap)
+        return;
+    if (g->len == g->cap)
+        ghost_drop_oldest(g);
+    g->inums[g->len++] = inum;
+}
+
+/**
+ * Put every table on the unused list, and forget the history.
+ */
+static void common_init(void)
+{
+    memset(dirhash->lists, 0, sizeof(dirhash->lists));
+    for (int i = dirhash->ntables - 1; i >= 0; i--) {
+        dirhash->tables[i].ref = 0;
+        list_push(LIST_UNUSED, &dirhash->tables[i]);
+    }
+    dirhash->ghosts[0].len = 0;
+    dirhash->ghosts[1].len = 0;
+    dirhash->hand = &dirhash->tables[0];
+    dirhash->target = 0;
+}
+
+static void common_put(struct hfs_dirhash_table *dt)
+{
+    dt->ref = 0;
+    list_move(LIST_UNUSED, dt);
+}
+
+/**
+ * Take an unused table if there is one.
+ */
+static inline struct hfs_dirhash_table *get_unused(void)
+{
+    return unused_list->tail;
+}
+
+/**
+ * LRU: one list, moved to the front on every use. The tail is the victim.
+ */
+static struct hfs_dirhash_table *lru_get(uint32_t inum)
+{
+    struct hfs_dirhash_table *dt = get_unused();
+
+    if (!dt)
+        dt = list_1->tail;
+    list_move(LIST_1, dt);
+    return dt;
+}
+
+static void lru_hit(struct hfs_dirhash_table *dt)
+{
+    list_move(LIST_1, dt);
+}
+
+/**
+ * CLOCK: a hit only sets the table's reference bit. To find a victim,
+ * the hand sweeps over the tables, giving each referenced table a second
+ * chance by clearing its bit.
+ */
+static struct hfs_dirhash_table *clock_get(uint32_t inum)
+{
+    struct hfs_dirhash_table *dt = get_unused();
+    struct hfs_dirhash_table *end = dirhash->tables + dirhash->ntables;
+
+    while (!dt) {
+        struct hfs_dirhash_table *hand = dirhash->hand;
+        if (++dirhash->hand == end)
+            dirhash->hand = dirhash->tables;
+        if (hand->ref)
+            hand->ref = 0;
+        else
+            dt = hand;
+    }
+    list_move(LIST_1, dt);
+    return dt;
+}
+
+static void clock_hit(struct hfs_dirhash_table *dt)
+{
+    dt->ref = 1;
+}
+
+/**
+ * 2Q (Johnson & Shasha): a directory seen for the first time goes on
+ * the FIFO list A1in (list 1), and nothing moves it on a hit. When it is
+ * evicted from A1in, its inum is remembered in A1out (ghost 0), and if it
+ * is loaded again while remembered, it goes on the LRU list Am (list 2).
+ * A directory that is scanned once thus never pushes out the ones that
+ * are used repeatedly.
+ */
+#define TWOQ_KIN    (dirhash->ntables / 4 ? dirhash->ntables / 4 : 1)
+#define TWOQ_KOUT   (dirhash->ntables / 2 ? dirhash->ntables / 2 : 1)
+
+static struct hfs_dirhash_table *twoq_get(uint32_t inum)
+{
+    struct hfs_dirhash_ghost *a1out = &dirhash->ghosts[0];
+    struct hfs_dirhash_table *dt = get_unused();
+
+    if (!dt) {
+        if (list_1->len > TWOQ_KIN || !list_2->tail) {
+            dt = list_1->tail;
+            if (a1out->len >= TWOQ_KOUT)
+                ghost_drop_oldest(a1out);
+            ghost_push(a1out, dt->inum);
+        } else {
+            dt = list_2->tail;
+        }
+    }
+
+    list_move(ghost_remove(a1out, inum) ? LIST_2 : LIST_1, dt);
+    return dt;
+}
+
+static void twoq_hit(struct hfs_dirhash_table *dt)
+{
+    if (dt->list == LIST_2)
+        list_move(LIST_2, dt);
+}
+
+/**
+ * ARC (Megiddo & Modha): T1 (list 1) holds directories used once
+ * recently and T2 (list 2) directories used at least twice, both in LRU
+ * order, and B1 and B2 (ghosts 0 and 1) remember what was evicted from
+ * each. A miss that hits in B1 means T1 is too small and grows the target
+ * size of T1, a miss that hits in B2 shrinks it.
+ */
+static struct hfs_dirhash_table *arc_replace(bool in_b2)
+{
+    struct hfs_dirhash_table *dt;
+    int t1 = list_1->len;
+
+    if (t1 && (t1 > dirhash->target || (in_b2 && t1 == dirhash->target)
+                                     || !list_2->len)) {
+        dt = list_1->tail;
+        ghost_push(&dirhash->ghosts[0], dt->inum);
+    } else {
+        dt = list_2->tail;
+        ghost_push(&dirhash->ghosts[1], dt->inum);
+    }
+    return dt;
+}
+
+static struct hfs_dirhash_table *arc_get(uint32_t inum)
+{
+    struct hfs_dirhash_ghost *b1 = &dirhash->ghosts[0];
+    struct hfs_dirhash_ghost *b2 = &dirhash->ghosts[1];
+    struct hfs_dirhash_table *dt = get_unused();
+    int c = dirhash->ntables;
+    int list = LIST_2;
+
+    if (ghost_remove(b1, inum)) {
+        int delta = b1->len >= b2->len ? 1 : b2->len / (b1->len + 1);
+        dirhash->target += delta;
+        if (dirhash->target > c)
+            dirhash->target = c;
+        if (!dt)
+            dt = arc_replace(false);
+    } else if (ghost_remove(b2, inum)) {
+        int delta = b2->len >= b1->len ? 1 : b1->len / (b2->len + 1);
+        dirhash->target -= delta;
+        if (dirhash->target < 0)
+            dirhash->target = 0;
+        if (!dt)
+            dt = arc_replace(true);
+    } else {
+        list = LIST_1;
+        if (list_1->len + b1->len >= c) {
+            if (b1->len) {
+                ghost_drop_oldest(b1);
+            } else if (!dt) {
+                dt = list_1->tail;  // T1 is the whole cache
+            }
+        } else if (list_1->len + list_2->len + b1->len + b2->len >= 2 * c) {
+            ghost_drop_oldest(b2);
+        }
+        if (!dt)
+            dt = arc_replace(false);
+    }
+
+    list_move(list, dt);
+    return dt;
+}
+
+static void arc_hit(struct hfs_dirhash_table *dt)
+{
+    list_move(LIST_2, dt);
+}
+
+const struct hfs_dirhash_policy hfs_dirhash_policies[HFS_DIRHASH_NPOLICIES] = {
+    [HFS_DIRHASH_LRU] = {
+        .name = "lru",
+        .init = common_init,
+        .get = lru_get,
+        .hit = lru_hit,
+        .put = common_put,
+    },
+    [HFS_DIRHASH_CLOCK] = {
+        .name = "clock",
+        .init = common_init,
+        .get = clock_get,
+        .hit = clock_hit,
+        .put = common_put,
+    },
+    [HFS_DIRHASH_2Q] = {
+        .name = "2q",
+        .init = common_init,
+        .get = twoq_get,
+        .hit = twoq_hit,
+        .put = common_put,
+    },
+    [HFS_DIRHASH_ARC] = {
+        .name = "arc",
+        .init = common_init,
+        .get = arc_get,
+        .hit = arc_hit,
+        .put = common_put,
+    },
+};
@@ -0,0 +1,491 @@
+/**
+ * fsemu/src/extent.c
+ *
+ * Extent trees. See include/extent.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "extent.h"
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HFS_DEBUG
+static uint64_t ext_lookup_cnt = 0;
+#endif
+
+/**
+ * Blocks allocated to a file ahead of its writes, for file blocks
+ * [lblk, lblk + len), by inum. Only in memory, and only touched under
+ * the file's lock.
+ */
+struct ext_rsv {
+	uint32_t	lblk;
+	uint32_t	pblk;
+	uint32_t	len;
+};
+
+static struct ext_rsv *ext_rsv;
+static uint64_t ext_nrsv;
+
+/**
+ * The nodes on the way from the root to a leaf, and the index entry that
+ * was followed out of each.
+ */
+struct ext_path {
+	struct hfs_extent_header	*node[HFS_EXT_MAXDEPTH + 1];
+	int							pos[HFS_EXT_MAXDEPTH + 1];
+	int							depth;		// level of the leaf
+};
+
+static inline struct hfs_extent_header *ext_root(struct hfs_inode *file)
+{
+	return &file->data.ext_root.hdr;
+}
+
+static inline struct hfs_extent *ext_entries(struct hfs_extent_header *hdr)
+{
+	return (struct hfs_extent *)(hdr + 1);
+}
+
+static inline struct hfs_extent_idx *idx_entries(struct hfs_extent_header *hdr)
+{
+	return (struct hfs_extent_idx *)(hdr + 1);
+}
+
+/* Extents and index entries both start with their first file block. */
+static inline uint32_t entry_key(struct hfs_extent_header *hdr, int i)
+{
+	return ext_entries(hdr)[i].lblk;
+}
+
+static inline bool blocks_valid(uint32_t b, uint32_t n)
+{
+	return b >= sb->datastart && (uint64_t)b + n <= sb->size;
+}
+
+static inline bool node_valid(struct hfs_extent_header *hdr)
+{
+	return hdr->magic == HFS_EXT_MAGIC && hdr->entries <= hdr->max
+			&& hdr->max <= HFS_EXT_BLOCK_MAX && hdr->depth <= HFS_EXT_MAXDEPTH;
+}
+
+/**
+ * The child an index entry points to, or NULL if it cannot be one.
+ */
+static struct hfs_extent_header *ext_child(struct hfs_extent_header *hdr,
+										   int pos)
+{
+	struct hfs_extent_header *child;
+	uint32_t b = idx_entries(hdr)[pos].child;
+
+	if (!blocks_valid(b, 1))
+		return NULL;
+	child = BLKADDR(b);
+	if (!node_valid(child) || child->depth + 1 != hdr->depth)
+		return NULL;
+	return child;
+}
+
+/**
+ * The last entry of a node whose key is not greater than lblk, or -1 if
+ * lblk is below them all.
+ */
+static int node_search(struct hfs_extent_header *hdr, uint32_t lblk)
+{
+	int lo = 0, hi = hdr->entries - 1, pos = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (entry_key(hdr, mid) <= lblk) {
+			pos = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return pos;
+}
+
+/**
+ * Give a regular file an empty extent tree.
+ */
+void hfs_extent_init(struct hfs_inode *file)
+{
+	struct hfs_extent_header *root = ext_root(file);
+
+	root->magic = HFS_EXT_MAGIC;
+	root->entries = 0;
+	root->max = HFS_EXT_INODE_MAX;
+	root->depth = 0;
+	file->flags |= I_EXTENTS;
+}
+
+static bool do_map(struct hfs_inode *file, uint32_t lblk,
+				   uint32_t *pblk, uint32_t *len)
+{
+	struct hfs_extent_header *hdr = ext_root(file);
+	uint32_t next = UINT32_MAX;		// first mapped block after lblk
+	int pos;
+
+	*len = 1;
+	if (!node_valid(hdr))
+		return false;
+	for (int level = 0; level <= HFS_EXT_MAXDEPTH; level++) {
+		pos = node_search(hdr, lblk);
+		if (pos + 1 < hdr->entries)
+			next = entry_key(hdr, pos + 1);
+		if (pos < 0)
+			break;		// below the first extent of the file
+		if (hdr->depth == 0) {
+			struct hfs_extent *e = &ext_entries(hdr)[pos];
+			if (lblk - e->lblk >= e->len)
+				break;
+			*pblk = e->pblk + (lblk - e->lblk);
+			*len = e->len - (lblk - e->lblk);
+			if (blocks_valid(*pblk, *len))
+				return true;
+			*len = 1;
+			return false;
+		}
+		if (!(hdr = ext_child(hdr, pos)))
+			return false;
+	}
+	if (next == UINT32_MAX)
+		*len = UINT32_MAX;
+	else if (next > lblk)
+		*len = next - lblk;
+	return false;
+}
+
+/**
+ * Find where file block lblk is on disk. Returns true if it is mapped,
+ * with *pblk set to its disk block and *len to the number of blocks from
+ * lblk to the end of its extent. Otherwise lblk is in a hole, and *len is
+ * the number of blocks up to the next extent (UINT32_MAX if none).
+ */
+bool hfs_extent_map(struct hfs_inode *file, uint32_t lblk,
+					uint32_t *pblk, uint32_t *len)
+{
+#ifdef HFS_DEBUG
+	ext_lookup_cnt++;
+#endif
+	return do_map(file, lblk, pblk, len);
+}
+
+/**
+ * Walk from the root down to the leaf lblk belongs in. An index entry's
+ * key is the lowest file block of its subtree, so if lblk is below the
+ * first key of a node, that key is lowered to lblk.
+ */
+static int find_path(struct hfs_inode *file, uint32_t lblk,
+					 struct ext_path *path)
+{
+	struct hfs_extent_header *hdr = ext_root(file);
+	int pos;
+
+	for (int level = 0; level <= HFS_EXT_MAXDEPTH; level++) {
+		path->node[level] = hdr;
+		if (hdr->depth == 0) {
+			path->depth = level;
+			return 0;
+		}
+		if ((pos = node_search(hdr, lblk)) < 0) {
+			pos = 0;
+			idx_entries(hdr)[0].lblk = lblk;
+		}
+		path->pos[level] = pos;
+		if (!(hdr = ext_child(hdr, pos)))
+			break;
+	}
+	pr_warn("corrupt extent tree in inode %d\n", inum(file));
+	return -EINVAL;
+}
+
+/**
+ * A new, empty node one block in size.
+ */
+static uint32_t new_node(struct hfs_inode *file, uint16_t depth)
+{
+	struct hfs_extent_header *hdr;
+	uint32_t b;
+
+	if (!(b = hfs_balloc_alloc(hfs_balloc_goal(file))))
+		return 0;
+	hdr = BLKADDR(b);
+	memset(hdr, 0, BSIZE);
+	hdr->magic = HFS_EXT_MAGIC;
+	hdr->max = HFS_EXT_BLOCK_MAX;
+	hdr->depth = depth;
+	return b;
+}
+
+static void node_insert(struct hfs_extent_header *hdr, int pos,
+						const void *entry)
+{
+	struct hfs_extent *e = ext_entries(hdr);
+
+	memmove(&e[pos + 1], &e[pos], (hdr->entries - pos) * sizeof(*e));
+	memcpy(&e[pos], entry, sizeof(*e));
+	hdr->entries++;
+}
+
+/**
+ * Make room in the (full) node at the given level of path for lblk. The
+ * root is moved into a new block below it, which leaves it with one index
+ * entry. Any other node is split in half, if its parent has room for the
+ * new index entry; otherwise the parent is dealt with first, and the
+ * caller has to walk the tree again and retry. A file that is appended to
+ * only ever adds entries at the end, so if lblk goes after the last entry,
+ * only that entry moves and the node is left full.
+ */
+static int split_node(struct hfs_inode *file, struct ext_path *path,
+					  int level, uint32_t lblk)
+{
+	struct hfs_extent_header *hdr = path->node[level], *parent, *new;
+	struct hfs_extent_idx idx = { 0 };
+	uint32_t b;
+	int half;
+
+	if (level == 0) {
+		if (!(b = new_node(file, hdr->depth)))
+			return -EALLOC;
+		new = BLKADDR(b);
+		new->entries = hdr->entries;
+		memcpy(ext_entries(new), ext_entries(hdr),
+			   hdr->entries * sizeof(struct hfs_extent));
+		idx.lblk = entry_key(new, 0);
+		idx.child = b;
+		hdr->depth++;
+		hdr->entries = 0;
+		node_insert(hdr, 0, &idx);
+		return 0;
+	}
+
+	parent = path->node[level - 1];
+	if (parent->entries == parent->max)
+		return split_node(file, path, level - 1, lblk);
+	if (!(b = new_node(file, hdr->depth)))
+		return -EALLOC;
+	new = BLKADDR(b);
+	half = hdr->entries / 2;
+	if (lblk > entry_key(hdr, hdr->entries - 1))
+		half = hdr->entries - 1;
+	new->entries = hdr->entries - half;
+	memcpy(ext_entries(new), &ext_entries(hdr)[half],
+		   new->entries * sizeof(struct hfs_extent));
+	hdr->entries = half;
+	idx.lblk = entry_key(new, 0);
+	idx.child = b;
+	node_insert(parent, path->pos[level - 1] + 1, &idx);
+	return 0;
+}
+
+/**
+ * Add an extent for blocks of the file that are not mapped yet, merging
+ * it into the one before it if it continues that one on disk.
+ */
+static int insert_extent(struct hfs_inode *file, struct hfs_extent *ext)
+{
+	struct hfs_extent_header *leaf;
+	struct ext_path path;
+	int pos, ret;
+
+	for (int tries = 0; tries <= 2 * (HFS_EXT_MAXDEPTH + 1); tries++) {
+		if ((ret = find_path(file, ext->lblk, &path)) < 0)
+			return ret;
+		leaf = path.node[path.depth];
+		pos = node_search(leaf, ext->lblk);
+		if (pos >= 0) {
+			struct hfs_extent *prev = &ext_entries(leaf)[pos];
+			if (prev->lblk + prev->len == ext->lblk
+					&& prev->pblk + prev->len == ext->pblk) {
+				prev->len += ext->len;
+				return 0;
+			}
+		}
+		if (leaf->entries < leaf->max) {
+			node_insert(leaf, pos + 1, ext);
+			return 0;
+		}
+		if ((ret = split_node(file, &path, path.depth, ext->lblk)) < 0)
+			return ret;
+	}
+	return -EALLOC;
+}
+
+/**
+ * Allocate up to n blocks for the file, starting at file block lblk,
+ * which must not be mapped yet (nor the n - 1 blocks after it). The
+ * blocks are contiguous on disk, and placed right after the block before
+ * lblk if possible; fewer than n are allocated if the next one is taken.
+ * The blocks are not zeroed.
+ *
+ * Delayed allocation, sort of: a file that is being appended to gets as
+ * many blocks again as it has so far (up to HFS_EXT_PREALLOC_MAX) set
+ * aside for it in one contiguous run, and its next appends are mapped
+ * from that reservation, without going through the bitmap. Whatever is
+ * left of the reservation is given back by hfs_extent_release() when the
+ * file is closed, or when it is written to anywhere else.
+ *
+ * Returns the number of blocks allocated, with *pblk the first one, or
+ * 0 if none could be.
+ */
+uint32_t hfs_extent_alloc(struct hfs_inode *file, uint32_t lblk,
+						  uint32_t n, uint32_t *pblk)
+{
+	struct ext_rsv *rsv = &ext_rsv[inum(file)];
+	uint32_t prev, len, first, count;
+	struct hfs_extent ext;
+
+	if (rsv->len && rsv->lblk != lblk)
+		hfs_extent_release(file);
+	if (!rsv->len) {
+		uint64_t goal = hfs_balloc_goal(file);
+		uint32_t want = n;
+
+		if (lblk > 0 && do_map(file, lblk - 1, &prev, &len))
+			goal = prev + 1;
+		if (!do_map(file, lblk, &prev, &len) && len == UINT32_MAX) {
+			// Nothing after lblk: an append.
+			if (want < lblk)
+				want = (lblk < HFS_EXT_PREALLOC_MAX) ? lblk
+													 : HFS_EXT_PREALLOC_MAX;
+		}
+		if (!(first = hfs_balloc_alloc_run(goal, want, &count)))
+			return 0;
+		rsv->lblk = lblk;
+		rsv->pblk = first;
+		rsv->len = count;
+	}
+
+	ext.lblk = lblk;
+	ext.len = (n < rsv->len) ? n : rsv->len;
+	ext.pblk = rsv->pblk;
+	if (insert_extent(file, &ext) < 0) {
+		hfs_extent_release(file);
+		return 0;
+	}
+	rsv->lblk += ext.len;
+	rsv->pblk += ext.len;
+	rsv->len -= ext.len;
+	*pblk = ext.pblk;
+	return ext.len;
+}
+
+/**
+ * Give back the blocks set aside for the file's appends.
+ */
+void hfs_extent_release(struct hfs_inode *file)
+{
+	struct ext_rsv *rsv = &ext_rsv[inum(file)];
+
+	for (uint32_t i = 0; i < rsv->len; i++)
+		hfs_balloc_free(rsv->pblk + i);
+	__atomic_store_n(&rsv->len, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Whether the file has blocks set aside. Takes no lock, so this is only
+ * good for skipping hfs_extent_release() when there is nothing to give
+ * back.
+ */
+bool hfs_extent_reserved(struct hfs_inode *file)
+{
+	return __atomic_load_n(&ext_rsv[inum(file)].len, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set up the (empty) table of reservations. A table left from before a
+ * reset is dropped without giving anything back, as the bitmap it was
+ * taken from is gone.
+ */
+int hfs_extent_rsv_init(void)
+{
+	free(ext_rsv);
+	ext_nrsv = sb->ninodes;
+	if (!(ext_rsv = calloc(ext_nrsv, sizeof(struct ext_rsv)))) {
+		pr_warn("Failed to allocate extent reservations.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Give back every reservation, before the file system is unmounted.
+ */
+void hfs_extent_rsv_exit(void)
+{
+	for (uint64_t i = 0; ext_rsv && i < ext_nrsv; i++)
+		hfs_extent_release(inode_from_inum(i));
+	free(ext_rsv);
+	ext_rsv = NULL;
+}
+
+static void free_node(struct hfs_extent_header *hdr)
+{
+	if (hdr->depth == 0) {
+		for (int i = 0; i < hdr->entries; i++) {
+			struct hfs_extent *e = &ext_entries(hdr)[i];
+			for (uint32_t j = 0; j < e->len; j++)
+				hfs_balloc_free(e->pblk + j);
+		}
+		return;
+	}
+	for (int i = 0; i < hdr->entries; i++) {
+		struct hfs_extent_header *child = ext_child(hdr, i);
+		if (child) {
+			free_node(child);
+			hfs_balloc_free(idx_entries(hdr)[i].child);
+		}
+	}
+}
+
+/**
+ * Free every block of the file, and the nodes of its extent tree.
+ */
+void hfs_extent_free_all(struct hfs_inode *file)
+{
+	hfs_extent_release(file);
+	if (node_valid(ext_root(file)))
+		free_node(ext_root(file));
+	hfs_extent_init(file);
+}
+
+static uint32_t count_node(struct hfs_extent_header *hdr)
+{
+	uint32_t n = 0;
+
+	for (int i = 0; i < hdr->entries; i++) {
+		if (hdr->depth == 0) {
+			n += ext_entries(hdr)[i].len;
+		} else {
+			struct hfs_extent_header *child = ext_child(hdr, i);
+			if (child)
+				n += 1 + count_node(child);
+		}
+	}
+	return n;
+}
+
+/**
+ * Number of blocks the file takes up, its tree nodes included.
+ */
+uint32_t hfs_extent_nblocks(struct hfs_inode *file)
+{
+	if (!node_valid(ext_root(file)))
+		return 0;
+	return count_node(ext_root(file));
+}
+
+#ifdef HFS_DEBUG
+/**
+ * Number of mapping lookups so far.
+ */
+uint64_t hfs_extent_nlookups(void)
+{
+	return ext_lookup_cnt;
+}
+#endif
@@ -11,19 +11,35 @@
 #include "util.h"
 #include "fsemu.h"
 #include "file.h"
+#include "process.h"
+#include "alloc.h"
+#include "sync.h"
+#include "extent.h"
+#include "clock.h"
+#include "sysstat.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
 /* Optional add-on features. */
 #ifdef _HFS_DIRHASH
 #include "dirhash.h"
 #endif
+#ifdef _HFS_PCACHE
+#include "pcache.h"
+#else
+struct hfs_pcache_key;
+#endif
 
 char *fs = NULL;
 struct hfs_superblock *sb;
@@ -31,43 +47,234 @@ struct hfs_inode *inodes;
 char *inobitmap, *bitmap;
 
 /**
- * File descriptors.
+ * Options of the current mount, see parse_mount_opts().
+ */
+struct hfs_mount_opts mount_opts;
+
+#ifdef HFS_DEBUG
+void (*lookup_tracer)(const void *addr, size_t len);
+#endif
+
+/*
+ * Concurrency (see include/sync.h).
+ *
+ * Every inode has a sequence count, which is odd while the inode, or the
+ * directory or file it describes, is being changed, and a reader/writer
+ * lock. System calls that change inodes first write-lock them. Once a
+ * system call holds its locks, it looks up its pathnames again, and if
+ * anything changed in between it lets go and starts over. Readers do not
+ * normally lock anything, but one that keeps losing the race with writers
+ * takes the read lock (see MAX_SEQ_RETRIES).
+ *
+ * Lock order:
+ *  1. rename_lock, only taken by fs_rename() across two directories, so
+ *     that no directory moves while the order below is worked out.
+ *  2. Directories, a parent before its children. Two directories neither
+ *     of which is an ancestor of the other go lower inum first.
+ *  3. Other inodes, lower inum first.
+ *  4. A process's lock (its descriptor table and cwd, see process.h).
+ * The allocators take no locks at all (see include/alloc.h).
+ *
+ * NOTE: Between write_begin() and write_end() a system call must not look
+ * anything up; another writer may be waiting for it while holding a lock
+ * on a directory the lookup would have to read. For the same reason,
+ * nothing may be looked up while holding a process's lock, which is
+ * taken between write_begin() and write_end().
+ */
+static uint32_t *inode_seqs;
+static pthread_rwlock_t *inode_locks;
+static uint32_t *inode_pins;		// see fs_read_map()
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads that lose to writers this many times take the read lock. */
+#define MAX_SEQ_RETRIES		4
+
+/* Set in a pin count once the inode is unlinked while pinned. */
+#define PIN_ORPHAN			0x80000000u
+
+static inline uint32_t *inode_seq(struct hfs_inode *inode)
+{
+	return &inode_seqs[inum(inode)];
+}
+
+static inline pthread_rwlock_t *inode_lock(struct hfs_inode *inode)
+{
+	return &inode_locks[inum(inode)];
+}
+
+/**
+ * The inodes a system call changes, at most one of each, in lock order.
  */
-struct file openfiles[MAXOPENFILES];
+struct inode_set {
+	int					n;
+	struct hfs_inode	*inodes[4];
+};
+
+static void inode_set_add(struct inode_set *set, struct hfs_inode *inode)
+{
+	if (!inode)
+		return;
+	for (int i = 0; i < set->n; i++) {
+		if (set->inodes[i] == inode)
+			return;
+	}
+	set->inodes[set->n++] = inode;
+}
 
 /**
- * Current working directory.
+ * Add two inodes that have no order of their own, lower inum first.
  */
-struct hfs_dentry *cwd;
+static void inode_set_add_pair(struct inode_set *set, struct hfs_inode *a,
+							   struct hfs_inode *b)
+{
+	if (a && b && inum(b) < inum(a)) {
+		inode_set_add(set, b);
+		inode_set_add(set, a);
+	} else {
+		inode_set_add(set, a);
+		inode_set_add(set, b);
+	}
+}
+
+static void lock_inodes(struct inode_set *set)
+{
+	for (int i = 0; i < set->n; i++)
+		pthread_rwlock_wrlock(inode_lock(set->inodes[i]));
+}
+
+static void unlock_inodes(struct inode_set *set)
+{
+	for (int i = set->n - 1; i >= 0; i--)
+		pthread_rwlock_unlock(inode_lock(set->inodes[i]));
+}
+
+static void write_begin(struct inode_set *set)
+{
+	for (int i = 0; i < set->n; i++)
+		write_seqbegin(inode_seq(set->inodes[i]));
+}
+
+static void write_end(struct inode_set *set)
+{
+	for (int i = 0; i < set->n; i++)
+		write_seqend(inode_seq(set->inodes[i]));
+}
+
+/**
+ * Allocate the sequence counts, the locks and the pin counts, one of each
+ * per inode.
+ */
+static int init_sync(void)
+{
+	free(inode_seqs);
+	free(inode_locks);
+	free(inode_pins);
+	inode_seqs = calloc(sb->ninodes, sizeof(uint32_t));
+	inode_locks = malloc(sb->ninodes * sizeof(pthread_rwlock_t));
+	inode_pins = calloc(sb->ninodes, sizeof(uint32_t));
+	if (!inode_seqs || !inode_locks || !inode_pins) {
+		pr_warn("Failed to allocate inode locks.\n");
+		return -1;
+	}
+	for (uint64_t i = 0; i < sb->ninodes; i++)
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	return 0;
+}
+
+static void free_sync(void)
+{
+	free(inode_seqs);
+	free(inode_locks);
+	free(inode_pins);
+	inode_seqs = NULL;
+	inode_locks = NULL;
+	inode_pins = NULL;
+}
 
 #ifdef _HFS_INLINE_DIRECTORY
 static inline void inode_set_inline_flag(struct hfs_inode *inode)
 {
 	inode->flags |= I_INLINE;
-	sb->inline_inodes++;
+	__atomic_add_fetch(&sb->inline_inodes, 1, __ATOMIC_RELAXED);
 }
 
 static inline void inode_unset_inline_flag(struct hfs_inode *inode)
 {
 	inode->flags &= (~I_INLINE);
-	sb->inline_inodes--;
+	__atomic_sub_fetch(&sb->inline_inodes, 1, __ATOMIC_RELAXED);
 }
 #endif
 
 
-static inline void inode_touch_atime(struct hfs_inode *inode)
+/*
+ * Timestamps are only stored when they change, so that an inode changed
+ * many times within a second is not dirtied again every time.
+ */
+static inline void inode_touch_ctime(struct hfs_inode *inode)
 {
-	inode->atime = time(NULL);
+	time_t now = hfs_now();
+	if (inode->ctime != now)
+		inode->ctime = now;
 }
 
-static inline void inode_touch_ctime(struct hfs_inode *inode)
+static inline void inode_touch_mtime(struct hfs_inode *inode)
 {
-	inode->ctime = time(NULL);
+	time_t now = hfs_now();
+	if (inode->mtime != now)
+		inode->mtime = now;
 }
 
-static inline void inode_touch_mtime(struct hfs_inode *inode)
+/* How stale relatime lets an access time get, like Linux's. */
+#define RELATIME_MAX	(24 * 60 * 60)
+
+/**
+ * A file has been read. Update its access time as the atime= mount
+ * option says. Readers take no lock, so whether an update is due is
+ * checked without one, and the read lock is only taken (keeping the
+ * inode from being freed) for the update itself. The access time is
+ * stored outside of the sequence count: stat() may see it change while
+ * it is reading the rest of the inode, like with Linux's lazytime.
+ */
+static void file_accessed(struct hfs_inode *file)
+{
+	time_t atime, now;
+
+	if (mount_opts.atime == HFS_ATIME_NONE)
+		return;
+	atime = __atomic_load_n(&file->atime, __ATOMIC_RELAXED);
+	now = hfs_now();
+	if (atime == now)
+		return;
+	if (mount_opts.atime == HFS_ATIME_RELATIME && atime > file->mtime
+			&& atime > file->ctime && now - atime < RELATIME_MAX)
+		return;
+
+	pthread_rwlock_rdlock(inode_lock(file));
+	if (file->type == T_REG)
+		__atomic_store_n(&file->atime, now, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(inode_lock(file));
+}
+
+/**
+ * Names have been added to or removed from dir. Let the in-memory
+ * lookup caches know that whatever they remember about dir is stale.
+ */
+static inline void dir_changed(struct hfs_inode *dir)
+{
+#ifdef _HFS_PCACHE
+	hfs_pcache_invalidate_dir(dir);
+#endif
+}
+
+/**
+ * The shape of the namespace has changed (e.g. a directory has moved),
+ * so any cached pathname may now resolve differently.
+ */
+static inline void namespace_changed(void)
 {
-	inode->mtime = time(NULL);
+#ifdef _HFS_PCACHE
+	hfs_pcache_invalidate_all();
+#endif
 }
 
 /*
@@ -110,23 +317,26 @@ static void init_superblock(size_t size)
 }
 
 /**
- * Initialise bitmaps.
+ * Initialise bitmaps, and the allocators built on them.
  */
-static inline void init_bitmaps(void)
+static inline int init_bitmaps(void)
 {
 	// set inode #0 so root inode will be allocated to 1.
 	inobitmap[0] |= 1;
+	return hfs_alloc_init();
 }
 
 /**
- * Read from an existing superblock to populate the global variables.
+ * Read from an existing superblock to populate the global variables,
+ * and set up the allocators.
  */
-static inline void read_sb(void)
+static inline int read_sb(void)
 {
 	sb = (struct hfs_superblock *)fs;
 	inodes = BLKADDR(sb->inodestart);
 	inobitmap = BLKADDR(sb->inodebitmapstart);
 	bitmap = BLKADDR(sb->bitmapstart);
+	return hfs_alloc_init();
 }
 
 /**
@@ -139,26 +349,17 @@ static void wipe_block(uint32_t blocknum)
 }
 
 /*
- * Consult the bitmap and allocate a datablock.
+ * Consult the bitmap and allocate a datablock for owner, placed
+ * according to the placement policy (see hfs_balloc_goal()).
  * 
  * Returns 0 for failure, positive int for allocated block number.
  */
-static uint32_t alloc_data_block(void)
-{
-	uint32_t block = 0;
-	for (int i = 0; i < sb->size; i++) {
-		if (bitmap[i] != 0xff) {
-			for (int j = 0; j < 8; j++) {
-				if (((bitmap[i] >> j) & 1) == 0) {
-					bitmap[i] |= 1 << j;
-					block = sb->datastart + (i * 8 + j);
-					wipe_block(block);
-					goto out;
-				}
-			}
-		}
-	}
-out:
+static uint32_t alloc_data_block(struct hfs_inode *owner)
+{
+	uint32_t block = hfs_balloc_alloc(hfs_balloc_goal(owner));
+
+	if (block)
+		wipe_block(block);
 	return block;
 }
 
@@ -167,10 +368,7 @@ out:
  */
 static void free_data_block(uint32_t b)
 {
-	char *bm = BLKADDR(sb->bitmapstart);
-	int byte = b / 8;
-	int bit = b % 8;
-	bm[byte] &= ~(1 << bit);
+	hfs_balloc_free(b);
 }
 
 /**
@@ -180,10 +378,10 @@ static void init_inode(struct hfs_inode *inode, uint8_t type)
 {
 	memset((void *)inode, 0x0, sizeof(struct hfs_inode));
 	inode->type = type;
-	sb->inode_used++;
+	hfs_alloc_count(HFS_CNT_INODES, 1);
 	// Enable inline by default for directories.
 	if (type == T_DIR) {
-		sb->ndirectories++;
+		hfs_alloc_count(HFS_CNT_DIRS, 1);
 #ifdef _HFS_INLINE_DIRECTORY
 		inode_set_inline_flag(inode);
 #endif
@@ -194,49 +392,45 @@ static void init_inode(struct hfs_inode *inode, uint8_t type)
 			inode->flags |= I_DIRHASH;
 #endif
 	} else if (type == T_REG) {
-		sb->nfiles++;
+		hfs_alloc_count(HFS_CNT_FILES, 1);
+		hfs_extent_init(inode);
 	}
-	inode_touch_atime(inode);
-	inode_touch_mtime(inode);
-	inode_touch_ctime(inode);
+	inode->atime = inode->mtime = inode->ctime = hfs_now();
 }
 
 /**
  * Find a free inode from the inode bitmap and return its inum.
+ * 
+ * Where the inode goes is up to the placement policy, see
+ * hfs_ialloc_goal(). With the default policy and the "ialloc=near" mount
+ * option, the first free inode after the parent directory's is taken, so
+ * that the inodes of a directory's children sit close to it (and to each
+ * other) in inodes[]. Otherwise allocation simply continues from where
+ * the last one left off.
  */
-static int get_free_inum(void)
+static int get_free_inum(uint8_t type, struct hfs_inode *parent)
 {
-	int inum = 0;
-	for (int i = 0; i < sb->ninodes / 8; i++) {
-		if (inobitmap[i] != 0xff) {
-			for (int j = 0; j < 8; j++) {
-				if (((inobitmap[i] >> j) & 1) == 0) {
-					inobitmap[i] |= 1 << j;
-					inum = i * 8 + j;
-					goto out;
-				}
-			}
-		}
-	}
-out:
-	return inum;
+	bool isdir = (type == T_DIR);
+	return hfs_ialloc_alloc(hfs_ialloc_goal(parent, isdir), isdir);
 }
 
 /*
  * Locates an unused (T_UNUSED) inode from the inode pool
  * and returns a pointer to that inode. Also initializes 
  * the type field.
+ * 
+ * parent is the directory the inode will be linked into, if known.
  */
-static struct hfs_inode *alloc_inode(uint8_t type)
+static struct hfs_inode *alloc_inode(uint8_t type, struct hfs_inode *parent)
 {
+	struct hfs_inode *inode = NULL;
 	int inum;
-	if (!(inum = get_free_inum()))
-		return NULL;
-	else {
-		struct hfs_inode *inode = inode_from_inum(inum);
+
+	if ((inum = get_free_inum(type, parent))) {
+		inode = inode_from_inum(inum);
 		init_inode(inode, type);
-		return inode;
 	}
+	return inode;
 }
 
 /**
@@ -250,25 +444,37 @@ static int free_inode(struct hfs_inode *inode)
 	if (inode->nlink > 0)
 		return -1;
 
-	for (int i = 0; i < NBLOCKS; i++) {
-		if (inode->data.blocks[i]) {
-			free_data_block(inode->data.blocks[i]);
-			inode->data.blocks[i] = 0;
+	// Still mapped by fs_read_map(): the last fs_read_unmap() frees it.
+	if (__atomic_fetch_or(&inode_pins[inum(inode)], PIN_ORPHAN,
+						  __ATOMIC_ACQ_REL) & ~PIN_ORPHAN)
+		return 0;
+	__atomic_store_n(&inode_pins[inum(inode)], 0, __ATOMIC_RELAXED);
+
+	if (inode->flags & I_EXTENTS) {
+		hfs_extent_free_all(inode);
+	} else {
+		for (int i = 0; i < NBLOCKS; i++) {
+			if (inode->data.blocks[i]) {
+				free_data_block(inode->data.blocks[i]);
+				inode->data.blocks[i] = 0;
+			}
 		}
 	}
 
+#ifdef _HFS_DIRHASH
 	if (inode->type == T_DIR)
-		sb->ndirectories--;
-	else if (inode->type == T_REG)
-		sb->nfiles--;
-
+		hfs_dirhash_release(inode);
+#endif
+	uint8_t type = inode->type;
+	if (type == T_DIR)
+		hfs_alloc_count(HFS_CNT_DIRS, -1);
+	else if (type == T_REG)
+		hfs_alloc_count(HFS_CNT_FILES, -1);
+	hfs_alloc_count(HFS_CNT_INODES, -1);
+
+	// The inode is done with before its number is up for grabs.
 	inode->type = T_UNUSED;
-	sb->inode_used--;
-
-	int ino = inum(inode);
-	int byte = ino / 8;
-	int bit = ino % 8;
-	inobitmap[byte] &= ~(1 << bit);
+	hfs_ialloc_free(inum(inode), type == T_DIR);
 
 	return 0;
 }
@@ -298,17 +504,417 @@ static struct hfs_dentry *alloc_dentry_from_block(uint32_t block_num,
 }
 
 /**
- * Allocates a dentry of reclen to the given directory inode.
+ * A dentry that has been moved to another place in its directory.
+ */
+struct dent_move {
+	struct hfs_dentry	*from;
+	struct hfs_dentry	*to;
+};
+
+static struct hfs_dentry *moved_dentry(struct hfs_dentry *dent,
+									   struct dent_move *moves, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (moves[i].from == dent)
+			return moves[i].to;
+	}
+	return dent;
+}
+
+struct dent_moves {
+	struct dent_move	*moves;
+	int					n;
+};
+
+static void fixup_process(struct hfs_process *p, void *arg)
+{
+	struct dent_moves *m = arg;
+
+	pthread_mutex_lock(&p->lock);
+	p->cwd = moved_dentry(p->cwd, m->moves, m->n);
+	for (int fd = 0; fd < p->nfiles; fd++) {
+		if (p->files[fd].f_dentry)
+			p->files[fd].f_dentry = moved_dentry(p->files[fd].f_dentry,
+												 m->moves, m->n);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Dentries have been moved (e.g. when a directory is converted or an
+ * index block is split), so update the working directories and the open
+ * files of every process that still point at the old locations. All
+ * moves are applied at once, since a dentry may have moved to where
+ * another one was.
+ *
+ * The path cache remembers dentries by address too, both as results and
+ * as the starting points of relative lookups, and the old addresses may
+ * now hold other dentries. It is retired as a whole.
+ */
+static void fixup_dentry_refs(struct dent_move *moves, int n)
+{
+	struct dent_moves m = { moves, n };
+
+	process_for_each(fixup_process, &m);
+	namespace_changed();
+}
+
+#ifdef _HFS_HTREE
+
+/**
+ * Hash of a name for the htree index (FNV-1a).
+ */
+static uint32_t dx_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+static inline struct hfs_dx_root *dx_get_root(struct hfs_inode *dir)
+{
+	return (struct hfs_dx_root *)(BLKADDR(dir->data.blocks[0])
+								  + HFS_DX_ROOT_OFF);
+}
+
+/**
+ * Find the index entry covering hash: the last one whose hash is not
+ * greater than it.
+ */
+static int dx_find(struct hfs_dx_root *root, uint32_t hash)
+{
+	int lo = 1, hi = root->count - 1, pos = 0;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		trace_read(&root->entries[mid], sizeof(struct hfs_dx_entry));
+		if (root->entries[mid].hash <= hash) {
+			pos = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return pos;
+}
+
+/**
+ * Append a copy of dentry src to the block being built at *end.
+ * Returns the new dentry.
+ */
+static struct hfs_dentry *dx_append(char *block, uint16_t *end,
+									struct hfs_dentry *src)
+{
+	struct hfs_dentry *dent = (struct hfs_dentry *)(block + *end);
+	uint16_t reclen = sizeof(struct hfs_dentry) + src->namelen;
+
+	dent->inum = src->inum;
+	dent->file_type = src->file_type;
+	dent->namelen = src->namelen;
+	dent->reclen = reclen;
+	memcpy(dent->name, src->name, src->namelen);
+	*end += reclen;
+	return dent;
+}
+
+struct dx_rec {
+	uint32_t			hash;
+	uint16_t			reclen;
+	struct hfs_dentry	*dent;
+};
+
+static int dx_rec_cmp(const void *a, const void *b)
+{
+	uint32_t ha = ((const struct dx_rec *)a)->hash;
+	uint32_t hb = ((const struct dx_rec *)b)->hash;
+	return (ha > hb) - (ha < hb);
+}
+
+/* Room for dentries in a leaf (the last few bytes can never be used). */
+#define DX_LEAF_SPACE	(BSIZE - sizeof(struct hfs_dentry))
+
+/* Most dentries two leaves can hold. */
+#define DX_MAX_RECS		(2 * BSIZE / sizeof(struct hfs_dentry))
+
+/**
+ * Find a free slot in data.blocks[] for a new leaf. Returns -1 if there
+ * is none.
+ */
+static int dx_free_slot(struct hfs_inode *dir)
+{
+	for (int i = 1; i < NBLOCKS; i++) {
+		if (!dir->data.blocks[i])
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Append the live dentries of a leaf to recs. Returns the new count.
+ */
+static int dx_collect(char *leaf, struct dx_rec *recs, int n, int *size)
+{
+	struct hfs_dentry *dent;
+
+	for_each_block_dent(dent, leaf) {
+		if (dent->reclen == 0)
+			break;
+		if (!dent->inum)
+			continue;
+		recs[n].hash = dx_hash(dent->name);
+		recs[n].reclen = sizeof(struct hfs_dentry) + dent->namelen;
+		recs[n].dent = dent;
+		*size += recs[n].reclen;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Sort the n dentries in recs, which hold size bytes, by hash and find
+ * where to split them in two: on a hash boundary as close to the middle
+ * as possible (so that all names with the same hash stay in the same
+ * leaf), with both halves fitting in a leaf. Returns the number of bytes
+ * below the split, or -EALLOC if there is no such boundary.
+ */
+static int dx_split_point(struct dx_rec *recs, int n, int size)
+{
+	int k, best = -1, left = 0;
+
+	qsort(recs, n, sizeof(recs[0]), dx_rec_cmp);
+	for (k = 1; k < n; k++) {
+		left += recs[k - 1].reclen;
+		if (recs[k].hash == recs[k - 1].hash)
+			continue;
+		if (left > DX_LEAF_SPACE)
+			break;
+		if (size - left > DX_LEAF_SPACE)
+			continue;
+		if (best < 0 || abs(size - 2 * left) < abs(size - 2 * best))
+			best = left;
+		else
+			break;
+	}
+	return best < 0 ? -EALLOC : best;
+}
+
+/**
+ * Rewrite the dentries in recs, sorted and split by dx_split_point(),
+ * into the two adjacent leaves of index entries pos and pos + 1, the
+ * first best bytes of them into the first leaf, and without holes. The
+ * hash of index entry pos + 1 is updated to the split.
+ */
+static void dx_distribute(struct hfs_inode *dir, int pos,
+						  struct dx_rec *recs, int n, int best)
+{
+	static __thread char buf[2][BSIZE];
+	static __thread struct dent_move moves[DX_MAX_RECS];
+	struct hfs_dx_root *root = dx_get_root(dir);
+	char *leaf[2];
+	uint16_t end[2] = { 0, 0 };
+	int k, left = 0;
+
+	leaf[0] = BLKADDR(dir->data.blocks[root->entries[pos].block]);
+	leaf[1] = BLKADDR(dir->data.blocks[root->entries[pos + 1].block]);
+	memset(buf, 0, sizeof(buf));
+	left = 0;
+	for (k = 0; k < n; k++) {
+		int half = (left >= best);
+		struct hfs_dentry *copy = dx_append(buf[half], &end[half],
+											recs[k].dent);
+		if (half && end[1] == copy->reclen)
+			root->entries[pos + 1].hash = recs[k].hash;
+		moves[k].from = recs[k].dent;
+		moves[k].to = (struct hfs_dentry *)
+						(leaf[half] + ((char *)copy - buf[half]));
+		left += recs[k].reclen;
+	}
+	memcpy(leaf[0], buf[0], BSIZE);
+	memcpy(leaf[1], buf[1], BSIZE);
+	fixup_dentry_refs(moves, n);
+}
+
+/**
+ * Make room in the leaf of index entry pos. If there is a free slot, the
+ * leaf is split in two: a new leaf is inserted into the index after pos,
+ * and the upper half of the hashes move there. Otherwise, the entries
+ * are shared out with a neighbouring leaf instead, moving the boundary
+ * between them, as long as the two together have room for need more
+ * bytes.
+ */
+static int dx_make_room(struct hfs_inode *dir, int pos, int need)
+{
+	static __thread struct dx_rec recs[DX_MAX_RECS];
+	struct hfs_dx_root *root = dx_get_root(dir);
+	int slot, n, best, size = 0;
+
+	if (root->count < root->limit && (slot = dx_free_slot(dir)) > 0) {
+		char *leaf = BLKADDR(dir->data.blocks[root->entries[pos].block]);
+
+		// Nothing is changed until the leaf is known to split.
+		n = dx_collect(leaf, recs, 0, &size);
+		if (n < 2 || (best = dx_split_point(recs, n, size)) < 0
+				|| !(dir->data.blocks[slot] = alloc_data_block(dir)))
+			return -EALLOC;
+		dir->size += BSIZE;
+
+		memmove(&root->entries[pos + 2], &root->entries[pos + 1],
+				(root->count - pos - 1) * sizeof(struct hfs_dx_entry));
+		root->entries[pos + 1].block = slot;
+		root->count++;
+		dx_distribute(dir, pos, recs, n, best);
+		return 0;
+	}
+
+	// Try the right neighbour, then the left one.
+	for (int i = 0; i < 2; i++) {
+		int lpos = (i == 0) ? pos : pos - 1;
+		if (lpos < 0 || lpos + 1 >= root->count)
+			continue;
+
+		size = 0;
+		n = dx_collect(BLKADDR(dir->data.blocks[root->entries[lpos].block]),
+					   recs, 0, &size);
+		n = dx_collect(BLKADDR(dir->data.blocks[root->entries[lpos + 1].block]),
+					   recs, n, &size);
+		if (size + 2 * need > 2 * DX_LEAF_SPACE)
+			continue;
+		if ((best = dx_split_point(recs, n, size)) >= 0) {
+			dx_distribute(dir, lpos, recs, n, best);
+			return 0;
+		}
+	}
+	return -EALLOC;
+}
+
+/**
+ * Turn a single-block directory into an htree directory: its entries
+ * move to a new leaf, and block 0 is rewritten as the index root.
+ */
+static int dx_make_indexed(struct hfs_inode *dir)
+{
+	static __thread char buf[BSIZE];
+	static __thread struct dent_move moves[BSIZE / sizeof(struct hfs_dentry)];
+	char *block = BLKADDR(dir->data.blocks[0]);
+	char *leaf;
+	struct hfs_dentry *dent, *dot, *dotdot;
+	struct hfs_dx_root *root;
+	uint32_t parent = 0;
+	uint16_t end = 0;
+	int slot = 1, n = 0;
+
+	if (dir->data.blocks[slot]
+			|| !(dir->data.blocks[slot] = alloc_data_block(dir)))
+		return -EALLOC;
+	dir->size += BSIZE;
+	leaf = BLKADDR(dir->data.blocks[slot]);
+
+	memset(buf, 0, BSIZE);
+	for_each_block_dent(dent, block) {
+		if (dent->reclen == 0)
+			break;
+		if (!dent->inum)
+			continue;
+		if (strcmp(dent->name, ".") == 0)
+			continue;
+		if (strcmp(dent->name, "..") == 0) {
+			parent = dent->inum;
+			continue;
+		}
+		struct hfs_dentry *copy = dx_append(buf, &end, dent);
+		moves[n].from = dent;
+		moves[n].to = (struct hfs_dentry *)(leaf + ((char *)copy - buf));
+		n++;
+	}
+	memcpy(leaf, buf, BSIZE);
+	fixup_dentry_refs(moves, n);
+
+	memset(block, 0, BSIZE);
+	dot = (struct hfs_dentry *)block;
+	dot->inum = inum(dir);
+	dot->file_type = T_DIR;
+	dentry_set_name(dot, ".");
+	dot->reclen = get_dentry_reclen_from_name(".");
+	dotdot = (struct hfs_dentry *)(block + dot->reclen);
+	dotdot->inum = parent;
+	dotdot->file_type = T_DIR;
+	dentry_set_name(dotdot, "..");
+	dotdot->reclen = BSIZE - dot->reclen;
+
+	root = dx_get_root(dir);
+	root->limit = NBLOCKS - 1;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = slot;
+
+#ifdef _HFS_DIRHASH
+	inode_disable_dirhash(dir);
+#endif
+	dir->flags |= I_HTREE;
+	return 0;
+}
+
+/**
+ * Allocate a dentry for name in an htree directory, in the leaf its hash
+ * maps to, making room in the leaf if it is full (see dx_make_room()).
+ *
+ * If no room can be made, the index is dropped and the directory carries
+ * on as a plain list of blocks (block 0 still reads as "." and ".."),
+ * which keeps whatever space is left in the leaves usable. NULL is
+ * returned in that case too.
+ */
+static struct hfs_dentry *dx_alloc_dentry(struct hfs_inode *dir,
+										  const char *name, uint16_t reclen)
+{
+	struct hfs_dx_root *root = dx_get_root(dir);
+	uint32_t hash = dx_hash(name);
+	struct hfs_dentry *dent;
+	int pos;
+
+	for (int tries = 0; tries < 4; tries++) {
+		pos = dx_find(root, hash);
+		dent = alloc_dentry_from_block(
+					dir->data.blocks[root->entries[pos].block], reclen);
+		if (dent)
+			return dent;
+		if (dx_make_room(dir, pos, reclen) < 0)
+			break;
+	}
+	dir->flags &= ~I_HTREE;
+	return NULL;
+}
+#endif  // _HFS_HTREE
+
+/**
+ * Allocates a dentry of reclen for name to the given directory inode.
  * 
  * _HFS_DIRHASH:
  * If, as a result of this allocation, the size of this directory grows
  * beyond one block, then we need to unset the I_DIRHASH flag to indicate
  * that this directory will NO LONGER use dirhash.
+ *
+ * _HFS_HTREE:
+ * Instead of growing to a second block, a directory is converted to an
+ * htree directory, and from then on entries go where the index says.
+ * Without htree support, the index of an htree directory is dropped and
+ * the directory is treated as a plain list of blocks.
  */
-static struct hfs_dentry *alloc_dentry(struct hfs_inode *dir, uint16_t reclen)
+static struct hfs_dentry *alloc_dentry(struct hfs_inode *dir,
+									   const char *name, uint16_t reclen)
 {
 	struct hfs_dentry *dent;
 	int unused = -1;
+
+#ifdef _HFS_HTREE
+	if (dir->flags & I_HTREE) {
+		if ((dent = dx_alloc_dentry(dir, name, reclen)))
+			return dent;
+		// The index is full, fall through to the plain allocator.
+	}
+#else
+	dir->flags &= ~I_HTREE;
+#endif
 	for (int i = 0; i < NBLOCKS; i++) {
 		if (dir->data.blocks[i]) {
 			dent = alloc_dentry_from_block(dir->data.blocks[i], reclen);
@@ -324,14 +930,31 @@ static struct hfs_dentry *alloc_dentry(struct hfs_inode *dir, uint16_t reclen)
 	if (unused < 0)
 		return NULL;
 
+#ifdef _HFS_HTREE
+	if (unused == 1 && dir->data.blocks[0]) {
+		for (unused = 2; unused < NBLOCKS; unused++) {
+			if (dir->data.blocks[unused])
+				break;
+		}
+		if (unused == NBLOCKS) {
+			if (dx_make_indexed(dir) < 0) {
+				printf("Error: data allocation failed.\n");
+				return NULL;
+			}
+			return dx_alloc_dentry(dir, name, reclen);
+		}
+		unused = 1;
+	}
+#endif
+
 	// allocate new data block to unused address
 #ifdef _HFS_DIRHASH
 	// If we are allocating ALL BUT the VERY FIRST block, then 
 	// we need to disable dirhash for this directory.
 	if (dir->data.blocks[0])
-		dir->flags &= ~I_DIRHASH;
-#endif 
-	if ((dir->data.blocks[unused] = alloc_data_block()) == 0) {
+		inode_disable_dirhash(dir);
+#endif
+	if ((dir->data.blocks[unused] = alloc_data_block(dir)) == 0) {
 		printf("Error: data allocation failed.\n");
 		return NULL;
 	}
@@ -360,17 +983,23 @@ static inline void init_dentry(struct hfs_dentry *dent,
 /**
  * Unlinks a dentry from its inode.
  * As a result of this unlinking, the inode's nlink is decremented.
+ * dir is the directory holding dent.
  * 
  * NOTE: Do NOT reset the name. The rename() system call relies on this
  * function not wiping out the name.
  * 
  * TODO: Coalescing adjacent free spaces
  */
-static int unlink_dent(struct hfs_dentry *dent)
+static int unlink_dent(struct hfs_inode *dir, struct hfs_dentry *dent)
 {
 	if (strcmp(dent->name, ".") == 0 || strcmp(dent->name, "..") == 0)
 		return -1;
 
+#ifdef _HFS_DIRHASH
+	if (dir->flags & I_DIRHASH)
+		hfs_dirhash_delete(dir, dent->name);
+#endif
+
 	struct hfs_inode *inode = dentry_get_inode(dent);
 	inode->nlink--;	 // Can be done in if clause. I know. Keep quiet.
 	// If inode nlink becomes 0, deallocate that inode.
@@ -422,7 +1051,7 @@ static int convert_inline_directory(struct hfs_inode *dir)
 		return -1;
 
 	struct hfs_dentry *dent;
-	uint32_t block = alloc_data_block();
+	uint32_t block = alloc_data_block(dir);
 	if (!block) 
 		return -1;
 
@@ -439,6 +1068,8 @@ static int convert_inline_directory(struct hfs_inode *dir)
 
 	// Conver the inline directory entries and fill in the block.
 	struct hfs_dentry *inline_dent;
+	struct dent_move moves[sizeof(dir->data) / sizeof(struct hfs_dentry)];
+	int n = 0;
 	for_each_inline_dent(inline_dent, dir) {
 		if (!inline_dent->reclen)
 			break;  // end of list
@@ -446,7 +1077,10 @@ static int convert_inline_directory(struct hfs_inode *dir)
 			continue;  // empty item
 		dent = alloc_dentry_from_block(block, inline_dent->reclen);	
 		init_dentry(dent, &inodes[inline_dent->inum], inline_dent->name);
+		moves[n].from = inline_dent;
+		moves[n++].to = dent;
 	}
+	fixup_dentry_refs(moves, n);
 
 	// Unset the inline bit in flag
 	inode_unset_inline_flag(dir);
@@ -483,7 +1117,7 @@ static struct hfs_dentry *new_dentry(struct hfs_inode *dir,
 
 	// Not inline or inline allocation was unsuccessful
 	if (!dent) {
-		if (!(dent = alloc_dentry(dir, reclen)))
+		if (!(dent = alloc_dentry(dir, name, reclen)))
 			return NULL;
 	}
 
@@ -543,7 +1177,7 @@ struct hfs_dentry *do_creat(struct hfs_inode *dir,
 	struct hfs_dentry *dent;
 	struct hfs_inode *inode;
 
-	inode = alloc_inode(type);
+	inode = alloc_inode(type, dir);
 	if (!inode)
 		return NULL;
 
@@ -552,7 +1186,7 @@ struct hfs_dentry *do_creat(struct hfs_inode *dir,
 
 	if (type == T_DIR) {
 		if ((ret = init_dir_inode(inode, dir)) < 0) {
-			unlink_dent(dent);
+			unlink_dent(dir, dent);
 			return NULL;
 		}
 	}
@@ -564,31 +1198,21 @@ struct hfs_dentry *do_creat(struct hfs_inode *dir,
  */
 static void init_rootdir(void)
 {
-	struct hfs_inode *rootino = alloc_inode(T_DIR);     
+	struct hfs_inode *rootino = alloc_inode(T_DIR, NULL);
 	pr_info("Root inum: %d\n", inum(rootino));
 	init_dir_inode(rootino, rootino);	// root inode parent is self
 	sb->rootdir.file_type = T_DIR;
 	sb->rootdir.inum = inum(rootino);
 }
 
-/**
- * Initializes file descriptor table.
- */
-static void init_fd(void)
-{
-	for (int i = 0; i < MAXOPENFILES; i++) {
-		openfiles[i].f_dentry = NULL;
-		openfiles[i].offset = 0;
-	}
-}
-
 /**
  * Master function to initialize the file system.
  */
 static int init_fs(size_t size)
 {
 	init_superblock(size);	// fill in superblock
-	init_bitmaps();
+	if (init_bitmaps() < 0)
+		return -1;
 	init_rootdir();			// create root directory
 
 	pr_debug("Inode size: %ld\n", sizeof(struct hfs_inode));
@@ -603,7 +1227,11 @@ static int init_fs(size_t size)
 static int init_caches(void)
 {
 #ifdef _HFS_DIRHASH
-	hfs_dirhash_init();
+	hfs_dirhash_init(mount_opts.dirhash_size, mount_opts.dirhash_policy);
+#endif
+#ifdef _HFS_PCACHE
+	if (hfs_pcache_init() < 0)
+		return -1;
 #endif
 	return 0;
 }
@@ -616,6 +1244,9 @@ static void free_caches(void)
 #ifdef _HFS_DIRHASH
 	hfs_dirhash_free();
 #endif
+#ifdef _HFS_PCACHE
+	hfs_pcache_free();
+#endif
 }
 
 /**
@@ -632,12 +1263,15 @@ static struct hfs_dentry *find_dent_in_block(uint32_t bnum, const char *name)
 	int namelen = strlen(name) + 1;
 
 	for_each_block_dent(dent, block) {
+		trace_read(dent, sizeof(struct hfs_dentry));
 		if (dent->reclen == 0)
 			break;
 		if (!dent->inum)
 			continue;
-		if (dent->namelen == namelen && strcmp(dent->name, name) == 0) {
-			return dent;		
+		if (dent->namelen == namelen) {
+			trace_read(dent->name, namelen);
+			if (strcmp(dent->name, name) == 0)
+				return dent;
 		}
 	}
 
@@ -655,13 +1289,16 @@ static struct hfs_dentry *lookup_inline_dent(struct hfs_inode *dir,
 	int namelen = strlen(name) + 1;
 
 	for_each_inline_dent(dent, dir) {
+		trace_read(dent, sizeof(struct hfs_dentry));
 		if (dent->reclen == 0)
 			break;
 		if (dent->inum == 0)
 			continue;
-		if (namelen == dent->namelen && strcmp(name, dent->name) == 0) {
-			return dent;
-		}	
+		if (namelen == dent->namelen) {
+			trace_read(dent->name, namelen);
+			if (strcmp(name, dent->name) == 0)
+				return dent;
+		}
 	}
 	return NULL;
 }
@@ -674,6 +1311,8 @@ static struct hfs_dentry *lookup_inline_dent(struct hfs_inode *dir,
  */
 static struct hfs_dentry *lookup_dent(struct hfs_inode *dir, const char *name)
 {
+	sysstat_phase(HFS_PHASE_DIRSCAN);
+
 #ifdef _HFS_INLINE_DIRECTORY
 	// Inline directory lookup
 	if (inode_is_inline_dir(dir)) {
@@ -681,9 +1320,22 @@ static struct hfs_dentry *lookup_dent(struct hfs_inode *dir, const char *name)
 	}
 #endif  // _HFS_INLINE_DIRECTORY
 
+#ifdef _HFS_HTREE
+	// Indexed lookup, "." and ".." are in block 0
+	if ((dir->flags & I_HTREE) && strcmp(name, ".") != 0
+			&& strcmp(name, "..") != 0) {
+		struct hfs_dx_root *root = dx_get_root(dir);
+		trace_read(root, sizeof(*root));
+		int pos = dx_find(root, dx_hash(name));
+		trace_read(&root->entries[pos], sizeof(struct hfs_dx_entry));
+		return find_dent_in_block(
+					dir->data.blocks[root->entries[pos].block], name);
+	}
+#endif  // _HFS_HTREE
+
 	// Regular lookup
 	struct hfs_dentry *dent = NULL;
-	for (int i = 0; i < NBLOCKS - 1; i++) {
+	for (int i = 0; i < NBLOCKS; i++) {
 		if (dir->data.blocks[i]) {
 			dent = find_dent_in_block(dir->data.blocks[i], name);
 			if (dent)
@@ -813,36 +1465,75 @@ struct hfs_dummy_dentry {
 };
 
 /**
- * Lookup the provided pathname. (No relative pathnames.) 
- * Even if pathname does not start with '/', the file system
- * will still use the root directory as a starting point.
- */
-static struct hfs_dentry *do_lookup(const char *pathname, struct hfs_inode **pi)
-{
+ * Walk the provided pathname one component at a time, starting at the
+ * start dentry.
+ *
+ * No locks are taken. Each directory is scanned under its sequence count
+ * (see include/sync.h), and the scan is repeated if the directory changed
+ * while it was being scanned. The inode found is read under the same
+ * count, so the walk never steps into a directory through a dentry that
+ * had already been changed.
+ *
+ * @param start	The dentry the walk starts at (root or cwd)
+ * @param istart	The inode of start
+ * @param pathname	The pathname to resolve
+ * @param pi	Filled with the parent inode (see dir_lookup())
+ * @param inode	Filled with the inode of the dentry found, as read under
+ * 				the count of the directory it was found in. The dentry
+ * 				itself may be changed as soon as the walk is over.
+ * @param last	Filled with the directory scanned in the final step of
+ * 				the walk, or NULL if the result was not read from a
+ * 				directory (i.e. it must not be cached).
+ * @param key	_HFS_PCACHE: the path cache key of the full pathname, used
+ * 				to cache every intermediate directory under its prefix.
+ * @param depth	_HFS_PCACHE: number of components of the full pathname
+ * 				already resolved before start.
+ */
+static struct hfs_dentry *walk_path(struct hfs_dentry *start,
+									struct hfs_inode *istart,
+									const char *pathname,
+									struct hfs_inode **pi,
+									struct hfs_inode **inode,
+									struct hfs_inode **last,
+									struct hfs_pcache_key *key, int depth)
+{
+	sysstat_phase(HFS_PHASE_WALK);
 	struct hfs_dentry *dent = NULL;
-	struct hfs_dentry *prev = NULL;
+	struct hfs_dentry *prev = start;
 	struct hfs_inode *iprev = NULL;
-	const char *pathname_cpy = pathname;
+	struct hfs_inode *next;
 	char component[DENTRYNAMELEN + 1] = { '\0' };
+	uint32_t seq;
 
 #ifdef _HFS_INLINE_DIRECTORY
-	static struct hfs_dummy_dentry dummy_dentry;
+	static __thread struct hfs_dummy_dentry dummy_dentry;
 #endif
 
-	prev = (pathname[0] == '/') ? &sb->rootdir : cwd;
+	*last = NULL;
+	next = istart;
 
 	// FIXME: lookup would fail if called with "/"
 	while (get_path_component(&pathname, component)) {
-		iprev = dentry_get_inode(prev);
-		if (iprev->type != T_DIR) 
-			return NULL;
+		iprev = next;
+retry:
+		seq = read_seqbegin(inode_seq(iprev));
+		trace_read(iprev, offsetof(struct hfs_inode, ctime));
+		if (iprev->type != T_DIR) {
+			if (read_seqretry(inode_seq(iprev), seq))
+				goto retry;
+			iprev = NULL;
+			dent = NULL;
+			break;
+		}
 
 #ifdef _HFS_INLINE_DIRECTORY
 		// Inline directories require special handling with
 		// the "." and ".." entries since they don't really exist.
 		if (inode_is_inline_dir(iprev)) {
 			if (strcmp(component, ".") == 0) {
+				// next is still iprev, prev may be out of date.
 				dent = prev;
+				*last = NULL;
 				goto step_check;
 			} else if (strcmp(component, "..") == 0) {
 				dent = &dummy_dentry.dent;
@@ -851,22 +1542,34 @@ static struct hfs_dentry *do_lookup(const char *pathname, struct hfs_inode **pi)
 				strcpy(dent->name, "..");
 				dent->namelen = strlen("..") + 1;
 				dent->reclen = get_dentry_reclen_from_name("..");
+				next = dentry_get_inode(dent);
+				*last = NULL;
 				goto step_check;
 			}
 		}
+#endif
+		*last = iprev;
+#ifdef _HFS_PCACHE
+		if (key)
+			hfs_pcache_key_dir(key, iprev);
 #endif
 		if (iprev->flags & I_DIRHASH) {
 #ifdef _HFS_DIRHASH
-			struct hfs_dirhash_entry *ent;
-			if ((ent = hfs_dirhash_lookup(iprev, component)))
-				dent = ent->dent;
-			else
-				dent = NULL;
+			if ((dent = hfs_dirhash_lookup(iprev, component))) {
+				trace_read(dent, sizeof(struct hfs_dentry) + dent->namelen);
+			} else if (!(iprev->flags & I_DIRHASH)) {
+				// The directory could not be cached.
+				dent = lookup_dent(iprev, component);
+			}
 #endif
 		} else {
 			dent = lookup_dent(iprev, component);
 		}
+		if (dent)
+			next = dentry_get_inode(dent);
 step_check:
+		if (read_seqretry(inode_seq(iprev), seq))
+			goto retry;
 		if (!dent) {
 			// If lookup failed on the last component, then fill
 			// in the pi field. Otherwise, set pi field to NULL
@@ -878,22 +1581,145 @@ step_check:
 		if (!path_is_empty(pathname)) {
 			// Continue traversal, current directory becomes new prev.
 			prev = dent;
+#ifdef _HFS_PCACHE
+			hfs_pcache_put_prefix(key, ++depth, dent, next, iprev, *last);
+#endif
 		}
 	}
 
 	if (pi)
 		*pi = iprev;
-	
+	if (inode)
+		*inode = dent ? next : NULL;
+
+	return dent;
+}
+
+/**
+ * Lookup the provided pathname, starting at the directory start, whose
+ * inode is istart. The inode of the dentry found is stored in *inode.
+ *
+ * _HFS_PCACHE:
+ * The full pathname is first looked up in the path cache. On a miss,
+ * the walk resumes from the deepest prefix of the pathname that is
+ * cached, if any, and the result is then cached.
+ */
+static struct hfs_dentry *do_lookup_at(struct hfs_dentry *start,
+									   struct hfs_inode *istart,
+									   const char *pathname,
+									   struct hfs_inode **pi,
+									   struct hfs_inode **inode)
+{
+	struct hfs_dentry *dent;
+	struct hfs_inode *iprev, *ifound, *last;
+	struct hfs_pcache_key *keyp = NULL;
+	int depth = 0;
+
+#ifdef _HFS_PCACHE
+	struct hfs_pcache_key key;
+	struct hfs_pcache_hit hit;
+
+	keyp = &key;
+	hfs_pcache_key_init(&key, istart, pathname);
+	if (hfs_pcache_lookup(&key, &hit)) {
+		if (pi)
+			*pi = hit.pi;
+		if (inode)
+			*inode = hit.inode;
+		return hit.dent;
+	}
+
+	if (hfs_pcache_lookup_prefix(&key, &depth, &hit)) {
+		const char *rest = pathname + key.prefix[depth - 1].len;
+		key.dir_gen = hit.dir_gen;
+		if (!hit.dent || hit.inode->type != T_DIR) {
+			// A component along the way is missing or not a directory.
+			dent = NULL;
+			iprev = ifound = NULL;
+			last = inode_from_inum(hit.dir);
+		} else if (path_is_empty(rest)) {
+			// Only trailing separators left, e.g. "/a/b/"
+			dent = hit.dent;
+			ifound = hit.inode;
+			iprev = hit.pi;
+			last = inode_from_inum(hit.dir);
+		} else {
+			dent = walk_path(hit.dent, hit.inode, rest, &iprev, &ifound,
+							 &last, &key, depth);
+		}
+		// The walk went through hit.dent, which must not have been
+		// changed since the probe.
+		if (hfs_pcache_hit_valid(&hit))
+			goto out;
+		depth = 0;
+		hfs_pcache_key_init(&key, istart, pathname);
+	}
+#endif
+
+	dent = walk_path(start, istart, pathname, &iprev, &ifound, &last,
+					 keyp, depth);
+
+#ifdef _HFS_PCACHE
+out:
+	hfs_pcache_put(&key, dent, ifound, iprev, last);
+#endif
+
+	if (pi)
+		*pi = iprev;
+	if (inode)
+		*inode = ifound;
 	return dent;
 }
 
+static struct hfs_dentry *do_lookup(const char *pathname, struct hfs_inode **pi,
+									struct hfs_inode **inode)
+{
+	struct hfs_dentry *start;
+
+	start = (pathname[0] == '/') ? &sb->rootdir : current_process()->cwd;
+	trace_read(start, sizeof(struct hfs_dentry));
+	return do_lookup_at(start, dentry_get_inode(start), pathname, pi, inode);
+}
+
 /**
  * Regular lookup. Searches for the file specified by pathname
  * and return the resulting dentry or NULL if file isn't found.
  */
 struct hfs_dentry *lookup(const char *pathname)
 {
-	return do_lookup(pathname, NULL);
+	return do_lookup(pathname, NULL, NULL);
+}
+
+/**
+ * Look up pathname, and return the inode it leads to or NULL if file
+ * isn't found. Callers that go on to read the inode (e.g. stat) must
+ * use this rather than read it through the dentry, which may already
+ * have been moved or reused by the time lookup() returns. The dentry
+ * is stored in *dent if dent is not NULL.
+ */
+struct hfs_inode *lookup_inode(const char *pathname, struct hfs_dentry **dent)
+{
+	struct hfs_inode *inode = NULL;
+	struct hfs_dentry *found;
+
+	found = do_lookup(pathname, NULL, &inode);
+	if (dent)
+		*dent = found;
+	return found ? inode : NULL;
+}
+
+/**
+ * Look up pathname relative to the directory dir, whose inode is idir,
+ * which the caller found earlier and holds on to like a working
+ * directory, and return the inode it leads to (see lookup_inode()).
+ * Used by the ring (see ring.c) to look up many names in one directory.
+ */
+struct hfs_inode *lookup_at(struct hfs_dentry *dir, struct hfs_inode *idir,
+							const char *pathname)
+{
+	struct hfs_inode *inode = NULL;
+
+	return do_lookup_at(dir, idir, pathname, NULL, &inode) ? inode : NULL;
 }
 
 /**
@@ -908,21 +1734,19 @@ struct hfs_dentry *lookup(const char *pathname)
  */
 struct hfs_dentry *dir_lookup(const char *pathname, struct hfs_inode **pi)
 {
-	return do_lookup(pathname, pi);
+	return do_lookup(pathname, pi, NULL);
 }
 
 /**
- * Find an unused file struct and return its index 
- * as the file descriptor.
+ * Called by system calls that modify things once they hold their locks:
+ * check that pathname still resolves to dent in dir, as it did when it
+ * was looked up without the locks.
  */
-static int get_open_fd(void)
+static bool lookup_unchanged(const char *pathname, struct hfs_dentry *dent,
+							 struct hfs_inode *dir)
 {
-	for (int i = 0; i < MAXOPENFILES; i++) {
-		if (!(openfiles[i].f_dentry)) {
-			return i;
-		}
-	}
-	return -ENOFD;
+	struct hfs_inode *pi;
+	return dir_lookup(pathname, &pi) == dent && pi == dir;
 }
 
 /**
@@ -933,10 +1757,12 @@ static int get_open_fd(void)
  */
 int fs_creat(const char *pathname)
 {
-	int fd, ret;
+	sysstat_syscall(SYS_creat);
+	struct inode_set locked;
 	struct hfs_dentry *dent;
 	struct hfs_inode *dir;
 
+retry:
 	if ((dent = dir_lookup(pathname, &dir))) {
 		pr_warn("%s already exists.\n", pathname);
 		return -EEXISTS;
@@ -952,12 +1778,114 @@ int fs_creat(const char *pathname)
 	if (strlen(filename) > DENTRYNAMELEN)
 		return -EINVNAME;
 
-	if (!(do_creat(dir, filename, T_REG)))
-		return -EALLOC;
+	locked = (struct inode_set){ 0 };
+	inode_set_add(&locked, dir);
+	lock_inodes(&locked);
+	if (!lookup_unchanged(pathname, NULL, dir)) {
+		unlock_inodes(&locked);
+		goto retry;
+	}
+
+	write_begin(&locked);
+	dent = do_creat(dir, filename, T_REG);
+	write_end(&locked);
+	if (dent)
+		dir_changed(dir);
+	unlock_inodes(&locked);
+
+	return dent ? 0 : -EALLOC;
+}
+
+/**
+ * Check if a block of dentries contains no valid dentries
+ * (apart from the . and .. entries).
+ */
+static int dir_block_isempty(uint32_t b)
+{
+	char *block = BLKADDR(b);
+	struct hfs_dentry *dent;
 	
+	for_each_block_dent(dent, block) {
+		if (dent->reclen == 0)
+			break;
+		if (dent->inum) {
+			if (strcmp(dentry_get_name(dent), ".") == 0
+					|| strcmp(dentry_get_name(dent), "..") == 0)
+				continue;
+			return -1;
+		}
+	}
 	return 0;
 }
 
+/**
+ * Check if a directory is empty (apart from the . and .. entries).
+ */
+static bool dir_isempty(struct hfs_inode *dir)
+{
+#ifdef _HFS_INLINE_DIRECTORY
+	if (inode_is_inline_dir(dir)) {
+		struct hfs_dentry *dent;
+		for_each_inline_dent(dent, dir) {
+			if (dent->reclen == 0)
+				break;
+			if (dent->inum)
+				return false;
+		}
+		return true;
+	} 
+#endif  // _HFS_INLINE_DIRECTORY
+
+	for (int i = 0; i < NBLOCKS; i++) {
+		if (dir->data.blocks[i]) {
+			if (dir_block_isempty(dir->data.blocks[i]) < 0)
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * The parent of a directory, read under its sequence count.
+ */
+static struct hfs_inode *dir_parent(struct hfs_inode *dir)
+{
+	struct hfs_dentry *dotdot;
+	uint32_t seq, p_inum;
+
+	do {
+		seq = read_seqbegin(inode_seq(dir));
+		p_inum = 0;
+#ifdef _HFS_INLINE_DIRECTORY
+		if (inode_is_inline_dir(dir))
+			p_inum = dir->data.inline_dir.p_inum;
+		else
+#endif
+		if ((dotdot = lookup_dent(dir, "..")))
+			p_inum = dotdot->inum;
+	} while (read_seqretry(inode_seq(dir), seq));
+
+	return (p_inum && p_inum < sb->ninodes) ? inode_from_inum(p_inum) : NULL;
+}
+
+/**
+ * Is a the directory dir or one of its ancestors? Only meaningful while
+ * directories cannot move, i.e. under rename_lock.
+ */
+static bool is_ancestor(struct hfs_inode *a, struct hfs_inode *dir)
+{
+	struct hfs_inode *root = dentry_get_inode(&sb->rootdir);
+
+	for (uint64_t n = 0; dir && n < sb->ninodes; n++) {
+		if (dir == a)
+			return true;
+		if (dir == root || dir->type != T_DIR)
+			return false;
+		dir = dir_parent(dir);
+	}
+	return false;
+}
+
 /**
  * Basic version of the POSIX rename system call.
  * 
@@ -974,10 +1902,15 @@ int fs_creat(const char *pathname)
  */
 int fs_rename(const char *oldpath, const char *newpath)
 {
+	sysstat_syscall(SYS_rename);
 	struct hfs_dentry *olddent = NULL, *newdent = NULL;
 	struct hfs_inode *olddir = NULL, *newdir = NULL;
-	struct hfs_inode *inode;
+	struct hfs_inode *inode, *victim = NULL;
+	struct inode_set locked;
+	bool cross;
+	int ret = 0;
 
+retry:
 	// Old path must exist; new path will be overwritten if exists,
 	// but new path's parent directory must be present.
 	if (!(olddent = dir_lookup(oldpath, &olddir)) || !olddir)
@@ -999,16 +1932,66 @@ int fs_rename(const char *oldpath, const char *newpath)
 			return -ESAME;
 		if (newdent->file_type != olddent->file_type)
 			return -EINVTYPE;
+		victim = dentry_get_inode(newdent);
+	}
 
-		unlink_dent(newdent);
+	// Across two directories, the lock order depends on which is above
+	// the other, so no directory may move until both are locked.
+	if ((cross = (olddir != newdir))) {
+		pthread_mutex_lock(&rename_lock);
+		if (inode->type == T_DIR) {
+			// A directory cannot be moved under itself, and a
+			// directory above olddir is not empty.
+			if (is_ancestor(inode, newdir)) {
+				ret = -EINVAL;
+				goto out_unlock_rename;
+			}
+			if (victim && is_ancestor(victim, olddir)) {
+				ret = -ENOTEMPTY;
+				goto out_unlock_rename;
+			}
+		}
 	}
 
+	// The moved inode is locked too: a directory's ".." changes, and
+	// so does the ctime.
+	locked = (struct inode_set){ 0 };
+	if (cross && is_ancestor(newdir, olddir)) {
+		inode_set_add(&locked, newdir);
+		inode_set_add(&locked, olddir);
+	} else if (cross && is_ancestor(olddir, newdir)) {
+		inode_set_add(&locked, olddir);
+		inode_set_add(&locked, newdir);
+	} else {
+		inode_set_add_pair(&locked, olddir, newdir);
+	}
+	inode_set_add_pair(&locked, inode, victim);
+	lock_inodes(&locked);
+	if (!lookup_unchanged(oldpath, olddent, olddir)
+			|| !lookup_unchanged(newpath, newdent, newdir)
+			|| dentry_get_inode(olddent) != inode
+			|| (newdent && dentry_get_inode(newdent) != victim)) {
+		unlock_inodes(&locked);
+		if (cross)
+			pthread_mutex_unlock(&rename_lock);
+		victim = NULL;
+		goto retry;
+	}
+	if (victim && victim->type == T_DIR && !dir_isempty(victim)) {
+		ret = -ENOTEMPTY;
+		goto out_unlock;
+	}
+
+	write_begin(&locked);
+	if (newdent)
+		unlink_dent(newdir, newdent);
+
 	// NOTE: new_dentry may have converted directory from inline to regular,
 	// so we have to unlink before creating new dentry. Since unlink_dent
 	// decreases nlink and we don't need that, we'll preemptively increase
 	// nlink by 1 prior to unlinking the old inode.
 	inode->nlink++;		
-	unlink_dent(olddent);
+	unlink_dent(olddir, olddent);
 	new_dentry(newdir, inode, newname);
 	inode->nlink--;
 
@@ -1017,42 +2000,40 @@ int fs_rename(const char *oldpath, const char *newpath)
 
 	inode_touch_ctime(inode);
 	inode_touch_mtime(newdir);
+	write_end(&locked);
 
-	return 0;
+	if (inode->type == T_DIR) {
+		namespace_changed();
+	} else {
+		dir_changed(olddir);
+		dir_changed(newdir);
+	}
+
+out_unlock:
+	unlock_inodes(&locked);
+out_unlock_rename:
+	if (cross)
+		pthread_mutex_unlock(&rename_lock);
+	return ret;
 }
 
 /**
  * Basic version of the POSIX open system call.
- * Currently no support for flags/modes as there are no
- * processes yet.
+ * Currently no support for flags/modes. The descriptor belongs to the
+ * calling thread's process (see process.h).
  */
 int fs_open(const char *pathname)
 {
-	int fd;
+	sysstat_syscall(SYS_open);
 	struct hfs_dentry *dent;
+	struct hfs_inode *inode;
 
-	if ((fd = get_open_fd()) < 0)
-		return fd;	// ENOFD
 	if ((dent = lookup(pathname)) == NULL)
 		return -ENOFOUND;
-	if ((dentry_get_inode(dent))->type == T_DIR)
+	if ((inode = dentry_get_inode(dent))->type == T_DIR)
 		return -EINVTYPE;
 
-	openfiles[fd].f_dentry = dent;
-	openfiles[fd].offset = 0;
-	return fd;
-}
-
-/**
- * Check if a give file descriptor is actually in use.
- */
-static int fd_inuse(int fd)
-{
-	if (fd < 0 || fd >= MAXOPENFILES)
-		return -1;
-	if (!openfiles[fd].f_dentry)
-		return -1;
-	return 1;
+	return fd_install(dent, inode);	// or ENOFD
 }
 
 /**
@@ -1060,11 +2041,23 @@ static int fd_inuse(int fd)
  */
 int fs_close(int fd)
 {
-	if (!fd_inuse(fd))
-		return -EINVFD;
+	sysstat_syscall(SYS_close);
+	struct hfs_inode *file;
+	int ret;
 
-	openfiles[fd].f_dentry = NULL;
-	openfiles[fd].offset = 0;
+	if (!(file = fd_get(fd, NULL)))
+		return -EINVFD;
+	if ((ret = fd_close(fd)) < 0)
+		return ret;
+
+	// Blocks set aside for appends are given back once the file is
+	// closed (by any descriptor, which at worst costs the next append
+	// a trip to the bitmap).
+	if (file->type == T_REG && hfs_extent_reserved(file)) {
+		pthread_rwlock_wrlock(inode_lock(file));
+		hfs_extent_release(file);
+		pthread_rwlock_unlock(inode_lock(file));
+	}
 	return 0;
 }
 
@@ -1074,82 +2067,204 @@ int fs_close(int fd)
  */
 unsigned int fs_lseek(int fd, unsigned int off)
 {
-	if (!fd_inuse(fd))
+	sysstat_syscall(SYS_lseek);
+	struct hfs_inode *file;
+
+	if (!(file = fd_get(fd, NULL)))
 		return -EINVFD;
-	if (off < 0 || off > dentry_get_inode(openfiles[fd].f_dentry)->size)
+	if (off < 0 || off > file->size)
 		return -EINVAL;
 
-	openfiles[fd].offset = off;
+	fd_set_offset(fd, file, off);
 	return off;
 }
 
 /**
- * Get the actual address for the offset in the given file.
- * 
- * @param file	The file inode.
- * @param off	The desired offset
- * @param alloc	TRUE if want block allocation if currently unused.
- * @return		The address corresponding to offset.
+ * Find where block lblk of a file is on disk, and how many of the up to
+ * want blocks from it on follow it there. If alloc is set and lblk is not
+ * mapped yet, it is allocated, together with as many of the want - 1
+ * blocks after it as can be put right after it, and *fresh is set.
+ * Fresh blocks are not zeroed; that is up to the caller, for whatever
+ * part of them it does not write.
+ *
+ * Returns true if lblk is mapped, with *pblk its disk block and *run the
+ * number of blocks in the run. Otherwise *run is the number of blocks up
+ * to the next one that is mapped.
+ */
+static bool file_map(struct hfs_inode *file, uint32_t lblk, uint32_t want,
+					 bool alloc, uint32_t *pblk, uint32_t *run, bool *fresh)
+{
+	if (fresh)
+		*fresh = false;
+	if (file->flags & I_EXTENTS) {
+		if (hfs_extent_map(file, lblk, pblk, run))
+			return true;
+		if (!alloc)
+			return false;
+		if (want > *run)
+			want = *run;
+		if (!(*run = hfs_extent_alloc(file, lblk, want, pblk)))
+			return false;
+		*fresh = true;
+		return true;
+	}
+
+	// Files made before extents map each block on its own.
+	*run = 1;
+	if (lblk >= NBLOCKS) {
+		*run = UINT32_MAX;
+		return false;
+	}
+	if (!file->data.blocks[lblk]) {
+		if (!alloc || !(file->data.blocks[lblk] = alloc_data_block(file)))
+			return false;
+	}
+	*pblk = file->data.blocks[lblk];
+	while (*run < want && lblk + *run < NBLOCKS
+			&& file->data.blocks[lblk + *run] == *pblk + *run)
+		(*run)++;
+	if (*pblk < sb->datastart || (uint64_t)*pblk + *run > sb->size) {
+		*run = 1;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Total length of the buffers of an iovec array, or -EINVAL if there are
+ * too many of them or they add up to more than a call can return.
  */
-static char *get_off_addr(struct hfs_inode *file, unsigned int off, int alloc)
+static int64_t iov_total(const struct iovec *iov, int iovcnt)
 {
-	int b = off / BSIZE;
-	if (b > NBLOCKS)
-		return NULL;
+	int64_t total = 0;
 
-	char *addr = NULL;
-	if (file->data.blocks[b]) {
-		addr = BLKADDR(file->data.blocks[b]) + off % BSIZE;
-	} else {
-		if (alloc) {
-			file->data.blocks[b] = alloc_data_block();
-			if (file->data.blocks[b]) {
-				addr = BLKADDR(file->data.blocks[b]) + off % BSIZE;
+	if (iovcnt < 0 || iovcnt > HFS_IOV_MAX || (iovcnt && !iov))
+		return -EINVAL;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len && !iov[i].iov_base)
+			return -EINVAL;
+		if ((total += iov[i].iov_len) > INT_MAX)
+			return -EINVAL;
+	}
+	return total;
+}
+
+/**
+ * Read from a file into the buffers of iov, filling each before moving
+ * on to the next. The mapping is looked up once per run of the file,
+ * however many buffers the run is spread over. Holes read as zeros.
+ * 
+ * @param file		The file's inode
+ * @param off		The starting offset
+ * @param iov		Buffers wherein bytes read are stored
+ * @param iovcnt	Number of buffers
+ * @param n			Number of bytes requested (their total length)
+ * @return			The number of bytes read
+ */
+static unsigned int do_readv(struct hfs_inode *file, unsigned int off,
+							 const struct iovec *iov, int iovcnt,
+							 unsigned int n)
+{
+	uint32_t size = file->size;	// once, it may be being written to
+	unsigned int nread = 0;
+	uint32_t lblk, pblk, run, want;
+	uint64_t len, chunk;	// size of each run, and of each copy
+	size_t iov_off = 0;		// into iov[i]
+	int i = 0;
+	char *src;
+
+	if (off >= size)
+		return 0;
+	if (n > size - off)
+		n = size - off;  // rest of the file.
+
+	while (nread < n) {
+		lblk = off / BSIZE;
+		want = ((uint64_t)off + (n - nread) - 1) / BSIZE - lblk + 1;
+		src = NULL;
+		if (file_map(file, lblk, want, false, &pblk, &run, NULL))
+			src = (char *)BLKADDR(pblk) + off % BSIZE;
+
+		len = (uint64_t)run * BSIZE - off % BSIZE;  // rest of the run.
+		if (len > n - nread)
+			len = n - nread;  // rest of requested bytes.
+		for (uint64_t done = 0; done < len; done += chunk) {
+			sysstat_phase(HFS_PHASE_COPY);
+			while (iov_off == iov[i].iov_len) {
+				if (++i == iovcnt)
+					return nread + done;	// the buffers are full
+				iov_off = 0;
 			}
+			chunk = iov[i].iov_len - iov_off;
+			if (chunk > len - done)
+				chunk = len - done;
+			if (src)
+				memcpy(iov[i].iov_base + iov_off, src + done, chunk);
+			else
+				memset(iov[i].iov_base + iov_off, 0, chunk);
+			iov_off += chunk;
 		}
+		nread += len;
+		off += len;
 	}
-	return addr;
+
+	return nread;
 }
 
 /**
- * Read from a file.
- * 
- * @param file	The file's inode
- * @param off	The starting offset
- * @param buf	Buffer wherein bytes read are stored
- * @param n		Number of bytes requested
- * @return		The number of bytes read
- * 
+ * Read from a file at off into iov, n bytes in all.
+ *
+ * The file is read without a lock, and read again if it was written to
+ * in the meantime (under the read lock, if that keeps happening).
+ */
+static unsigned int read_file(struct hfs_inode *file, unsigned int off,
+							  const struct iovec *iov, int iovcnt,
+							  unsigned int n)
+{
+	unsigned int ret;
+	uint32_t seq;
+
+	for (int tries = 0; ; tries++) {
+		if (tries == MAX_SEQ_RETRIES) {
+			pthread_rwlock_rdlock(inode_lock(file));
+			ret = do_readv(file, off, iov, iovcnt, n);
+			pthread_rwlock_unlock(inode_lock(file));
+			break;
+		}
+		seq = read_seqbegin(inode_seq(file));
+		ret = do_readv(file, off, iov, iovcnt, n);
+		if (!read_seqretry(inode_seq(file), seq))
+			break;
+	}
+	if (ret > 0)
+		file_accessed(file);
+	return ret;
+}
+
+/**
+ * The regular file open at fd, and the descriptor's offset if off is
+ * given; or NULL, with *err set.
  */
-unsigned int do_read(struct hfs_inode *file, unsigned int off, 
-					 void *buf, unsigned int n)
+static struct hfs_inode *fd_file(int fd, foff_t *off, int *err)
 {
-	int nread = 0;
-	int size;	// size of each copy
-	char *start;
+	struct hfs_inode *file;
 
-	while (n > 0 && off < file->size) {
-		if (!(start = get_off_addr(file, off, 0)))
-			goto out;
-
-		// determine what the copy size should be
-		size = BSIZE - off % BSIZE;  // rest of the block.
-		if (file->size < off + size)
-			size = file->size - off;  // rest of the file.
-		if (nread + size > n)
-			size = n - nread;  // rest of requested bytes.
-		memcpy(buf + nread, start, size);
-		n -= size;
-		nread += size;
-		off += size;
+	if (!(file = fd_get(fd, off))) {
+		*err = -EINVFD;
+		return NULL;
 	}
-
-out:
-	return nread;
+	if (file->type != T_REG) {
+		*err = -EINVTYPE;
+		return NULL;
+	}
+	return file;
 }
 
 /**
  * Basic version of the POSIX read system call.
+ *
+ * Two threads reading the same descriptor at once may both read from the
+ * same offset; use fs_pread() to read from a shared descriptor.
  * 
  * @param fd	File descriptor to read from
  * @param buf	Buffer wherein bytes read are stored
@@ -1158,61 +2273,257 @@ out:
  */
 unsigned int fs_read(int fd, void *buf, unsigned int count)
 {
-	if (!fd_inuse(fd))
-		return -EINVFD;
+	sysstat_syscall(SYS_read);
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	struct hfs_inode *file;
+	foff_t off;
+	int ret;
+
+	if (!(file = fd_file(fd, &off, &ret)))
+		return ret;
 	if (!buf)
 		return -1;	
 
-	struct hfs_inode *file = dentry_get_inode(openfiles[fd].f_dentry);
-	if (file->type != T_REG)
-		return -EINVTYPE;
+	ret = read_file(file, off, &iov, 1, count);
+	fd_set_offset(fd, file, off + ret);
+	return ret;
+}
 
+/**
+ * Basic version of the POSIX pread system call: read from offset off,
+ * without using or moving the descriptor's offset.
+ */
+int fs_pread(int fd, void *buf, unsigned int count, unsigned int off)
+{
+	sysstat_syscall(SYS_pread);
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	struct hfs_inode *file;
 	int ret;
-	unsigned int off = openfiles[fd].offset;
-	ret = do_read(file, off, buf, count);
-	if (ret < 0)
-		goto bad_read;
-	openfiles[fd].offset += ret;
 
-bad_read:
+	if (!(file = fd_file(fd, NULL, &ret)))
+		return ret;
+	if (!buf || count > INT_MAX)
+		return -EINVAL;
+
+	return read_file(file, off, &iov, 1, count);
+}
+
+/**
+ * Basic version of the POSIX readv system call: read into the buffers of
+ * iov in order, in a single pass over the file.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	sysstat_syscall(SYS_readv);
+	struct hfs_inode *file;
+	int64_t total;
+	foff_t off;
+	int ret;
+
+	if (!(file = fd_file(fd, &off, &ret)))
+		return ret;
+	if ((total = iov_total(iov, iovcnt)) < 0)
+		return total;
+
+	ret = read_file(file, off, iov, iovcnt, total);
+	fd_set_offset(fd, file, off + ret);
 	return ret;
 }
 
+/* What holes are mapped to. */
+static const char zero_block[BSIZE];
+
 /**
- * Write to a file.
+ * Map up to len bytes of a file from offset off, without copying them:
+ * iov is filled with the addresses and lengths of the runs of the image
+ * they are in, at most iovcnt of them (holes are mapped to a block of
+ * zeros, one block per entry). The descriptor's offset is not used or
+ * moved.
+ *
+ * If anything was mapped, the file is pinned until fs_read_unmap(pin):
+ * if it is unlinked in the meantime, its blocks are only freed once the
+ * last pin is gone. The blocks are not copied on write, though, so the
+ * runs show whatever is written to the file after they were mapped,
+ * like a shared mapping would.
  * 
- * @param file	The file's inode
- * @param off	The starting offset
- * @param buf	Buffer wherein bytes to be written are stored
- * @param n		Number of bytes left to be written
- * @return		The number of bytes written
+ * @param fd		File descriptor to read from
+ * @param off		Offset to start at
+ * @param len		Number of bytes requested
+ * @param iov		Where the runs go
+ * @param iovcnt	Number of entries in iov
+ * @param pin		Set to what fs_read_unmap() needs
+ * @return			Number of entries of iov filled (0 at the end of the
+ * 					file), or a negative error code
+ */
+int fs_read_map(int fd, unsigned int off, unsigned int len,
+				struct iovec *iov, int iovcnt, struct hfs_pin *pin)
+{
+	sysstat_syscall(SYS_read_map);
+	struct hfs_inode *file;
+	uint32_t lblk, pblk, run, want, size;
+	uint64_t n;
+	int cnt = 0;
+
+	pin->inum = 0;
+	if (!(file = fd_get(fd, NULL)))
+		return -EINVFD;
+	if (!iov || iovcnt <= 0)
+		return -EINVAL;
+	if (file->type != T_REG)
+		return -EINVTYPE;
+
+	// The read lock keeps the mapping still while it is looked up and
+	// the file from being freed before it is pinned.
+	pthread_rwlock_rdlock(inode_lock(file));
+	size = file->size;
+	if (off < size && len > size - off)
+		len = size - off;
+	while (off < size && len > 0 && cnt < iovcnt) {
+		lblk = off / BSIZE;
+		want = ((uint64_t)off + len - 1) / BSIZE - lblk + 1;
+		if (file_map(file, lblk, want, false, &pblk, &run, NULL)) {
+			n = (uint64_t)run * BSIZE - off % BSIZE;
+			iov[cnt].iov_base = (char *)BLKADDR(pblk) + off % BSIZE;
+		} else {
+			n = BSIZE - off % BSIZE;
+			iov[cnt].iov_base = (void *)zero_block;
+		}
+		if (n > len)
+			n = len;
+		iov[cnt++].iov_len = n;
+		off += n;
+		len -= n;
+	}
+	if (cnt) {
+		__atomic_add_fetch(&inode_pins[inum(file)], 1, __ATOMIC_RELAXED);
+		pin->inum = inum(file);
+	}
+	pthread_rwlock_unlock(inode_lock(file));
+	if (cnt)
+		file_accessed(file);
+	return cnt;
+}
+
+/**
+ * Drop the pin fs_read_map() took. The runs it mapped must not be used
+ * any more.
  */
-unsigned int do_write(struct hfs_inode *file, unsigned int *off, 
-					  void *buf, unsigned int n)
+void fs_read_unmap(struct hfs_pin *pin)
 {
-	int nwritten = 0;
-	int size;	// size of each write
+	sysstat_syscall(SYS_read_unmap);
+	struct hfs_inode *file;
+	struct inode_set locked = { 0 };
+
+	if (!pin->inum)
+		return;
+	file = inode_from_inum(pin->inum);
+	pin->inum = 0;
+	if (__atomic_sub_fetch(&inode_pins[inum(file)], 1, __ATOMIC_ACQ_REL)
+			!= PIN_ORPHAN)
+		return;
+
+	// The file was unlinked while pinned, and this was the last pin.
+	inode_set_add(&locked, file);
+	lock_inodes(&locked);
+	if (__atomic_load_n(&inode_pins[inum(file)], __ATOMIC_RELAXED)
+			== PIN_ORPHAN) {
+		write_begin(&locked);
+		free_inode(file);
+		write_end(&locked);
+	}
+	unlock_inodes(&locked);
+}
+
+/**
+ * Write the buffers of iov to a file, one after the other, n bytes in
+ * all. The mapping is looked up (or allocated) once per run of the file.
+ * Blocks allocated for the write are only zeroed where it does not cover
+ * them, so a large write into new blocks is a single copy per extent.
+ * 
+ * @param file		The file's inode
+ * @param off		The starting offset, moved past what was written
+ * @param iov		Buffers wherein bytes to be written are stored
+ * @param iovcnt	Number of buffers
+ * @param n			Number of bytes to be written (their total length)
+ * @return			The number of bytes written, or -EALLOC if there was
+ * 					no room for any of them
+ */
+static int do_writev(struct hfs_inode *file, unsigned int *off,
+					 const struct iovec *iov, int iovcnt, unsigned int n)
+{
+	unsigned int nwritten = 0;
+	uint32_t lblk, pblk, run, want, head;
+	uint64_t len, chunk;	// size of each run, and of each copy
+	size_t iov_off = 0;		// into iov[i]
+	int i = 0;
+	bool fresh;
 	char *start;
 
 	inode_touch_mtime(file);
 
-	while (n > 0) {
-		if (!(start = get_off_addr(file, *off, 1)))
-			return -EALLOC;
-
-		// determine what the copy size should be
-		size = n;
-		if (size > BSIZE - *off % BSIZE)
-			size = BSIZE - *off % BSIZE;
-		memcpy(start, buf + nwritten, size);
-		n -= size;
-		nwritten += size;
-		*off += size;
+	if ((uint64_t)*off + n > UINT32_MAX)
+		n = UINT32_MAX - *off;
+	while (nwritten < n) {
+		lblk = *off / BSIZE;
+		want = ((uint64_t)*off + (n - nwritten) - 1) / BSIZE - lblk + 1;
+		if (!file_map(file, lblk, want, true, &pblk, &run, &fresh))
+			return nwritten ? nwritten : -EALLOC;
+
+		start = BLKADDR(pblk);
+		head = *off % BSIZE;
+		len = (uint64_t)run * BSIZE - head;
+		if (len > n - nwritten)
+			len = n - nwritten;
+		if (fresh) {
+			// The run is no longer than the write, but it may start
+			// and end in the middle of a block.
+			memset(start, 0, head);
+			if ((head + len) % BSIZE)
+				memset(start + head + len, 0, BSIZE - (head + len) % BSIZE);
+		}
+		for (uint64_t done = 0; done < len; done += chunk) {
+			sysstat_phase(HFS_PHASE_COPY);
+			while (iov_off == iov[i].iov_len) {
+				if (++i == iovcnt) {	// nothing more to write
+					*off += done;
+					return nwritten + done;
+				}
+				iov_off = 0;
+			}
+			chunk = iov[i].iov_len - iov_off;
+			if (chunk > len - done)
+				chunk = len - done;
+			memcpy(start + head + done, iov[i].iov_base + iov_off, chunk);
+			iov_off += chunk;
+		}
+		nwritten += len;
+		*off += len;
 	}
 
 	return nwritten;
 }
 
+/**
+ * Write iov to a file at *off under its lock, and grow the file if the
+ * write went past its end.
+ */
+static int write_file(struct hfs_inode *file, unsigned int *off,
+					  const struct iovec *iov, int iovcnt, unsigned int n)
+{
+	struct inode_set locked = { 0 };
+	int ret;
+
+	inode_set_add(&locked, file);
+	lock_inodes(&locked);
+	write_begin(&locked);
+	ret = do_writev(file, off, iov, iovcnt, n);
+	if (ret > 0 && *off > file->size)
+		file->size = *off;
+	write_end(&locked);
+	unlock_inodes(&locked);
+	return ret;
+}
+
 /**
  * Basic version of the POSIX write system call.
  * 
@@ -1223,24 +2534,61 @@ unsigned int do_write(struct hfs_inode *file, unsigned int *off,
  */
 unsigned int fs_write(int fd, void *buf, unsigned int count)
 {
-	if (!fd_inuse(fd))
-		return -EINVFD;
+	sysstat_syscall(SYS_write);
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	struct hfs_inode *file;
+	foff_t off;
+	int ret;
+
+	if (!(file = fd_file(fd, &off, &ret)))
+		return ret;
 	if (!buf)
 		return -1;	
 
-	struct hfs_inode *file = dentry_get_inode(openfiles[fd].f_dentry);
-	if (file->type != T_REG)
-		return -EINVTYPE;
+	if ((ret = write_file(file, &off, &iov, 1, count)) > 0)
+		fd_set_offset(fd, file, off);
+	return ret;
+}
 
+/**
+ * Basic version of the POSIX pwrite system call: write at offset off,
+ * without using or moving the descriptor's offset. Like lseek, off may
+ * not be past the end of the file.
+ */
+int fs_pwrite(int fd, const void *buf, unsigned int count, unsigned int off)
+{
+	sysstat_syscall(SYS_pwrite);
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+	struct hfs_inode *file;
 	int ret;
-	unsigned int off = openfiles[fd].offset;
-	ret = do_write(file, &off, buf, count);
-	
-	if (ret) {
-		openfiles[fd].offset = off;
-		if (off > file->size)
-			file->size = off;
-	}
+
+	if (!(file = fd_file(fd, NULL, &ret)))
+		return ret;
+	if (!buf || count > INT_MAX || off > file->size)
+		return -EINVAL;
+
+	return write_file(file, &off, &iov, 1, count);
+}
+
+/**
+ * Basic version of the POSIX writev system call: write the buffers of iov
+ * in order, in a single pass over the file, under one lock.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	sysstat_syscall(SYS_writev);
+	struct hfs_inode *file;
+	int64_t total;
+	foff_t off;
+	int ret;
+
+	if (!(file = fd_file(fd, &off, &ret)))
+		return ret;
+	if ((total = iov_total(iov, iovcnt)) < 0)
+		return total;
+
+	if ((ret = write_file(file, &off, iov, iovcnt, total)) > 0)
+		fd_set_offset(fd, file, off);
 	return ret;
 }
 
@@ -1249,14 +2597,34 @@ unsigned int fs_write(int fd, void *buf, unsigned int count)
  */
 int fs_unlink(const char *pathname)
 {
-	struct hfs_inode *dir;
+	sysstat_syscall(SYS_unlink);
+	struct hfs_inode *dir, *inode;
 	struct hfs_dentry *dent;
+	struct inode_set locked;
+
+retry:
 	if (!(dent = dir_lookup(pathname, &dir)) || !dir)
 		return -ENOFOUND;
-	if (dentry_get_inode(dent)->type == T_DIR)
+	inode = dentry_get_inode(dent);
+	if (inode->type == T_DIR)
 		return -EINVTYPE;
-	unlink_dent(dent);
+
+	locked = (struct inode_set){ 0 };
+	inode_set_add(&locked, dir);
+	inode_set_add(&locked, inode);
+	lock_inodes(&locked);
+	if (!lookup_unchanged(pathname, dent, dir)
+			|| dentry_get_inode(dent) != inode) {
+		unlock_inodes(&locked);
+		goto retry;
+	}
+
+	write_begin(&locked);
+	unlink_dent(dir, dent);
 	inode_touch_mtime(dir);
+	write_end(&locked);
+	dir_changed(dir);
+	unlock_inodes(&locked);
 	return 0;
 }
 
@@ -1265,15 +2633,19 @@ int fs_unlink(const char *pathname)
  */
 int fs_link(const char *oldpath, const char *newpath)
 {
-	struct hfs_dentry *olddent = lookup(oldpath);
-	if (!olddent)
+	sysstat_syscall(SYS_link);
+	struct hfs_dentry *olddent, *dent;
+	struct hfs_inode *inode, *dir;
+	struct inode_set locked;
+
+retry:
+	if (!(olddent = lookup(oldpath)))
 		return -ENOFOUND;
-	struct hfs_inode *inode = dentry_get_inode(olddent);
+	inode = dentry_get_inode(olddent);
 	if (inode->type == T_DIR)
 		return -EINVTYPE;
 
 	// make sure newpath doesn't already exist
-	struct hfs_inode *dir;
 	if (dir_lookup(newpath, &dir)) {
 		pr_warn("%s already exists.\n", newpath);
 		return -EEXISTS;
@@ -1283,11 +2655,26 @@ int fs_link(const char *oldpath, const char *newpath)
 
 	char filename[DENTRYNAMELEN + 1];
 	get_filename(newpath, filename);
-	if (!new_dentry(dir, inode, filename)) {
-		return -EALLOC;
-	} else {
-		return 0;
+
+	// With the inode locked, it only has to be still alive.
+	locked = (struct inode_set){ 0 };
+	inode_set_add(&locked, dir);
+	inode_set_add(&locked, inode);
+	lock_inodes(&locked);
+	if (inode->nlink == 0 || inode->type == T_DIR
+			|| !lookup_unchanged(newpath, NULL, dir)) {
+		unlock_inodes(&locked);
+		goto retry;
 	}
+
+	write_begin(&locked);
+	dent = new_dentry(dir, inode, filename);
+	write_end(&locked);
+	if (dent)
+		dir_changed(dir);
+	unlock_inodes(&locked);
+
+	return dent ? 0 : -EALLOC;
 }
 
 /**
@@ -1295,8 +2682,12 @@ int fs_link(const char *oldpath, const char *newpath)
  */
 int fs_mkdir(const char *pathname)
 {
+	sysstat_syscall(SYS_mkdir);
 	struct hfs_inode *dir;
+	struct hfs_dentry *dent;
+	struct inode_set locked;
 
+retry:
 	if (dir_lookup(pathname, &dir)) {
 		pr_warn("%s already exists.\n", pathname);
 		return -EEXISTS;
@@ -1312,59 +2703,24 @@ int fs_mkdir(const char *pathname)
 	if (strlen(filename) > DENTRYNAMELEN)
 		return -EINVNAME;
 
-	if (!(do_creat(dir, filename, T_DIR)))
-		return -EALLOC;
-
-	return 0;
-}
-
-/**
- * Check if a block of dentries contains no valid dentries
- * (apart from the . and .. entries).
- */
-static int dir_block_isempty(uint32_t b)
-{
-	char *block = BLKADDR(b);
-	struct hfs_dentry *dent;
-	
-	for_each_block_dent(dent, block) {
-		if (dent->reclen == 0)
-			break;
-		if (dent->inum) {
-			if (strcmp(dentry_get_name(dent), ".") == 0
-					|| strcmp(dentry_get_name(dent), "..") == 0)
-				continue;
-			return -1;
-		}
+	locked = (struct inode_set){ 0 };
+	inode_set_add(&locked, dir);
+	lock_inodes(&locked);
+	if (!lookup_unchanged(pathname, NULL, dir)) {
+		unlock_inodes(&locked);
+		goto retry;
 	}
-	return 0;
-}
 
-/**
- * Check if a directory is empty.
- */
-static int dir_isempty(struct hfs_inode *dir)
-{
-#ifdef _HFS_INLINE_DIRECTORY
-	if (inode_is_inline_dir(dir)) {
-		struct hfs_dentry *dent;
-		for_each_inline_dent(dent, dir) {
-			if (dent->reclen == 0)
-				break;
-			if (dent->inum)
-				return -1;
-		}
-		return 0;
-	} 
-#endif  // _HFS_INLINE_DIRECTORY
-
-	for (int i = 0; i < NBLOCKS; i++) {
-		if (dir->data.blocks[i]) {
-			if (!dir_block_isempty(dir->data.blocks[i]))
-				return -ENOTEMPTY;
-		}
+	write_begin(&locked);
+	dent = do_creat(dir, filename, T_DIR);
+	write_end(&locked);
+	if (dent) {
+		dir_changed(dir);
+		dir_changed(dentry_get_inode(dent));
 	}
-	return 0;
+	unlock_inodes(&locked);
+
+	return dent ? 0 : -EALLOC;
 }
 
 /**
@@ -1372,18 +2728,41 @@ static int dir_isempty(struct hfs_inode *dir)
  */
 int fs_rmdir(const char *pathname)
 {
-	struct hfs_inode *parent;
-	struct hfs_dentry *dent = dir_lookup(pathname, &parent);
+	sysstat_syscall(SYS_rmdir);
+	struct hfs_inode *parent, *dir;
+	struct hfs_dentry *dent;
+	struct inode_set locked;
+
+retry:
+	dent = dir_lookup(pathname, &parent);
 	if (!dent || !parent)
 		return -ENOFOUND;
-	if (dentry_get_inode(dent)->type != T_DIR)
+	dir = dentry_get_inode(dent);
+	if (dir->type != T_DIR)
 		return -EINVTYPE;
-	if (!dir_isempty(dentry_get_inode(dent)))
+
+	locked = (struct inode_set){ 0 };
+	inode_set_add(&locked, parent);
+	inode_set_add(&locked, dir);
+	lock_inodes(&locked);
+	if (!lookup_unchanged(pathname, dent, parent)
+			|| dentry_get_inode(dent) != dir) {
+		unlock_inodes(&locked);
+		goto retry;
+	}
+	if (!dir_isempty(dir)) {
+		unlock_inodes(&locked);
 		return -ENOTEMPTY;
+	}
 
-	unlink_dent(dent);
+	write_begin(&locked);
+	unlink_dent(parent, dent);
 	parent->nlink--;
 	inode_touch_mtime(parent);
+	write_end(&locked);
+	dir_changed(parent);
+	dir_changed(dir);
+	unlock_inodes(&locked);
 	return 0;
 }
 
@@ -1405,7 +2784,7 @@ static int symlink_set_target(struct hfs_inode *symlink, const char *target)
 	}
 
 	/* Regular symlink, stored in a block */
-	if (!(symlink->data.blocks[0] = alloc_data_block()))
+	if (!(symlink->data.blocks[0] = alloc_data_block(symlink)))
 		return -EALLOC;
 	char *path = BLKADDR(symlink->data.blocks[0]);
 	strncpy(path, target, linklen);
@@ -1424,34 +2803,46 @@ static int symlink_set_target(struct hfs_inode *symlink, const char *target)
  */
 int fs_symlink(const char *target, const char *linkpath)
 {
+	sysstat_syscall(SYS_symlink);
 	int ret;
 	struct hfs_dentry *dent;
 	struct hfs_inode *dir = NULL, *symlink;
+	struct inode_set locked;
 
 	if (strlen(target) > BSIZE)
 		return -EINVAL;
 
-	if ((do_lookup(linkpath, &dir)))
+retry:
+	if ((do_lookup(linkpath, &dir, NULL)))
 		return -EEXISTS;
 	if (!dir)
 		return -ENOFOUND;
-	
-	symlink = alloc_inode(T_SYM);
-	if (!symlink)
-		return -EALLOC;
 
 	char filename[DENTRYNAMELEN];
 	get_filename(linkpath, filename);
 	if (strlen(filename) > DENTRYNAMELEN)
 		return -EINVNAME;
 
-	if (!(dent = do_creat(dir, filename, T_SYM)))
-		return -EALLOC;
-
-	symlink = inode_from_inum(dent->inum);
-	if ((ret = symlink_set_target(symlink, target)) < 0)
-		unlink_dent(dent);
+	locked = (struct inode_set){ 0 };
+	inode_set_add(&locked, dir);
+	lock_inodes(&locked);
+	if (!lookup_unchanged(linkpath, NULL, dir)) {
+		unlock_inodes(&locked);
+		goto retry;
+	}
 
+	write_begin(&locked);
+	if ((dent = do_creat(dir, filename, T_SYM))) {
+		symlink = inode_from_inum(dent->inum);
+		if ((ret = symlink_set_target(symlink, target)) < 0)
+			unlink_dent(dir, dent);
+	} else {
+		ret = -EALLOC;
+	}
+	write_end(&locked);
+	if (dent)
+		dir_changed(dir);
+	unlock_inodes(&locked);
 	return ret;
 }
 
@@ -1464,6 +2855,7 @@ int fs_symlink(const char *target, const char *linkpath)
  */
 int fs_readlink(const char *pathname, char *buf, size_t bufsize)
 {
+	sysstat_syscall(SYS_readlink);
 	struct hfs_dentry *dent;
 	struct hfs_inode *symlink;
 	char *link;
@@ -1506,6 +2898,10 @@ static void do_stat(uint32_t inum, struct hfs_stat *statbuf)
 	statbuf->st_accesstime = inode->atime;
 	statbuf->st_modifytime = inode->mtime;
 	statbuf->st_changetime = inode->ctime;
+	if (inode->flags & I_EXTENTS) {
+		statbuf->st_blocks = hfs_extent_nblocks(inode);
+		return;
+	}
 	for (int i = 0; i < NBLOCKS; i++) {
 		if (inode->data.blocks[i])
 			statbuf->st_blocks++;
@@ -1514,20 +2910,126 @@ static void do_stat(uint32_t inum, struct hfs_stat *statbuf)
 
 /**
  * Basic implementation of the POSIX stat() system call.
+ * The inode is copied without a lock, and copied again if it changed
+ * in the meantime (under the read lock, if that keeps happening).
  */
 int fs_stat(const char *pathname, struct hfs_stat *statbuf)
 {
-	struct hfs_dentry *dent;
+	sysstat_syscall(SYS_stat);
+	struct hfs_inode *inode;
 
 	if (!statbuf)
 		return -EINVAL;
-	if (!(dent = lookup(pathname)))
+	if (!(inode = lookup_inode(pathname, NULL)))
 		return -ENOFOUND;
 
-	do_stat(dent->inum, statbuf);
+	inode_stat(inode, statbuf);
 	return 0;
 }
 
+/**
+ * stat() an inode that has already been looked up (see lookup_inode()).
+ */
+void inode_stat(struct hfs_inode *inode, struct hfs_stat *statbuf)
+{
+	uint32_t seq;
+
+	for (int tries = 0; ; tries++) {
+		if (tries == MAX_SEQ_RETRIES) {
+			pthread_rwlock_rdlock(inode_lock(inode));
+			do_stat(inum(inode), statbuf);
+			pthread_rwlock_unlock(inode_lock(inode));
+			break;
+		}
+		seq = read_seqbegin(inode_seq(inode));
+		do_stat(inum(inode), statbuf);
+		if (!read_seqretry(inode_seq(inode), seq))
+			break;
+	}
+}
+
+/**
+ * Count the entries in a block of dentries.
+ */
+static int count_block_dents(uint32_t bnum)
+{
+	char *block = BLKADDR(bnum);
+	struct hfs_dentry *dent;
+	int n = 0;
+
+	for_each_block_dent(dent, block) {
+		if (dent->reclen == 0)
+			break;
+		if (dent->inum)
+			n++;
+	}
+	return n;
+}
+
+/**
+ * Read every entry of the directory of a dentry that has already been
+ * looked up, as getdents() would, and return how many there are, or
+ * -EINVTYPE if it is not a directory. There is no getdents() system
+ * call yet; this is what replaying one does (see include/replay.h).
+ */
+int dentry_readdir(struct hfs_dentry *dent)
+{
+	struct hfs_inode *dir = dentry_get_inode(dent);
+	int n = 0;
+
+	pthread_rwlock_rdlock(inode_lock(dir));
+	if (dir->type != T_DIR) {
+		n = -EINVTYPE;
+		goto out;
+	}
+
+#ifdef _HFS_INLINE_DIRECTORY
+	if (inode_is_inline_dir(dir)) {
+		struct hfs_dentry *d;
+
+		n = 2;	// "." and "..", which are not stored
+		for_each_inline_dent(d, dir) {
+			if (!d->reclen)
+				break;
+			if (d->inum)
+				n++;
+		}
+		goto out;
+	}
+#endif
+
+#ifdef _HFS_DIRHASH
+	if (dir->flags & I_DIRHASH) {
+		n = count_block_dents(dir->data.dirhash_rec.block);
+		goto out;
+	}
+#endif
+
+	for (int i = 0; i < NBLOCKS; i++) {
+		if (dir->data.blocks[i])
+			n += count_block_dents(dir->data.blocks[i]);
+	}
+out:
+	pthread_rwlock_unlock(inode_lock(dir));
+	return n;
+}
+
+#ifdef HFS_DEBUG
+/**
+ * Have tracer called with the address and length of every piece of the
+ * image (inodes, dentries, names) that pathname walks read, and of the
+ * dirhash tables they probe, to measure the memory footprint of lookups
+ * or to feed the cache simulator (see include/cachesim.h). Pass NULL to
+ * stop tracing.
+ *
+ * Only walks are traced, lookups answered by the path cache are not.
+ */
+void fs_trace_lookup(void (*tracer)(const void *addr, size_t len))
+{
+	lookup_tracer = tracer;
+}
+#endif  // HFS_DEBUG
+
 /**
  * Prints a list of enabled features.
  */
@@ -1549,14 +3051,29 @@ void print_features(void)
 #endif
 	pr_info("Dirhash\n");
 
+#ifdef _HFS_PCACHE
+	pr_info(KBLD KGRN "[ON]  " KNRM);
+#else
+	pr_info(KBLD KYEL "[OFF] " KNRM);
+#endif
+	pr_info("Path lookup cache\n");
+
+#ifdef _HFS_HTREE
+	pr_info(KBLD KGRN "[ON]  " KNRM);
+#else
+	pr_info(KBLD KYEL "[OFF] " KNRM);
+#endif
+	pr_info("Hash-indexed directories\n");
+
 	pr_info("\n");
 }
 
 /**
- * Change working directory.
+ * Change the working directory of the calling thread's process.
  */
 int fs_chdir(const char *pathname)
 {
+	sysstat_syscall(SYS_chdir);
 	struct hfs_dentry *dent;
 	struct hfs_inode *dir;
 
@@ -1566,15 +3083,120 @@ int fs_chdir(const char *pathname)
 	if (dir->type != T_DIR)
 		return -EINVTYPE;
 	
-	cwd = dent;
+	struct hfs_process *p = current_process();
+	pthread_mutex_lock(&p->lock);
+	p->cwd = dent;
+	pthread_mutex_unlock(&p->lock);
 	return 0;
 }
 
+/**
+ * Parse a comma-separated list of mount options, e.g. "ialloc=near".
+ * Options not mentioned are reset to their defaults.
+ * 
+ * Supported options:
+ *   ialloc=near|next	Allocate inodes near their parent directory's,
+ *   					or after the last allocated inode (default).
+ *   placement=flat|group|orlov
+ *   					Inode and block placement policy: no grouping
+ *   					(default), ext2-style block groups, or block
+ *   					groups with Orlov spreading of top-level
+ *   					directories. See include/alloc.h.
+ *   dirhash=N			Number of dirhash tables (default 100).
+ *   dirhash_policy=lru|clock|2q|arc
+ *   					Which dirhash table to recycle when all are in
+ *   					use (default lru). See include/dirhash.h.
+ *   					Both only exist with _HFS_DIRHASH.
+ *   clock=N|precise	Take timestamps from a clock read every N ms
+ *   					(default 10), or read the time for every one.
+ *   					See include/clock.h.
+ *   atime=relatime|strict|noatime
+ *   					Update a file's access time when it is read
+ *   					only if it is older than its modify or change
+ *   					time or a day old (default), on every read, or
+ *   					never.
+ */
+static int parse_mount_opts(const char *opts)
+{
+	char buf[256], *opt, *val, *saveptr;
+
+	memset(&mount_opts, 0, sizeof(mount_opts));
+	if (!opts)
+		return 0;
+	if (strlen(opts) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, opts);
+
+	for (opt = strtok_r(buf, ",", &saveptr); opt;
+				opt = strtok_r(NULL, ",", &saveptr)) {
+		if ((val = strchr(opt, '=')))
+			*val++ = '\0';
+
+		if (strcmp(opt, "ialloc") == 0 && val) {
+			if (strcmp(val, "near") == 0)
+				mount_opts.ialloc_near_parent = true;
+			else if (strcmp(val, "next") == 0)
+				mount_opts.ialloc_near_parent = false;
+			else
+				goto bad_opt;
+		} else if (strcmp(opt, "placement") == 0 && val) {
+			if (strcmp(val, "flat") == 0)
+				mount_opts.placement = HFS_PLACE_FLAT;
+			else if (strcmp(val, "group") == 0)
+				mount_opts.placement = HFS_PLACE_GROUP;
+			else if (strcmp(val, "orlov") == 0)
+				mount_opts.placement = HFS_PLACE_ORLOV;
+			else
+				goto bad_opt;
+#ifdef _HFS_DIRHASH
+		} else if (strcmp(opt, "dirhash") == 0 && val) {
+			if ((mount_opts.dirhash_size = atoi(val)) <= 0)
+				goto bad_opt;
+		} else if (strcmp(opt, "dirhash_policy") == 0 && val) {
+			int i;
+			for (i = 0; i < HFS_DIRHASH_NPOLICIES; i++) {
+				if (strcmp(val, hfs_dirhash_policies[i].name) == 0)
+					break;
+			}
+			if (i == HFS_DIRHASH_NPOLICIES)
+				goto bad_opt;
+			mount_opts.dirhash_policy = i;
+#endif
+		} else if (strcmp(opt, "clock") == 0 && val) {
+			if (strcmp(val, "precise") == 0)
+				mount_opts.clock_tick = -1;
+			else if ((mount_opts.clock_tick = atoi(val)) <= 0)
+				goto bad_opt;
+		} else if (strcmp(opt, "atime") == 0 && val) {
+			if (strcmp(val, "relatime") == 0)
+				mount_opts.atime = HFS_ATIME_RELATIME;
+			else if (strcmp(val, "strict") == 0)
+				mount_opts.atime = HFS_ATIME_STRICT;
+			else if (strcmp(val, "noatime") == 0)
+				mount_opts.atime = HFS_ATIME_NONE;
+			else
+				goto bad_opt;
+		} else {
+			goto bad_opt;
+		}
+	}
+	return 0;
+
+bad_opt:
+	printf("Error: bad mount option: %s.\n", opt);
+	memset(&mount_opts, 0, sizeof(mount_opts));
+	return -EINVAL;
+}
+
 /*
  * Allocates space for file system in memory.
+ * 
+ * @param size	Size of the file system to create if there is no image
+ * @param opts	Mount options (see parse_mount_opts()), may be NULL
  */
-int fs_mount(unsigned long size)
+int fs_mount(unsigned long size, const char *opts)
 {
+	sysstat_syscall(SYS_mount);
 	size_t fs_size;
 	int fs_is_new = 0;
 	int fd;
@@ -1584,6 +3206,9 @@ int fs_mount(unsigned long size)
 		return -1;
 	}
 
+	if (parse_mount_opts(opts) < 0)
+		return -EINVAL;
+
 	if (size > MAXFSSIZE) {
 		printf("Error: file system size cannot be greater than 1GB.\n");
 		return -1;
@@ -1639,13 +3264,17 @@ int fs_mount(unsigned long size)
 			return -1;
 	}
 
-	init_fd();
-	read_sb();
 	close(fd); 
+	if (read_sb() < 0)
+		return -1;
+	if (init_sync() < 0 || hfs_extent_rsv_init() < 0)
+		return -1;
+	hfs_clock_start(mount_opts.clock_tick ? mount_opts.clock_tick
+										  : HFS_CLOCK_TICK_DEFAULT);
 
 	sb->last_mounted = time(NULL);
 
-	cwd = &sb->rootdir;
+	init_processes();
 
 	pr_info("File system successfully mounted.\n");
 	print_features();
@@ -1657,10 +3286,15 @@ int fs_mount(unsigned long size)
  */
 int fs_unmount(void)
 {
+	sysstat_syscall(SYS_unmount);
 	if (!fs)
 		return -1;
 
+	hfs_clock_stop();
 	free_caches();
+	free_sync();
+	hfs_extent_rsv_exit();
+	hfs_alloc_exit();
 	printf("Quitting fsemu...\n");
 	fflush(stdout);
 	munmap(fs, sb->size * BSIZE);
@@ -1673,16 +3307,21 @@ int fs_unmount(void)
  */
 int fs_reset(void)
 {
+	sysstat_syscall(SYS_reset);
 	if (!fs)
 		return -1;
 
 	unsigned long fs_size = sb->size * BSIZE;
+	hfs_alloc_sync();	// nothing left to fold into the new superblock
 	memset(fs, 0x0, fs_size);
 	if (init_fs(fs_size) < 0)
 		return -1;
 	if (init_caches() < 0)
 		return -1;
-	init_fd();
-	read_sb();
-	return 0;
+	if (read_sb() < 0)
+		return -1;
+	init_processes();
+	if (hfs_extent_rsv_init() < 0)
+		return -1;
+	return init_sync();
 }
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static size_t fs_size;	// size of file system.
 
@@ -31,15 +32,33 @@ static inline void print_title(void)
 	puts("");
 }
 
+/**
+ * Usage: fsemu [-o mount_options] [batch_file]
+ */
 int main(int argc, char *argv[])
 {
+	const char *mount_opts = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			mount_opts = optarg;
+			break;
+		default:
+			exit(0);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc != 1 && argc != 2) {
 		exit(0);
 	}
 
 	fs_size = MAXFSSIZE;
 
-	if (fs_mount(fs_size) < 0) {
+	if (fs_mount(fs_size, mount_opts) < 0) {
 		printf("Error: failed to mount file system.\n");
 		exit(0);
 	}
@@ -12,14 +12,45 @@
 /* The need to include fs.h should be eliminated with further implementation
  * of more system calls such as getdents(). */
 #include "fs.h"
+#include "process.h"
+#include "alloc.h"
 
 #include <unistd.h>
 #include <stdio.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #define LINKBUFSZ	4096
+#define CAT_IOVCNT	64
+
+/**
+ * Write out all of iov, however many calls it takes.
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) < 0)
+			return -1;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
 
 /**
  * cat - concatenate files and print on the standard output.
+ *
+ * The file is written out straight from the image (see fs_read_map()),
+ * CAT_IOVCNT runs at a time.
  */
 int cat(const char *pathname)
 {
@@ -27,13 +58,20 @@ int cat(const char *pathname)
 	if (fd < 0)
 		return fd;
 
-	char buf[BUFSIZ];	
+	struct iovec iov[CAT_IOVCNT];
+	struct hfs_pin pin;
+	unsigned int off = 0;
 	int ret;
-	while ((ret = fs_read(fd, buf, BUFSIZ)) > 0) {
-		if (write(1, buf, ret) < 0) {
-			perror("write");
+	while ((ret = fs_read_map(fd, off, UINT_MAX, iov, CAT_IOVCNT, &pin)) > 0) {
+		for (int i = 0; i < ret; i++)
+			off += iov[i].iov_len;
+		if (writev_all(1, iov, ret) < 0) {
+			perror("writev");
+			fs_read_unmap(&pin);
+			fs_close(fd);
 			return -1;
 		}
+		fs_read_unmap(&pin);
 	}
 	if (ret < 0) 
 		fs_pstrerror(ret, "cat");
@@ -175,7 +213,7 @@ int ls(const char *pathname)
 	struct hfs_inode *src;
 	const char *name;
 	if (!pathname) {
-		src = dentry_get_inode(cwd);
+		src = dentry_get_inode(current_process()->cwd);
 		name = "";
 	} else {
 		struct hfs_dentry *src_dent;
@@ -188,6 +226,7 @@ int ls(const char *pathname)
 	// For now only prints out the root's contents
 	ls_dir(src, name);
 	puts("");
+	hfs_alloc_sync();
 	pr_info("Total inodes in use: %lu/%lu\n", sb->inode_used, sb->ninodes);
 	pr_info("Directories: %lu total. Files: %lu total.\n", 
 							sb->ndirectories, sb->nfiles);
@@ -196,18 +235,22 @@ int ls(const char *pathname)
 }
 
 /**
- * List all open file descriptors.
+ * List all open file descriptors of the current process.
  */
 void lsfd(void)
 {
-	printf("open file descriptors: \n");
-	for (int i = 0; i < MAXOPENFILES; i++) {
-		if (openfiles[i].f_dentry) {
+	struct hfs_process *p = current_process();
+
+	printf("open file descriptors (pid %d): \n", p->pid);
+	pthread_mutex_lock(&p->lock);
+	for (int i = 0; i < p->nfiles; i++) {
+		if (p->files[i].f_dentry) {
 			printf(" [%d] %s (off=%d)\n", i, 
-					dentry_get_name(openfiles[i].f_dentry),
-					openfiles[i].offset);
+					dentry_get_name(p->files[i].f_dentry),
+					p->files[i].offset);
 		}
 	}
+	pthread_mutex_unlock(&p->lock);
 	puts("");
 }
 
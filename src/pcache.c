@@ -0,0 +1,388 @@
+/**
+ * fsemu/src/pcache.c
+ *
+ * Full-path lookup cache. See include/pcache.h for the design.
+ */
+
+#include "fsemu.h"
+#include "pcache.h"
+#include "sync.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+struct hfs_pcache *pcache;
+
+#ifdef HFS_DEBUG
+static int pc_hit_cnt = 0, pc_neg_hit_cnt = 0, pc_miss_cnt = 0;
+static int pc_stale_cnt = 0, pc_inval_cnt = 0;
+static int pc_resume_cnt = 0, pc_resume_depth = 0;
+#endif
+
+static inline uint32_t *dir_gen(uint32_t inum)
+{
+	return &pcache->dir_gens[inum & (HFS_PCACHE_NGENS - 1)];
+}
+
+static inline uint32_t load_gen(uint32_t *gen)
+{
+	return __atomic_load_n(gen, __ATOMIC_ACQUIRE);
+}
+
+static inline void bump_gen(uint32_t *gen)
+{
+	__atomic_add_fetch(gen, 1, __ATOMIC_RELEASE);
+}
+
+static inline struct hfs_pcache_entry *get_entry(uint32_t hash)
+{
+	return &pcache->entries[hash & (HFS_PCACHE_SIZE - 1)];
+}
+
+/**
+ * Prepare a key for the given pathname and starting point.
+ *
+ * The hash is FNV-1a over the pathname, seeded with the starting directory
+ * so that the same relative path from two different working directories
+ * does not land on the same entry. The running hash is recorded at the
+ * end of every component, giving the hash of each prefix for free.
+ */
+void hfs_pcache_key_init(struct hfs_pcache_key *key,
+						 struct hfs_inode *start, const char *path)
+{
+	uint64_t s = (uintptr_t)start;
+	uint32_t h;
+	const unsigned char *p = (const unsigned char *)path;
+	int i, n = 0;
+
+	// Inodes sit at multiples of their size in one array, so their
+	// addresses share their low bits; mix the whole address in (the
+	// finalizer of MurmurHash3).
+	s = (s ^ (s >> 33)) * 0xff51afd7ed558ccdULL;
+	s = (s ^ (s >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	h = 2166136261u ^ (uint32_t)(s ^ (s >> 33));
+
+	for (i = 0; p[i]; i++) {
+		if (p[i] == '/' && i > 0 && p[i - 1] != '/'
+				&& n < HFS_PCACHE_MAXDEPTH) {
+			key->prefix[n].len = i;
+			key->prefix[n].hash = h;
+			n++;
+		}
+		h = (h ^ p[i]) * 16777619u;
+	}
+
+	key->start = start;
+	key->path = path;
+	key->len = i;
+	key->hash = h;
+	key->nprefix = n;
+	key->gen = pcache ? load_gen(&pcache->gen) : 0;
+	key->dir_gen = 0;
+}
+
+/**
+ * The walk is about to scan dir. Remember the directory's generation,
+ * for the entries that the scan's result goes into.
+ */
+void hfs_pcache_key_dir(struct hfs_pcache_key *key, struct hfs_inode *dir)
+{
+	if (pcache)
+		key->dir_gen = load_gen(dir_gen(inum(dir)));
+}
+
+/**
+ * Is the entry hit was copied from still up to date? Also used by callers
+ * that read through hit->dent, to check that what they read was not
+ * changed under them.
+ */
+bool hfs_pcache_hit_valid(struct hfs_pcache_hit *hit)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return hit->gen == load_gen(&pcache->gen)
+			&& hit->dir_gen == load_gen(dir_gen(hit->dir));
+}
+
+/**
+ * Find the valid entry for the first len bytes of path, if any, and copy
+ * the result into hit. An entry that is being filled counts as a miss.
+ */
+static bool probe(struct hfs_inode *start, const char *path, int len,
+				  uint32_t hash, struct hfs_pcache_hit *hit, bool *stale)
+{
+	struct hfs_pcache_entry *ent = get_entry(hash);
+	uint32_t seq;
+
+	*stale = false;
+	seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return false;
+	if (ent->hash != hash || ent->start != start || ent->pathlen != len
+			|| memcmp(ent->path, path, len) != 0)
+		return false;
+
+	hit->dent = ent->dent;
+	hit->inode = ent->inode;
+	hit->pi = ent->pi;
+	hit->dir = ent->dir;
+	hit->dir_gen = ent->dir_gen;
+	hit->gen = ent->gen;
+	if (read_seqretry(&ent->seq, seq))
+		return false;
+
+	if (!hfs_pcache_hit_valid(hit)) {
+		*stale = true;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Fill the entry for the first len bytes of path with the generations
+ * recorded in key.
+ */
+static void fill(struct hfs_pcache_key *key, int len, uint32_t hash,
+				 struct hfs_dentry *dent, struct hfs_inode *inode,
+				 struct hfs_inode *pi, struct hfs_inode *last)
+{
+	struct hfs_pcache_entry *ent = get_entry(hash);
+
+	if (!write_seqtrybegin(&ent->seq))
+		return;
+	ent->hash = hash;
+	ent->gen = key->gen;
+	ent->dir = inum(last);
+	ent->dir_gen = key->dir_gen;
+	ent->start = key->start;
+	ent->dent = dent;
+	ent->inode = inode;
+	ent->pi = pi;
+	ent->pathlen = len;
+	memcpy(ent->path, key->path, len);
+	write_seqend(&ent->seq);
+}
+
+/**
+ * Probe the cache. On a hit, returns true and fills in hit (whose dent
+ * is NULL for a negative entry).
+ *
+ * An entry is only trusted if the global generation and the generation
+ * of the directory it depends on are both unchanged since it was filled.
+ */
+bool hfs_pcache_lookup(struct hfs_pcache_key *key, struct hfs_pcache_hit *hit)
+{
+	bool stale;
+
+	if (!pcache || !pcache->enabled || key->len >= HFS_PCACHE_PATHLEN)
+		return false;
+
+	if (!probe(key->start, key->path, key->len, key->hash, hit, &stale)) {
+#ifdef HFS_DEBUG
+		pc_miss_cnt++;
+		if (stale)
+			pc_stale_cnt++;
+#endif
+		return false;
+	}
+
+#ifdef HFS_DEBUG
+	if (hit->dent)
+		pc_hit_cnt++;
+	else
+		pc_neg_hit_cnt++;
+#endif
+	return true;
+}
+
+/**
+ * Fill the entry for key with the result of a full walk.
+ *
+ * @param dent	The dentry found, NULL if the lookup failed
+ * @param inode	The inode the walk found dent to refer to
+ * @param pi	The parent inode as reported by the walk
+ * @param last	The directory scanned in the final step of the walk.
+ * 				NULL means the result must not be cached (e.g. it was
+ * 				synthesised for an inline directory's "." or "..").
+ */
+void hfs_pcache_put(struct hfs_pcache_key *key, struct hfs_dentry *dent,
+					struct hfs_inode *inode, struct hfs_inode *pi,
+					struct hfs_inode *last)
+{
+	if (!pcache || !pcache->enabled || !last
+			|| key->len >= HFS_PCACHE_PATHLEN)
+		return;
+
+	fill(key, key->len, key->hash, dent, inode, pi, last);
+}
+
+/**
+ * Find the deepest prefix of the key's pathname that is still cached.
+ * On success, *depth is set to the number of components covered by the
+ * entry found, i.e. the walk may resume after key->prefix[*depth - 1].
+ */
+bool hfs_pcache_lookup_prefix(struct hfs_pcache_key *key, int *depth,
+							  struct hfs_pcache_hit *hit)
+{
+	bool stale;
+
+	if (!pcache || !pcache->enabled || !pcache->prefix)
+		return false;
+
+	for (int i = key->nprefix - 1; i >= 0; i--) {
+		if (key->prefix[i].len >= HFS_PCACHE_PATHLEN)
+			continue;
+		if (probe(key->start, key->path, key->prefix[i].len,
+					key->prefix[i].hash, hit, &stale)) {
+			*depth = i + 1;
+#ifdef HFS_DEBUG
+			pc_resume_cnt++;
+			pc_resume_depth += i + 1;
+#endif
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Cache the result of resolving the first depth components of the key's
+ * pathname. Called by the walk for every intermediate component.
+ */
+void hfs_pcache_put_prefix(struct hfs_pcache_key *key, int depth,
+						   struct hfs_dentry *dent, struct hfs_inode *inode,
+						   struct hfs_inode *pi, struct hfs_inode *last)
+{
+	if (!pcache || !pcache->enabled || !pcache->prefix || !last
+			|| depth < 1 || depth > key->nprefix
+			|| key->prefix[depth - 1].len >= HFS_PCACHE_PATHLEN)
+		return;
+
+	fill(key, key->prefix[depth - 1].len, key->prefix[depth - 1].hash,
+		 dent, inode, pi, last);
+}
+
+/**
+ * A name has been added to or removed from dir.
+ */
+void hfs_pcache_invalidate_dir(struct hfs_inode *dir)
+{
+	if (!pcache)
+		return;
+	bump_gen(dir_gen(inum(dir)));
+#ifdef HFS_DEBUG
+	pc_inval_cnt++;
+#endif
+}
+
+/**
+ * The shape of the namespace has changed (e.g. a directory was renamed),
+ * retire every entry at once.
+ */
+void hfs_pcache_invalidate_all(void)
+{
+	if (!pcache)
+		return;
+	bump_gen(&pcache->gen);
+#ifdef HFS_DEBUG
+	pc_inval_cnt++;
+#endif
+}
+
+/**
+ * Drop every cached entry. Not to be called while lookups are running.
+ */
+void hfs_pcache_clear(void)
+{
+	if (!pcache)
+		return;
+	memset(pcache->entries, 0, sizeof(pcache->entries));
+	pcache->gen++;
+}
+
+/**
+ * Turn the cache on or off. Used by the benchmark to compare against
+ * the uncached walk.
+ */
+void hfs_pcache_enable(bool enable)
+{
+	if (!pcache)
+		return;
+	if (enable && !pcache->enabled)
+		hfs_pcache_clear();
+	pcache->enabled = enable;
+}
+
+bool hfs_pcache_enabled(void)
+{
+	return pcache && pcache->enabled;
+}
+
+/**
+ * Turn prefix resumption on or off.
+ */
+void hfs_pcache_enable_prefix(bool enable)
+{
+	if (!pcache)
+		return;
+	if (enable && !pcache->prefix)
+		hfs_pcache_clear();
+	pcache->prefix = enable;
+}
+
+/**
+ * Allocate and initialize the path cache.
+ */
+int hfs_pcache_init(void)
+{
+	if (pcache)
+		hfs_pcache_free();
+
+	pcache = malloc(sizeof(struct hfs_pcache));
+	if (!pcache) {
+		pr_warn("Failed to initialize path cache.\n");
+		return -1;
+	}
+	memset(pcache, 0, sizeof(struct hfs_pcache));
+	pcache->gen = 1;
+	pcache->enabled = true;
+	pcache->prefix = true;
+
+	pr_info("Path cache initialized successfully (%ld bytes)\n",
+									sizeof(struct hfs_pcache));
+	return 0;
+}
+
+/**
+ * Free the path cache.
+ */
+void hfs_pcache_free(void)
+{
+	free(pcache);
+	pcache = NULL;
+}
+
+#ifdef HFS_DEBUG
+void hfs_pcache_perf_stat(struct hfs_pcache_perf_stat *statbuf)
+{
+	if (!statbuf)
+		return;
+	statbuf->s_hit_count = pc_hit_cnt;
+	statbuf->s_neg_hit_count = pc_neg_hit_cnt;
+	statbuf->s_miss_count = pc_miss_cnt;
+	statbuf->s_stale_count = pc_stale_cnt;
+	statbuf->s_inval_count = pc_inval_cnt;
+	statbuf->s_resume_count = pc_resume_cnt;
+	statbuf->s_resume_depth = pc_resume_depth;
+}
+
+void hfs_pcache_stat_clear(void)
+{
+	pc_hit_cnt = 0;
+	pc_neg_hit_cnt = 0;
+	pc_miss_cnt = 0;
+	pc_stale_cnt = 0;
+	pc_inval_cnt = 0;
+	pc_resume_cnt = 0;
+	pc_resume_depth = 0;
+}
+#endif  // HFS_DEBUG
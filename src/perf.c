@@ -0,0 +1,144 @@
+/**
+ * fsemu/src/perf.c
+ *
+ * Hardware performance counters. See include/perf.h.
+ */
+
+#include "fsemu.h"
+#include "perf.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+const char *hfs_perf_names[HFS_PERF_NEVENTS] = {
+	[HFS_PERF_CYCLES]			= "cycles",
+	[HFS_PERF_INSTRUCTIONS]		= "instructions",
+	[HFS_PERF_BRANCH_MISSES]	= "branch_misses",
+	[HFS_PERF_L1D_LOADS]		= "l1d_loads",
+	[HFS_PERF_L1D_MISSES]		= "l1d_misses",
+	[HFS_PERF_LLC_LOADS]		= "llc_loads",
+	[HFS_PERF_LLC_MISSES]		= "llc_misses",
+	[HFS_PERF_DTLB_MISSES]		= "dtlb_misses",
+};
+
+#define CACHE_EVENT(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} events[HFS_PERF_NEVENTS] = {
+	[HFS_PERF_CYCLES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[HFS_PERF_INSTRUCTIONS] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[HFS_PERF_BRANCH_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	[HFS_PERF_L1D_LOADS] = {
+		PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+										PERF_COUNT_HW_CACHE_OP_READ,
+										PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+	[HFS_PERF_L1D_MISSES] = {
+		PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+										PERF_COUNT_HW_CACHE_OP_READ,
+										PERF_COUNT_HW_CACHE_RESULT_MISS) },
+	[HFS_PERF_LLC_LOADS] = {
+		PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_LL,
+										PERF_COUNT_HW_CACHE_OP_READ,
+										PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+	[HFS_PERF_LLC_MISSES] = {
+		PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_LL,
+										PERF_COUNT_HW_CACHE_OP_READ,
+										PERF_COUNT_HW_CACHE_RESULT_MISS) },
+	[HFS_PERF_DTLB_MISSES] = {
+		PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+										PERF_COUNT_HW_CACHE_OP_READ,
+										PERF_COUNT_HW_CACHE_RESULT_MISS) },
+};
+
+/* Whether the reason no counter could be opened has been told yet. */
+static bool told_unavailable;
+
+/**
+ * Open a counter for every event there is, disabled. Returns the number
+ * of counters opened, 0 if the machine has none to offer.
+ */
+int hfs_perf_open(struct hfs_perf *perf)
+{
+	struct perf_event_attr attr;
+	int n = 0, err = 0;
+
+	memset(perf, 0, sizeof(*perf));
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+							| PERF_FORMAT_TOTAL_TIME_RUNNING;
+		perf->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf->fds[i] < 0)
+			err = errno;
+		else
+			n++;
+	}
+
+	if (!n && !told_unavailable) {
+		pr_info("Performance counters unavailable: %s.\n", strerror(err));
+		told_unavailable = true;
+	}
+	return n;
+}
+
+void hfs_perf_close(struct hfs_perf *perf)
+{
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++) {
+		if (perf->fds[i] >= 0)
+			close(perf->fds[i]);
+		perf->fds[i] = -1;
+	}
+}
+
+/**
+ * Zero every counter and start counting.
+ */
+void hfs_perf_start(struct hfs_perf *perf)
+{
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++) {
+		if (perf->fds[i] < 0)
+			continue;
+		ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/**
+ * Stop counting, and read what was counted into perf->values. A counter
+ * that never got to run on the hardware is not valid.
+ */
+void hfs_perf_stop(struct hfs_perf *perf)
+{
+	uint64_t buf[3];	// value, time enabled, time running
+
+	for (int i = 0; i < HFS_PERF_NEVENTS; i++) {
+		perf->valid[i] = false;
+		if (perf->fds[i] < 0)
+			continue;
+		ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf->fds[i], buf, sizeof(buf)) != sizeof(buf) || !buf[2])
+			continue;
+		perf->values[i] = buf[2] < buf[1]
+							? (uint64_t)((double)buf[0] * buf[1] / buf[2])
+							: buf[0];
+		perf->valid[i] = true;
+	}
+}
@@ -0,0 +1,243 @@
+/**
+ * fsemu/src/process.c
+ *
+ * Emulated processes and their file descriptor tables. See
+ * include/process.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "process.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The first process, which every thread that has not attached itself to
+ * another one runs as. Also the head of the list of all processes.
+ */
+struct hfs_process init_process = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.pid = 1,
+	.free_fd = -1,
+	.prev = &init_process,
+	.next = &init_process,
+};
+
+__thread struct hfs_process *current;
+
+/* Protects the list of processes and next_pid. */
+static pthread_mutex_t process_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_pid = 2;
+
+/**
+ * Put slots [from, to) of a table on its free list, lowest first.
+ */
+static void free_slots(struct hfs_process *p, int from, int to)
+{
+	for (int fd = to - 1; fd >= from; fd--) {
+		p->files[fd].f_dentry = NULL;
+		p->files[fd].f_inode = NULL;
+		p->files[fd].offset = 0;
+		p->files[fd].next_free = p->free_fd;
+		p->free_fd = fd;
+	}
+}
+
+/**
+ * Close every descriptor of a process, and move it to the root.
+ */
+static void reset_process(struct hfs_process *p, void *arg)
+{
+	pthread_mutex_lock(&p->lock);
+	p->free_fd = -1;
+	p->nopen = 0;
+	free_slots(p, 0, p->nfiles);
+	p->cwd = &sb->rootdir;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Called when the file system is mounted or reset, when every dentry a
+ * process may hold on to is gone.
+ */
+void init_processes(void)
+{
+	process_for_each(reset_process, NULL);
+}
+
+/**
+ * Create a process. It starts out in the working directory of the
+ * calling thread's process, with no open files.
+ */
+struct hfs_process *process_create(void)
+{
+	struct hfs_process *p;
+
+	if (!(p = calloc(1, sizeof(*p))))
+		return NULL;
+	pthread_mutex_init(&p->lock, NULL);
+	p->free_fd = -1;
+	p->cwd = current_process()->cwd;
+
+	pthread_mutex_lock(&process_list_lock);
+	p->pid = next_pid++;
+	p->prev = init_process.prev;
+	p->next = &init_process;
+	init_process.prev->next = p;
+	init_process.prev = p;
+	pthread_mutex_unlock(&process_list_lock);
+	return p;
+}
+
+/**
+ * Run the calling thread as process p from now on (as init, if p is
+ * NULL).
+ */
+void process_attach(struct hfs_process *p)
+{
+	current = p;
+}
+
+/**
+ * Free a process created by process_create(). No thread may still be
+ * attached to it, except the caller, which goes back to being init.
+ */
+void process_exit(struct hfs_process *p)
+{
+	if (!p || p == &init_process)
+		return;
+	if (current == p)
+		current = NULL;
+
+	pthread_mutex_lock(&process_list_lock);
+	p->prev->next = p->next;
+	p->next->prev = p->prev;
+	pthread_mutex_unlock(&process_list_lock);
+
+	pthread_mutex_destroy(&p->lock);
+	free(p->files);
+	free(p);
+}
+
+/**
+ * Call fn on every process. Processes can neither come nor go while this
+ * is going on, but fn has to take p->lock itself.
+ */
+void process_for_each(void (*fn)(struct hfs_process *p, void *arg),
+					  void *arg)
+{
+	struct hfs_process *p = &init_process;
+
+	pthread_mutex_lock(&process_list_lock);
+	do {
+		fn(p, arg);
+		p = p->next;
+	} while (p != &init_process);
+	pthread_mutex_unlock(&process_list_lock);
+}
+
+/**
+ * Double the size of a descriptor table, and put the new slots on its
+ * free list.
+ */
+static int grow_files(struct hfs_process *p)
+{
+	int n = p->nfiles ? p->nfiles * 2 : NR_OPEN_DEFAULT;
+	struct file *files;
+
+	if (n > NR_OPEN_MAX)
+		return -ENOFD;
+	if (!(files = realloc(p->files, n * sizeof(struct file))))
+		return -ENOFD;
+	p->files = files;
+	free_slots(p, p->nfiles, n);
+	p->nfiles = n;
+	return 0;
+}
+
+/**
+ * Give the calling thread's process a descriptor for dent, whose inode
+ * is inode. Reads and writes go through the inode, since the dentry may
+ * be moved while the file is open.
+ * Returns the descriptor, or -ENOFD if the table cannot grow any more.
+ */
+int fd_install(struct hfs_dentry *dent, struct hfs_inode *inode)
+{
+	struct hfs_process *p = current_process();
+	int fd;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->free_fd < 0 && grow_files(p) < 0) {
+		pthread_mutex_unlock(&p->lock);
+		return -ENOFD;
+	}
+	fd = p->free_fd;
+	p->free_fd = p->files[fd].next_free;
+	p->files[fd].f_dentry = dent;
+	p->files[fd].f_inode = inode;
+	p->files[fd].offset = 0;
+	p->nopen++;
+	pthread_mutex_unlock(&p->lock);
+	return fd;
+}
+
+static inline bool fd_valid(struct hfs_process *p, int fd)
+{
+	return fd >= 0 && fd < p->nfiles && p->files[fd].f_dentry;
+}
+
+/**
+ * Return the inode a descriptor of the calling thread's process refers
+ * to, and its offset if off is given, or NULL if it is not open.
+ */
+struct hfs_inode *fd_get(int fd, foff_t *off)
+{
+	struct hfs_process *p = current_process();
+	struct hfs_inode *inode = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if (fd_valid(p, fd)) {
+		inode = p->files[fd].f_inode;
+		if (off)
+			*off = p->files[fd].offset;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return inode;
+}
+
+/**
+ * Set the offset of a descriptor, unless it has since been closed or
+ * reused for another file.
+ */
+void fd_set_offset(int fd, struct hfs_inode *inode, foff_t off)
+{
+	struct hfs_process *p = current_process();
+
+	pthread_mutex_lock(&p->lock);
+	if (fd_valid(p, fd) && p->files[fd].f_inode == inode)
+		p->files[fd].offset = off;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Close a descriptor of the calling thread's process.
+ */
+int fd_close(int fd)
+{
+	struct hfs_process *p = current_process();
+
+	pthread_mutex_lock(&p->lock);
+	if (!fd_valid(p, fd)) {
+		pthread_mutex_unlock(&p->lock);
+		return -EINVFD;
+	}
+	p->files[fd].f_dentry = NULL;
+	p->files[fd].f_inode = NULL;
+	p->files[fd].offset = 0;
+	p->files[fd].next_free = p->free_fd;
+	p->free_fd = fd;
+	p->nopen--;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
@@ -0,0 +1,310 @@
+/**
+ * fsemu/src/replay.c
+ *
+ * Replaying system call traces. See include/replay.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "fs.h"
+#include "fs_syscall.h"
+#include "process.h"
+#include "bench.h"
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+const char *hfs_replay_names[HFS_REPLAY_NOPS] = {
+	[HFS_REPLAY_OPEN]		= "open",
+	[HFS_REPLAY_STAT]		= "stat",
+	[HFS_REPLAY_LSTAT]		= "lstat",
+	[HFS_REPLAY_ACCESS]		= "access",
+	[HFS_REPLAY_READLINK]	= "readlink",
+	[HFS_REPLAY_MKDIR]		= "mkdir",
+	[HFS_REPLAY_GETDENTS]	= "getdents",
+	[HFS_REPLAY_EXECVE]		= "execve",
+};
+
+/**
+ * Does op make its path, if it is not there yet?
+ */
+static inline bool replay_creates(struct hfs_replay_op *op)
+{
+	return op->op == HFS_REPLAY_MKDIR
+			|| (op->op == HFS_REPLAY_OPEN && (op->flags & HFS_REPLAY_CREAT));
+}
+
+/**
+ * Read the op log in file, and check that it is whole and that every
+ * operation refers to a path and process there is. Also note which of
+ * the paths the log creates are already in the file system.
+ */
+int hfs_replay_load(struct hfs_replay *r, const char *file)
+{
+	FILE *fp;
+	long size;
+	size_t off;
+
+	memset(r, 0, sizeof(*r));
+	if (!(fp = fopen(file, "r"))) {
+		perror("open");
+		return -1;
+	}
+	if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0) {
+		perror("seek");
+		fclose(fp);
+		return -1;
+	}
+	rewind(fp);
+	if (!(r->data = malloc(size + 1))) {
+		fclose(fp);
+		return -EALLOC;
+	}
+	if (fread(r->data, 1, size, fp) != (size_t)size) {
+		perror("read");
+		fclose(fp);
+		goto bad;
+	}
+	fclose(fp);
+
+	if ((size_t)size < sizeof(r->hdr))
+		goto bad;
+	memcpy(&r->hdr, r->data, sizeof(r->hdr));
+	if (memcmp(r->hdr.magic, HFS_REPLAY_MAGIC, sizeof(r->hdr.magic)) != 0
+			|| r->hdr.version != HFS_REPLAY_VERSION)
+		goto bad;
+	off = sizeof(r->hdr);
+	if ((uint64_t)off + r->hdr.strsize
+			+ (uint64_t)r->hdr.nops * sizeof(struct hfs_replay_op) != size)
+		goto bad;
+
+	// Paths
+	if (!(r->paths = malloc((r->hdr.npaths + 1) * sizeof(char *))))
+		goto oom;
+	r->data[size] = '\0';
+	for (uint32_t i = 0; i < r->hdr.npaths; i++) {
+		if (off >= sizeof(r->hdr) + r->hdr.strsize)
+			goto bad;
+		r->paths[i] = r->data + off;
+		off += strlen(r->paths[i]) + 1;
+	}
+	if (off != sizeof(r->hdr) + r->hdr.strsize)
+		goto bad;
+
+	// Operations
+	r->ops = (struct hfs_replay_op *)(r->data + off);
+	for (uint32_t i = 0; i < r->hdr.nops; i++) {
+		if (r->ops[i].op >= HFS_REPLAY_NOPS
+				|| r->ops[i].pid >= r->hdr.npids
+				|| r->ops[i].path >= r->hdr.npaths)
+			goto bad;
+	}
+
+	if (!(r->existed = calloc(r->hdr.npaths + 1, sizeof(bool))))
+		goto oom;
+	for (uint32_t i = 0; i < r->hdr.nops; i++) {
+		uint32_t path = r->ops[i].path;
+		if (replay_creates(&r->ops[i]))
+			r->existed[path] = lookup(r->paths[path]) != NULL;
+	}
+	return 0;
+
+bad:
+	printf("Error: %s is not a valid op log.\n", file);
+	hfs_replay_free(r);
+	return -EINVAL;
+oom:
+	hfs_replay_free(r);
+	return -EALLOC;
+}
+
+void hfs_replay_free(struct hfs_replay *r)
+{
+	free(r->existed);
+	free(r->paths);
+	free(r->data);
+	memset(r, 0, sizeof(*r));
+}
+
+/**
+ * Make the call op describes. Returns what the system call returned, or
+ * a negative error code.
+ */
+static int replay_op(struct hfs_replay *r, struct hfs_replay_op *op)
+{
+	const char *path = r->paths[op->path];
+	struct hfs_stat statbuf;
+	struct hfs_dentry *dent;
+	char buf[256];
+	int fd, ret;
+
+	switch (op->op) {
+	case HFS_REPLAY_OPEN:
+	case HFS_REPLAY_EXECVE:
+		fd = fs_open(path);
+		if (fd == -ENOFOUND && (op->flags & HFS_REPLAY_CREAT)
+				&& fs_creat(path) == 0)
+			fd = fs_open(path);
+		if (fd == -EINVTYPE)
+			return 0;	// a directory, which has no descriptors here
+		if (fd >= 0)
+			fs_close(fd);
+		return fd;
+	case HFS_REPLAY_STAT:
+	case HFS_REPLAY_LSTAT:
+	case HFS_REPLAY_ACCESS:
+		return fs_stat(path, &statbuf);
+	case HFS_REPLAY_READLINK:
+		// load cannot make links, so a link the trace read is a file
+		// here. Only a readlink that failed in the trace fails on one.
+		ret = fs_readlink(path, buf, sizeof(buf));
+		if (ret == -EINVTYPE)
+			return op->flags & HFS_REPLAY_FAILED ? ret : 0;
+		return ret;
+	case HFS_REPLAY_MKDIR:
+		return fs_mkdir(path);
+	case HFS_REPLAY_GETDENTS:
+		if (!(dent = lookup(path)))
+			return -ENOFOUND;
+		return dentry_readdir(dent);
+	}
+	return -EINVAL;
+}
+
+struct replay_thread {
+	pthread_t				thread;
+	struct hfs_replay		*r;
+	struct hfs_process		**procs;
+	uint32_t				*ops;		// indices of this thread's ops
+	uint32_t				nops;
+	uint64_t				*ticks;
+	int						*results;
+};
+
+static void *replay_thread_main(void *arg)
+{
+	struct replay_thread *t = arg;
+	struct hfs_process *saved = current;
+	int pid = -1;
+
+	for (uint32_t i = 0; i < t->nops; i++) {
+		struct hfs_replay_op *op = &t->r->ops[t->ops[i]];
+		uint64_t begin;
+		int ret;
+
+		if (op->pid != pid) {
+			pid = op->pid;
+			process_attach(t->procs[pid]);
+		}
+		begin = hfs_bench_ticks();
+		ret = replay_op(t->r, op);
+		t->ticks[t->ops[i]] = hfs_bench_ticks() - begin;
+		t->results[t->ops[i]] = ret;
+	}
+	process_attach(saved);
+	return NULL;
+}
+
+/**
+ * Replay the whole log once, with nthreads threads (the calling thread
+ * alone if nthreads <= 1). The time each operation took, and what its
+ * system call returned, are stored in ticks[] and results[], by the
+ * operation's position in the log.
+ */
+int hfs_replay_run(struct hfs_replay *r, int nthreads, uint64_t *ticks,
+				   int *results)
+{
+	struct hfs_process **procs;
+	struct replay_thread *threads;
+	uint32_t *order;
+	int created = 0, ret = 0;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > (int)r->hdr.npids)
+		nthreads = r->hdr.npids ? r->hdr.npids : 1;
+
+	procs = calloc(r->hdr.npids, sizeof(*procs));
+	threads = calloc(nthreads, sizeof(*threads));
+	order = malloc(r->hdr.nops * sizeof(*order) + 1);
+	if (!procs || !threads || !order) {
+		ret = -EALLOC;
+		goto out;
+	}
+	for (uint32_t p = 0; p < r->hdr.npids; p++) {
+		if (!(procs[p] = process_create())) {
+			ret = -EALLOC;
+			goto out;
+		}
+	}
+
+	// Process p is replayed by thread p % nthreads, and the operations of
+	// each thread are laid out in order, one thread after another.
+	for (uint32_t i = 0; i < r->hdr.nops; i++)
+		threads[r->ops[i].pid % nthreads].nops++;
+	for (int t = 0, first = 0; t < nthreads; t++) {
+		threads[t].ops = order + first;
+		first += threads[t].nops;
+		threads[t].nops = 0;
+	}
+	for (uint32_t i = 0; i < r->hdr.nops; i++) {
+		struct replay_thread *t = &threads[r->ops[i].pid % nthreads];
+		t->ops[t->nops++] = i;
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		threads[t].r = r;
+		threads[t].procs = procs;
+		threads[t].ticks = ticks;
+		threads[t].results = results;
+	}
+	if (nthreads == 1) {
+		replay_thread_main(&threads[0]);
+		goto out;
+	}
+	for (created = 0; created < nthreads; created++) {
+		if (pthread_create(&threads[created].thread, NULL,
+						   replay_thread_main, &threads[created]) != 0) {
+			printf("Error: failed to create thread %d.\n", created);
+			ret = -1;
+			break;
+		}
+	}
+	for (int t = 0; t < created; t++)
+		pthread_join(threads[t].thread, NULL);
+
+out:
+	if (procs) {
+		for (uint32_t p = 0; p < r->hdr.npids; p++)
+			process_exit(procs[p]);
+	}
+	free(procs);
+	free(threads);
+	free(order);
+	return ret;
+}
+
+/**
+ * Remove what a replay created, newest first, so that the files in a
+ * directory it made go before the directory. What was there when the
+ * log was loaded stays.
+ */
+void hfs_replay_undo(struct hfs_replay *r)
+{
+	for (uint32_t i = r->hdr.nops; i-- > 0; ) {
+		struct hfs_replay_op *op = &r->ops[i];
+		const char *path = r->paths[op->path];
+		struct hfs_dentry *dent;
+
+		if (!replay_creates(op) || r->existed[op->path]
+				|| !(dent = lookup(path)))
+			continue;
+		if (dentry_get_inode(dent)->type == T_DIR)
+			fs_rmdir(path);
+		else
+			fs_unlink(path);
+	}
+}
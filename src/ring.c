@@ -0,0 +1,275 @@
+/**
+ * fsemu/src/ring.c
+ *
+ * Batched system calls. See include/ring.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "fs.h"
+#include "process.h"
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Longest parent directory that is looked up once for a whole group. */
+#define RING_PARENT_MAX	512
+
+/* An operation of a run of LOOKUPs and STATs, while it is being sorted. */
+struct ring_op {
+	struct hfs_sqe	*sqe;
+	unsigned int	seq;	// position in the run, to keep the sort stable
+	int				plen;	// length of the parent directory's path
+};
+
+int hfs_ring_init(struct hfs_ring *ring, unsigned int entries)
+{
+	if (!entries || (entries & (entries - 1)))
+		return -EINVAL;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->entries = entries;
+	ring->sqes = calloc(entries, sizeof(struct hfs_sqe));
+	ring->cqes = calloc(2 * entries, sizeof(struct hfs_cqe));
+	ring->ops = calloc(entries, sizeof(struct ring_op));
+	if (!ring->sqes || !ring->cqes || !ring->ops) {
+		hfs_ring_free(ring);
+		return -EALLOC;
+	}
+	return 0;
+}
+
+void hfs_ring_free(struct hfs_ring *ring)
+{
+	free(ring->sqes);
+	free(ring->cqes);
+	free(ring->ops);
+	memset(ring, 0, sizeof(*ring));
+}
+
+/**
+ * Return the next free submission queue entry, cleared, or NULL if the
+ * submission queue is full.
+ */
+struct hfs_sqe *hfs_ring_get_sqe(struct hfs_ring *ring)
+{
+	struct hfs_sqe *sqe;
+
+	if (ring->sq_tail - ring->sq_head == ring->entries)
+		return NULL;
+	sqe = &ring->sqes[ring->sq_tail++ & (ring->entries - 1)];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/**
+ * Return the oldest completion that has not been seen yet, or NULL.
+ */
+struct hfs_cqe *hfs_ring_peek_cqe(struct hfs_ring *ring)
+{
+	if (ring->cq_head == ring->cq_tail)
+		return NULL;
+	return &ring->cqes[ring->cq_head & (2 * ring->entries - 1)];
+}
+
+void hfs_ring_cqe_seen(struct hfs_ring *ring)
+{
+	if (ring->cq_head != ring->cq_tail)
+		ring->cq_head++;
+}
+
+static void post_cqe(struct hfs_ring *ring, struct hfs_sqe *sqe, int res)
+{
+	struct hfs_cqe *cqe = &ring->cqes[ring->cq_tail++
+									  & (2 * ring->entries - 1)];
+	cqe->user_data = sqe->user_data;
+	cqe->res = res;
+}
+
+static inline bool op_is_readonly(uint8_t opcode)
+{
+	return opcode == HFS_OP_LOOKUP || opcode == HFS_OP_STAT;
+}
+
+/**
+ * Do one operation on its own, just like the system call would.
+ */
+static int do_op(struct hfs_sqe *sqe)
+{
+	switch (sqe->opcode) {
+	case HFS_OP_NOP:
+		return 0;
+	case HFS_OP_LOOKUP:
+		return lookup(sqe->path) ? 0 : -ENOFOUND;
+	case HFS_OP_STAT:
+		return fs_stat(sqe->path, sqe->statbuf);
+	case HFS_OP_OPEN:
+		return fs_open(sqe->path);
+	case HFS_OP_CLOSE:
+		return fs_close(sqe->fd);
+	case HFS_OP_READ:
+		return fs_pread(sqe->fd, sqe->buf, sqe->len, sqe->off);
+	case HFS_OP_WRITE:
+		return fs_pwrite(sqe->fd, sqe->buf, sqe->len, sqe->off);
+	case HFS_OP_CREAT:
+		return fs_creat(sqe->path);
+	case HFS_OP_UNLINK:
+		return fs_unlink(sqe->path);
+	case HFS_OP_MKDIR:
+		return fs_mkdir(sqe->path);
+	default:
+		return -EINVAL;
+	}
+}
+
+/**
+ * Do a LOOKUP or STAT once the inode its path leads to has been found.
+ */
+static int finish_readonly(struct hfs_sqe *sqe, struct hfs_inode *inode)
+{
+	if (!inode)
+		return -ENOFOUND;
+	if (sqe->opcode == HFS_OP_STAT)
+		inode_stat(inode, sqe->statbuf);
+	return 0;
+}
+
+/**
+ * Length of the part of path that names the parent directory, up to and
+ * including the last separator ("/a/b/" for "/a/b/c", "/" for "/c", ""
+ * for "c"), or -1 if the path cannot be split up that way: paths that
+ * end in a separator, and very long parents.
+ */
+static int parent_len(const char *path)
+{
+	const char *slash;
+	size_t len;
+
+	if (!path || !(len = strlen(path)) || path[len - 1] == '/')
+		return -1;
+	if (!(slash = strrchr(path, '/')))
+		return 0;
+	if (slash - path >= RING_PARENT_MAX)
+		return -1;
+	return slash - path + 1;
+}
+
+/**
+ * Look up the parent directory of the operations that share op's, the
+ * working directory standing in for the parent of relative names.
+ * Returns its inode, and stores its dentry in *dir.
+ */
+static struct hfs_inode *lookup_parent(struct ring_op *op,
+									   struct hfs_dentry **dir)
+{
+	static __thread char parent[RING_PARENT_MAX];
+
+	if (op->plen <= 1) {
+		*dir = op->plen ? &sb->rootdir : current_process()->cwd;
+		return dentry_get_inode(*dir);
+	}
+	memcpy(parent, op->sqe->path, op->plen - 1);
+	parent[op->plen - 1] = '\0';
+	return lookup_inode(parent, dir);
+}
+
+static int op_cmp(const void *a, const void *b)
+{
+	const struct ring_op *x = a, *y = b;
+	int len = x->plen < y->plen ? x->plen : y->plen;
+	int ret = memcmp(x->sqe->path, y->sqe->path, len);
+
+	if (ret)
+		return ret;
+	if (x->plen != y->plen)
+		return x->plen - y->plen;
+	if ((ret = strcmp(x->sqe->path + x->plen, y->sqe->path + y->plen)))
+		return ret;
+	return x->seq < y->seq ? -1 : 1;
+}
+
+static inline bool same_parent(struct ring_op *x, struct ring_op *y)
+{
+	return x->plen == y->plen && !memcmp(x->sqe->path, y->sqe->path, x->plen);
+}
+
+/**
+ * Do a run of n LOOKUPs and STATs, starting at ring->sq_head, sorted by
+ * parent directory and then by name. Each parent directory is looked up
+ * once, and each operation then only looks up its last component in it,
+ * unless the operation before it had the same path. Only inodes are kept
+ * from one operation to the next, since dentries may move in between.
+ */
+static void do_readonly_run(struct hfs_ring *ring, unsigned int n)
+{
+	struct ring_op *ops = ring->ops;
+	unsigned int nops = 0;
+	struct hfs_dentry *dir = NULL;
+	struct hfs_inode *idir = NULL, *inode = NULL;
+
+	for (unsigned int i = 0; i < n; i++) {
+		struct hfs_sqe *sqe = &ring->sqes[(ring->sq_head + i)
+										  & (ring->entries - 1)];
+		int plen = parent_len(sqe->path);
+
+		if (plen < 0 || (sqe->opcode == HFS_OP_STAT && !sqe->statbuf)) {
+			post_cqe(ring, sqe, do_op(sqe));
+			continue;
+		}
+		ops[nops].sqe = sqe;
+		ops[nops].seq = nops;
+		ops[nops].plen = plen;
+		nops++;
+	}
+	qsort(ops, nops, sizeof(struct ring_op), op_cmp);
+
+	for (unsigned int i = 0; i < nops; i++) {
+		struct hfs_sqe *sqe = ops[i].sqe;
+		const char *name = sqe->path + ops[i].plen;
+
+		if (i == 0 || !same_parent(&ops[i - 1], &ops[i])) {
+			idir = lookup_parent(&ops[i], &dir);
+			inode = NULL;
+		} else if (inode && !strcmp(name, ops[i - 1].sqe->path + ops[i].plen)) {
+			// The same path again, which was just found.
+			post_cqe(ring, sqe, finish_readonly(sqe, inode));
+			continue;
+		}
+		inode = idir ? lookup_at(dir, idir, name) : NULL;
+		post_cqe(ring, sqe, finish_readonly(sqe, inode));
+	}
+}
+
+/**
+ * Do every operation submitted so far, as far as there is room for their
+ * completions. Returns the number of operations done.
+ */
+int hfs_ring_submit(struct hfs_ring *ring)
+{
+	unsigned int room = 2 * ring->entries - (ring->cq_tail - ring->cq_head);
+	unsigned int todo = ring->sq_tail - ring->sq_head;
+	unsigned int done = 0;
+
+	if (todo > room)
+		todo = room;
+
+	while (done < todo) {
+		struct hfs_sqe *sqe = &ring->sqes[ring->sq_head
+										  & (ring->entries - 1)];
+		unsigned int n = 1;
+
+		if (op_is_readonly(sqe->opcode)) {
+			while (done + n < todo
+				   && op_is_readonly(ring->sqes[(ring->sq_head + n)
+												& (ring->entries - 1)].opcode))
+				n++;
+			do_readonly_run(ring, n);
+		} else {
+			post_cqe(ring, sqe, do_op(sqe));
+		}
+		ring->sq_head += n;
+		done += n;
+	}
+	return done;
+}
@@ -9,6 +9,9 @@
 #include "fs_syscall.h"
 #include "fserror.h"
 #include "util.h"
+#include "bench.h"
+#include "cachesim.h"
+#include "sysstat.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -60,7 +63,7 @@ static uint64_t sysargs[MAXARGS];
 		return ret;	\
 	}
 
-SYSCALL_DEFINE1(mount, unsigned long);
+SYSCALL_DEFINE2(mount, unsigned long, const char *);
 SYSCALL_DEFINE0(unmount);
 SYSCALL_DEFINE1(open, const char *);
 SYSCALL_DEFINE1(close, int);
@@ -166,8 +169,15 @@ static int syscall_handler(void)
 	switch (sysnum)
 	{
 	case SYS_mount: 
-		check_argc(1);
+		// mount SIZE [OPTIONS]
+		if (argc == 2) {
+			SYSCALL_ARGINT(0);
+			sysargs[1] = 0;
+			break;
+		}
+		check_argc(2);
 		SYSCALL_ARGINT(0);
+		SYSCALL_ARGPTR(1);
 		break;
 	case SYS_unmount:
 		check_argc(0);
@@ -314,34 +324,246 @@ static void loadf_handler()
 }
 
 /**
- * Handles the load [FILE] command.
+ * Handles the load [FILE] [threads] command.
  */
 static void load_handler()
 {
-	if (argc != 2) {
-		printf("Usage: load [FILE]\n");
+	if (argc != 2 && argc != 3) {
+		printf("Usage: load [FILE] [threads]\n");
 		return;
 	}
 
-	int ret = benchmark_init_fs((const char *)argv[1]);
+	int ret = benchmark_init_fs((const char *)argv[1],
+								argc == 3 ? atoi(argv[2]) : 1);
 	if (ret < 0)
 		printf("Benchmark failed: %s.\n", fs_strerror(ret));
 }
 
 /**
- * Handles the benchmark [FILE] command.
+ * Handles the benchmark [FILE] [repcount] [sweep | threads[=N]] command.
+ * With "sweep", the dirhash pool size and replacement policy are swept
+ * instead. With "threads", the lookups are run in 1 to N threads at once
+ * (N defaults to the number of CPUs).
  */
 static void benchmark_handler()
 {
-	if (argc != 2 && argc != 3) {
-		printf("Usage: benchmark [FILE] [repcount]\n");
+	if (argc < 2 || argc > 4 || (argc == 4 && strcmp(argv[3], "sweep")
+					&& strncmp(argv[3], "threads", strlen("threads")))) {
+		printf("Usage: benchmark [FILE] [repcount] [sweep | threads[=N]]\n");
 		return;
 	}
 
 	int repcount = 1;
-	if (argc == 3)
+	if (argc >= 3)
 		repcount = atoi(argv[2]);
-	benchmark_lookup((const char *)argv[1], repcount);
+	if (argc == 4 && strcmp(argv[3], "sweep") == 0) {
+		benchmark_dirhash_sweep((const char *)argv[1], repcount);
+	} else if (argc == 4) {
+		char *n = strchr(argv[3], '=');
+		benchmark_lookup_mt((const char *)argv[1], repcount,
+							n ? atoi(n + 1) : 0);
+	} else {
+		benchmark_lookup((const char *)argv[1], repcount);
+	}
+}
+
+/**
+ * Handles the benchopt [warmup=N] [format=human|csv|json] [timer=raw|tsc]
+ * [perf=on|off] [output=FILE] command, which sets how benchmarks measure and report
+ * (see include/bench.h), or shows it.
+ */
+static void benchopt_handler()
+{
+	for (int i = 1; i < argc; i++) {
+		if (hfs_bench_set_opt(argv[i]) < 0) {
+			printf("Usage: benchopt [warmup=N] [format=human|csv|json] "
+				   "[timer=raw|tsc] [perf=on|off] [output=FILE]\n");
+			return;
+		}
+	}
+	hfs_bench_show_opts();
+}
+
+/**
+ * Handles the sysstat [on|off|reset|NAME] command: times every system
+ * call and phase from now on (on) or stops (off), forgets the times so far
+ * (reset), prints the histogram of system call or phase NAME, or prints
+ * them all (see include/sysstat.h).
+ */
+static void sysstat_handler()
+{
+	if (argc > 2) {
+		printf("Usage: sysstat [on|off|reset|NAME]\n");
+		return;
+	}
+
+	if (argc == 1)
+		hfs_sysstat_dump();
+	else if (strcmp(argv[1], "on") == 0)
+		hfs_sysstat_enable(true);
+	else if (strcmp(argv[1], "off") == 0)
+		hfs_sysstat_enable(false);
+	else if (strcmp(argv[1], "reset") == 0)
+		hfs_sysstat_reset();
+	else if (hfs_sysstat_dump_hist(argv[1]) < 0)
+		printf("Usage: sysstat [on|off|reset|NAME]\n");
+}
+
+/**
+ * Handles the creates [count] [threads] command: count files are created
+ * in each of 1 to threads threads at once (the number of CPUs by default).
+ */
+static void creates_handler()
+{
+	if (argc > 3) {
+		printf("Usage: creates [count] [threads]\n");
+		return;
+	}
+
+	int ret = benchmark_creat_mt(argc >= 2 ? atoi(argv[1]) : 0,
+								 argc == 3 ? atoi(argv[2]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the seqio [MiB] [bufsize] command: sequential write, rewrite
+ * and read throughput of a file of the given size.
+ */
+static void seqio_handler()
+{
+	if (argc > 3) {
+		printf("Usage: seqio [MiB] [bufsize]\n");
+		return;
+	}
+
+	int ret = benchmark_seqio(argc >= 2 ? atoi(argv[1]) : 0,
+							  argc == 3 ? atoi(argv[2]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the vecio [MiB] [iosize] [iovcnt] [threads] command: read,
+ * pread, readv, write, pwrite and writev compared.
+ */
+static void vecio_handler()
+{
+	if (argc > 5) {
+		printf("Usage: vecio [MiB] [iosize] [iovcnt] [threads]\n");
+		return;
+	}
+
+	int ret = benchmark_vecio(argc >= 2 ? atoi(argv[1]) : 0,
+							  argc >= 3 ? atoi(argv[2]) : 0,
+							  argc >= 4 ? atoi(argv[3]) : 0,
+							  argc == 5 ? atoi(argv[4]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the ring [FILE] [batch] [repcount] command: stat() calls made
+ * one at a time compared with the same calls batched through a ring.
+ */
+static void ring_handler()
+{
+	if (argc < 2 || argc > 4) {
+		printf("Usage: ring [FILE] [batch] [repcount]\n");
+		return;
+	}
+
+	int ret = benchmark_ring((const char *)argv[1],
+							 argc >= 3 ? atoi(argv[2]) : 0,
+							 argc == 4 ? atoi(argv[3]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the clock [FILE] [repcount] command: load with precise and
+ * coarse timestamps, and reads under each atime= mode.
+ */
+static void clock_handler()
+{
+	if (argc != 2 && argc != 3) {
+		printf("Usage: clock [FILE] [repcount]\n");
+		return;
+	}
+
+	int ret = benchmark_clock((const char *)argv[1],
+							  argc == 3 ? atoi(argv[2]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the cachesim [FILE] [passes] command: simulated cache and TLB
+ * misses per lookup (see include/cachesim.h).
+ */
+static void cachesim_handler()
+{
+	if (argc != 2 && argc != 3) {
+		printf("Usage: cachesim [FILE] [passes]\n");
+		return;
+	}
+
+	int ret = benchmark_cachesim((const char *)argv[1],
+								 argc == 3 ? atoi(argv[2]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the cachesimopt [l1=SIZE:WAYS] [l2=SIZE:WAYS] [llc=SIZE:WAYS]
+ * [line=BYTES] [tlb=ENTRIES:WAYS] [page=BYTES] [flush=on|off] command:
+ * sets the geometry the cachesim command simulates, and shows it.
+ */
+static void cachesimopt_handler()
+{
+	for (int i = 1; i < argc; i++) {
+		if (hfs_cachesim_set_opt(argv[i]) < 0) {
+			printf("Usage: cachesimopt [l1=SIZE:WAYS] [l2=SIZE:WAYS] "
+				   "[llc=SIZE:WAYS] [line=BYTES] [tlb=ENTRIES:WAYS] "
+				   "[page=BYTES] [flush=on|off]\n");
+			return;
+		}
+	}
+	hfs_cachesim_show_opts();
+}
+
+/**
+ * Handles the replay [LOG] [threads] [repcount] command: replays an op
+ * log made by tools/stracegen.py (see include/replay.h).
+ */
+static void replay_handler()
+{
+	if (argc < 2 || argc > 4) {
+		printf("Usage: replay [LOG] [threads] [repcount]\n");
+		return;
+	}
+
+	int ret = benchmark_replay((const char *)argv[1],
+							   argc >= 3 ? atoi(argv[2]) : 1,
+							   argc == 4 ? atoi(argv[3]) : 0);
+	if (ret < 0)
+		printf("Benchmark failed.\n");
+}
+
+/**
+ * Handles the placement [TREE_FILE] [FILE] command.
+ */
+static void placement_handler()
+{
+	if (argc != 3) {
+		printf("Usage: placement [TREE_FILE] [FILE]\n");
+		return;
+	}
+
+	int ret = benchmark_placement((const char *)argv[1],
+								  (const char *)argv[2]);
+	if (ret < 0)
+		printf("Benchmark failed: %s.\n", fs_strerror(ret));
 }
 
 /**
@@ -410,6 +632,17 @@ static int process_args()
 	HFS_BUILTIN_COMMAND(cat);
 	HFS_BUILTIN_COMMAND(load);
 	HFS_BUILTIN_COMMAND(benchmark);
+	HFS_BUILTIN_COMMAND(placement);
+	HFS_BUILTIN_COMMAND(cachesim);
+	HFS_BUILTIN_COMMAND(cachesimopt);
+	HFS_BUILTIN_COMMAND(creates);
+	HFS_BUILTIN_COMMAND(seqio);
+	HFS_BUILTIN_COMMAND(vecio);
+	HFS_BUILTIN_COMMAND(ring);
+	HFS_BUILTIN_COMMAND(benchopt);
+	HFS_BUILTIN_COMMAND(sysstat);
+	HFS_BUILTIN_COMMAND(clock);
+	HFS_BUILTIN_COMMAND(replay);
 	HFS_BUILTIN_COMMAND(show_inline);
 	HFS_BUILTIN_COMMAND(show_regular);
 	HFS_BUILTIN_COMMAND(dirhash_dump);
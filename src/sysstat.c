@@ -0,0 +1,312 @@
+/**
+ * fsemu/src/sysstat.c
+ *
+ * System call statistics. See include/sysstat.h.
+ */
+
+#include "fsemu.h"
+#include "fserror.h"
+#include "sysstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+bool hfs_sysstat_on;
+__thread struct hfs_sysstat *hfs_sysstat_self;
+
+const char *hfs_syscall_names[NR_SYSCALLS] = {
+	[SYS_mount]			= "mount",
+	[SYS_unmount]		= "unmount",
+	[SYS_open]			= "open",
+	[SYS_close]			= "close",
+	[SYS_unlink]		= "unlink",
+	[SYS_link]			= "link",
+	[SYS_mkdir]			= "mkdir",
+	[SYS_rmdir]			= "rmdir",
+	[SYS_creat]			= "creat",
+	[SYS_lseek]			= "lseek",
+	[SYS_read]			= "read",
+	[SYS_write]			= "write",
+	[SYS_rename]		= "rename",
+	[SYS_reset]			= "reset",
+	[SYS_symlink]		= "symlink",
+	[SYS_readlink]		= "readlink",
+	[SYS_stat]			= "stat",
+	[SYS_chdir]			= "chdir",
+	[SYS_pread]			= "pread",
+	[SYS_pwrite]		= "pwrite",
+	[SYS_readv]			= "readv",
+	[SYS_writev]		= "writev",
+	[SYS_read_map]		= "read_map",
+	[SYS_read_unmap]	= "read_unmap",
+};
+
+const char *hfs_phase_names[HFS_PHASE_NR] = {
+	[HFS_PHASE_WALK]	= "walk",
+	[HFS_PHASE_DIRSCAN]	= "dirscan",
+	[HFS_PHASE_ALLOC]	= "alloc",
+	[HFS_PHASE_COPY]	= "copy",
+};
+
+/*
+ * Threads that are still running, and what the ones that have exited
+ * recorded, under lock. A thread's statistics are added to retired by
+ * the destructor of key when it exits.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hfs_sysstat *live;
+static struct hfs_sysstat retired;
+static pthread_key_t key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void hist_add(struct hfs_sysstat_hist *dst,
+					 const struct hfs_sysstat_hist *src)
+{
+	if (!src->count)
+		return;
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->total += src->total;
+	for (int i = 0; i < HFS_SYSSTAT_NBUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static void stats_add(struct hfs_sysstat *dst, const struct hfs_sysstat *src)
+{
+	for (int i = 0; i < NR_SYSCALLS; i++)
+		hist_add(&dst->sys[i], &src->sys[i]);
+	for (int i = 0; i < HFS_PHASE_NR; i++)
+		hist_add(&dst->phase[i], &src->phase[i]);
+}
+
+static void stats_clear(struct hfs_sysstat *s)
+{
+	memset(s->sys, 0, sizeof(s->sys));
+	memset(s->phase, 0, sizeof(s->phase));
+}
+
+static void thread_exit(void *arg)
+{
+	struct hfs_sysstat *s = arg;
+
+	pthread_mutex_lock(&lock);
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		live = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	stats_add(&retired, s);
+	pthread_mutex_unlock(&lock);
+	free(s);
+}
+
+static void make_key(void)
+{
+	pthread_key_create(&key, thread_exit);
+}
+
+/**
+ * The calling thread's statistics, set up on its first timed call.
+ * Returns NULL if they could not be.
+ */
+struct hfs_sysstat *hfs_sysstat_thread(void)
+{
+	struct hfs_sysstat *s;
+
+	pthread_once(&key_once, make_key);
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
+	pthread_setspecific(key, s);
+
+	pthread_mutex_lock(&lock);
+	s->next = live;
+	if (live)
+		live->prev = s;
+	live = s;
+	pthread_mutex_unlock(&lock);
+	return hfs_sysstat_self = s;
+}
+
+/**
+ * Bucket of a time of ns nanoseconds: times below 2 * HFS_SYSSTAT_SUBBUCKETS
+ * have one each; above that, every power of two is split into
+ * HFS_SYSSTAT_SUBBUCKETS buckets by the bits after the leading one.
+ */
+static inline int bucket(uint64_t ns)
+{
+	int msb;
+
+	if (ns < 2 * HFS_SYSSTAT_SUBBUCKETS)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - HFS_SYSSTAT_SUBBITS + 1) << HFS_SYSSTAT_SUBBITS)
+			| ((ns >> (msb - HFS_SYSSTAT_SUBBITS))
+			   & (HFS_SYSSTAT_SUBBUCKETS - 1));
+}
+
+static uint64_t bucket_low(int b)
+{
+	int shift;
+
+	if (b < 2 * HFS_SYSSTAT_SUBBUCKETS)
+		return b;
+	shift = (b >> HFS_SYSSTAT_SUBBITS) - 1;
+	return (uint64_t)(HFS_SYSSTAT_SUBBUCKETS
+					  | (b & (HFS_SYSSTAT_SUBBUCKETS - 1))) << shift;
+}
+
+static uint64_t bucket_high(int b)
+{
+	if (b < 2 * HFS_SYSSTAT_SUBBUCKETS)
+		return b;
+	return bucket_low(b) + (1ULL << ((b >> HFS_SYSSTAT_SUBBITS) - 1)) - 1;
+}
+
+/**
+ * Stop timer t, and record its time.
+ */
+void hfs_sysstat_record(struct hfs_sysstat_timer *t)
+{
+	struct hfs_sysstat_hist *h = t->hist;
+	uint64_t ns = hfs_sysstat_ns() - t->begin;
+
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->count++;
+	h->total += ns;
+	h->buckets[bucket(ns)]++;
+}
+
+void hfs_sysstat_enable(bool on)
+{
+	hfs_sysstat_on = on;
+}
+
+/**
+ * Forget everything recorded so far, by every thread.
+ */
+void hfs_sysstat_reset(void)
+{
+	pthread_mutex_lock(&lock);
+	stats_clear(&retired);
+	for (struct hfs_sysstat *s = live; s; s = s->next)
+		stats_clear(s);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Add up what every thread recorded into total.
+ */
+static void sum(struct hfs_sysstat *total)
+{
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&lock);
+	stats_add(total, &retired);
+	for (struct hfs_sysstat *s = live; s; s = s->next)
+		stats_add(total, s);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * The largest time that could be at percentile p of h, i.e. the upper
+ * end of the bucket the p-th percentile falls in (nearest rank).
+ */
+static uint64_t percentile(const struct hfs_sysstat_hist *h, double p)
+{
+	uint64_t rank = (uint64_t)(p / 100 * h->count + 0.999999);
+	uint64_t seen = 0;
+
+	if (rank < 1)
+		rank = 1;
+	for (int b = 0; b < HFS_SYSSTAT_NBUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank)
+			return bucket_high(b) < h->max ? bucket_high(b) : h->max;
+	}
+	return h->max;
+}
+
+static void print_hist(const char *name, const struct hfs_sysstat_hist *h)
+{
+	printf("%10s %10lu %12.3f %10.0f %10lu %10lu %10lu %10lu %10lu\n",
+			name, h->count, h->total / 1e6, (double)h->total / h->count,
+			h->min, percentile(h, 50), percentile(h, 90), percentile(h, 99),
+			h->max);
+}
+
+/**
+ * Print the count and times (in ns) of every system call made, and of
+ * every phase, since the last reset.
+ */
+void hfs_sysstat_dump(void)
+{
+	struct hfs_sysstat *total = malloc(sizeof(*total));
+
+	if (!total) {
+		printf("Error: out of memory.\n");
+		return;
+	}
+	sum(total);
+
+	printf(KBLD "%10s %10s %12s %10s %10s %10s %10s %10s %10s\n" KNRM,
+			"call", "count", "total (ms)", "mean", "min", "p50", "p90",
+			"p99", "max");
+	for (int i = 0; i < NR_SYSCALLS; i++) {
+		if (total->sys[i].count)
+			print_hist(hfs_syscall_names[i], &total->sys[i]);
+	}
+	printf(KBLD "%10s\n" KNRM, "phase");
+	for (int i = 0; i < HFS_PHASE_NR; i++) {
+		if (total->phase[i].count)
+			print_hist(hfs_phase_names[i], &total->phase[i]);
+	}
+	if (!hfs_sysstat_on)
+		printf("(off)\n");
+	free(total);
+}
+
+/**
+ * Print the histogram of one system call or phase, by name.
+ */
+int hfs_sysstat_dump_hist(const char *name)
+{
+	const struct hfs_sysstat_hist *h = NULL;
+	struct hfs_sysstat *total;
+	uint64_t seen = 0;
+
+	if (!(total = malloc(sizeof(*total))))
+		return -EALLOC;
+	sum(total);
+	for (int i = 0; i < NR_SYSCALLS && !h; i++) {
+		if (strcmp(name, hfs_syscall_names[i]) == 0)
+			h = &total->sys[i];
+	}
+	for (int i = 0; i < HFS_PHASE_NR && !h; i++) {
+		if (strcmp(name, hfs_phase_names[i]) == 0)
+			h = &total->phase[i];
+	}
+	if (!h) {
+		free(total);
+		return -ENOFOUND;
+	}
+
+	printf(KBLD "%12s %12s %10s %8s\n" KNRM, "from (ns)", "to (ns)",
+			"count", "cum %");
+	for (int b = 0; b < HFS_SYSSTAT_NBUCKETS; b++) {
+		if (!h->buckets[b])
+			continue;
+		seen += h->buckets[b];
+		printf("%12lu %12lu %10lu %7.2f%%\n", bucket_low(b), bucket_high(b),
+				h->buckets[b], seen * 100.0 / h->count);
+	}
+	free(total);
+	return 0;
+}
@@ -8,60 +8,334 @@ a series of instructions that fsemu can understand and execute.
 Used for benchmarking real-world compiling workloads such as
 compiling the Linux kernel.
 
+The trace must be taken with -f, and with long enough strings that no
+path is cut short, e.g.
+
+	strace -f -s 4096 -o build.strace make
+
+The output is a binary op log (see include/replay.h), for fsemu's
+replay command. With --tree, the files and directories the trace shows
+existed before it began are also written out, as a file system
+description for fsemu's load command.
+
 """
 
 import argparse
+import posixpath
+import re
+import struct
 import sys
-import string
 
 # List of system calls of interest
 # [For now we are only interested in system calls that perform
 # path name lookups.]
 sys_calls = [
-	"execve", "access", "openat", "readlink", "stat", "getdents64", 
-	"mkdir", "lstat", 
+	"execve", "access", "openat", "readlink", "stat", "getdents64",
+	"mkdir", "lstat",
+]
+
+# Newer variants of the above that libc may use instead
+sys_variants = [
+	"open", "creat", "faccessat", "faccessat2", "readlinkat", "mkdirat",
+	"newfstatat", "fstatat64", "statx", "getdents", "execveat",
 ]
 
+# Operations, as in include/replay.h
+OP_OPEN = 0
+OP_STAT = 1
+OP_LSTAT = 2
+OP_ACCESS = 3
+OP_READLINK = 4
+OP_MKDIR = 5
+OP_GETDENTS = 6
+OP_EXECVE = 7
+op_names = [
+	"open", "stat", "lstat", "access", "readlink", "mkdir", "getdents",
+	"execve",
+]
+
+F_FAILED = 0x01
+F_CREAT = 0x02
+
+MAGIC = b"HFSREPL\0"
+VERSION = 1
 
 #
-# Trim a line in the raw strace file
-def process_line(line):
-	line = line.replace("(", " ").replace(")", " ").replace(",", "")
-	return line
+# A line of strace -f output: an optional PID, either bare or as
+# "[pid N]", the call and its arguments, and what it returned. Calls
+# that were interrupted by another process's come in two lines, the
+# first ending in "<unfinished ...>" and the second starting with
+# "<... name resumed>".
+#
+line_re = re.compile(r"^(?:\[pid\s+(\d+)\]|(\d+))?\s*(.*)$")
+call_re = re.compile(r"^(\w+)\((.*)\)\s+=\s+(-?\d+|\?|0x[0-9a-f]+)(.*)$")
+unfinished_re = re.compile(r"^(\w+)\((.*?)\s*<unfinished \.\.\.>$")
+resumed_re = re.compile(r"^<\.\.\. (\w+) resumed>\s?(.*)$")
+string_re = re.compile(r'"((?:[^"\\]|\\.)*)"(\.\.\.)?')
+fd_re = re.compile(r"^\s*(AT_FDCWD|-?\d+)(?:<([^>]*)>)?")
+
 
 #
-# IMPORTANT: strace must be generated with the -f flag, which records
-# the PID of the process that generated the system call. This function
-# will attempt to skip the first space-separated component in the given
-# line, and extract the next component as the system call name.
+# Undo strace's escaping of a string argument.
 #
-def parse_strace(strace):
+def unescape(s):
+	def sub(m):
+		e = m.group(1)
+		if e[0] == "x":
+			return chr(int(e[1:], 16))
+		if e[0] in "01234567":
+			return chr(int(e, 8))
+		return {"n": "\n", "t": "\t", "r": "\r", "v": "\v", "f": "\f"} \
+			.get(e, e)
+	return re.sub(r"\\(x[0-9a-fA-F]{2}|[0-7]{1,3}|.)", sub, s)
+
+
+#
+# A traced process: its working directory and open file descriptors.
+#
+class Process:
+	def __init__(self, cwd, fds=None):
+		self.cwd = cwd
+		self.fds = dict(fds) if fds else {}
+
+
+class Converter:
+	def __init__(self, cwd):
+		self.cwd = cwd
+		self.procs = {}			# PID -> Process
+		self.pids = {}			# PID -> index in the log
+		self.paths = {}			# path -> index in the log
+		self.ops = []
+		self.pending = {}		# PID -> unfinished call
+		self.counts = [0] * len(op_names)
+		self.skipped = 0		# calls whose path could not be known
+		self.kinds = {}			# path -> "D" or "F", found in the trace
+		self.created = set()	# paths the trace created
+
+	def proc(self, pid):
+		if pid not in self.procs:
+			self.procs[pid] = Process(self.cwd)
+		return self.procs[pid]
+
+	#
+	# Make path absolute, relative to the directory dirfd refers to
+	# (AT_FDCWD: the working directory), and normal. Returns None if
+	# that directory is not known.
+	#
+	def resolve(self, p, path, dirfd="AT_FDCWD", fdpath=None):
+		if not path.startswith("/"):
+			if fdpath:
+				base = fdpath
+			elif dirfd == "AT_FDCWD":
+				base = p.cwd
+			elif int(dirfd) in p.fds:
+				base = p.fds[int(dirfd)]
+			else:
+				return None
+			path = posixpath.join(base, path)
+		path = posixpath.normpath(path)
+		if path.startswith("//"):
+			path = "/" + path.lstrip("/")
+		return path
+
+	#
+	# Note that the trace shows path exists and is of kind ("D", "F" or
+	# None if it could be either), unless the trace itself created it.
+	#
+	def exists(self, path, kind):
+		if path in self.created:
+			return
+		if kind == "D" or path not in self.kinds:
+			self.kinds[path] = kind
+
+	def emit(self, pid, op, path, failed, flags=0):
+		if pid not in self.pids:
+			self.pids[pid] = len(self.pids)
+		if path not in self.paths:
+			self.paths[path] = len(self.paths)
+		if failed:
+			flags |= F_FAILED
+		self.ops.append((op, flags, self.pids[pid], self.paths[path]))
+		self.counts[op] += 1
+
+	def line(self, line):
+		m = line_re.match(line.rstrip("\n"))
+		pid = int(m.group(1) or m.group(2) or 0)
+		rest = m.group(3)
+
+		u = unfinished_re.match(rest)
+		if u:
+			self.pending[pid] = (u.group(1), u.group(2))
+			return
+		r = resumed_re.match(rest)
+		if r:
+			if pid not in self.pending:
+				return
+			name, args = self.pending.pop(pid)
+			if name != r.group(1):
+				return
+			rest = "%s(%s%s" % (name, args, r.group(2))
+		c = call_re.match(rest)
+		if c:
+			self.call(pid, c.group(1), c.group(2), c.group(3), c.group(4))
+
+	#
+	# A finished call: name(args) = ret, with the rest of the line
+	# (errno, or what a descriptor refers to) in tail.
+	#
+	def call(self, pid, name, args, ret, tail):
+		p = self.proc(pid)
+		try:
+			ret = int(ret, 0)
+		except ValueError:
+			ret = -1
+		failed = ret < 0
+
+		if name in ("clone", "clone3", "fork", "vfork"):
+			if ret > 0:
+				self.procs[ret] = Process(p.cwd, p.fds)
+			return
+		if name == "close":
+			fd = fd_re.match(args)
+			if fd and not failed and fd.group(1) != "AT_FDCWD":
+				p.fds.pop(int(fd.group(1)), None)
+			return
+		if name in ("chdir", "fchdir"):
+			if failed:
+				return
+			if name == "chdir":
+				s = string_re.search(args)
+				path = s and not s.group(2) and \
+					self.resolve(p, unescape(s.group(1)))
+			else:
+				fd = fd_re.match(args)
+				path = fd and (fd.group(2) or p.fds.get(int(fd.group(1))))
+			if path:
+				p.cwd = path
+			return
+		if name not in sys_calls and name not in sys_variants:
+			return
+
+		# The directory read by getdents is an open descriptor.
+		if name in ("getdents64", "getdents"):
+			fd = fd_re.match(args)
+			path = fd and (fd.group(2) or p.fds.get(int(fd.group(1))))
+			if not path:
+				self.skipped += 1
+				return
+			self.emit(pid, OP_GETDENTS, path, failed)
+			if not failed:
+				self.exists(path, "D")
+			return
+
+		# Every other call has a path, which may be relative to a
+		# descriptor given first.
+		dirfd, fdpath = "AT_FDCWD", None
+		if name in ("openat", "faccessat", "faccessat2", "readlinkat",
+					"mkdirat", "newfstatat", "fstatat64", "statx",
+					"execveat"):
+			fd = fd_re.match(args)
+			if not fd:
+				self.skipped += 1
+				return
+			dirfd, fdpath = fd.group(1), fd.group(2)
+		s = string_re.search(args)
+		if not s or s.group(2) or not s.group(1):
+			self.skipped += 1	# cut short, or AT_EMPTY_PATH
+			return
+		path = self.resolve(p, unescape(s.group(1)), dirfd, fdpath)
+		if not path:
+			self.skipped += 1
+			return
+		after = args[s.end():]
+
+		if name in ("open", "openat", "creat"):
+			creat = name == "creat" or "O_CREAT" in after
+			isdir = "O_DIRECTORY" in after
+			if not failed:
+				p.fds[ret] = path
+				if creat and path not in self.kinds:
+					self.created.add(path)
+				self.exists(path, "D" if isdir else None)
+			self.emit(pid, OP_OPEN, path, failed, F_CREAT if creat else 0)
+		elif name in ("stat", "lstat", "newfstatat", "fstatat64", "statx"):
+			nofollow = name == "lstat" or "AT_SYMLINK_NOFOLLOW" in after
+			if not failed:
+				self.exists(path, "D" if "S_IFDIR" in after else "F")
+			self.emit(pid, OP_LSTAT if nofollow else OP_STAT, path, failed)
+		elif name in ("access", "faccessat", "faccessat2"):
+			if not failed:
+				self.exists(path, None)
+			self.emit(pid, OP_ACCESS, path, failed)
+		elif name in ("readlink", "readlinkat"):
+			if not failed:
+				self.exists(path, "F")
+			self.emit(pid, OP_READLINK, path, failed)
+		elif name in ("mkdir", "mkdirat"):
+			if not failed and path not in self.kinds:
+				self.created.add(path)
+			self.emit(pid, OP_MKDIR, path, failed)
+		elif name in ("execve", "execveat"):
+			if not failed:
+				self.exists(path, "F")
+			self.emit(pid, OP_EXECVE, path, failed)
+
+	def write_log(self, out):
+		if len(self.pids) > 0xffff:
+			raise ValueError("too many processes (%d)" % len(self.pids))
+		paths = sorted(self.paths, key=self.paths.get)
+		strings = b"".join(p.encode("utf-8", "surrogateescape") + b"\0"
+							for p in paths)
+		out.write(MAGIC)
+		out.write(struct.pack("<IIIII", VERSION, len(self.pids),
+							  len(paths), len(self.ops), len(strings)))
+		out.write(strings)
+		for op in self.ops:
+			out.write(struct.pack("<BBHI", *op))
+
+	#
+	# Write what existed before the trace began as D and F lines, every
+	# directory before what is in it. A path only ever looked up is a
+	# file, unless something is in it.
+	#
+	def write_tree(self, out):
+		kinds = dict(self.kinds)
+		for path in list(kinds) + list(self.created):
+			parent = posixpath.dirname(path)
+			while parent != "/" and parent not in self.created:
+				kinds[parent] = "D"
+				parent = posixpath.dirname(parent)
+		for path in sorted(kinds):
+			if path != "/":
+				out.write("%s %s\n" % (kinds[path] or "F", path))
+
+
+def parse_strace(strace, conv):
 	line = strace.readline()
 	while line:
-		instr = process_line(line).split()
-		if instr[1] in sys_calls:
-			print(instr)
-			print(line)
+		conv.line(line)
 		line = strace.readline()
 
 
-def strace_gen(in_file, out_file=None):
-	# Open input file and re-route output to a file if specified
-	saved_stdout = None
+def strace_gen(in_file, out_file, tree_file=None, cwd="/"):
+	conv = Converter(cwd)
 	try:
-		strace_file = open(in_file, "r")
-		if out_file:
-			saved_stdout = sys.stdout
-			sys.stdout = open(out_file, "w")
-	except IOError as err:
+		with open(in_file, "r", errors="surrogateescape") as strace_file:
+			parse_strace(strace_file, conv)
+		with open(out_file, "wb") as out:
+			conv.write_log(out)
+		if tree_file:
+			with open(tree_file, "w", errors="surrogateescape") as out:
+				conv.write_tree(out)
+	except (IOError, ValueError) as err:
 		print(err)
 		sys.exit(1)
 
-	parse_strace(strace_file)
-
-	if saved_stdout:
-		sys.stdout.close()
-		sys.stdout = saved_stdout
+	print("%d operations of %d processes on %d paths, %d calls skipped" %
+		  (len(conv.ops), len(conv.pids), len(conv.paths), conv.skipped))
+	for op, name in enumerate(op_names):
+		if conv.counts[op]:
+			print("  %-10s %d" % (name, conv.counts[op]))
 
 
 def main():
@@ -73,13 +347,25 @@ def main():
 	)
 	parser.add_argument(
 		"-o", "--out",
-		help="the file to write results to",
+		help="the op log to write (default: FILE.log)",
 		metavar="FILE"
 	)
+	parser.add_argument(
+		"-t", "--tree",
+		help="also write the files the trace needs, for fsemu's load",
+		metavar="FILE"
+	)
+	parser.add_argument(
+		"-C", "--cwd",
+		help="working directory of the first process (default: /)",
+		default="/",
+		metavar="DIR"
+	)
 
 	args = parser.parse_args()
-	strace_gen(args.input_file, args.out)
+	strace_gen(args.input_file, args.out or args.input_file + ".log",
+			   args.tree, args.cwd)
 
 
 if __name__ == "__main__":
-	main()
\ No newline at end of file
+	main()